@@ -12,6 +12,14 @@
 #include <math.h>
 #include "01_gstrings.h"
 
+/*
+ *  Vectorized search kernels, selected in runtime
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+    #define MEM_SEARCH_SIMD 1
+    #include <immintrin.h>
+#endif
+
 /***************************************************************
  *              Constants
  ***************************************************************/
@@ -23,6 +31,13 @@
 /***************************************************************
  *              Prototypes
  ***************************************************************/
+typedef const char *(*mem_search_fn)(const char *buffer, size_t buffer_len, const char *s, size_t s_len);
+PRIVATE const char *mem_search_dispatch(const char *buffer, size_t buffer_len, const char *s, size_t s_len);
+
+/***************************************************************
+ *              Data
+ ***************************************************************/
+PRIVATE mem_search_fn __mem_search__ = mem_search_dispatch;
 
 /***************************************************************************
  *  Extract parameter: delimited by blanks (\b\t) or quotes ('' "")
@@ -653,17 +668,13 @@ PUBLIC BOOL int_in_str_list(const char **list, int i)
  ****************************************************************************/
 PUBLIC char * mem_find(const char *buffer, int buffer_len, const char *s, int s_len)
 {
-    register const char *src;
-
-    src = buffer;
-    while(buffer_len > 0 && buffer_len >= s_len) {
-        if(memcmp(src, s, s_len) == 0) {
-            return (char *)src;
-        }
-        src++;
-        buffer_len--;
+    if(buffer_len <= 0 || buffer_len < s_len) {
+        return (char *)0;
     }
-    return (char *)0;
+    if(s_len <= 0) {
+        return (char *)buffer;
+    }
+    return mem_search(buffer, buffer_len, s, s_len);
 }
 
 /****************************************************************************
@@ -681,13 +692,15 @@ PUBLIC char * mem_find_nchar(char *buffer, int buffer_len, char c, int n)
 
     src = buffer;
     while(buffer_len > 0) {
-        if(*src == c) {
-            veces++;
-            if(veces == n)
-                return src;
+        char *p = memchr(src, c, buffer_len);
+        if(!p) {
+            break;
         }
-        src++;
-        buffer_len--;
+        veces++;
+        if(veces == n)
+            return p;
+        buffer_len -= (p - src) + 1;
+        src = p + 1;
     }
     return (char *)0;
 }
@@ -706,17 +719,145 @@ PUBLIC int mem_counter(const char *buffer, int buffer_len, const char *s, int s_
 
     register const char *src;
 
+    if(s_len <= 0) {
+        return buffer_len > 0? buffer_len : 0;
+    }
+
     src = buffer;
     while(buffer_len > 0 && buffer_len >= s_len) {
-        if(memcmp(src, s, s_len) == 0) {
-            counter++;
+        const char *p = mem_search(src, buffer_len, s, s_len);
+        if(!p) {
+            break;
         }
-        src++;
-        buffer_len--;
+        counter++;
+        // overlapped occurrences are counted too
+        buffer_len -= (p - src) + 1;
+        src = p + 1;
     }
     return counter;
 }
 
+/****************************************************************************
+ *  Scalar search: memchr of first byte, then compare
+ ****************************************************************************/
+PRIVATE const char *mem_search_scalar(const char *buffer, size_t buffer_len, const char *s, size_t s_len)
+{
+    const char *end = buffer + buffer_len - s_len + 1; // last possible start + 1
+    const char *p = buffer;
+    while(p < end) {
+        p = memchr(p, s[0], end - p);
+        if(!p) {
+            return 0;
+        }
+        if(memcmp(p + 1, s + 1, s_len - 1) == 0) {
+            return p;
+        }
+        p++;
+    }
+    return 0;
+}
+
+#ifdef MEM_SEARCH_SIMD
+/****************************************************************************
+ *  SSE2 search: compare first and last bytes of pattern in 16 positions
+ *  at once, full compare only in the candidates.
+ ****************************************************************************/
+PRIVATE const char *mem_search_sse2(const char *buffer, size_t buffer_len, const char *s, size_t s_len)
+{
+    const __m128i first = _mm_set1_epi8(s[0]);
+    const __m128i last = _mm_set1_epi8(s[s_len - 1]);
+    size_t i = 0;
+
+    for(; i + s_len - 1 + 16 <= buffer_len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(buffer + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(buffer + i + s_len - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(
+                _mm_cmpeq_epi8(first, block_first),
+                _mm_cmpeq_epi8(last, block_last)
+            )
+        );
+        while(mask) {
+            int bit = __builtin_ctz(mask);
+            if(memcmp(buffer + i + bit + 1, s + 1, s_len - 2) == 0) {
+                return buffer + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    if(i + s_len > buffer_len) {
+        return 0;
+    }
+    return mem_search_scalar(buffer + i, buffer_len - i, s, s_len);
+}
+
+/****************************************************************************
+ *  AVX2 search: as SSE2 with 32 positions at once
+ ****************************************************************************/
+__attribute__((target("avx2")))
+PRIVATE const char *mem_search_avx2(const char *buffer, size_t buffer_len, const char *s, size_t s_len)
+{
+    const __m256i first = _mm256_set1_epi8(s[0]);
+    const __m256i last = _mm256_set1_epi8(s[s_len - 1]);
+    size_t i = 0;
+
+    for(; i + s_len - 1 + 32 <= buffer_len; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(buffer + i + s_len - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(
+                _mm256_cmpeq_epi8(first, block_first),
+                _mm256_cmpeq_epi8(last, block_last)
+            )
+        );
+        while(mask) {
+            int bit = __builtin_ctz(mask);
+            if(memcmp(buffer + i + bit + 1, s + 1, s_len - 2) == 0) {
+                return buffer + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    if(i + s_len > buffer_len) {
+        return 0;
+    }
+    return mem_search_sse2(buffer + i, buffer_len - i, s, s_len);
+}
+#endif
+
+/****************************************************************************
+ *  First call: select the search kernel of the cpu
+ ****************************************************************************/
+PRIVATE const char *mem_search_dispatch(const char *buffer, size_t buffer_len, const char *s, size_t s_len)
+{
+#ifdef MEM_SEARCH_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        __mem_search__ = mem_search_avx2;
+    } else {
+        __mem_search__ = mem_search_sse2;
+    }
+#else
+    __mem_search__ = mem_search_scalar;
+#endif
+    return __mem_search__(buffer, buffer_len, s, s_len);
+}
+
+/****************************************************************************
+ *  Find the first occurrence of s in buffer,
+ *  with vectorized kernels (SSE2/AVX2) when the cpu has them.
+ ****************************************************************************/
+PUBLIC char *mem_search(const char *buffer, size_t buffer_len, const char *s, size_t s_len)
+{
+    if(s_len == 0 || buffer_len < s_len) {
+        return (char *)0;
+    }
+    if(s_len == 1) {
+        return memchr(buffer, s[0], buffer_len);
+    }
+    return (char *)__mem_search__(buffer, buffer_len, s, s_len);
+}
+
 /***************************************************************************
  *
  ***************************************************************************/
@@ -350,6 +350,12 @@ PUBLIC char * mem_find_nchar(char *buffer, int buffer_len, char c, int n);
 **rst**/
 PUBLIC int mem_counter(const char *buffer, int buffer_len, const char *s, int s_len);
 
+/**rst**
+    Find the first occurrence of 's' in 'buffer', return NULL if not found.
+    Use vectorized kernels (SSE2/AVX2, selected in runtime) when the cpu has them.
+**rst**/
+PUBLIC char *mem_search(const char *buffer, size_t buffer_len, const char *s, size_t s_len);
+
 /**rst**
     Return TRUE if all characters (not empty) are numbers
 **rst**/
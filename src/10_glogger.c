@@ -21,11 +21,85 @@
 
 #include "10_glogger.h"
 
+/*
+ *  Async mode: per-thread rings drained by a writer thread
+ */
+#if defined(__GNUC__) && !defined(WIN32)
+    #define LOG_ASYNC 1
+    #include <pthread.h>
+    #include <time.h>
+    #include <sched.h>
+#endif
+
 /*****************************************************************
  *          Constants
  *****************************************************************/
 #define MAX_HANDLER_TYPES 10
 
+#define LOG_ASYNC_RING_SIZE     (64*1024)   /* default bytes of ring by thread */
+#define LOG_ASYNC_MAX_RECORD    (8*1024)    /* maximum bytes of a queued record */
+#define LOG_ASYNC_IDLE_WAIT     50          /* milliseconds of writer sleep without records */
+
+#define LOG_REC_PAD     0   /* skip to the begin of ring */
+#define LOG_REC_JSON    1   /* timespec and key/values, rendered by handler */
+#define LOG_REC_BF      2   /* transparent buffer */
+
+#define LOG_REC_STAMP_SIZE  12  /* seconds (int64) and nanoseconds (uint32) */
+
+#define LOG_VARIANTS    16  /* renders of a message: indented, notime, discover, binary */
+#define LOG_VARIANT_INDENTED    0x01
+#define LOG_VARIANT_NOTIME      0x02
+#define LOG_VARIANT_DISCOVER    0x04
+#define LOG_VARIANT_BINARY      0x08
+
+/*
+ *  MessagePack codes of binary records
+ */
+#define MP_FIXMAP       0x80
+#define MP_FIXSTR       0xa0
+#define MP_NIL          0xc0
+#define MP_EXT8         0xc7
+#define MP_FLOAT32      0xca
+#define MP_FLOAT64      0xcb
+#define MP_UINT8        0xcc
+#define MP_UINT16       0xcd
+#define MP_UINT32       0xce
+#define MP_UINT64       0xcf
+#define MP_INT8         0xd0
+#define MP_INT16        0xd1
+#define MP_INT32        0xd2
+#define MP_INT64        0xd3
+#define MP_FIXEXT4      0xd6
+#define MP_FIXEXT8      0xd7
+#define MP_STR8         0xd9
+#define MP_STR16        0xda
+#define MP_STR32        0xdb
+#define MP_MAP16        0xde
+#define MP_MAP32        0xdf
+#define MP_EXT_TIMESTAMP    0xff    /* -1 */
+
+#define LOG_LIMIT_SLOTS             256     /* buckets of rate limit by handler */
+#define LOG_LIMIT_PROBES            8
+#define LOG_LIMIT_SUMMARY_INTERVAL  5000    /* milliseconds between summaries of suppressed */
+#define LOG_LIMIT_SITE_KEY          0x80000000  /* site keys, the others are message fingerprints */
+
+#if defined(__GNUC__)
+    #define LOG_CALL_SITE() log_site_key(__builtin_return_address(0))
+#else
+    #define LOG_CALL_SITE() 0
+#endif
+
+#define LOG_REC_ALIGN(n) (((n) + 15) & ~((size_t)15))
+
+#ifdef LOG_ASYNC
+    #define LOG_LOCK()      pthread_mutex_lock(&mutex_handlers)
+    #define LOG_UNLOCK()    pthread_mutex_unlock(&mutex_handlers)
+    #define ASYNC_INC(var)  __sync_add_and_fetch(&(var), 1)
+#else
+    #define LOG_LOCK()
+    #define LOG_UNLOCK()
+#endif
+
 /*****************************************************************
  *          Structures
  *****************************************************************/
@@ -36,6 +110,26 @@ typedef struct {
     loghandler_fwrite_fn_t fwrite_fn;
 } hregister_t;
 
+/*
+ *  Token bucket, by call site or by message fingerprint
+ */
+typedef struct {
+    uint32_t key;           // 0 is free
+    uint32_t suppressed;    // messages suppressed since the last summary
+    uint64_t tokens;        // milli-tokens
+    uint64_t last_ms;
+    int priority;           // of the last message
+} log_bucket_t;
+
+typedef struct {
+    uint32_t burst;         // messages
+    uint32_t rate;          // messages by second
+    uint64_t suppressed;    // total of messages suppressed
+    uint32_t pending;       // buckets with suppressed messages
+    uint64_t next_summary_ms;
+    log_bucket_t buckets[LOG_LIMIT_SLOTS];
+} log_limiter_t;
+
 typedef struct {
     DL_ITEM_FIELDS
 
@@ -43,8 +137,71 @@ typedef struct {
     log_handler_opt_t handler_options;
     hregister_t *hr;
     void *h;
+    log_limiter_t *limiter;
 } log_handler_t;
 
+/*
+ *  Output of sink_vappend(): a json_buffer or a encoded record.
+ *  Record: timespec (LOG_REC_STAMP_SIZE bytes), fields, \0
+ *  Record fields: type ('s','i','d','n'), key\0, value (string\0, 8 bytes or nothing)
+ */
+typedef struct {
+    hgen_t hgen;
+    char *bf;
+    size_t size;
+    size_t len;
+    BOOL grow;          // bf is realloc'ed to fit the fields
+    uint32_t site;      // key of call site
+    BOOL overflow;      // some field has not fit in a fixed bf
+} log_sink_t;
+
+/*
+ *  Renders of a message, shared by the handlers with the same variant
+ */
+typedef struct {
+    const char *bf[LOG_VARIANTS];
+    size_t len[LOG_VARIANTS];
+    char stamp[90];     // timestamp of json renders, made by the first one
+} log_renders_t;
+
+/*
+ *  Value of a binary record
+ */
+typedef struct {
+    char type;          // 's','i','d','n','t' (timestamp)
+    const char *s;
+    size_t len;
+    long long int i;
+    double d;
+    int64_t sec;
+    uint32_t nsec;
+} log_mp_item_t;
+
+typedef struct {
+    uint32_t len;       // bytes of record in ring, aligned
+    uint32_t data_len;
+    uint16_t priority;
+    uint16_t type;      // LOG_REC_*
+    uint32_t site;      // key of call site
+} log_rec_hdr_t;
+
+#ifdef LOG_ASYNC
+/*
+ *  Single producer (the owner thread), single consumer (the writer thread)
+ */
+typedef struct log_ring_s {
+    struct log_ring_s *__next__;
+    char *bf;
+    size_t size;                // power of 2
+    volatile uint64_t head;     // written by producer
+    volatile uint64_t tail;     // written by consumer
+    volatile int orphan;        // the owner thread has finished
+    uint64_t dropped;
+    log_sink_t sink;            // encoding in scratch
+    char scratch[LOG_ASYNC_MAX_RECORD];
+} log_ring_t;
+#endif
+
 /*****************************************************************
  *          Data
  *****************************************************************/
@@ -53,17 +210,91 @@ PRIVATE char __app_version__[64] = {0};
 PRIVATE char __executable__[512] = {0};
 PRIVATE inform_cb_t __inform_cb__ = 0;
 PRIVATE void *__inform_cb_user_data__ = 0;
+#ifdef LOG_ASYNC
+PRIVATE __thread char last_message[4*1024+1];   /* by thread: encoded out of the lock */
+#else
 PRIVATE char last_message[4*1024+1];
+#endif
 PRIVATE uint32_t __alert_count__ = 0;
 PRIVATE uint32_t __critical_count__ = 0;
 PRIVATE uint32_t __error_count__ = 0;
 PRIVATE uint32_t __warning_count__ = 0;
 PRIVATE uint32_t __info_count__ = 0;
 PRIVATE uint32_t __debug_count__ = 0;
+PRIVATE uint32_t __suppressed_count__ = 0;
 
+#ifdef LOG_ASYNC
+PRIVATE __thread char __inside__ = 0;   /* by thread: handlers logging from handlers are ignored */
+PRIVATE pthread_mutex_t mutex_handlers = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#else
 PRIVATE volatile char __inside__ = 0;
+#endif
+PRIVATE int __hnd_trace_stack__ = 0;    /* handlers with LOG_HND_OPT_TRACE_STACK */
+PRIVATE volatile uint32_t __priority_mask__ = 0;   /* bit of priority accepted by some handler */
+
+#ifdef LOG_ASYNC
+PRIVATE volatile int __async_running__ = 0;
+PRIVATE volatile int __async_writer_idle__ = 0;
+PRIVATE log_async_policy_t __async_policy__ = LOG_ASYNC_DROP;
+PRIVATE size_t __async_ring_size__ = LOG_ASYNC_RING_SIZE;
+PRIVATE uint32_t __async_generation__ = 1;
+PRIVATE pthread_t async_writer;
+PRIVATE pthread_mutex_t mutex_async = PTHREAD_MUTEX_INITIALIZER;   /* list of rings */
+PRIVATE pthread_mutex_t mutex_wake = PTHREAD_MUTEX_INITIALIZER;
+PRIVATE pthread_cond_t cond_wake = PTHREAD_COND_INITIALIZER;
+PRIVATE pthread_cond_t cond_drain = PTHREAD_COND_INITIALIZER;  /* the writer has drained records */
+PRIVATE volatile int __async_waiters__ = 0;     /* threads waiting cond_drain */
+PRIVATE volatile int __async_producers__ = 0;   /* threads using his ring, see async_enter() */
+PRIVATE __thread int __producing__ = 0;
+PRIVATE pthread_key_t ring_key;
+PRIVATE pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+PRIVATE log_ring_t *rings = 0;
+PRIVATE __thread log_ring_t *__ring__ = 0;
+PRIVATE __thread uint32_t __ring_generation__ = 0;
+
+PRIVATE volatile uint64_t __async_queued__ = 0;
+PRIVATE volatile uint64_t __async_written__ = 0;
+PRIVATE volatile uint64_t __async_dropped__ = 0;
+PRIVATE volatile uint64_t __async_blocked__ = 0;
+PRIVATE volatile uint64_t __async_sync__ = 0;
+#endif
 
-PRIVATE hgen_t hgen;
+PRIVATE hgen_t hgen_variants[LOG_VARIANTS];
+PRIVATE log_sink_t bin_variants[LOG_VARIANTS];  /* binary renders */
+PRIVATE hgen_t hgen_decode = 0;
+
+/*
+ *  Keys of binary records written as fixint ids.
+ *  The ids are part of the format: add new keys only at the end.
+ */
+PRIVATE const char *binary_keys[] = {
+    "timestamp",
+    "gobj",
+    "function",
+    "msgset",
+    "msg",
+    "process",
+    "hostname",
+    "pid",
+    "path",
+    "errno",
+    "strerror",
+    "error",
+    "topic_name",
+    "topic",
+    "size",
+    "len",
+    "id",
+    "key",
+    "value",
+    "type",
+    "field",
+    "repeated",
+    "by",
+    0
+};
+PRIVATE log_sink_t sync_record = {0, 0, 0, 0, TRUE};  /* fields of sync messages */
+PRIVATE log_sink_t summary_record = {0, 0, 0, 0, TRUE};  /* fields of rate limit summaries */
 PRIVATE int atexit_registered = 0; /* Register atexit just 1 time. */
 PRIVATE char __initialized__ = 0;
 PRIVATE dl_list_t dl_clients;
@@ -74,12 +305,75 @@ PRIVATE hregister_t hregister[MAX_HANDLER_TYPES+1];
  *          Prototypes
  *****************************************************************/
 extern void jsonp_free(void *ptr);
-PRIVATE void _log_jnbf(int priority, log_opt_t opt, va_list ap);
+PRIVATE void _log_jnbf(int priority, log_opt_t opt, uint32_t site, va_list ap);
 PRIVATE void show_backtrace(loghandler_fwrite_fn_t fwrite_fn, void* h);
 PRIVATE void discover(hgen_t hgen);
-PRIVATE void json_append(hgen_t hgen, ...);
-PRIVATE void json_vappend(hgen_t hgen, va_list ap);
+PRIVATE void sink_vappend(log_sink_t *sink, va_list ap);
+PRIVATE void sink_end(log_sink_t *sink);
+PRIVATE BOOL sink_reserve(log_sink_t *sink, size_t need);
+PRIVATE void sink_add_json(log_sink_t *sink, char *key, json_t *jn);
+PRIVATE void sink_add_string(log_sink_t *sink, char *key, char *str);
+PRIVATE void sink_add_integer(log_sink_t *sink, char *key, long long int number);
+PRIVATE int render_variant(log_handler_t *lh, int priority);
+PRIVATE const char *render_record(
+    log_renders_t *renders,
+    int variant,
+    const char *stamp,
+    const char *fields,
+    const char *end,
+    size_t *len
+);
+PRIVATE void record_replay(hgen_t hgen, const char *p, const char *end);
+PRIVATE char *log_timestamp(char *bf, int bfsize, int64_t sec, uint32_t nsec);
+PRIVATE uint64_t mp_get_be(const unsigned char *p, size_t n);
+PRIVATE void render_binary(
+    log_sink_t *sink,
+    int variant,
+    const char *stamp,
+    const char *p,
+    const char *end
+);
 PRIVATE BOOL must_ignore(log_handler_t *lh, int priority);
+PRIVATE void update_priority_mask(void);
+PRIVATE BOOL priority_accepted(int priority);
+PRIVATE void sink_kv(log_sink_t *sink, const log_kv_t *kv, size_t n);
+PRIVATE log_sink_t *record_begin(int priority, log_opt_t opt, uint32_t site);
+PRIVATE void record_stamp(log_sink_t *sink);
+PRIVATE log_sink_t *record_resync(log_sink_t *sink);
+PRIVATE void record_commit(int priority, log_opt_t opt, log_sink_t *sink);
+PRIVATE void write_record(
+    int priority,
+    log_opt_t opt,
+    int type,
+    uint32_t site,
+    const char *data,
+    size_t len
+);
+PRIVATE uint32_t log_site_key(void *site);
+PRIVATE void limit_summaries(
+    log_handler_t *lh,
+    log_renders_t *renders,
+    uint64_t now,
+    BOOL force
+);
+#ifdef LOG_ASYNC
+PRIVATE BOOL async_eligible(int priority, log_opt_t opt);
+PRIVATE log_ring_t *ring_get(void);
+PRIVATE int async_push(
+    log_ring_t *ring,
+    int priority,
+    int type,
+    uint32_t site,
+    const char *data,
+    size_t len
+);
+PRIVATE int async_enqueue_bf(int priority, log_opt_t opt, const char *bf, int len);
+PRIVATE BOOL async_enter(void);
+PRIVATE void async_leave(void);
+PRIVATE void async_sync_point(void);
+PRIVATE void async_stop(void);
+PRIVATE void async_free_rings(void);
+#endif
 
 
 /*****************************************************************
@@ -108,17 +402,6 @@ PUBLIC int log_startup(
         atexit_registered = 1;
     }
 
-    if(!hgen) {
-        hgen = json_dict();
-        if(!hgen) {
-            print_error(
-                PEF_ABORT,
-                "ERROR YUNETA",
-                "json_dict(): FAILED"
-            );
-        }
-    }
-
     /*
      *  Register handlers included
      */
@@ -157,9 +440,46 @@ PUBLIC void log_end(void)
         return;
     }
 
+#ifdef LOG_ASYNC
+    async_stop();
+    async_free_rings();
+#endif
+
+    /*
+     *  Summaries of suppressed messages not written yet
+     */
+    LOG_LOCK();
+    __inside__ = 1;
+    uint64_t now = time_in_miliseconds();
+    lh = dl_first(&dl_clients);
+    while(lh) {
+        if(lh->limiter) {
+            limit_summaries(lh, 0, now, TRUE);
+        }
+        lh = dl_next(lh);
+    }
+    __inside__ = 0;
+    LOG_UNLOCK();
+
     while((lh=dl_first(&dl_clients))) {
         log_del_handler(lh->handler_name);
     }
+    if(sync_record.bf) {
+        free(sync_record.bf);
+        sync_record.bf = 0;
+        sync_record.size = 0;
+    }
+    if(summary_record.bf) {
+        free(summary_record.bf);
+        summary_record.bf = 0;
+        summary_record.size = 0;
+    }
+    for(int i=0; i<LOG_VARIANTS; i++) {
+        if(bin_variants[i].bf) {
+            free(bin_variants[i].bf);
+        }
+    }
+    memset(bin_variants, 0, sizeof(bin_variants));
     max_hregister = 0;
     __initialized__ = FALSE;
 }
@@ -284,7 +604,14 @@ PUBLIC int log_add_handler(
     /*----------------*
      *  Add to list
      *----------------*/
-    return dl_add(&dl_clients, lh);
+    LOG_LOCK();
+    if(lh->handler_options & LOG_HND_OPT_TRACE_STACK) {
+        __hnd_trace_stack__++;
+    }
+    int ret = dl_add(&dl_clients, lh);
+    update_priority_mask();
+    LOG_UNLOCK();
+    return ret;
 }
 
 /*****************************************************************
@@ -295,26 +622,48 @@ PUBLIC int log_del_handler(const char *handler_name)
     if(empty_string(handler_name)) {
         return 0;
     }
+    char *name = strdup(handler_name); // handler_name can be of a handler to delete
+    if(!name) {
+        return 0;
+    }
     int ret = 0;
-    log_handler_t *lh = dl_first(&dl_clients);
-    while(lh) {
-        log_handler_t *next = dl_next(lh);
-        if(strcmp(lh->handler_name, handler_name)==0) {
-            ret++;
-            dl_delete(&dl_clients, lh, 0);
-            if(lh->h && lh->hr->close_fn) {
-                lh->hr->close_fn(lh->h);
+    while(1) {
+        /*
+         *  Remove from list with lock, close without it: the close can log.
+         */
+        LOG_LOCK();
+        log_handler_t *lh = dl_first(&dl_clients);
+        while(lh) {
+            if(strcmp(lh->handler_name, name)==0) {
+                break;
             }
-            if(lh->handler_name) {
-                free(lh->handler_name);
+            lh = dl_next(lh);
+        }
+        if(lh) {
+            if(lh->handler_options & LOG_HND_OPT_TRACE_STACK) {
+                __hnd_trace_stack__--;
             }
-            free(lh);
+            dl_delete(&dl_clients, lh, 0);
+            update_priority_mask();
         }
-        /*
-         *  Next
-         */
-        lh = next;
+        LOG_UNLOCK();
+
+        if(!lh) {
+            break;
+        }
+        ret++;
+        if(lh->h && lh->hr->close_fn) {
+            lh->hr->close_fn(lh->h);
+        }
+        if(lh->handler_name) {
+            free(lh->handler_name);
+        }
+        if(lh->limiter) {
+            free(lh->limiter);
+        }
+        free(lh);
     }
+    free(name);
     return ret;
 }
 
@@ -324,6 +673,7 @@ PUBLIC int log_del_handler(const char *handler_name)
 PUBLIC json_t *log_list_handlers(void)
 {
     json_t *jn_array = json_array();
+    LOG_LOCK();
     log_handler_t *lh = dl_first(&dl_clients);
     while(lh) {
         json_t *jn_dict = json_object();
@@ -331,12 +681,18 @@ PUBLIC json_t *log_list_handlers(void)
         json_object_set_new(jn_dict, "handler_name", json_string(lh->handler_name));
         json_object_set_new(jn_dict, "handler_type", json_string(lh->hr->handler_type));
         json_object_set_new(jn_dict, "handler_options", json_integer(lh->handler_options));
+        if(lh->limiter) {
+            json_object_set_new(jn_dict, "rate_limit_burst", json_integer(lh->limiter->burst));
+            json_object_set_new(jn_dict, "rate_limit_rate", json_integer(lh->limiter->rate));
+            json_object_set_new(jn_dict, "suppressed", json_integer(lh->limiter->suppressed));
+        }
 
         /*
          *  Next
          */
         lh = dl_next(lh);
     }
+    LOG_UNLOCK();
     return jn_array;
 }
 
@@ -348,18 +704,22 @@ PUBLIC BOOL log_exist_handler(const char *handler_name)
     if(empty_string(handler_name)) {
         return FALSE;
     }
+    BOOL exist = FALSE;
+    LOG_LOCK();
     log_handler_t *lh = dl_first(&dl_clients);
     while(lh) {
         log_handler_t *next = dl_next(lh);
         if(strcmp(lh->handler_name, handler_name)==0) {
-            return TRUE;
+            exist = TRUE;
+            break;
         }
         /*
          *  Next
          */
         lh = next;
     }
-    return FALSE;
+    LOG_UNLOCK();
+    return exist;
 }
 
 /*****************************************************************
@@ -373,6 +733,23 @@ PUBLIC void log_clear_counters(void)
     __error_count__ = 0;
     __critical_count__ = 0;
     __alert_count__ = 0;
+    __suppressed_count__ = 0;
+    LOG_LOCK();
+    log_handler_t *lh = dl_first(&dl_clients);
+    while(lh) {
+        if(lh->limiter) {
+            lh->limiter->suppressed = 0;
+        }
+        lh = dl_next(lh);
+    }
+    LOG_UNLOCK();
+#ifdef LOG_ASYNC
+    __async_queued__ = 0;
+    __async_written__ = 0;
+    __async_dropped__ = 0;
+    __async_blocked__ = 0;
+    __async_sync__ = 0;
+#endif
 }
 
 /*****************************************************************
@@ -394,7 +771,7 @@ PUBLIC void log_alert(log_opt_t opt, ...)
     __alert_count__++;
 
     va_start(ap, opt);
-    _log_jnbf(priority, opt, ap);
+    _log_jnbf(priority, opt, LOG_CALL_SITE(), ap);
     va_end(ap);
 
     if(__inform_cb__) {
@@ -413,7 +790,7 @@ PUBLIC void log_critical(log_opt_t opt, ...)
     __critical_count__++;
 
     va_start(ap, opt);
-    _log_jnbf(priority, opt, ap);
+    _log_jnbf(priority, opt, LOG_CALL_SITE(), ap);
     va_end(ap);
 
     if(__inform_cb__) {
@@ -432,7 +809,7 @@ PUBLIC void log_error(log_opt_t opt, ...)
     __error_count__++;
 
     va_start(ap, opt);
-    _log_jnbf(priority, opt, ap);
+    _log_jnbf(priority, opt, LOG_CALL_SITE(), ap);
     va_end(ap);
 
     if(__inform_cb__) {
@@ -451,7 +828,7 @@ PUBLIC void log_warning(log_opt_t opt, ...)
     __warning_count__++;
 
     va_start(ap, opt);
-    _log_jnbf(priority, opt, ap);
+    _log_jnbf(priority, opt, LOG_CALL_SITE(), ap);
     va_end(ap);
 
     if(__inform_cb__) {
@@ -470,7 +847,7 @@ PUBLIC void log_info(log_opt_t opt, ...)
     __info_count__++;
 
     va_start(ap, opt);
-    _log_jnbf(priority, opt, ap);
+    _log_jnbf(priority, opt, LOG_CALL_SITE(), ap);
     va_end(ap);
 
     if(__inform_cb__) {
@@ -489,7 +866,7 @@ PUBLIC void log_debug(log_opt_t opt, ...)
     __info_count__++;
 
     va_start(ap, opt);
-    _log_jnbf(priority, opt, ap);
+    _log_jnbf(priority, opt, LOG_CALL_SITE(), ap);
     va_end(ap);
 
     if(__inform_cb__) {
@@ -611,7 +988,11 @@ PUBLIC void trace_hex_msg(
     if(__inside__) {
         return;
     }
+#ifdef LOG_ASYNC
+    async_sync_point();
+#endif
     __inside__ = 1;
+    LOG_LOCK();
 
     log_handler_t *lh = dl_first(&dl_clients);
     while(lh) {
@@ -632,6 +1013,7 @@ PUBLIC void trace_hex_msg(
         lh = dl_next(lh);
     }
 
+    LOG_UNLOCK();
     __inside__ = 0;
 
     if(__inform_cb__) {
@@ -806,7 +1188,11 @@ PUBLIC void log_debug_vdump(
     if(__inside__) {
         return;
     }
+#ifdef LOG_ASYNC
+    async_sync_point();
+#endif
     __inside__ = 1;
+    LOG_LOCK();
 
     log_handler_t *lh = dl_first(&dl_clients);
     while(lh) {
@@ -831,6 +1217,7 @@ PUBLIC void log_debug_vdump(
         lh = dl_next(lh);
     }
 
+    LOG_UNLOCK();
     __inside__ = 0;
 
     if(__inform_cb__) {
@@ -888,7 +1275,11 @@ PUBLIC void log_debug_dump(
     if(__inside__) {
         return;
     }
+#ifdef LOG_ASYNC
+    async_sync_point();
+#endif
     __inside__ = 1;
+    LOG_LOCK();
 
     log_handler_t *lh = dl_first(&dl_clients);
     while(lh) {
@@ -913,6 +1304,7 @@ PUBLIC void log_debug_dump(
         lh = dl_next(lh);
     }
 
+    LOG_UNLOCK();
     __inside__ = 0;
 
     if(__inform_cb__) {
@@ -997,7 +1389,11 @@ PUBLIC void log_debug_json(
     if(__inside__) {
         return;
     }
+#ifdef LOG_ASYNC
+    async_sync_point();
+#endif
     __inside__ = 1;
+    LOG_LOCK();
 
     log_handler_t *lh = dl_first(&dl_clients);
     if(s) {
@@ -1029,6 +1425,7 @@ PUBLIC void log_debug_json(
         }
     }
 
+    LOG_UNLOCK();
     __inside__ = 0;
 
     if(__inform_cb__) {
@@ -1047,7 +1444,7 @@ PUBLIC void log_monitor(
     int priority = LOG_MONITOR;
 
     va_start(ap, opt);
-    _log_jnbf(priority, opt, ap);
+    _log_jnbf(priority, opt, LOG_CALL_SITE(), ap);
     va_end(ap);
 }
 
@@ -1100,68 +1497,165 @@ PRIVATE BOOL must_ignore(log_handler_t *lh, int priority)
 }
 
 /*****************************************************************
- *      Log data in json format
+ *  Priorities accepted by some handler, with the handlers locked
  *****************************************************************/
-PRIVATE void _log_jnbf(int priority, log_opt_t opt, va_list ap)
+PRIVATE void update_priority_mask(void)
 {
-    if(!__initialized__) {
-        return;
+    uint32_t mask = 0;
+    log_handler_t *lh = dl_first(&dl_clients);
+    while(lh) {
+        for(int priority=0; priority<32; priority++) {
+            if(!must_ignore(lh, priority)) {
+                mask |= 1u << priority;
+            }
+        }
+        lh = dl_next(lh);
+    }
+    __priority_mask__ = mask;
+}
+
+/*****************************************************************
+ *  Some handler will write the priority? Check before encoding.
+ *****************************************************************/
+PRIVATE BOOL priority_accepted(int priority)
+{
+    if(priority < 0 || priority >= 32) {
+        return FALSE;
     }
+    return (__priority_mask__ & (1u << priority))? TRUE : FALSE;
+}
 
+/*****************************************************************
+ *  Begin a json message: return the record where to encode
+ *  the key/values, the ring of thread in async mode, else
+ *  the sync record with the handlers locked.
+ *  Return NULL if the message must be ignored.
+ *****************************************************************/
+PRIVATE log_sink_t *record_begin(int priority, log_opt_t opt, uint32_t site)
+{
+    if(!__initialized__) {
+        return 0;
+    }
     if(__inside__) {
-        return;
+        return 0;
+    }
+    if(!priority_accepted(priority) &&
+            !(opt & (LOG_OPT_EXIT_NEGATIVE|LOG_OPT_EXIT_ZERO|LOG_OPT_ABORT))) {
+        // No handler will write it: don't encode nor queue it
+        return 0;
     }
-    __inside__ = 1;
 
-    log_handler_t *lh = dl_first(&dl_clients);
-    while(lh) {
-        if(must_ignore(lh, priority)) {
-            /*
-             *  Next
-             */
-            lh = dl_next(lh);
-            continue;
+    log_sink_t *sink = 0;
+#ifdef LOG_ASYNC
+    if(__async_running__ && async_eligible(priority, opt) && async_enter()) {
+        log_ring_t *ring = ring_get();
+        if(ring) {
+            sink = &ring->sink;
+            memset(sink, 0, sizeof(log_sink_t));
+            sink->bf = ring->scratch;
+            sink->size = sizeof(ring->scratch);
+        } else {
+            async_leave();
         }
+    }
+    if(!sink) {
+        async_sync_point();
+    }
+#endif
+    __inside__ = 1; // logs while encoding are ignored, the record is in use
+    if(!sink) {
+        LOG_LOCK();
+        sink = &sync_record;
+        sink->len = 0;
+        sink->overflow = FALSE;
+    }
+    sink->site = site;
+    record_stamp(sink);
+    return sink;
+}
 
-        if(lh->hr->write_fn) {
-            // TODO with a hgen_dup analiza si es el mismo msg para no repetirlo
-            json_reset(hgen, (lh->handler_options & LOG_HND_OPT_BEATIFUL_JSON)?TRUE:FALSE);
-            if(!(lh->handler_options & LOG_HND_OPT_NOTIME)) {
-                char stamp[90];
-                current_timestamp(stamp, sizeof(stamp));
-                json_append(hgen,
-                    "timestamp", "%s", stamp,
-                    NULL
-                );
-            }
-            va_list ap_;
-            va_copy(ap_, ap);
-            json_vappend(hgen, ap_); // TODO las keys repetidas APARECEN!! cambia el json!!
-            va_end(ap_);
-            if(priority <= LOG_CRIT || !(lh->handler_options & LOG_HND_OPT_NODISCOVER)) {
-                // LOG_EMERG LOG_ALERT LOG_CRIT always use discover()
-                discover(hgen);
-            }
-            char *bf = json_get_buf(hgen);
-            int ret = (lh->hr->write_fn)(lh->h, priority, bf, strlen(bf));
-            if(ret < 0) { // Handler owns the message
-                break;
-            }
-        }
-        if(lh->hr->fwrite_fn) {
-            if((opt & (LOG_OPT_TRACE_STACK|LOG_OPT_EXIT_NEGATIVE|LOG_OPT_ABORT)) ||
-                    ((lh->handler_options & LOG_HND_OPT_TRACE_STACK) && priority <=LOG_ERR)
-                ) {
-                show_backtrace(lh->hr->fwrite_fn, lh->h);
-            }
+/*****************************************************************
+ *  The record begins with the timespec, formatted by the renders
+ *****************************************************************/
+PRIVATE void record_stamp(log_sink_t *sink)
+{
+    if(sink_reserve(sink, LOG_REC_STAMP_SIZE)) {
+        struct timespec ts;
+#ifdef WIN32
+        timespec_get(&ts, TIME_UTC);
+#else
+        clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+        int64_t sec = ts.tv_sec;
+        uint32_t nsec = (uint32_t)ts.tv_nsec;
+        memcpy(sink->bf, &sec, sizeof(sec));
+        memcpy(sink->bf + sizeof(sec), &nsec, sizeof(nsec));
+        sink->len = LOG_REC_STAMP_SIZE;
+    }
+}
+
+/*****************************************************************
+ *  The message doesn't fit in the ring record:
+ *  leave the ring and begin the sync record, with the same timestamp.
+ *  The fields must be encoded again.
+ *****************************************************************/
+PRIVATE log_sink_t *record_resync(log_sink_t *sink)
+{
+#ifdef LOG_ASYNC
+    if(sink != &sync_record) {
+        char stamp[LOG_REC_STAMP_SIZE];
+        memcpy(stamp, sink->bf, LOG_REC_STAMP_SIZE);
+        uint32_t site = sink->site;
+
+        ASYNC_INC(__async_sync__);
+        async_sync_point();
+        async_leave();
+
+        LOG_LOCK();
+        sink = &sync_record;
+        sink->len = 0;
+        sink->overflow = FALSE;
+        sink->site = site;
+        if(sink_reserve(sink, LOG_REC_STAMP_SIZE)) {
+            memcpy(sink->bf, stamp, LOG_REC_STAMP_SIZE);
+            sink->len = LOG_REC_STAMP_SIZE;
         }
+    }
+#endif
+    return sink;
+}
 
+/*****************************************************************
+ *  Queue or write the json message
+ *****************************************************************/
+PRIVATE void record_commit(int priority, log_opt_t opt, log_sink_t *sink)
+{
+    sink_end(sink);
+
+#ifdef LOG_ASYNC
+    if(sink != &sync_record) {
+        __inside__ = 0;
+        if(async_push(__ring__, priority, LOG_REC_JSON, sink->site, sink->bf, sink->len)==0) {
+            async_leave();
+            return;
+        }
         /*
-         *  Next
+         *  Ring full with LOG_ASYNC_SYNC policy, or stopping.
+         *  The record is in the ring, leave it after the write.
          */
-        lh = dl_next(lh);
+        async_sync_point();
+        __inside__ = 1;
+        LOG_LOCK();
+        write_record(priority, opt, LOG_REC_JSON, sink->site, sink->bf, sink->len);
+        LOG_UNLOCK();
+        __inside__ = 0;
+        async_leave();
+        return;
     }
+#endif
 
+    write_record(priority, opt, LOG_REC_JSON, sink->site, sink->bf, sink->len);
+    LOG_UNLOCK();
     __inside__ = 0;
 
     if(opt & LOG_OPT_EXIT_NEGATIVE) {
@@ -1175,6 +1669,76 @@ PRIVATE void _log_jnbf(int priority, log_opt_t opt, va_list ap)
     }
 }
 
+/*****************************************************************
+ *      Log data in json format
+ *****************************************************************/
+PRIVATE void _log_jnbf(int priority, log_opt_t opt, uint32_t site, va_list ap)
+{
+    log_sink_t *sink = record_begin(priority, opt, site);
+    if(!sink) {
+        return;
+    }
+
+    va_list ap_;
+    va_copy(ap_, ap);
+    sink_vappend(sink, ap_); // TODO las keys repetidas APARECEN!! cambia el json!!
+    va_end(ap_);
+
+    if(sink->overflow) {
+        sink = record_resync(sink);
+        va_copy(ap_, ap);
+        sink_vappend(sink, ap_);
+        va_end(ap_);
+    }
+
+    record_commit(priority, opt, sink);
+}
+
+/*****************************************************************
+ *      Log typed key/values
+ *****************************************************************/
+PUBLIC void log_kv(int priority, log_opt_t opt, const log_kv_t *kv, size_t n)
+{
+    uint32_t *count = 0;
+    switch(priority) {
+        case LOG_ALERT:
+            count = &__alert_count__;
+            break;
+        case LOG_CRIT:
+            count = &__critical_count__;
+            break;
+        case LOG_ERR:
+            count = &__error_count__;
+            break;
+        case LOG_WARNING:
+            count = &__warning_count__;
+            break;
+        case LOG_INFO:
+        case LOG_DEBUG:
+            count = &__info_count__;
+            break;
+        default:
+            break;
+    }
+    if(count) {
+        (*count)++;
+    }
+
+    log_sink_t *sink = record_begin(priority, opt, LOG_CALL_SITE());
+    if(sink) {
+        sink_kv(sink, kv, n);
+        if(sink->overflow) {
+            sink = record_resync(sink);
+            sink_kv(sink, kv, n);
+        }
+        record_commit(priority, opt, sink);
+    }
+
+    if(count && __inform_cb__) {
+        __inform_cb__(priority, *count, __inform_cb_user_data__);
+    }
+}
+
 /*****************************************************************
  *      Log data in transparent format
  *****************************************************************/
@@ -1186,39 +1750,31 @@ PUBLIC void _log_bf(int priority, log_opt_t opt, const char *bf, int len)
     if(len <= 0) {
         return;
     }
-
-    if(__inside__) {
+    if(!priority_accepted(priority) &&
+            !(opt & (LOG_OPT_EXIT_NEGATIVE|LOG_OPT_EXIT_ZERO|LOG_OPT_ABORT))) {
         return;
     }
-    __inside__ = 1;
 
-    log_handler_t *lh = dl_first(&dl_clients);
-    while(lh) {
-        if(must_ignore(lh, priority)) {
-            /*
-             *  Next
-             */
-            lh = dl_next(lh);
-            continue;
-        }
-        if(lh->hr->write_fn) {
-            int ret = (lh->hr->write_fn)(lh->h, priority, bf, len);
-            if(ret < 0) { // Handler owns the message
-                break;
-            }
-        }
-        if(lh->hr->fwrite_fn) {
-            if(opt & (LOG_OPT_TRACE_STACK|LOG_OPT_EXIT_NEGATIVE|LOG_OPT_ABORT)) {
-                show_backtrace(lh->hr->fwrite_fn, lh->h);
-            }
+#ifdef LOG_ASYNC
+    if(__async_running__ && !__inside__) {
+        if(async_enqueue_bf(priority, opt, bf, len)==0) {
+            return;
         }
+    }
+#endif
 
-        /*
-         *  Next
-         */
-        lh = dl_next(lh);
+    if(__inside__) {
+        return;
     }
+#ifdef LOG_ASYNC
+    async_sync_point();
+#endif
+    __inside__ = 1;
+    LOG_LOCK();
 
+    write_record(priority, opt, LOG_REC_BF, 0, bf, len);
+
+    LOG_UNLOCK();
     __inside__ = 0;
 
     if(opt & LOG_OPT_EXIT_NEGATIVE) {
@@ -1232,47 +1788,1333 @@ PUBLIC void _log_bf(int priority, log_opt_t opt, const char *bf, int len)
     }
 }
 
-/*****************************************************************
- *  Add key/values from va_list argument
- *****************************************************************/
-PRIVATE void json_vappend(hgen_t hgen, va_list ap)
+/***************************************************************************
+ *  Key of call site
+ ***************************************************************************/
+PRIVATE uint32_t log_site_key(void *site)
 {
-    char *key;
-    char *fmt;
-    size_t i;
-    char value[4*1024];
+    uint64_t x = (uint64_t)(uintptr_t)site;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return ((uint32_t)x) | LOG_LIMIT_SITE_KEY;
+}
 
-    while ((key = (char *)va_arg (ap, char *)) != NULL) {
-        fmt = (char *)va_arg (ap, char *);
-        for (i = 0; i < strlen (fmt); i++) {
-            int eof = 0;
+/***************************************************************************
+ *  Fingerprint of message: the key/values without timestamp, FNV-1a
+ ***************************************************************************/
+PRIVATE uint32_t log_fingerprint(int priority, int type, const char *data, size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+    if(type == LOG_REC_JSON) {
+        p += LOG_REC_STAMP_SIZE;
+    }
+    uint32_t h = 2166136261u ^ (uint32_t)priority;
+    for(; p < end; p++) {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+    h &= ~LOG_LIMIT_SITE_KEY;
+    return h? h : 1;
+}
 
-            if (fmt[i] != '%')
-                continue;
-            i++;
-            while (eof != 1) {
-                switch (fmt[i]) {
-                    case 'd':
-                    case 'i':
-                    case 'o':
-                    case 'u':
-                    case 'x':
-                    case 'X':
+/***************************************************************************
+ *  Find or make the bucket of key
+ ***************************************************************************/
+PRIVATE log_bucket_t *limit_bucket(log_limiter_t *lm, uint32_t key, uint64_t now)
+{
+    uint32_t idx = (key * 2654435761u) % LOG_LIMIT_SLOTS;
+    log_bucket_t *older = 0;
+    for(int i=0; i<LOG_LIMIT_PROBES; i++) {
+        log_bucket_t *b = &lm->buckets[(idx + i) % LOG_LIMIT_SLOTS];
+        if(b->key == key) {
+            return b;
+        }
+        if(!b->key) {
+            older = b;
+            break;
+        }
+        if(!older || b->last_ms < older->last_ms) {
+            older = b;
+        }
+    }
+    /*
+     *  New bucket, or reuse the older one (its suppressed are lost in summaries)
+     */
+    if(older->key && older->suppressed) {
+        lm->pending--;
+    }
+    older->key = key;
+    older->suppressed = 0;
+    older->tokens = (uint64_t)lm->burst * 1000;
+    older->last_ms = now;
+    return older;
+}
+
+PRIVATE void limit_refill(log_limiter_t *lm, log_bucket_t *b, uint64_t now)
+{
+    if(now > b->last_ms) {
+        b->tokens += (now - b->last_ms) * lm->rate;
+        if(b->tokens > (uint64_t)lm->burst * 1000) {
+            b->tokens = (uint64_t)lm->burst * 1000;
+        }
+        b->last_ms = now;
+    }
+}
+
+/***************************************************************************
+ *  Write "repeated N times" summary of bucket to handler,
+ *  rendered as a record in the variant of handler (json or binary).
+ *  The render buffers of variants are shared: the summary invalidates
+ *  the render of the message being written ("renders", can be null).
+ ***************************************************************************/
+PRIVATE void limit_summary(log_handler_t *lh, log_renders_t *renders, log_bucket_t *b)
+{
+    if(!lh->hr->write_fn) {
+        return;
+    }
+    log_sink_t *sink = &summary_record;
+    sink->len = 0;
+    sink->overflow = FALSE;
+    record_stamp(sink);
+    sink_add_string(sink, "msgset", MSGSET_STATISTICS);
+    sink_add_string(sink, "msg", "Log messages suppressed by rate limit");
+    sink_add_string(sink, "by", (b->key & LOG_LIMIT_SITE_KEY)? "call site":"same message");
+    sink_add_integer(sink, "repeated", b->suppressed);
+    sink_end(sink);
+
+    log_renders_t summary_renders;
+    memset(&summary_renders, 0, sizeof(summary_renders));
+    int variant = render_variant(lh, b->priority);
+    size_t len;
+    const char *bf = render_record(
+        &summary_renders,
+        variant,
+        sink->bf,                       // timespec
+        sink->bf + LOG_REC_STAMP_SIZE,  // fields
+        sink->bf + sink->len,
+        &len
+    );
+    (lh->hr->write_fn)(lh->h, b->priority, bf, len);
+    if(renders) {
+        renders->bf[variant] = 0;
+        renders->len[variant] = 0;
+    }
+
+    b->suppressed = 0;
+    lh->limiter->pending--;
+}
+
+/***************************************************************************
+ *  Write the summaries of suppressed messages, each interval or forced
+ ***************************************************************************/
+PRIVATE void limit_summaries(
+    log_handler_t *lh,
+    log_renders_t *renders,
+    uint64_t now,
+    BOOL force)
+{
+    log_limiter_t *lm = lh->limiter;
+    if(!lm->pending) {
+        return;
+    }
+    if(!force && now < lm->next_summary_ms) {
+        return;
+    }
+    for(int i=0; i<LOG_LIMIT_SLOTS && lm->pending; i++) {
+        log_bucket_t *b = &lm->buckets[i];
+        if(b->key && b->suppressed) {
+            limit_summary(lh, renders, b);
+        }
+    }
+    lm->next_summary_ms = now + LOG_LIMIT_SUMMARY_INTERVAL;
+}
+
+/***************************************************************************
+ *  Token buckets of call site and of message fingerprint.
+ *  Return TRUE if the message can be written to handler.
+ ***************************************************************************/
+PRIVATE BOOL limit_pass(
+    log_handler_t *lh,
+    log_renders_t *renders,
+    int priority,
+    uint32_t site,
+    uint32_t fingerprint,
+    uint64_t now)
+{
+    log_limiter_t *lm = lh->limiter;
+
+    log_bucket_t *bm = limit_bucket(lm, fingerprint, now);
+    limit_refill(lm, bm, now);  // refreshed, not reused by the site bucket
+    log_bucket_t *bs = 0;
+    if(site) {
+        bs = limit_bucket(lm, site, now);
+        limit_refill(lm, bs, now);
+    }
+
+    if(bm->tokens < 1000 || (bs && bs->tokens < 1000)) {
+        log_bucket_t *b = (bm->tokens < 1000)? bm : bs;
+        if(!b->suppressed) {
+            lm->pending++;
+            if(lm->pending == 1) {
+                lm->next_summary_ms = now + LOG_LIMIT_SUMMARY_INTERVAL;
+            }
+        }
+        b->suppressed++;
+        b->priority = priority;
+        lm->suppressed++;
+        __suppressed_count__++;
+        limit_summaries(lh, renders, now, FALSE);
+        return FALSE;
+    }
+
+    bm->tokens -= 1000;
+    if(bs) {
+        bs->tokens -= 1000;
+    }
+
+    /*
+     *  The flood is over: summary before the message
+     */
+    if(bm->suppressed) {
+        limit_summary(lh, renders, bm);
+    }
+    if(bs && bs->suppressed) {
+        limit_summary(lh, renders, bs);
+    }
+    limit_summaries(lh, renders, now, FALSE);
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Rate limit of handler
+ ***************************************************************************/
+PUBLIC int log_set_handler_rate_limit(
+    const char *handler_name,
+    uint32_t burst,
+    uint32_t rate)
+{
+    if(empty_string(handler_name)) {
+        return -1;
+    }
+    int ret = -1;
+    LOG_LOCK();
+    log_handler_t *lh = dl_first(&dl_clients);
+    while(lh) {
+        if(strcmp(lh->handler_name, handler_name)==0) {
+            if(!burst) {
+                if(lh->limiter) {
+                    free(lh->limiter);
+                    lh->limiter = 0;
+                }
+            } else {
+                if(!lh->limiter) {
+                    lh->limiter = calloc(1, sizeof(log_limiter_t));
+                }
+                if(lh->limiter) {
+                    lh->limiter->burst = burst;
+                    lh->limiter->rate = rate;
+                }
+            }
+            ret = 0;
+        }
+        lh = dl_next(lh);
+    }
+    LOG_UNLOCK();
+    return ret;
+}
+
+/***************************************************************************
+ *  Messages suppressed by rate limit, cleared by log_clear_counters()
+ ***************************************************************************/
+PUBLIC uint32_t log_suppressed_count(void)
+{
+    return __suppressed_count__;
+}
+
+/***************************************************************************
+ *  Write a record to handlers, with the handlers locked.
+ *  The json records are rendered once by variant of handler options.
+ ***************************************************************************/
+PRIVATE void write_record(
+    int priority,
+    log_opt_t opt,
+    int type,
+    uint32_t site,
+    const char *data,
+    size_t len)
+{
+    log_renders_t renders;
+    memset(&renders, 0, sizeof(renders));
+    uint32_t fingerprint = 0;
+    uint64_t now = 0;
+
+    log_handler_t *lh = dl_first(&dl_clients);
+    while(lh) {
+        if(must_ignore(lh, priority)) {
+            /*
+             *  Next
+             */
+            lh = dl_next(lh);
+            continue;
+        }
+
+        if(lh->limiter && priority <= LOG_DEBUG) {
+            if(!now) {
+                now = time_in_miliseconds();
+                fingerprint = log_fingerprint(priority, type, data, len);
+            }
+            if(!limit_pass(lh, &renders, priority, site, fingerprint, now)) {
+                /*
+                 *  Next
+                 */
+                lh = dl_next(lh);
+                continue;
+            }
+        }
+
+        if(lh->hr->write_fn) {
+            int ret;
+            if(type == LOG_REC_BF) {
+                ret = (lh->hr->write_fn)(lh->h, priority, data, len);
+            } else {
+                size_t bf_len;
+                const char *bf = render_record(
+                    &renders,
+                    render_variant(lh, priority),
+                    data,                       // timespec
+                    data + LOG_REC_STAMP_SIZE,  // fields
+                    data + len,
+                    &bf_len
+                );
+                ret = (lh->hr->write_fn)(lh->h, priority, bf, bf_len);
+            }
+            if(ret < 0) { // Handler owns the message
+                break;
+            }
+        }
+        if(lh->hr->fwrite_fn) {
+            if((opt & (LOG_OPT_TRACE_STACK|LOG_OPT_EXIT_NEGATIVE|LOG_OPT_ABORT)) ||
+                    (type == LOG_REC_JSON &&
+                    (lh->handler_options & LOG_HND_OPT_TRACE_STACK) && priority <=LOG_ERR)
+                ) {
+                show_backtrace(lh->hr->fwrite_fn, lh->h);
+            }
+        }
+
+        /*
+         *  Next
+         */
+        lh = dl_next(lh);
+    }
+}
+
+#ifdef LOG_ASYNC
+/***************************************************************************
+ *  Thread exit: the writer frees the ring when empty
+ ***************************************************************************/
+PRIVATE void ring_destructor(void *ring_)
+{
+    log_ring_t *ring = ring_;
+    if(__ring__ == ring && __ring_generation__ == __async_generation__) {
+        __ring__ = 0;
+        __sync_synchronize();
+        ring->orphan = 1;
+    }
+}
+
+PRIVATE void ring_key_create(void)
+{
+    pthread_key_create(&ring_key, ring_destructor);
+}
+
+/***************************************************************************
+ *  Return the ring of the current thread, create it if not exists
+ ***************************************************************************/
+PRIVATE log_ring_t *ring_get(void)
+{
+    if(__ring__ && __ring_generation__ == __async_generation__) {
+        return __ring__;
+    }
+
+    size_t size = __async_ring_size__;
+    log_ring_t *ring = malloc(sizeof(log_ring_t) + size);
+    if(!ring) {
+        return 0;
+    }
+    memset(ring, 0, sizeof(log_ring_t));
+    ring->bf = (char *)(ring + 1);
+    ring->size = size;
+
+    pthread_once(&ring_key_once, ring_key_create);
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&mutex_async);
+    ring->__next__ = rings;
+    rings = ring;
+    pthread_mutex_unlock(&mutex_async);
+
+    __ring__ = ring;
+    __ring_generation__ = __async_generation__;
+    return ring;
+}
+
+/***************************************************************************
+ *  Write a record in the ring (producer side).
+ *  Return -1 if there is no space.
+ ***************************************************************************/
+PRIVATE int ring_write(
+    log_ring_t *ring,
+    int priority,
+    int type,
+    uint32_t site,
+    const char *data,
+    size_t data_len)
+{
+    size_t total = LOG_REC_ALIGN(sizeof(log_rec_hdr_t) + data_len);
+    uint64_t head = ring->head;
+    size_t used = head - ring->tail;
+    size_t pos = head & (ring->size - 1);
+    size_t contiguous = ring->size - pos;
+    size_t need = (total > contiguous)? contiguous + total : total;
+
+    if(used + need > ring->size) {
+        return -1;
+    }
+    if(total > contiguous) {
+        log_rec_hdr_t *pad = (log_rec_hdr_t *)(ring->bf + pos);
+        pad->len = contiguous;
+        pad->data_len = 0;
+        pad->priority = 0;
+        pad->type = LOG_REC_PAD;
+        pad->site = 0;
+        head += contiguous;
+        pos = 0;
+    }
+    log_rec_hdr_t *hdr = (log_rec_hdr_t *)(ring->bf + pos);
+    hdr->len = total;
+    hdr->data_len = data_len;
+    hdr->priority = priority;
+    hdr->type = type;
+    hdr->site = site;
+    memcpy(hdr + 1, data, data_len);
+
+    __sync_synchronize();
+    ring->head = head + total;
+    return 0;
+}
+
+/***************************************************************************
+ *  Write the records of a ring (consumer side).
+ *  Return the number of records written.
+ ***************************************************************************/
+PRIVATE size_t ring_drain(log_ring_t *ring)
+{
+    size_t n = 0;
+    uint64_t tail = ring->tail;
+    uint64_t head = ring->head;
+    __sync_synchronize();
+
+    while(tail != head) {
+        log_rec_hdr_t *hdr = (log_rec_hdr_t *)(ring->bf + (tail & (ring->size - 1)));
+        if(hdr->type != LOG_REC_PAD) {
+            write_record(
+                hdr->priority,
+                0,
+                hdr->type,
+                hdr->site,
+                (const char *)(hdr + 1),
+                hdr->data_len
+            );
+            n++;
+        }
+        tail += hdr->len;
+    }
+
+    __sync_synchronize();
+    ring->tail = tail;
+    if(n) {
+        // After the tail: it's the progress seen by async_wait_drain()
+        __sync_add_and_fetch(&__async_written__, n);
+    }
+    return n;
+}
+
+/***************************************************************************
+ *  Write the records of all rings, in a batch by ring.
+ *  Free the rings of finished threads.
+ ***************************************************************************/
+PRIVATE size_t async_drain_all(void)
+{
+    size_t n = 0;
+
+    pthread_mutex_lock(&mutex_async);
+    log_ring_t **prev = &rings;
+    log_ring_t *ring;
+    while((ring = *prev)) {
+        if(ring->tail != ring->head) {
+            LOG_LOCK();
+            n += ring_drain(ring);
+            LOG_UNLOCK();
+        }
+        if(ring->orphan && ring->tail == ring->head) {
+            *prev = ring->__next__;
+            free(ring);
+            continue;
+        }
+        prev = &ring->__next__;
+    }
+    pthread_mutex_unlock(&mutex_async);
+
+    if(n && __async_waiters__) {
+        pthread_mutex_lock(&mutex_wake);
+        pthread_cond_broadcast(&cond_drain);
+        pthread_mutex_unlock(&mutex_wake);
+    }
+    return n;
+}
+
+/***************************************************************************
+ *  Are there records pending of write?
+ ***************************************************************************/
+PRIVATE BOOL async_pending(void)
+{
+    BOOL pending = FALSE;
+    pthread_mutex_lock(&mutex_async);
+    log_ring_t *ring = rings;
+    while(ring) {
+        if(ring->tail != ring->head) {
+            pending = TRUE;
+            break;
+        }
+        ring = ring->__next__;
+    }
+    pthread_mutex_unlock(&mutex_async);
+    return pending;
+}
+
+/***************************************************************************
+ *  Wake up the writer if it's sleeping
+ ***************************************************************************/
+PRIVATE void async_wake(void)
+{
+    __sync_synchronize();
+    if(__async_writer_idle__) {
+        pthread_mutex_lock(&mutex_wake);
+        pthread_cond_signal(&cond_wake);
+        pthread_mutex_unlock(&mutex_wake);
+    }
+}
+
+PRIVATE void async_pause(void)
+{
+    struct timespec ts = {0, 100*1000};
+    nanosleep(&ts, 0);
+}
+
+/***************************************************************************
+ *  Absolute time of a wait of LOG_ASYNC_IDLE_WAIT
+ ***************************************************************************/
+PRIVATE void async_deadline(struct timespec *ts)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_nsec += LOG_ASYNC_IDLE_WAIT * 1000000L;
+    if(ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/***************************************************************************
+ *  Wait until the writer drains records or the async mode stops.
+ *  `written` is the __async_written__ read before checking the ring.
+ ***************************************************************************/
+PRIVATE void async_wait_drain(uint64_t written)
+{
+    pthread_mutex_lock(&mutex_wake);
+    __sync_add_and_fetch(&__async_waiters__, 1);
+    pthread_cond_signal(&cond_wake);
+    if(__async_running__ && __async_written__ == written) {
+        struct timespec ts;
+        async_deadline(&ts);
+        pthread_cond_timedwait(&cond_drain, &mutex_wake, &ts);
+    }
+    __sync_sub_and_fetch(&__async_waiters__, 1);
+    pthread_mutex_unlock(&mutex_wake);
+}
+
+/***************************************************************************
+ *  Writer thread
+ ***************************************************************************/
+PRIVATE void *async_writer_thread(void *arg)
+{
+    __inside__ = 1; // the logs of handlers are ignored, as in sync mode
+
+    while(__async_running__) {
+        if(async_drain_all() > 0) {
+            continue;
+        }
+        pthread_mutex_lock(&mutex_wake);
+        __async_writer_idle__ = 1;
+        __sync_synchronize();
+        if(__async_running__ && !async_pending()) {
+            struct timespec ts;
+            async_deadline(&ts);
+            pthread_cond_timedwait(&cond_wake, &mutex_wake, &ts);
+        }
+        __async_writer_idle__ = 0;
+        pthread_mutex_unlock(&mutex_wake);
+    }
+    async_drain_all();
+
+    return 0;
+}
+
+/***************************************************************************
+ *  Queue a record, applying the policy if the ring is full.
+ *  Return -1 if the record must be written synchronously.
+ ***************************************************************************/
+PRIVATE int async_push(
+    log_ring_t *ring,
+    int priority,
+    int type,
+    uint32_t site,
+    const char *data,
+    size_t len)
+{
+    BOOL blocked = FALSE;
+
+    while(1) {
+        uint64_t written = __async_written__;
+        __sync_synchronize();
+        if(ring_write(ring, priority, type, site, data, len) == 0) {
+            break;
+        }
+        switch(__async_policy__) {
+            case LOG_ASYNC_BLOCK:
+                if(!blocked) {
+                    blocked = TRUE;
+                    ASYNC_INC(__async_blocked__);
+                }
+                if(!__async_running__) {
+                    return -1;
+                }
+                async_wait_drain(written);
+                break;
+
+            case LOG_ASYNC_SYNC:
+                ASYNC_INC(__async_sync__);
+                return -1;
+
+            case LOG_ASYNC_DROP:
+            default:
+                ring->dropped++;
+                ASYNC_INC(__async_dropped__);
+                return 0;
+        }
+    }
+    ASYNC_INC(__async_queued__);
+    async_wake();
+    return 0;
+}
+
+/***************************************************************************
+ *  Can the message be queued?
+ ***************************************************************************/
+PRIVATE BOOL async_eligible(int priority, log_opt_t opt)
+{
+    if(opt & (LOG_OPT_TRACE_STACK|LOG_OPT_EXIT_NEGATIVE|LOG_OPT_EXIT_ZERO|LOG_OPT_ABORT)) {
+        // The stack must be of the caller, and the message written before exit.
+        return FALSE;
+    }
+    if(__hnd_trace_stack__ && priority <= LOG_ERR) {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Copy the buffer in the ring of the thread.
+ *  Return -1 if the message must be written synchronously.
+ ***************************************************************************/
+PRIVATE int async_enqueue_bf(int priority, log_opt_t opt, const char *bf, int len)
+{
+    if(opt & (LOG_OPT_TRACE_STACK|LOG_OPT_EXIT_NEGATIVE|LOG_OPT_EXIT_ZERO|LOG_OPT_ABORT)) {
+        return -1;
+    }
+    if(len > LOG_ASYNC_MAX_RECORD) {
+        return -1;
+    }
+    if(!async_enter()) {
+        return -1;
+    }
+    int ret = -1;
+    log_ring_t *ring = ring_get();
+    if(ring) {
+        ret = async_push(ring, priority, LOG_REC_BF, 0, bf, len);
+    }
+    async_leave();
+    return ret;
+}
+
+/***************************************************************************
+ *  Before a synchronous write: wait the queued records of this thread,
+ *  to keep the order of messages.
+ ***************************************************************************/
+PRIVATE void async_sync_point(void)
+{
+    if(!__async_running__ || !async_enter()) {
+        return;
+    }
+    log_ring_t *ring = __ring__;
+    if(ring && __ring_generation__ == __async_generation__) {
+        while(__async_running__) {
+            uint64_t written = __async_written__;
+            __sync_synchronize();
+            if(ring->tail == ring->head) {
+                break;
+            }
+            async_wait_drain(written);
+        }
+    }
+    async_leave();
+}
+
+/***************************************************************************
+ *  Register the thread as producer while it uses his ring:
+ *  async_stop() waits them, so their records are drained
+ *  and the rings are not freed while in use.
+ *  Return FALSE if the async mode is not running.
+ ***************************************************************************/
+PRIVATE BOOL async_enter(void)
+{
+    __sync_add_and_fetch(&__async_producers__, 1);
+    if(!__async_running__) {
+        __sync_sub_and_fetch(&__async_producers__, 1);
+        return FALSE;
+    }
+    __producing__++;
+    return TRUE;
+}
+
+PRIVATE void async_leave(void)
+{
+    __producing__--;
+    __sync_sub_and_fetch(&__async_producers__, 1);
+}
+
+/***************************************************************************
+ *  Stop the writer, writing the pending records
+ ***************************************************************************/
+PRIVATE void async_stop(void)
+{
+    if(!__async_running__) {
+        return;
+    }
+    __async_running__ = 0;
+    __sync_synchronize();
+
+    pthread_mutex_lock(&mutex_wake);
+    pthread_cond_signal(&cond_wake);
+    pthread_cond_broadcast(&cond_drain);
+    pthread_mutex_unlock(&mutex_wake);
+    pthread_join(async_writer, 0);
+
+    /*
+     *  Producers that have seen the async mode running
+     */
+    while(__async_producers__ > __producing__) {
+        async_pause();
+    }
+
+    /*
+     *  Records queued while stopping
+     */
+    char inside = __inside__;
+    __inside__ = 1;
+    async_drain_all();
+    __inside__ = inside;
+}
+
+/***************************************************************************
+ *  Free all rings, the threads will create new ones.
+ *  After async_stop(): no producer is using them.
+ ***************************************************************************/
+PRIVATE void async_free_rings(void)
+{
+    pthread_mutex_lock(&mutex_async);
+    while(rings) {
+        log_ring_t *next = rings->__next__;
+        free(rings);
+        rings = next;
+    }
+    __async_generation__++;
+    pthread_mutex_unlock(&mutex_async);
+}
+#endif /* LOG_ASYNC */
+
+/***************************************************************************
+ *  Set async mode
+ ***************************************************************************/
+PUBLIC int log_set_async(
+    BOOL async,
+    size_t ring_size,
+    log_async_policy_t policy)
+{
+#ifdef LOG_ASYNC
+    if(!async) {
+        async_stop();
+        return 0;
+    }
+    if(!__initialized__) {
+        print_error(
+            PEF_CONTINUE,
+            "ERROR YUNETA",
+            "log_set_async(): glogger not initialized"
+        );
+        return -1;
+    }
+
+    if(ring_size == 0) {
+        ring_size = LOG_ASYNC_RING_SIZE;
+    }
+    size_t size = 4*LOG_ASYNC_MAX_RECORD;
+    while(size < ring_size) {
+        size <<= 1;
+    }
+    __async_ring_size__ = size;     // new size for new threads
+    __async_policy__ = policy;
+
+    if(__async_running__) {
+        return 0;
+    }
+    __async_running__ = 1;
+    if(pthread_create(&async_writer, 0, async_writer_thread, 0)!=0) {
+        __async_running__ = 0;
+        print_error(
+            PEF_CONTINUE,
+            "ERROR YUNETA",
+            "log_set_async(): pthread_create() FAILED"
+        );
+        return -1;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/***************************************************************************
+ *  Wait until the queued messages are written
+ ***************************************************************************/
+PUBLIC void log_async_flush(void)
+{
+#ifdef LOG_ASYNC
+    if(__inside__) {
+        return;
+    }
+    while(__async_running__) {
+        uint64_t written = __async_written__;
+        __sync_synchronize();
+        if(!async_pending()) {
+            break;
+        }
+        async_wait_drain(written);
+    }
+#endif
+}
+
+/***************************************************************************
+ *  Statistics of async mode
+ ***************************************************************************/
+PUBLIC json_t *log_async_stats(void)
+{
+    json_t *jn_stats = json_object();
+#ifdef LOG_ASYNC
+    size_t threads = 0;
+    size_t pending_bytes = 0;
+
+    pthread_mutex_lock(&mutex_async);
+    log_ring_t *ring = rings;
+    while(ring) {
+        threads++;
+        pending_bytes += ring->head - ring->tail;
+        ring = ring->__next__;
+    }
+    pthread_mutex_unlock(&mutex_async);
+
+    const char *policy;
+    switch(__async_policy__) {
+        case LOG_ASYNC_BLOCK:
+            policy = "block";
+            break;
+        case LOG_ASYNC_SYNC:
+            policy = "sync";
+            break;
+        case LOG_ASYNC_DROP:
+        default:
+            policy = "drop";
+            break;
+    }
+
+    json_object_set_new(jn_stats, "async", json_boolean(__async_running__));
+    json_object_set_new(jn_stats, "policy", json_string(policy));
+    json_object_set_new(jn_stats, "ring_size", json_integer(__async_ring_size__));
+    json_object_set_new(jn_stats, "threads", json_integer(threads));
+    json_object_set_new(jn_stats, "pending_bytes", json_integer(pending_bytes));
+    json_object_set_new(jn_stats, "queued", json_integer(__async_queued__));
+    json_object_set_new(jn_stats, "written", json_integer(__async_written__));
+    json_object_set_new(jn_stats, "dropped", json_integer(__async_dropped__));
+    json_object_set_new(jn_stats, "blocked", json_integer(__async_blocked__));
+    json_object_set_new(jn_stats, "sync", json_integer(__async_sync__));
+#else
+    json_object_set_new(jn_stats, "async", json_false());
+#endif
+    return jn_stats;
+}
+
+/*****************************************************************
+ *  Put a field in the record of sink,
+ *  the fields not fitting are lost.
+ *****************************************************************/
+PRIVATE BOOL sink_reserve(log_sink_t *sink, size_t need)
+{
+    if(sink->len + need <= sink->size) {
+        return TRUE;
+    }
+    if(!sink->grow) {
+        sink->overflow = TRUE;
+        return FALSE;
+    }
+    size_t size = sink->size? sink->size : 1024;
+    while(size < sink->len + need) {
+        size *= 2;
+    }
+    char *bf = realloc(sink->bf, size);
+    if(!bf) {
+        return FALSE;
+    }
+    sink->bf = bf;
+    sink->size = size;
+    return TRUE;
+}
+
+PRIVATE void sink_put(log_sink_t *sink, char type, const char *key, const void *value, size_t len)
+{
+    size_t key_len = strlen(key) + 1;
+    if(!sink_reserve(sink, 1 + key_len + len + 1)) { // +1 end of fields
+        return;
+    }
+    sink->bf[sink->len++] = type;
+    memcpy(sink->bf + sink->len, key, key_len);
+    sink->len += key_len;
+    memcpy(sink->bf + sink->len, value, len);
+    sink->len += len;
+}
+
+PRIVATE void sink_end(log_sink_t *sink)
+{
+    if(sink_reserve(sink, 1)) {
+        sink->bf[sink->len++] = 0;
+    }
+}
+
+PRIVATE void sink_add_string(log_sink_t *sink, char *key, char *str)
+{
+    if(sink->hgen) {
+        json_add_string(sink->hgen, key, str);
+        return;
+    }
+    sink_put(sink, 's', key, str, strlen(str) + 1);
+}
+
+PRIVATE void sink_add_null(log_sink_t *sink, char *key)
+{
+    if(sink->hgen) {
+        json_add_null(sink->hgen, key);
+        return;
+    }
+    sink_put(sink, 'n', key, "", 0);
+}
+
+PRIVATE void sink_add_double(log_sink_t *sink, char *key, double number)
+{
+    if(sink->hgen) {
+        json_add_double(sink->hgen, key, number);
+        return;
+    }
+    sink_put(sink, 'd', key, &number, sizeof(number));
+}
+
+PRIVATE void sink_add_integer(log_sink_t *sink, char *key, long long int number)
+{
+    if(sink->hgen) {
+        json_add_integer(sink->hgen, key, number);
+        return;
+    }
+    sink_put(sink, 'i', key, &number, sizeof(number));
+}
+
+PRIVATE void sink_add_json(log_sink_t *sink, char *key, json_t *jn)
+{
+    if(!jn) {
+        sink_add_null(sink, key);
+        return;
+    }
+    size_t flags = JSON_ENCODE_ANY |
+        JSON_INDENT(0) |
+        JSON_REAL_PRECISION(get_real_precision());
+    char *bf = json_dumps(jn, flags);
+    if(bf) {
+        helper_doublequote2quote(bf);
+        sink_add_string(sink, key, bf);
+        jsonp_free(bf) ;
+    } else {
+        sink_add_null(sink, key);
+    }
+}
+
+/*****************************************************************
+ *  Add typed key/values, without format parsing
+ *****************************************************************/
+PRIVATE void sink_kv(log_sink_t *sink, const log_kv_t *kv, size_t n)
+{
+    for(size_t i=0; i<n; i++, kv++) {
+        char *key = (char *)kv->key;
+        if(!key) {
+            continue;
+        }
+        switch(kv->type) {
+            case LOG_KV_TYPE_STRING:
+                if(kv->v.s) {
+                    if(strcmp(key, "msg")==0) {
+                        snprintf(last_message, sizeof(last_message), "%s", kv->v.s);
+                    }
+                    sink_add_string(sink, key, (char *)kv->v.s);
+                } else {
+                    sink_add_null(sink, key);
+                }
+                break;
+            case LOG_KV_TYPE_INTEGER:
+                sink_add_integer(sink, key, kv->v.i);
+                break;
+            case LOG_KV_TYPE_REAL:
+                sink_add_double(sink, key, kv->v.r);
+                break;
+            case LOG_KV_TYPE_JSON:
+                sink_add_json(sink, key, kv->v.j);
+                break;
+            case LOG_KV_TYPE_NULL:
+            default:
+                sink_add_null(sink, key);
+                break;
+        }
+    }
+}
+
+/*****************************************************************
+ *  Add the key/values of a record to a json_buffer
+ *****************************************************************/
+PRIVATE void record_replay(hgen_t hgen, const char *p, const char *end)
+{
+    while(p < end && *p) {
+        char type = *p++;
+        char *key = (char *)p;
+        p += strlen(key) + 1;
+        switch(type) {
+            case 's':
+                json_add_string(hgen, key, (char *)p);
+                p += strlen(p) + 1;
+                break;
+            case 'i':
+                {
+                    long long int v;
+                    memcpy(&v, p, sizeof(v));
+                    json_add_integer(hgen, key, v);
+                    p += sizeof(v);
+                }
+                break;
+            case 'd':
+                {
+                    double v;
+                    memcpy(&v, p, sizeof(v));
+                    json_add_double(hgen, key, v);
+                    p += sizeof(v);
+                }
+                break;
+            default:
+                json_add_null(hgen, key);
+                break;
+        }
+    }
+}
+
+/*****************************************************************
+ *  MessagePack of binary records, big endian numbers
+ *****************************************************************/
+PRIVATE void mp_put_be(log_sink_t *sink, uint64_t v, int n)
+{
+    unsigned char *p = (unsigned char *)sink->bf + sink->len;
+    for(int i=n-1; i>=0; i--) {
+        p[i] = (unsigned char)(v & 0xff);
+        v >>= 8;
+    }
+    sink->len += n;
+}
+
+PRIVATE uint64_t mp_get_be(const unsigned char *p, size_t n)
+{
+    uint64_t v = 0;
+    for(size_t i=0; i<n; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+PRIVATE void mp_put_code(log_sink_t *sink, unsigned char code)
+{
+    sink->bf[sink->len++] = (char)code;
+}
+
+PRIVATE void mp_put_str(log_sink_t *sink, const char *str, size_t len)
+{
+    if(len < 32) {
+        mp_put_code(sink, MP_FIXSTR | (unsigned char)len);
+    } else if(len <= 0xff) {
+        mp_put_code(sink, MP_STR8);
+        mp_put_be(sink, len, 1);
+    } else if(len <= 0xffff) {
+        mp_put_code(sink, MP_STR16);
+        mp_put_be(sink, len, 2);
+    } else {
+        mp_put_code(sink, MP_STR32);
+        mp_put_be(sink, len, 4);
+    }
+    memcpy(sink->bf + sink->len, str, len);
+    sink->len += len;
+}
+
+PRIVATE void mp_put_integer(log_sink_t *sink, long long int v)
+{
+    if(v >= 0) {
+        if(v < 128) {
+            mp_put_code(sink, (unsigned char)v);
+        } else if(v <= 0xff) {
+            mp_put_code(sink, MP_UINT8);
+            mp_put_be(sink, v, 1);
+        } else if(v <= 0xffff) {
+            mp_put_code(sink, MP_UINT16);
+            mp_put_be(sink, v, 2);
+        } else if(v <= 0xffffffffLL) {
+            mp_put_code(sink, MP_UINT32);
+            mp_put_be(sink, v, 4);
+        } else {
+            mp_put_code(sink, MP_UINT64);
+            mp_put_be(sink, v, 8);
+        }
+    } else {
+        if(v >= -32) {
+            mp_put_code(sink, (unsigned char)v); // negative fixint
+        } else if(v >= -128) {
+            mp_put_code(sink, MP_INT8);
+            mp_put_be(sink, (uint64_t)v, 1);
+        } else if(v >= -32768) {
+            mp_put_code(sink, MP_INT16);
+            mp_put_be(sink, (uint64_t)v, 2);
+        } else if(v >= -2147483648LL) {
+            mp_put_code(sink, MP_INT32);
+            mp_put_be(sink, (uint64_t)v, 4);
+        } else {
+            mp_put_code(sink, MP_INT64);
+            mp_put_be(sink, (uint64_t)v, 8);
+        }
+    }
+}
+
+PRIVATE void mp_put_double(log_sink_t *sink, double v)
+{
+    uint64_t u;
+    memcpy(&u, &v, sizeof(u));
+    mp_put_code(sink, MP_FLOAT64);
+    mp_put_be(sink, u, 8);
+}
+
+PRIVATE void mp_put_timestamp(log_sink_t *sink, int64_t sec, uint32_t nsec)
+{
+    if((sec >> 34) == 0) {
+        if(nsec == 0 && sec <= 0xffffffffLL) {
+            mp_put_code(sink, MP_FIXEXT4);
+            mp_put_code(sink, MP_EXT_TIMESTAMP);
+            mp_put_be(sink, sec, 4);
+        } else {
+            mp_put_code(sink, MP_FIXEXT8);
+            mp_put_code(sink, MP_EXT_TIMESTAMP);
+            mp_put_be(sink, ((uint64_t)nsec << 34) | (uint64_t)sec, 8);
+        }
+    } else {
+        mp_put_code(sink, MP_EXT8);
+        mp_put_code(sink, 12);
+        mp_put_code(sink, MP_EXT_TIMESTAMP);
+        mp_put_be(sink, nsec, 4);
+        mp_put_be(sink, (uint64_t)sec, 8);
+    }
+}
+
+/*****************************************************************
+ *  Put the key of a binary field, with room for its value.
+ *  Like in records, the fields not fitting are lost.
+ *****************************************************************/
+PRIVATE BOOL mp_put_key(log_sink_t *sink, uint32_t *count, const char *key, size_t value_size)
+{
+    size_t key_len = strlen(key);
+    if(!sink_reserve(sink, 5 + key_len + value_size)) {
+        return FALSE;
+    }
+    for(int id=0; binary_keys[id]; id++) {
+        if(strcmp(binary_keys[id], key)==0) {
+            mp_put_code(sink, (unsigned char)id);
+            (*count)++;
+            return TRUE;
+        }
+    }
+    mp_put_str(sink, key, key_len);
+    (*count)++;
+    return TRUE;
+}
+
+/*****************************************************************
+ *  Render a record in MessagePack
+ *****************************************************************/
+PRIVATE void render_binary(
+    log_sink_t *sink,
+    int variant,
+    const char *stamp,
+    const char *p,
+    const char *end)
+{
+    uint32_t count = 0;
+    sink->grow = TRUE;
+    sink->len = 0;
+    if(!sink_reserve(sink, 5)) {
+        return;
+    }
+    mp_put_code(sink, MP_MAP32);
+    sink->len += 4; // count of keys, set at end
+
+    if(!(variant & LOG_VARIANT_NOTIME)) {
+        if(mp_put_key(sink, &count, "timestamp", 15)) {
+            int64_t sec;
+            uint32_t nsec;
+            memcpy(&sec, stamp, sizeof(sec));
+            memcpy(&nsec, stamp + sizeof(sec), sizeof(nsec));
+            mp_put_timestamp(sink, sec, nsec);
+        }
+    }
+
+    while(p < end && *p) {
+        char type = *p++;
+        const char *key = p;
+        p += strlen(key) + 1;
+        switch(type) {
+            case 's':
+                {
+                    size_t len = strlen(p);
+                    if(mp_put_key(sink, &count, key, 5 + len)) {
+                        mp_put_str(sink, p, len);
+                    }
+                    p += len + 1;
+                }
+                break;
+            case 'i':
+                {
+                    long long int v;
+                    memcpy(&v, p, sizeof(v));
+                    if(mp_put_key(sink, &count, key, 9)) {
+                        mp_put_integer(sink, v);
+                    }
+                    p += sizeof(v);
+                }
+                break;
+            case 'd':
+                {
+                    double v;
+                    memcpy(&v, p, sizeof(v));
+                    if(mp_put_key(sink, &count, key, 9)) {
+                        mp_put_double(sink, v);
+                    }
+                    p += sizeof(v);
+                }
+                break;
+            default:
+                if(mp_put_key(sink, &count, key, 1)) {
+                    mp_put_code(sink, MP_NIL);
+                }
+                break;
+        }
+    }
+
+    if(variant & LOG_VARIANT_DISCOVER) {
+        const char *process = get_process_name();
+        const char *hostname = get_host_name();
+        if(mp_put_key(sink, &count, "process", 5 + strlen(process))) {
+            mp_put_str(sink, process, strlen(process));
+        }
+        if(mp_put_key(sink, &count, "hostname", 5 + strlen(hostname))) {
+            mp_put_str(sink, hostname, strlen(hostname));
+        }
+        if(mp_put_key(sink, &count, "pid", 9)) {
+            mp_put_integer(sink, get_pid());
+        }
+    }
+
+    size_t len = sink->len;
+    sink->len = 1;
+    mp_put_be(sink, count, 4);
+    sink->len = len;
+}
+
+/*****************************************************************
+ *  Add key/values from va_list argument
+ *****************************************************************/
+PRIVATE void sink_vappend(log_sink_t *sink, va_list ap)
+{
+    char *key;
+    char *fmt;
+    size_t i;
+    char value[4*1024];
+
+    while ((key = (char *)va_arg (ap, char *)) != NULL) {
+        fmt = (char *)va_arg (ap, char *);
+        for (i = 0; i < strlen (fmt); i++) {
+            int eof = 0;
+
+            if (fmt[i] != '%')
+                continue;
+            i++;
+            while (eof != 1) {
+                switch (fmt[i]) {
+                    case 'd':
+                    case 'i':
+                    case 'o':
+                    case 'u':
+                    case 'x':
+                    case 'X':
                         if (fmt[i - 1] == 'l') {
                             if (i - 2 > 0 && fmt[i - 2] == 'l') {
                                 long long int v;
                                 v = va_arg(ap, long long int);
-                                json_add_integer(hgen, key, v);
+                                sink_add_integer(sink, key, v);
 
                             } else {
                                 long int v;
                                 v = va_arg(ap, long int);
-                                json_add_integer(hgen, key, v);
+                                sink_add_integer(sink, key, v);
                             }
                         } else {
                             int v;
                             v = va_arg(ap, int);
-                            json_add_integer(hgen, key, v);
+                            sink_add_integer(sink, key, v);
                         }
                         eof = 1;
                         break;
@@ -1287,11 +3129,11 @@ PRIVATE void json_vappend(hgen_t hgen, va_list ap)
                         if (fmt[i - 1] == 'L') {
                             long double v;
                             v = va_arg (ap, long double);
-                            json_add_double(hgen, key, v);
+                            sink_add_double(sink, key, v);
                         } else {
                             double v;
                             v = va_arg (ap, double);
-                            json_add_double(hgen, key, v);
+                            sink_add_double(sink, key, v);
                         }
                         eof = 1;
                         break;
@@ -1317,9 +3159,9 @@ PRIVATE void json_vappend(hgen_t hgen, va_list ap)
                                 if(strcmp(key, "msg")==0) {
                                     snprintf(last_message, sizeof(last_message), "%s", value);
                                 }
-                                json_add_string(hgen, key, value);
+                                sink_add_string(sink, key, value);
                             } else {
-                                json_add_null(hgen, key);
+                                sink_add_null(sink, key);
                             }
 
                         } else {
@@ -1331,9 +3173,9 @@ PRIVATE void json_vappend(hgen_t hgen, va_list ap)
                                 if(strcmp(key, "msg")==0) {
                                     snprintf(last_message, sizeof(last_message), "%s", value);
                                 }
-                                json_add_string(hgen, key, value);
+                                sink_add_string(sink, key, value);
                             } else {
-                                json_add_null(hgen, key);
+                                sink_add_null(sink, key);
                             }
                         }
                         eof = 1;
@@ -1346,9 +3188,9 @@ PRIVATE void json_vappend(hgen_t hgen, va_list ap)
                             p = va_arg (ap, void *);
                             eof = 1;
                             if(p && (len = snprintf(value, sizeof(value), "%p", (char *)p))>0) {
-                                json_add_string(hgen, key, value);
+                                sink_add_string(sink, key, value);
                             } else {
-                                json_add_null(hgen, key);
+                                sink_add_null(sink, key);
                             }
                         }
                         break;
@@ -1359,21 +3201,7 @@ PRIVATE void json_vappend(hgen_t hgen, va_list ap)
                             jn = va_arg (ap, void *);
                             eof = 1;
 
-                            if(jn) {
-                                size_t flags = JSON_ENCODE_ANY |
-                                    JSON_INDENT(0) |
-                                    JSON_REAL_PRECISION(get_real_precision());
-                                char *bf = json_dumps(jn, flags);
-                                if(bf) {
-                                    helper_doublequote2quote(bf);
-                                    json_add_string(hgen, key, bf);
-                                    jsonp_free(bf) ;
-                                } else {
-                                    json_add_null(hgen, key);
-                                }
-                            } else {
-                                json_add_null(hgen, key);
-                            }
+                            sink_add_json(sink, key, jn);
                         }
                         break;
                     case '%':
@@ -1388,28 +3216,472 @@ PRIVATE void json_vappend(hgen_t hgen, va_list ap)
 }
 
 /*****************************************************************
- *  Add key/values from ... argument
+ *      Discover extra data
  *****************************************************************/
-PRIVATE void json_append(hgen_t hgen, ...)
+PRIVATE void discover(hgen_t hgen)
 {
-    va_list ap;
+    json_add_string(hgen, "process", (char *)get_process_name());
+    json_add_string(hgen, "hostname", (char *)get_host_name());
+    json_add_integer(hgen, "pid", get_pid());
+}
 
-    va_start(ap, hgen);
-    json_vappend(hgen, ap);
-    va_end(ap);
+/*****************************************************************
+ *  Variant of render used by the handler
+ *****************************************************************/
+PRIVATE int render_variant(log_handler_t *lh, int priority)
+{
+    int variant = 0;
+    if(lh->handler_options & LOG_HND_OPT_BINARY) {
+        variant |= LOG_VARIANT_BINARY;
+    } else if(lh->handler_options & LOG_HND_OPT_BEATIFUL_JSON) {
+        variant |= LOG_VARIANT_INDENTED;
+    }
+    if(lh->handler_options & LOG_HND_OPT_NOTIME) {
+        variant |= LOG_VARIANT_NOTIME;
+    }
+    if(priority <= LOG_CRIT || !(lh->handler_options & LOG_HND_OPT_NODISCOVER)) {
+        // LOG_EMERG LOG_ALERT LOG_CRIT always use discover()
+        variant |= LOG_VARIANT_DISCOVER;
+    }
+    return variant;
 }
 
 /*****************************************************************
- *      Discover extra data
+ *  Render the message in a variant, only the first time,
+ *  the next handlers with the same variant share the render.
  *****************************************************************/
-PRIVATE void discover(hgen_t hgen)
+PRIVATE const char *render_record(
+    log_renders_t *renders,
+    int variant,
+    const char *stamp,
+    const char *fields,
+    const char *end,
+    size_t *len)
 {
-    json_append(hgen,
-        "process",      "%s", get_process_name(),
-        "hostname",     "%s", get_host_name(),
-        "pid",          "%d", get_pid(),
-        NULL
-    );
+    if(!renders->bf[variant] && (variant & LOG_VARIANT_BINARY)) {
+        log_sink_t *sink = &bin_variants[variant];
+        render_binary(sink, variant, stamp, fields, end);
+        renders->bf[variant] = sink->bf;
+        renders->len[variant] = sink->len;
+
+    } else if(!renders->bf[variant]) {
+        hgen_t hgen = hgen_variants[variant];
+        if(!hgen) {
+            hgen = json_dict();
+            if(!hgen) {
+                print_error(
+                    PEF_ABORT,
+                    "ERROR YUNETA",
+                    "json_dict(): FAILED"
+                );
+            }
+            hgen_variants[variant] = hgen;
+        }
+        json_reset(hgen, (variant & LOG_VARIANT_INDENTED)?TRUE:FALSE);
+        if(!(variant & LOG_VARIANT_NOTIME)) {
+            if(!renders->stamp[0]) {
+                int64_t sec;
+                uint32_t nsec;
+                memcpy(&sec, stamp, sizeof(sec));
+                memcpy(&nsec, stamp + sizeof(sec), sizeof(nsec));
+                log_timestamp(renders->stamp, sizeof(renders->stamp), sec, nsec);
+            }
+            json_add_string(hgen, "timestamp", renders->stamp);
+        }
+        record_replay(hgen, fields, end);
+        if(variant & LOG_VARIANT_DISCOVER) {
+            discover(hgen);
+        }
+        renders->bf[variant] = json_get_buf(hgen);
+        renders->len[variant] = strlen(renders->bf[variant]);
+    }
+    *len = renders->len[variant];
+    return renders->bf[variant];
+}
+
+/*****************************************************************
+ *  Timestamp of timespec, in the format of current_timestamp()
+ *****************************************************************/
+PRIVATE char *log_timestamp(char *bf, int bfsize, int64_t sec, uint32_t nsec)
+{
+    time_t t = (time_t)sec;
+    struct tm tm;
+    char stamp[64], zone[16];
+
+#ifdef WIN32
+    if(localtime_s(&tm, &t)!=0) {
+#else
+    if(!localtime_r(&t, &tm)) { // the writer thread formats too: no localtime()
+#endif
+        snprintf(bf, bfsize, "%lld.%09lu", (long long)sec, (unsigned long)nsec);
+        return bf;
+    }
+    strftime(stamp, sizeof (stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    strftime(zone, sizeof (zone), "%z", &tm);
+    snprintf(bf, bfsize, "%s.%09lu%s", stamp, (unsigned long)nsec, zone);
+    return bf;
+}
+
+/*****************************************************************
+ *  Get a value of binary record.
+ *  Return 1 if got, 0 if incomplete, -1 if not supported.
+ *****************************************************************/
+PRIVATE int mp_get(const unsigned char **pp, const unsigned char *end, log_mp_item_t *item)
+{
+    const unsigned char *p = *pp;
+    size_t n = 0;   // bytes of value after code
+
+    #define MP_NEED(x) if((size_t)(end - p) < (size_t)(x)) return 0;
+
+    MP_NEED(1)
+    unsigned char code = *p++;
+    memset(item, 0, sizeof(log_mp_item_t));
+
+    if(code < 0x80) {
+        item->type = 'i';
+        item->i = code;
+    } else if(code >= 0xe0) {
+        item->type = 'i';
+        item->i = (signed char)code;
+    } else if((code & 0xe0) == MP_FIXSTR) {
+        item->type = 's';
+        item->len = code & 0x1f;
+    } else {
+        switch(code) {
+            case MP_NIL:
+                item->type = 'n';
+                break;
+            case MP_UINT8:
+            case MP_UINT16:
+            case MP_UINT32:
+            case MP_UINT64:
+                n = (size_t)1 << (code - MP_UINT8);
+                MP_NEED(n)
+                item->type = 'i';
+                item->i = (long long int)mp_get_be(p, n);
+                break;
+            case MP_INT8:
+            case MP_INT16:
+            case MP_INT32:
+            case MP_INT64:
+                n = (size_t)1 << (code - MP_INT8);
+                MP_NEED(n)
+                item->type = 'i';
+                item->i = (long long int)mp_get_be(p, n);
+                if(n < 8 && (item->i & (1LL << (n*8 - 1)))) {
+                    item->i -= 1LL << (n*8);  // sign
+                }
+                break;
+            case MP_FLOAT32:
+                {
+                    n = 4;
+                    MP_NEED(n)
+                    uint32_t u = (uint32_t)mp_get_be(p, n);
+                    float f;
+                    memcpy(&f, &u, sizeof(f));
+                    item->type = 'd';
+                    item->d = f;
+                }
+                break;
+            case MP_FLOAT64:
+                {
+                    n = 8;
+                    MP_NEED(n)
+                    uint64_t u = mp_get_be(p, n);
+                    item->type = 'd';
+                    memcpy(&item->d, &u, sizeof(item->d));
+                }
+                break;
+            case MP_STR8:
+            case MP_STR16:
+            case MP_STR32:
+                n = (size_t)1 << (code - MP_STR8);
+                MP_NEED(n)
+                item->type = 's';
+                item->len = (size_t)mp_get_be(p, n);
+                break;
+            case MP_FIXEXT4:
+                n = 1 + 4;
+                MP_NEED(n)
+                if(p[0] != MP_EXT_TIMESTAMP) {
+                    return -1;
+                }
+                item->type = 't';
+                item->sec = (int64_t)mp_get_be(p + 1, 4);
+                break;
+            case MP_FIXEXT8:
+                {
+                    n = 1 + 8;
+                    MP_NEED(n)
+                    if(p[0] != MP_EXT_TIMESTAMP) {
+                        return -1;
+                    }
+                    uint64_t u = mp_get_be(p + 1, 8);
+                    item->type = 't';
+                    item->nsec = (uint32_t)(u >> 34);
+                    item->sec = (int64_t)(u & 0x3ffffffffULL);
+                }
+                break;
+            case MP_EXT8:
+                n = 1 + 1 + 12;
+                MP_NEED(n)
+                if(p[0] != 12 || p[1] != MP_EXT_TIMESTAMP) {
+                    return -1;
+                }
+                item->type = 't';
+                item->nsec = (uint32_t)mp_get_be(p + 2, 4);
+                item->sec = (int64_t)mp_get_be(p + 6, 8);
+                break;
+            default:
+                return -1;
+        }
+    }
+    p += n;
+
+    if(item->type == 's') {
+        MP_NEED(item->len)
+        item->s = (const char *)p;
+        p += item->len;
+    }
+
+    #undef MP_NEED
+
+    *pp = p;
+    return 1;
+}
+
+/*****************************************************************
+ *  Convert a binary record to json
+ *****************************************************************/
+PUBLIC int log_binary2json(
+    const char *bf,
+    size_t len,
+    BOOL indented,
+    char **json)
+{
+    const unsigned char *p = (const unsigned char *)bf;
+    const unsigned char *end = p + len;
+    uint32_t count;
+
+    *json = 0;
+    if(!bf || len < 1) {
+        return 0;
+    }
+    if((*p & 0xf0) == MP_FIXMAP) {
+        count = *p & 0x0f;
+        p++;
+    } else if(*p == MP_MAP16) {
+        if(len < 3) {
+            return 0;
+        }
+        count = (uint32_t)mp_get_be(p + 1, 2);
+        p += 3;
+    } else if(*p == MP_MAP32) {
+        if(len < 5) {
+            return 0;
+        }
+        count = (uint32_t)mp_get_be(p + 1, 4);
+        p += 5;
+    } else {
+        return -1;
+    }
+
+    char *scratch = malloc(len + 2);   // key and string value with nulls
+    if(!scratch) {
+        return -1;
+    }
+
+    LOG_LOCK();
+    if(!hgen_decode) {
+        hgen_decode = json_dict();
+        if(!hgen_decode) {
+            print_error(
+                PEF_ABORT,
+                "ERROR YUNETA",
+                "json_dict(): FAILED"
+            );
+        }
+    }
+    json_reset(hgen_decode, indented);
+
+    int ret = 1;
+    for(uint32_t i=0; i<count && ret > 0; i++) {
+        log_mp_item_t k, v;
+        char *key;
+        char stamp[90];
+
+        if((ret = mp_get(&p, end, &k)) <= 0 || (ret = mp_get(&p, end, &v)) <= 0) {
+            break;
+        }
+        if(k.type == 'i') {
+            if(k.i < 0 || k.i >= (long long int)(sizeof(binary_keys)/sizeof(binary_keys[0]) - 1)) {
+                ret = -1;
+                break;
+            }
+            key = (char *)binary_keys[k.i];
+        } else if(k.type == 's') {
+            memcpy(scratch, k.s, k.len);
+            scratch[k.len] = 0;
+            key = scratch;
+        } else {
+            ret = -1;
+            break;
+        }
+
+        switch(v.type) {
+            case 's':
+                {
+                    char *value = scratch + ((k.type == 's')? k.len + 1 : 0);
+                    memcpy(value, v.s, v.len);
+                    value[v.len] = 0;
+                    json_add_string(hgen_decode, key, value);
+                }
+                break;
+            case 'i':
+                json_add_integer(hgen_decode, key, v.i);
+                break;
+            case 'd':
+                json_add_double(hgen_decode, key, v.d);
+                break;
+            case 't':
+                log_timestamp(stamp, sizeof(stamp), v.sec, v.nsec);
+                json_add_string(hgen_decode, key, stamp);
+                break;
+            default:
+                json_add_null(hgen_decode, key);
+                break;
+        }
+    }
+
+    if(ret > 0) {
+        *json = strdup(json_get_buf(hgen_decode));
+        ret = *json? (int)((const char *)p - bf) : -1;
+    }
+    LOG_UNLOCK();
+
+    free(scratch);
+    return ret;
+}
+
+/*****************************************************************
+ *  Position of binary record in a line of "file" handler,
+ *  after the "priority: " header. Return -1 if text line.
+ *****************************************************************/
+PRIVATE int binary_line_header(const unsigned char *p, size_t len)
+{
+    if(len > 0 && p[0] == MP_MAP32) {
+        return 0;   // LOG_AUDIT, without header
+    }
+    for(size_t i=0; i<len && i<32 && p[i] != '\n'; i++) {
+        if(p[i] == ':') {
+            if(i + 2 < len && p[i+1] == ' ' && p[i+2] == MP_MAP32) {
+                return (int)(i + 2);
+            }
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/*****************************************************************
+ *  Convert the binary records of a file to json lines
+ *****************************************************************/
+PUBLIC int log_binary_stream2json(FILE *in, FILE *out, BOOL indented)
+{
+    size_t size = 64*1024;
+    size_t len = 0;
+    size_t pos = 0;
+    BOOL eof = FALSE;
+    int records = 0;
+
+    char *bf = malloc(size);
+    if(!bf) {
+        return -1;
+    }
+
+    while(1) {
+        /*
+         *  Read more data, keeping the current line
+         */
+        if(!eof) {
+            if(pos > 0) {
+                memmove(bf, bf + pos, len - pos);
+                len -= pos;
+                pos = 0;
+            }
+            if(len == size) {
+                char *new_bf = realloc(bf, size * 2);
+                if(!new_bf) {
+                    free(bf);
+                    return -1;
+                }
+                bf = new_bf;
+                size *= 2;
+            }
+            size_t readed = fread(bf + len, 1, size - len, in);
+            len += readed;
+            if(readed == 0) {
+                if(ferror(in)) {
+                    free(bf);
+                    return -1;
+                }
+                eof = TRUE;
+            }
+        }
+
+        /*
+         *  Convert the complete lines
+         */
+        while(pos < len) {
+            const unsigned char *line = (const unsigned char *)bf + pos;
+            size_t avail = len - pos;
+
+            int header = binary_line_header(line, avail);
+            if(header >= 0) {
+                char *json;
+                int ret = log_binary2json(
+                    (const char *)line + header,
+                    avail - header,
+                    indented,
+                    &json
+                );
+                if(ret > 0 && (header + ret < (int)avail || eof)) {
+                    fwrite(line, 1, header, out);
+                    fputs(json, out);
+                    fputc('\n', out);
+                    free(json);
+                    records++;
+                    pos += header + ret;
+                    if(pos < len && (bf[pos] == '\n' || bf[pos] == 0)) {
+                        pos++;  // end of line of "file", or null of raw "udp"
+                    }
+                    continue;
+                }
+                if(json) {
+                    free(json);
+                }
+                if(ret >= 0 && !eof) {
+                    break; // incomplete, read more
+                }
+                // bad record, copied as text
+            }
+
+            const char *nl = memchr(line, '\n', avail);
+            if(!nl && !eof) {
+                break; // incomplete, read more
+            }
+            size_t line_len = nl? (size_t)(nl - (const char *)line) + 1 : avail;
+            fwrite(line, 1, line_len, out);
+            pos += line_len;
+        }
+
+        if(eof) {
+            break;
+        }
+    }
+
+    free(bf);
+    return records;
 }
 
 /***************************************************************************
@@ -119,6 +119,7 @@ typedef enum {
 
     LOG_HND_OPT_TRACE_STACK     = 0x1000,
     LOG_HND_OPT_BEATIFUL_JSON   = 0x2000,
+    LOG_HND_OPT_BINARY          = 0x4000,   // MessagePack records, see log_binary2json()
     LOG_HND_OPT_DEEP_TRACE      = 0x8000,
 } log_handler_opt_t;
 
@@ -169,9 +170,6 @@ typedef void   (*inform_cb_t)(int priority, uint32_t count, void *user_data);
  *     Prototypes
  *****************************************************************/
 
-//TODO modo produccion: impide mas de x logs msg/seg (1000 msg/seg podría estar bien)
-//     modo test: logs sin limite
-
 /*
  *  Setup log system
  */
@@ -189,6 +187,31 @@ PUBLIC int log_set_inform_cb(
     void * inform_cb_user_data
 );
 
+/*
+ *  Async mode.
+ *  The messages are encoded once in a ring of the calling thread,
+ *  and a writer thread renders them by handler options and writes them in batches.
+ *  Synchronous writes, after the queued messages of the calling thread:
+ *      - messages with LOG_OPT_TRACE_STACK, exit or abort options,
+ *      - errors when some handler has LOG_HND_OPT_TRACE_STACK,
+ *      - dumps: trace_hex_msg(), log_debug_dump(), log_debug_json(),...
+ *      - messages not fitting in a queued record (8K).
+ *  Not available in WIN32.
+ */
+typedef enum {
+    LOG_ASYNC_DROP = 0,     // Ring full: drop the message, counted in "dropped"
+    LOG_ASYNC_BLOCK,        // Ring full: wait until the writer frees space
+    LOG_ASYNC_SYNC,         // Ring full: write it in the calling thread
+} log_async_policy_t;
+
+PUBLIC int log_set_async(
+    BOOL async,                 // FALSE: stop the writer, writing the queued messages
+    size_t ring_size,           // bytes of ring by thread, default 0 = 64K
+    log_async_policy_t policy
+);
+PUBLIC void log_async_flush(void);      // Wait until the queued messages are written
+PUBLIC json_t *log_async_stats(void);   // Cleared with log_clear_counters()
+
 PUBLIC int log_register_handler(
     const char *handler_type,   // already registered: "stdout", "file", "udp"
     loghandler_close_fn_t close_fn,
@@ -204,13 +227,46 @@ PUBLIC int log_add_handler(
 );
 PUBLIC int log_del_handler(const char* handler_name); // Return # handlers deleted.
 PUBLIC json_t *log_list_handlers(void);
+
+/*
+ *  Rate limit of a handler, token buckets by call site and by same message.
+ *  The suppressed messages are summarized with "repeated" count,
+ *  when the flood is over or each 5 seconds.
+ *  LOG_AUDIT and LOG_MONITOR are not limited.
+ */
+PUBLIC int log_set_handler_rate_limit(
+    const char *handler_name,
+    uint32_t burst,         // messages in a burst, 0 = no limit
+    uint32_t rate           // messages by second
+);
+PUBLIC uint32_t log_suppressed_count(void);  // Cleared with log_clear_counters()
+
+/*
+ *  Binary records of handlers with LOG_HND_OPT_BINARY:
+ *  a MessagePack map32 (first byte 0xdf) with the same keys and values of json,
+ *  the timestamp is a MessagePack timestamp (ext -1),
+ *  the well-known keys ("gobj", "msg",...) are positive fixint ids.
+ *  Use them with "file" or raw "udp" handlers.
+ *  The timestamps are converted to the local time zone of the decoder.
+ */
+PUBLIC int log_binary2json(     // Return bytes of record, 0 if incomplete, -1 if bad record
+    const char *bf,
+    size_t len,
+    BOOL indented,
+    char **json                 // json of record, free it with free()
+);
+PUBLIC int log_binary_stream2json(  // Return records converted, -1 on error
+    FILE *in,                   // lines of "file" handler, the text lines are copied
+    FILE *out,
+    BOOL indented
+);
 PUBLIC BOOL log_exist_handler(const char *handler_name);
 
 PUBLIC void _log_bf(int priority, log_opt_t opt, const char *bf, int len);
 
 PUBLIC void log_clear_counters(void);
 
-PUBLIC const char *log_last_message(void);
+PUBLIC const char *log_last_message(void); // "msg" of the last message logged by the calling thread
 
 /*
  *  Main Log functions.
@@ -222,6 +278,54 @@ PUBLIC void log_warning(log_opt_t opt, ...);
 PUBLIC void log_info(log_opt_t opt, ...);
 PUBLIC void log_debug(log_opt_t opt, ...);
 
+/*
+ *  Typed key/values: without format parsing of log_*() functions,
+ *  same output. Example:
+
+    log_error_kv(0,
+        LOG_KV_STR("gobj",      __FILE__),
+        LOG_KV_STR("msgset",    MSGSET_PARAMETER_ERROR),
+        LOG_KV_STR("msg",       "Bad length"),
+        LOG_KV_INT("len",       len)
+    );
+ */
+typedef enum {
+    LOG_KV_TYPE_NULL = 0,
+    LOG_KV_TYPE_STRING,
+    LOG_KV_TYPE_INTEGER,
+    LOG_KV_TYPE_REAL,
+    LOG_KV_TYPE_JSON,       // json_t * not owned, written as "%j"
+} log_kv_type_t;
+
+typedef struct {
+    const char *key;
+    log_kv_type_t type;
+    union {
+        const char *s;
+        long long int i;
+        double r;
+        json_t *j;
+    } v;
+} log_kv_t;
+
+#define LOG_KV_STR(key_, value_)    ((log_kv_t){.key=(key_), .type=LOG_KV_TYPE_STRING, .v.s=(value_)})
+#define LOG_KV_INT(key_, value_)    ((log_kv_t){.key=(key_), .type=LOG_KV_TYPE_INTEGER, .v.i=(value_)})
+#define LOG_KV_REAL(key_, value_)   ((log_kv_t){.key=(key_), .type=LOG_KV_TYPE_REAL, .v.r=(value_)})
+#define LOG_KV_JSON(key_, value_)   ((log_kv_t){.key=(key_), .type=LOG_KV_TYPE_JSON, .v.j=(value_)})
+#define LOG_KV_NULL(key_)           ((log_kv_t){.key=(key_), .type=LOG_KV_TYPE_NULL})
+
+PUBLIC void log_kv(int priority, log_opt_t opt, const log_kv_t *kv, size_t n);
+
+#define LOG_KV_ARRAY(...) \
+    (const log_kv_t[]){__VA_ARGS__}, (sizeof((log_kv_t[]){__VA_ARGS__})/sizeof(log_kv_t))
+
+#define log_alert_kv(opt, ...)      log_kv(LOG_ALERT, (opt), LOG_KV_ARRAY(__VA_ARGS__))
+#define log_critical_kv(opt, ...)   log_kv(LOG_CRIT, (opt), LOG_KV_ARRAY(__VA_ARGS__))
+#define log_error_kv(opt, ...)      log_kv(LOG_ERR, (opt), LOG_KV_ARRAY(__VA_ARGS__))
+#define log_warning_kv(opt, ...)    log_kv(LOG_WARNING, (opt), LOG_KV_ARRAY(__VA_ARGS__))
+#define log_info_kv(opt, ...)       log_kv(LOG_INFO, (opt), LOG_KV_ARRAY(__VA_ARGS__))
+#define log_debug_kv(opt, ...)      log_kv(LOG_DEBUG, (opt), LOG_KV_ARRAY(__VA_ARGS__))
+
 /*
  *  LOG_INFO functions.
  */
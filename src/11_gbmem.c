@@ -21,10 +21,23 @@
  ***********************************************************************/
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <jansson.h> /* by gbmem_json_info */
 #include <uv.h> /* by mutex */
+#ifndef NOT_INCLUDE_LIBUNWIND
+#define UNW_LOCAL_ONLY
+#include <libunwind.h> /* by allocation profiler */
+#endif
 #include "11_gbmem.h"
 
+/*
+ *  Thread cache: per-thread lists of free blocks in front of the global pool
+ */
+#if defined(__GNUC__) && !defined(WIN32)
+    #define GBMEM_THREAD_CACHE 1
+    #include <pthread.h>
+#endif
+
 /***************************************************************
  *          Constants
  ***************************************************************/
@@ -35,6 +48,35 @@ typedef uint32_t memtrace_t;    // WARNING: hardcoded in some places.
 
 #define MINIMUM_MIN_BLOCK (sizeof(bdl_t) + sizeof(memtrace_t))
 
+#define TCACHE_MAX_BLOCKS   16                  /* block sizes (in blocks) with thread cache */
+#define TCACHE_BATCH        16                  /* blocks moved in each refill/flush */
+#define TCACHE_MAX_COUNT    (2*TCACHE_BATCH)    /* maximum blocks by size in a thread cache */
+
+#ifdef GBMEM_THREAD_CACHE
+    #define MEM_TRACE_COUNTER_INC() __sync_add_and_fetch(&__mem_trace_counter__, 1)
+    #define STAT_ADD(var, n)        __sync_add_and_fetch(&(var), (n))
+    #define STAT_SUB(var, n)        __sync_sub_and_fetch(&(var), (n))
+#else
+    #define MEM_TRACE_COUNTER_INC() (++__mem_trace_counter__)
+    #define STAT_ADD(var, n)        ((var) += (n))
+    #define STAT_SUB(var, n)        ((var) -= (n))
+#endif
+
+#define SLAB_CLASSES        16
+#define SLAB_MAX_SIZE       4096            /* largest size (with headers) of the size classes */
+#define SLAB_SIZE           (16*1024)       /* bytes carved from superblock in each refill */
+#define SLAB_MAX_OBJECTS    64
+
+#define PROF_MAX_DEPTH      8       /* frames saved of a sampled allocation */
+#define PROF_MAX_SKIP       8       /* frames of gbmem over the caller of the allocation */
+#define PROF_MAX_SITES      1024    /* table of allocation sites */
+#define PROF_PTR_BUCKETS    4096    /* buckets of the table of sampled live pointers */
+#define PROF_MAX_JSON_SITES 50      /* sites with more live bytes shown in gbmem_json_info */
+#define PROF_MARK           ((memtrace_t)0xFFFFFFFF)    /* memtrace of a sampled block, the original is saved */
+
+/* memtrace of an alloc pointer */
+#define MEMTRACE_OF(p) (((memtrace_t *)(((bdl_t *)(p)) - 1)) - 1)
+
 
 /***************************************************************
  *          Structures
@@ -49,6 +91,49 @@ typedef struct sb_s {
     void *pointer;
 } sb_t;
 
+typedef struct {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t hits;          /* served from a free list (pool or thread cache) */
+    uint64_t slab_refills;  /* slabs carved from the superblock */
+    uint64_t requested;     /* requested bytes, to know the internal fragmentation */
+} slab_stats_t;
+
+typedef struct {
+    uint32_t hash;
+    int depth;                      /* 0 is a free slot */
+    void *ips[PROF_MAX_DEPTH];      /* call stack */
+    uint64_t allocs;                /* sampled allocations */
+    uint64_t alloc_bytes;           /* sampled requested bytes */
+    uint64_t live_count;            /* sampled allocations not freed */
+    uint64_t live_bytes;            /* sampled requested bytes not freed */
+} prof_site_t;
+
+typedef struct prof_ptr_s {
+    struct prof_ptr_s *next;
+    PTR p;
+    size_t bytes;                   /* requested bytes */
+    memtrace_t memtrace;            /* replaced by PROF_MARK, restored when freed */
+    prof_site_t *site;
+} prof_ptr_t;
+
+#ifdef GBMEM_THREAD_CACHE
+typedef struct tcache_s {
+    uint32_t generation;                /* lists are valid only in the same gbmem generation */
+    BOOL registered;                    /* thread exit destructor registered */
+    volatile int lock;                  /* spinlock of lists, other threads can flush them */
+    struct tcache_s *next;              /* list of caches of the generation, mutex_gbmem */
+    ZBLOCK *list[TCACHE_MAX_BLOCKS];    /* free blocks by size */
+    uint32_t count[TCACHE_MAX_BLOCKS];
+} tcache_t;
+
+/*
+ *  Order of locks: mutex_gbmem, then the lock of cache
+ */
+#define TCACHE_LOCK(tc)     while(__sync_lock_test_and_set(&(tc)->lock, 1)) {}
+#define TCACHE_UNLOCK(tc)   __sync_lock_release(&(tc)->lock)
+#endif
+
 /***************************************************************
  *          Data
  ***************************************************************/
@@ -105,12 +190,64 @@ PRIVATE size_t count_sb;        /* nº superbloques allocated */
 
 PRIVATE dl_list_t dl_superblocks;
 
+/*
+ *  Slab mode: the sizes are rounded to geometric size classes
+ */
+PRIVATE BOOL __slab_mode__ = FALSE;
+PRIVATE const size_t slab_class_sizes[SLAB_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+PRIVATE uint8_t slab_class_index[SLAB_MAX_SIZE/16]; /* size class by (size-1)/16 */
+PRIVATE slab_stats_t slab_stats[SLAB_CLASSES];
+
+/*
+ *  Allocation profiler, protected by mutex_prof.
+ *  The tables are allocated with the libc, outside of gbmem.
+ */
+PRIVATE uint32_t __prof_sample_rate__ = 0;  /* sample one of each N allocations, 0 is disabled */
+PRIVATE volatile size_t __prof_live__ = 0;  /* sampled pointers not freed */
+PRIVATE BOOL __prof_mutex_initialized__ = FALSE;
+PRIVATE uv_mutex_t mutex_prof;
+PRIVATE prof_site_t *prof_sites = 0;        /* open addressing by hash of call stack */
+PRIVATE size_t prof_n_sites = 0;
+PRIVATE prof_site_t prof_overflow_site;     /* collect the sites when the table is full */
+PRIVATE prof_ptr_t **prof_ptrs = 0;         /* sampled live pointers */
+#ifdef GBMEM_THREAD_CACHE
+PRIVATE __thread uint32_t prof_countdown = 0;
+#else
+PRIVATE uint32_t prof_countdown = 0;
+#endif
+
+/*
+ *  Thread cache
+ */
+PRIVATE BOOL __thread_cache_enabled__ = TRUE;
+PRIVATE uint32_t __gbmem_generation__ = 1;
+#ifdef GBMEM_THREAD_CACHE
+PRIVATE __thread tcache_t tcache;
+PRIVATE pthread_key_t tcache_key;
+PRIVATE pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+PRIVATE volatile size_t __tcache_blocks__ = 0;  /* blocks in the thread caches, atomic */
+PRIVATE tcache_t *tcaches = 0;  /* caches of the current generation, mutex_gbmem */
+#endif
+
 
 /***************************************************************
  *          Prototypes
  ***************************************************************/
 PRIVATE BOOL alloc_superblock(bdl_t req);
 PRIVATE char * gbmem_substr_dup(const char *str, size_t size);
+PRIVATE bdl_t size2blocks(size_t size, int *cls);
+PRIVATE int blocks2class(bdl_t blocks);
+PRIVATE PTR _gbmem_malloc(size_t size);
+PRIVATE void prof_sample(PTR p, size_t size, void *caller);
+PRIVATE void prof_unsample(PTR p);
+PRIVATE void prof_resize(PTR p, size_t size);
+#ifdef GBMEM_THREAD_CACHE
+PRIVATE ZBLOCK *tcache_alloc(bdl_t blocks);
+PRIVATE BOOL tcache_free(ZBLOCK *p, bdl_t blocks);
+PRIVATE size_t tcache_flush_registered(void);
+#endif
 
 
 /***************************************************************************
@@ -351,6 +488,36 @@ PUBLIC int gbmem_startup(
         return -1;
     }
 
+    /*--------------------------------*
+     *  Slab mode
+     *--------------------------------*/
+    __slab_mode__ = (flags & GBMEM_SLAB_MODE)?TRUE:FALSE;
+    if(__slab_mode__ && block_size != 16) {
+        /*
+         *  The class of a free is got from his blocks,
+         *  with bigger blocks several classes would have the same blocks.
+         */
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "Slab mode needs a min_block of 16, slab mode disabled",
+            "block_size",   "%ld", (long)block_size,
+            NULL
+        );
+        __slab_mode__ = FALSE;
+    }
+    memset(slab_stats, 0, sizeof(slab_stats));
+    for(size_t i=0, c=0; i<sizeof(slab_class_index); i++) {
+        while((i+1)*16 > slab_class_sizes[c]) {
+            c++;
+        }
+        slab_class_index[i] = (uint8_t)c;
+    }
+
     __gbmem_initialized__ = TRUE;
     uv_mutex_unlock(&mutex_gbmem);
 
@@ -470,9 +637,46 @@ PUBLIC void gbmem_shutdown(void)
     avail = 0;
     chunk = 0;
 
+    /*
+     *  The blocks of the thread caches are gone with the superblocks
+     */
+    __gbmem_generation__++;
+#ifdef GBMEM_THREAD_CACHE
+    __tcache_blocks__ = 0;
+    tcaches = 0;
+#endif
+
     uv_mutex_unlock(&mutex_gbmem);
     uv_mutex_destroy(&mutex_gbmem);
     __gbmem_initialized__ = FALSE;
+
+    /*
+     *  The sampled pointers are gone with the superblocks
+     */
+    if(__prof_mutex_initialized__) {
+        uv_mutex_lock(&mutex_prof);
+        __prof_sample_rate__ = 0;
+        if(prof_ptrs) {
+            for(int i=0; i<PROF_PTR_BUCKETS; i++) {
+                prof_ptr_t *pp = prof_ptrs[i];
+                while(pp) {
+                    prof_ptr_t *next = pp->next;
+                    free(pp);
+                    pp = next;
+                }
+            }
+            free(prof_ptrs);
+            prof_ptrs = 0;
+        }
+        if(prof_sites) {
+            free(prof_sites);
+            prof_sites = 0;
+        }
+        prof_n_sites = 0;
+        memset(&prof_overflow_site, 0, sizeof(prof_overflow_site));
+        __prof_live__ = 0;
+        uv_mutex_unlock(&mutex_prof);
+    }
 }
 
 /***********************************************************************
@@ -592,10 +796,71 @@ PRIVATE BOOL alloc_superblock(bdl_t req)
     return TRUE;
 }
 
+/***********************************************************************
+ *  Return the blocks of a size (with headers).
+ *  In slab mode the size is rounded to his size class, returned in cls,
+ *  else cls is -1.
+ ***********************************************************************/
+PRIVATE bdl_t size2blocks(size_t size, int *cls)
+{
+    *cls = -1;
+    if(__slab_mode__ && size <= SLAB_MAX_SIZE) {
+        int c = slab_class_index[(size-1) >> 4];
+        bdl_t blocks = BytesToBlocks(slab_class_sizes[c]);
+        if(blocks <= pool_size) {
+            *cls = c;
+            return blocks;
+        }
+    }
+    return BytesToBlocks(size);
+}
+
+/***********************************************************************
+ *  Return the size class of the blocks, -1 if not in slab mode
+ ***********************************************************************/
+PRIVATE int blocks2class(bdl_t blocks)
+{
+    if(!__slab_mode__ || blocks <= 0) {
+        return -1;
+    }
+    size_t size = BlocksToBytes((size_t)blocks);
+    if(size > SLAB_MAX_SIZE) {
+        return -1;
+    }
+    int cls;
+    size2blocks(size, &cls);
+    return cls;
+}
+
 /***********************************************************************
  *      Alloc memory
  ***********************************************************************/
 PUBLIC PTR gbmem_malloc(size_t size)
+{
+    PTR p = _gbmem_malloc(size);
+
+    /*
+     *  Allocation profiler: sample one of each N allocations
+     */
+    if(__prof_sample_rate__ && p && __gbmem_initialized__) {
+        if(prof_countdown == 0 || prof_countdown > __prof_sample_rate__) {
+            prof_countdown = __prof_sample_rate__;
+        }
+        if(--prof_countdown == 0) {
+#if defined(__GNUC__)
+            prof_sample(p, size, __builtin_return_address(0));
+#else
+            prof_sample(p, size, 0);
+#endif
+        }
+    }
+    return p;
+}
+
+/***********************************************************************
+ *      Alloc memory from the pool
+ ***********************************************************************/
+PRIVATE PTR _gbmem_malloc(size_t size)
 {
     register ZBLOCK *p ;
     bdl_t blocks;
@@ -696,8 +961,13 @@ PUBLIC PTR gbmem_malloc(size_t size)
         );
         return (PTR)0;
     }
-    blocks = BytesToBlocks(size);
+    int cls;
+    blocks = size2blocks(size, &cls);
     bytes = (size_t) BlocksToBytes(blocks);
+    if(cls >= 0) {
+        STAT_ADD(slab_stats[cls].allocs, 1);
+        STAT_ADD(slab_stats[cls].requested, (uint64_t)original_size);
+    }
 
     if (blocks > pool_size) {
         log_error(LOG_OPT_TRACE_STACK,
@@ -729,12 +999,40 @@ PUBLIC PTR gbmem_malloc(size_t size)
         return (PTR)0;
     }
 
+#ifdef GBMEM_THREAD_CACHE
+    /*--------------------------------------------------*
+     *  Firstly try the thread cache, without the global mutex
+     *--------------------------------------------------*/
+    if(__thread_cache_enabled__ && !__trace_allocs_frees__ && blocks <= TCACHE_MAX_BLOCKS) {
+        p = tcache_alloc(blocks);
+        if(p) {
+            if(cls >= 0) {
+                STAT_ADD(slab_stats[cls].hits, 1);
+            }
+            memset(p, 0, bytes);
+
+            /*
+             *  Save trace
+             */
+            *((memtrace_t *)p) = MEM_TRACE_COUNTER_INC();
+            p = (ZBLOCK *)(((memtrace_t *)p) + 1);
+
+            /*
+             *  Save size (in blocks)
+             */
+            *((bdl_t *)p) = blocks;
+            p = (ZBLOCK *)(((bdl_t *)p) + 1);
+            return (PTR) p;
+        }
+    }
+#endif
+
     /*--------------------------------------------------*
      *  Lock
      *--------------------------------------------------*/
     uv_mutex_lock(&mutex_gbmem);
 
-    __mem_trace_counter__++;
+    MEM_TRACE_COUNTER_INC();
 
     if(__trace_allocs_frees__) {
         for(int xx=0; __memory_check_list__ && __memory_check_list__[xx]!=0; xx++) {
@@ -758,6 +1056,9 @@ PUBLIC PTR gbmem_malloc(size_t size)
     if(p) {
         pool[blocks-1] = p->link;
         pool_sizes[blocks-1]--;
+        if(cls >= 0) {
+            STAT_ADD(slab_stats[cls].hits, 1);
+        }
 
         memset(p, 0, bytes);
 
@@ -807,10 +1108,19 @@ PUBLIC PTR gbmem_malloc(size_t size)
 //                 NULL
 //             );
 
+#ifdef GBMEM_THREAD_CACHE
+            /*---------------------------------------------------*
+             *  The free blocks in the thread caches
+             *  are not seen by the pool: take them back.
+             *---------------------------------------------------*/
+            tcache_flush_registered();
+#endif
+
             /*---------------------------------------------------*
              *  Permite allocar bloques de tamaño superior
              *  (Se derrocha memoria y si ocurre con frecuencia
              *  malo).
+             *  The first try is the own size, if flushed from the thread caches.
              *---------------------------------------------------*/
             bdl_t original_blocks = blocks;
             while(blocks <= pool_size) {
@@ -819,6 +1129,21 @@ PUBLIC PTR gbmem_malloc(size_t size)
                     pool[blocks-1] = p->link;
                     pool_sizes[blocks-1]--;
 
+                    int higher_cls = blocks2class(blocks);
+                    if(higher_cls != cls) {
+                        /*
+                         *  Charged to the class of the higher block, as it will be his free
+                         */
+                        if(cls >= 0) {
+                            STAT_SUB(slab_stats[cls].allocs, 1);
+                            STAT_SUB(slab_stats[cls].requested, (uint64_t)original_size);
+                        }
+                        if(higher_cls >= 0) {
+                            STAT_ADD(slab_stats[higher_cls].allocs, 1);
+                            STAT_ADD(slab_stats[higher_cls].requested, (uint64_t)original_size);
+                        }
+                    }
+
                     memset(p, 0, bytes);
 
                     /*
@@ -893,6 +1218,27 @@ PUBLIC PTR gbmem_malloc(size_t size)
     avail = (ZBLOCK *) ((char *)avail + blocks * block_size);
     amt_avail -= blocks;
 
+    if(cls >= 0) {
+        /*
+         *  Slab mode: carve a slab of objects of the size class,
+         *  the rest of objects go to the free list.
+         */
+        size_t objects = SLAB_SIZE / bytes;
+        if(objects > SLAB_MAX_OBJECTS) {
+            objects = SLAB_MAX_OBJECTS;
+        }
+        while(objects > 1 && amt_avail >= blocks) {
+            ZBLOCK *q = avail;
+            avail = (ZBLOCK *) ((char *)avail + blocks * block_size);
+            amt_avail -= blocks;
+            q->link = pool[blocks-1];
+            pool[blocks-1] = q;
+            pool_sizes[blocks-1]++;
+            objects--;
+        }
+        STAT_ADD(slab_stats[cls].slab_refills, 1);
+    }
+
     /*
      *  Save trace
      */
@@ -966,6 +1312,32 @@ PUBLIC void gbmem_free(PTR p)
         return;
     }
 
+    if(__prof_live__ && *MEMTRACE_OF(p) == PROF_MARK) {
+        prof_unsample(p);
+    }
+
+    if(__slab_mode__) {
+        int cls = blocks2class(*(((bdl_t *)p) - 1));
+        if(cls >= 0) {
+            STAT_ADD(slab_stats[cls].frees, 1);
+        }
+    }
+
+#ifdef GBMEM_THREAD_CACHE
+    /*--------------------------------------------------*
+     *  Firstly try the thread cache, without the global mutex
+     *--------------------------------------------------*/
+    if(__thread_cache_enabled__ && !__trace_allocs_frees__) {
+        blocks = *(((bdl_t *)p) - 1);
+        if(blocks > 0 && blocks <= TCACHE_MAX_BLOCKS) {
+            ZBLOCK *zp = (ZBLOCK *)(((memtrace_t *)(((bdl_t *)p) - 1)) - 1);
+            if(tcache_free(zp, blocks)) {
+                return;
+            }
+        }
+    }
+#endif
+
     /*--------------------------------------------------*
      *  Lock
      *--------------------------------------------------*/
@@ -1109,6 +1481,23 @@ PUBLIC PTR gbmem_realloc(PTR p, size_t new_size)
     blocks = *((bdl_t *)pp);
     old_size = (size_t) BlocksToBytes(blocks);
 
+    /*---------------------------------*
+     *  Same size class: in place
+     *---------------------------------*/
+    size_t new_total = new_size + sizeof(bdl_t) + sizeof(memtrace_t);
+    if(new_size > 0 && new_total <= __max_block__) {
+        int cls;
+        if(size2blocks(new_total, &cls) == blocks) {
+            size_t capacity = old_size - sizeof(bdl_t) - sizeof(memtrace_t);
+            // The rest of block is zeroed as a new alloc
+            memset((char *)p + new_size, 0, capacity - new_size);
+            if(__prof_live__ && *MEMTRACE_OF(p) == PROF_MARK) {
+                prof_resize(p, new_size);
+            }
+            return p;
+        }
+    }
+
     q = gbmem_malloc(new_size);
     if(!q) {
         return (PTR)0;
@@ -1119,6 +1508,232 @@ PUBLIC PTR gbmem_realloc(PTR p, size_t new_size)
     return q;
 }
 
+#ifdef GBMEM_THREAD_CACHE
+/***************************************************************************
+ *  Return the blocks of a size of the thread cache to the pool
+ *  WARNING mutex_gbmem and the lock of cache must be locked
+ ***************************************************************************/
+PRIVATE void tcache_flush_size(tcache_t *tc, unsigned idx, uint32_t n)
+{
+    size_t moved = 0;
+    while(n > 0 && tc->list[idx]) {
+        ZBLOCK *p = tc->list[idx];
+        tc->list[idx] = p->link;
+        tc->count[idx]--;
+
+        p->link = pool[idx];
+        pool[idx] = p;
+        pool_sizes[idx]++;
+        moved += idx + 1;
+        n--;
+    }
+    if(moved) {
+        __sync_sub_and_fetch(&__tcache_blocks__, moved);
+    }
+}
+
+/***************************************************************************
+ *  Return all the blocks of the thread cache to the pool
+ ***************************************************************************/
+PRIVATE void tcache_flush_all(tcache_t *tc)
+{
+    if(!__gbmem_initialized__ || tc->generation != __gbmem_generation__) {
+        return;
+    }
+    uv_mutex_lock(&mutex_gbmem);
+    TCACHE_LOCK(tc);
+    for(unsigned i=0; i<TCACHE_MAX_BLOCKS; i++) {
+        tcache_flush_size(tc, i, tc->count[i]);
+    }
+    TCACHE_UNLOCK(tc);
+    uv_mutex_unlock(&mutex_gbmem);
+}
+
+/***************************************************************************
+ *  Return the blocks of all the thread caches to the pool,
+ *  return the blocks moved.
+ *  WARNING mutex_gbmem must be locked
+ ***************************************************************************/
+PRIVATE size_t tcache_flush_registered(void)
+{
+    size_t blocks = __tcache_blocks__;
+    for(tcache_t *tc = tcaches; tc; tc = tc->next) {
+        TCACHE_LOCK(tc);
+        for(unsigned i=0; i<TCACHE_MAX_BLOCKS; i++) {
+            tcache_flush_size(tc, i, tc->count[i]);
+        }
+        TCACHE_UNLOCK(tc);
+    }
+    return blocks - __tcache_blocks__;
+}
+
+/***************************************************************************
+ *  Thread exit: return the cached blocks to the pool
+ ***************************************************************************/
+PRIVATE void tcache_destructor(void *tc_)
+{
+    tcache_t *tc = tc_;
+    tcache_flush_all(tc);
+
+    if(!__gbmem_initialized__ || tc->generation != __gbmem_generation__) {
+        return;
+    }
+    uv_mutex_lock(&mutex_gbmem);
+    tcache_t **prev = &tcaches;
+    while(*prev) {
+        if(*prev == tc) {
+            *prev = tc->next;
+            break;
+        }
+        prev = &(*prev)->next;
+    }
+    uv_mutex_unlock(&mutex_gbmem);
+}
+
+PRIVATE void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_destructor);
+}
+
+/***************************************************************************
+ *  Return the thread cache of the current thread
+ ***************************************************************************/
+PRIVATE tcache_t *tcache_get(void)
+{
+    tcache_t *tc = &tcache;
+    if(tc->generation != __gbmem_generation__) {
+        /*
+         *  New thread or new gbmem startup, the old blocks are not valid
+         */
+        memset(tc->list, 0, sizeof(tc->list));
+        memset(tc->count, 0, sizeof(tc->count));
+        tc->lock = 0;
+        uv_mutex_lock(&mutex_gbmem);
+        tc->generation = __gbmem_generation__;
+        tc->next = tcaches;
+        tcaches = tc;
+        uv_mutex_unlock(&mutex_gbmem);
+    }
+    if(!tc->registered) {
+        pthread_once(&tcache_key_once, tcache_key_create);
+        pthread_setspecific(tcache_key, tc);
+        tc->registered = TRUE;
+    }
+    return tc;
+}
+
+/***************************************************************************
+ *  Get a block from the thread cache, refill it from the pool if empty
+ ***************************************************************************/
+PRIVATE ZBLOCK *tcache_alloc(bdl_t blocks)
+{
+    tcache_t *tc = tcache_get();
+    unsigned idx = blocks - 1;
+
+    if(!tc->list[idx]) {
+        /*
+         *  Refill a batch, from the pool or from the current superblock.
+         *  New superblocks are only allocated by the locked path.
+         */
+        size_t moved = 0;
+        uv_mutex_lock(&mutex_gbmem);
+        TCACHE_LOCK(tc);
+        while(tc->count[idx] < TCACHE_BATCH) {
+            ZBLOCK *p = pool[idx];
+            if(p) {
+                pool[idx] = p->link;
+                pool_sizes[idx]--;
+            } else if(amt_avail >= blocks) {
+                p = avail;
+                avail = (ZBLOCK *) ((char *)avail + blocks * block_size);
+                amt_avail -= blocks;
+            } else {
+                break;
+            }
+            p->link = tc->list[idx];
+            tc->list[idx] = p;
+            tc->count[idx]++;
+            moved += blocks;
+        }
+        if(moved) {
+            __sync_add_and_fetch(&__tcache_blocks__, moved);
+        }
+        TCACHE_UNLOCK(tc);
+        uv_mutex_unlock(&mutex_gbmem);
+    }
+
+    TCACHE_LOCK(tc);
+    ZBLOCK *p = tc->list[idx];
+    if(p) {
+        tc->list[idx] = p->link;
+        tc->count[idx]--;
+        __sync_sub_and_fetch(&__tcache_blocks__, (size_t)blocks);
+    }
+    TCACHE_UNLOCK(tc);
+    return p;
+}
+
+/***************************************************************************
+ *  Save a free block in the thread cache, flush a batch to the pool if full
+ ***************************************************************************/
+PRIVATE BOOL tcache_free(ZBLOCK *p, bdl_t blocks)
+{
+    tcache_t *tc = tcache_get();
+    unsigned idx = blocks - 1;
+
+    if(tc->count[idx] >= TCACHE_MAX_COUNT) {
+        uv_mutex_lock(&mutex_gbmem);
+        TCACHE_LOCK(tc);
+        tcache_flush_size(tc, idx, TCACHE_BATCH);
+        TCACHE_UNLOCK(tc);
+        uv_mutex_unlock(&mutex_gbmem);
+    }
+
+    TCACHE_LOCK(tc);
+    p->link = tc->list[idx];
+    tc->list[idx] = p;
+    tc->count[idx]++;
+    __sync_add_and_fetch(&__tcache_blocks__, (size_t)blocks);
+    TCACHE_UNLOCK(tc);
+    return TRUE;
+}
+#endif
+
+/***************************************************************************
+ *  Return the blocks of the thread cache of the current thread to the pool
+ ***************************************************************************/
+PUBLIC void gbmem_flush_thread_cache(void)
+{
+#ifdef GBMEM_THREAD_CACHE
+    tcache_flush_all(&tcache);
+#endif
+}
+
+/***************************************************************************
+ *  Enable/disable the thread caches (enabled by default)
+ *  Disabling returns the blocks of all the thread caches to the pool.
+ ***************************************************************************/
+PUBLIC void gbmem_enable_thread_cache(BOOL enable)
+{
+    __thread_cache_enabled__ = enable?TRUE:FALSE;
+#ifdef GBMEM_THREAD_CACHE
+    if(!enable && __gbmem_initialized__) {
+        uv_mutex_lock(&mutex_gbmem);
+        tcache_flush_registered();
+        uv_mutex_unlock(&mutex_gbmem);
+    }
+#endif
+}
+
+/***************************************************************************
+ *  Return the generation of gbmem, changed in each gbmem_shutdown().
+ *  Caches of gbmem memory out of gbmem must be discarded when it changes.
+ ***************************************************************************/
+PUBLIC uint32_t gbmem_generation(void)
+{
+    return __gbmem_generation__;
+}
+
 /***************************************************************************
  *     calloc with gbmem
  ***************************************************************************/
@@ -1219,6 +1834,422 @@ PUBLIC void gbmem_trace_alloc_free(
     __memory_check_list__ = memory_check_list;
 }
 
+/*************************************************************************
+ *  Return the call stack of the sampled allocation.
+ *  The stack is trimmed to the frame of the caller of gbmem_malloc(),
+ *  the frames of gbmem above it depend of the inlining of the compiler.
+ *************************************************************************/
+PRIVATE int prof_backtrace(void **ips, int max_depth, void *caller)
+{
+    int depth = 0;
+
+#ifndef NOT_INCLUDE_LIBUNWIND
+    unw_cursor_t cursor; unw_context_t uc;
+    unw_word_t ip;
+    void *frames[PROF_MAX_DEPTH + PROF_MAX_SKIP];
+    int n = 0;
+
+    unw_getcontext(&uc);
+    unw_init_local(&cursor, &uc);
+
+    while(n < max_depth + PROF_MAX_SKIP && unw_step(&cursor) > 0) {
+        unw_get_reg(&cursor, UNW_REG_IP, &ip);
+        frames[n++] = (void *)(size_t)ip;
+    }
+
+    int first = 0;
+    if(caller) {
+        first = n;
+        for(int i=0; i<n; i++) {
+            if(frames[i] == caller) {
+                first = i;
+                break;
+            }
+        }
+    }
+    for(int i=first; i<n && depth < max_depth; i++) {
+        ips[depth++] = frames[i];
+    }
+#endif
+
+    if(depth == 0 && caller) {
+        /*
+         *  Without libunwind, or caller not found, only the caller of gbmem_malloc()
+         */
+        ips[depth++] = caller;
+    }
+    return depth;
+}
+
+/*************************************************************************
+ *  Get the site of a call stack, create it if not exists.
+ *  WARNING mutex_prof must be locked
+ *************************************************************************/
+PRIVATE prof_site_t *prof_get_site(void **ips, int depth)
+{
+    uint32_t hash = 2166136261u;   /* FNV-1a */
+    for(int i=0; i<depth; i++) {
+        size_t x = (size_t)ips[i];
+        for(int j=0; j<(int)sizeof(x); j++) {
+            hash ^= (uint8_t)(x >> (j*8));
+            hash *= 16777619u;
+        }
+    }
+
+    size_t idx = hash & (PROF_MAX_SITES-1);
+    for(size_t n=0; n<PROF_MAX_SITES; n++) {
+        prof_site_t *site = &prof_sites[idx];
+        if(site->depth == 0) {
+            if(prof_n_sites >= PROF_MAX_SITES*3/4) {
+                break;
+            }
+            site->hash = hash;
+            site->depth = depth;
+            memcpy(site->ips, ips, depth * sizeof(void *));
+            prof_n_sites++;
+            return site;
+        }
+        if(site->hash == hash && site->depth == depth &&
+                memcmp(site->ips, ips, depth * sizeof(void *))==0) {
+            return site;
+        }
+        idx = (idx + 1) & (PROF_MAX_SITES-1);
+    }
+    return &prof_overflow_site;
+}
+
+/*************************************************************************
+ *  Register a sampled allocation
+ *************************************************************************/
+PRIVATE void prof_sample(PTR p, size_t bytes, void *caller)
+{
+    void *ips[PROF_MAX_DEPTH];
+    int depth = prof_backtrace(ips, PROF_MAX_DEPTH, caller);
+    if(depth == 0) {
+        return;
+    }
+
+    prof_ptr_t *pp = calloc(1, sizeof(prof_ptr_t));
+    if(!pp) {
+        return;
+    }
+
+    uv_mutex_lock(&mutex_prof);
+    if(!prof_sites || !prof_ptrs) {
+        uv_mutex_unlock(&mutex_prof);
+        free(pp);
+        return;
+    }
+
+    prof_site_t *site = prof_get_site(ips, depth);
+    site->allocs++;
+    site->alloc_bytes += bytes;
+    site->live_count++;
+    site->live_bytes += bytes;
+
+    size_t idx = ((size_t)p >> 4) & (PROF_PTR_BUCKETS-1);
+    pp->p = p;
+    pp->bytes = bytes;
+    pp->memtrace = *MEMTRACE_OF(p);
+    pp->site = site;
+    pp->next = prof_ptrs[idx];
+    prof_ptrs[idx] = pp;
+    __prof_live__++;
+
+    *MEMTRACE_OF(p) = PROF_MARK;
+    uv_mutex_unlock(&mutex_prof);
+}
+
+/*************************************************************************
+ *  Unregister a sampled allocation being freed
+ *************************************************************************/
+PRIVATE void prof_unsample(PTR p)
+{
+    uv_mutex_lock(&mutex_prof);
+    if(!prof_ptrs) {
+        uv_mutex_unlock(&mutex_prof);
+        return;
+    }
+    size_t idx = ((size_t)p >> 4) & (PROF_PTR_BUCKETS-1);
+    prof_ptr_t **link = &prof_ptrs[idx];
+    while(*link) {
+        prof_ptr_t *pp = *link;
+        if(pp->p == p) {
+            *link = pp->next;
+            pp->site->live_count--;
+            pp->site->live_bytes -= pp->bytes;
+            __prof_live__--;
+            *MEMTRACE_OF(p) = pp->memtrace;
+            free(pp);
+            break;
+        }
+        link = &pp->next;
+    }
+    uv_mutex_unlock(&mutex_prof);
+}
+
+/*************************************************************************
+ *  Update the bytes of a sampled allocation reallocated in place
+ *************************************************************************/
+PRIVATE void prof_resize(PTR p, size_t size)
+{
+    uv_mutex_lock(&mutex_prof);
+    if(!prof_ptrs) {
+        uv_mutex_unlock(&mutex_prof);
+        return;
+    }
+    size_t idx = ((size_t)p >> 4) & (PROF_PTR_BUCKETS-1);
+    prof_ptr_t *pp = prof_ptrs[idx];
+    while(pp) {
+        if(pp->p == p) {
+            pp->site->live_bytes -= pp->bytes;
+            pp->site->live_bytes += size;
+            if(size > pp->bytes) {
+                pp->site->alloc_bytes += size - pp->bytes;
+            }
+            pp->bytes = size;
+            break;
+        }
+        pp = pp->next;
+    }
+    uv_mutex_unlock(&mutex_prof);
+}
+
+/*************************************************************************
+ *  Compare sites by live bytes, descending
+ *************************************************************************/
+PRIVATE int cmp_prof_site(const void *a, const void *b)
+{
+    const prof_site_t *sa = a;
+    const prof_site_t *sb = b;
+    if(sa->live_bytes > sb->live_bytes) {
+        return -1;
+    } else if(sa->live_bytes < sb->live_bytes) {
+        return 1;
+    }
+    return 0;
+}
+
+/*************************************************************************
+ *  Return a copy of the used sites, sorted by live bytes.
+ *  The copy is done under lock and must be free() by the caller,
+ *  it's outside of gbmem to allow json/gbmem allocations while using it.
+ *************************************************************************/
+PRIVATE size_t prof_snapshot(prof_site_t **sites_)
+{
+    size_t n = 0;
+
+    *sites_ = 0;
+    if(!__prof_mutex_initialized__) {
+        return 0;
+    }
+    uv_mutex_lock(&mutex_prof);
+    if(prof_sites) {
+        prof_site_t *sites = calloc(prof_n_sites + 1, sizeof(prof_site_t));
+        if(sites) {
+            for(size_t i=0; i<PROF_MAX_SITES; i++) {
+                if(prof_sites[i].depth > 0) {
+                    sites[n++] = prof_sites[i];
+                }
+            }
+            if(prof_overflow_site.allocs) {
+                sites[n++] = prof_overflow_site;
+            }
+            *sites_ = sites;
+        }
+    }
+    uv_mutex_unlock(&mutex_prof);
+
+    if(*sites_) {
+        qsort(*sites_, n, sizeof(prof_site_t), cmp_prof_site);
+    }
+    return n;
+}
+
+/*************************************************************************
+ *  Enable the sampling allocation profiler:
+ *  one of each sample_rate allocations saves his call stack,
+ *  the live bytes are kept by call site.
+ *  Use 0 to disable the sampling, the sampled pointers keep being tracked.
+ *************************************************************************/
+PUBLIC int gbmem_enable_alloc_profiler(uint32_t sample_rate)
+{
+    if(!__prof_mutex_initialized__) {
+        if(uv_mutex_init(&mutex_prof)) {
+            log_error(LOG_OPT_TRACE_STACK,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "process",      "%s", get_process_name(),
+                "hostname",     "%s", get_host_name(),
+                "pid",          "%d", get_pid(),
+                "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+                "msg",          "%s", "uv_mutex_init() FAILED",
+                NULL
+            );
+            return -1;
+        }
+        __prof_mutex_initialized__ = TRUE;
+    }
+
+    uv_mutex_lock(&mutex_prof);
+    if(sample_rate && !prof_sites) {
+        prof_sites = calloc(PROF_MAX_SITES, sizeof(prof_site_t));
+        prof_ptrs = calloc(PROF_PTR_BUCKETS, sizeof(prof_ptr_t *));
+        if(!prof_sites || !prof_ptrs) {
+            free(prof_sites);
+            free(prof_ptrs);
+            prof_sites = 0;
+            prof_ptrs = 0;
+            uv_mutex_unlock(&mutex_prof);
+            log_error(LOG_OPT_TRACE_STACK,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "process",      "%s", get_process_name(),
+                "hostname",     "%s", get_host_name(),
+                "pid",          "%d", get_pid(),
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "calloc() FAILED",
+                NULL
+            );
+            return -1;
+        }
+        prof_n_sites = 0;
+        memset(&prof_overflow_site, 0, sizeof(prof_overflow_site));
+    }
+    __prof_sample_rate__ = sample_rate;
+    uv_mutex_unlock(&mutex_prof);
+
+    return 0;
+}
+
+/*************************************************************************
+ *  Dump the allocation profile in pprof legacy heap format.
+ *  The counters are estimated multiplying the sampled by the sample rate.
+ *************************************************************************/
+PUBLIC int gbmem_dump_alloc_profile(const char *path)
+{
+    prof_site_t *sites;
+    size_t n = prof_snapshot(&sites);
+    if(!sites) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+            "msg",          "%s", "allocation profiler not enabled",
+            NULL
+        );
+        return -1;
+    }
+
+    FILE *file = fopen(path, "w");
+    if(!file) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "fopen() FAILED",
+            "path",         "%s", path,
+            NULL
+        );
+        free(sites);
+        return -1;
+    }
+
+    unsigned long long rate = __prof_sample_rate__? __prof_sample_rate__:1;
+    unsigned long long live_count = 0, live_bytes = 0, allocs = 0, alloc_bytes = 0;
+    for(size_t i=0; i<n; i++) {
+        live_count += sites[i].live_count;
+        live_bytes += sites[i].live_bytes;
+        allocs += sites[i].allocs;
+        alloc_bytes += sites[i].alloc_bytes;
+    }
+    fprintf(file, "heap profile: %llu: %llu [%llu: %llu] @ heapprofile\n",
+        live_count * rate, live_bytes * rate, allocs * rate, alloc_bytes * rate
+    );
+    for(size_t i=0; i<n; i++) {
+        prof_site_t *site = &sites[i];
+        fprintf(file, "%llu: %llu [%llu: %llu] @",
+            (unsigned long long)site->live_count * rate,
+            (unsigned long long)site->live_bytes * rate,
+            (unsigned long long)site->allocs * rate,
+            (unsigned long long)site->alloc_bytes * rate
+        );
+        for(int j=0; j<site->depth; j++) {
+            fprintf(file, " %p", site->ips[j]);
+        }
+        fprintf(file, "\n");
+    }
+    free(sites);
+
+    /*
+     *  Mapped libraries, to symbolize the addresses
+     */
+    fprintf(file, "\nMAPPED_LIBRARIES:\n");
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if(maps) {
+        char line[1024];
+        while(fgets(line, sizeof(line), maps)) {
+            fputs(line, file);
+        }
+        fclose(maps);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/*************************************************************************
+ *  Return the json of the allocation profiler
+ *************************************************************************/
+PRIVATE json_t *prof_json_info(void)
+{
+    prof_site_t *sites;
+    size_t n = prof_snapshot(&sites);
+    if(!sites) {
+        return 0;
+    }
+    json_int_t rate = __prof_sample_rate__? __prof_sample_rate__:1;
+
+    json_t *jn_sites = json_array();
+    for(size_t i=0; i<n && i<PROF_MAX_JSON_SITES; i++) {
+        prof_site_t *site = &sites[i];
+        if(!site->live_count) {
+            break;
+        }
+        json_t *jn_stack = json_array();
+        for(int j=0; j<site->depth; j++) {
+            char temp[32];
+            snprintf(temp, sizeof(temp), "%p", site->ips[j]);
+            json_array_append_new(jn_stack, json_string(temp));
+        }
+        json_array_append_new(
+            jn_sites,
+            json_pack("{s:I, s:I, s:I, s:I, s:I, s:o}",
+                "live_count", (json_int_t)site->live_count,
+                "live_bytes", (json_int_t)site->live_bytes,
+                "estimated_live_bytes", (json_int_t)site->live_bytes * rate,
+                "allocs", (json_int_t)site->allocs,
+                "alloc_bytes", (json_int_t)site->alloc_bytes,
+                "stack", jn_stack
+            )
+        );
+    }
+    free(sites);
+
+    return json_pack("{s:I, s:I, s:I, s:o}",
+        "sample_rate", (json_int_t)__prof_sample_rate__,
+        "sampled_live", (json_int_t)__prof_live__,
+        "sites", (json_int_t)n,
+        "top_sites", jn_sites
+    );
+}
+
 /*************************************************************************
  *   memory stats
  *************************************************************************/
@@ -1285,6 +2316,12 @@ PUBLIC void gbmem_stats(
             }
         }
 
+#ifdef GBMEM_THREAD_CACHE
+        /*
+         *  The blocks of the thread caches are free too
+         */
+        free_segmented_mem += __tcache_blocks__ * block_size;
+#endif
         free_superblock_mem = (size_t)(amt_avail) * (size_t)block_size;
         total_free_mem = free_segmented_mem + free_superblock_mem;
         allocated_system_mem = (size_t)count_sb * (size_t)chunk * (size_t)block_size;
@@ -1457,6 +2494,45 @@ PUBLIC void *gbmem_json_info(BOOL display_free_segmented_mem)
     json_object_set_new(jn_m, "total_free_mem", json_integer(total_free_mem));
     json_object_set_new(jn_m, "mem_in_use", json_integer(mem_in_use));
     json_object_set_new(jn_m, "allocated_system_mem", json_integer(allocated_system_mem));
+    json_object_set_new(jn_m, "slab_mode", json_boolean(__slab_mode__));
+    if(__slab_mode__) {
+        json_t *jn_slabs = json_object();
+        for(int i=0; i<SLAB_CLASSES; i++) {
+            slab_stats_t *st = &slab_stats[i];
+            if(!st->allocs) {
+                continue;
+            }
+            size_t class_size = slab_class_sizes[i];
+            bdl_t blocks = BytesToBlocks(class_size);
+            json_int_t hit_ratio = (json_int_t)(st->hits * 100 / st->allocs);
+            json_int_t internal_frag = 100 - (json_int_t)(st->requested * 100 / (st->allocs * class_size));
+            char temp[20];
+            snprintf(temp, sizeof(temp), "%d", (int)class_size);
+            json_object_set_new(
+                jn_slabs,
+                temp,
+                json_pack("{s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I}",
+                    "allocs", (json_int_t)st->allocs,
+                    "frees", (json_int_t)st->frees,
+                    "in_use", (json_int_t)(st->allocs - st->frees),
+                    "hits", (json_int_t)st->hits,
+                    "hit_ratio", hit_ratio,                 // %
+                    "slab_refills", (json_int_t)st->slab_refills,
+                    "internal_fragmentation", internal_frag, // % of class size not requested
+                    "free_mem", (json_int_t)((size_t)pool_sizes[blocks-1] * BlocksToBytes((size_t)blocks))
+                )
+            );
+        }
+        json_object_set_new(jn_m, "slab_classes", jn_slabs);
+    }
+    json_t *jn_prof = prof_json_info();
+    if(jn_prof) {
+        json_object_set_new(jn_m, "alloc_profiler", jn_prof);
+    }
+#ifdef GBMEM_THREAD_CACHE
+    json_object_set_new(jn_m, "thread_cache", json_boolean(__thread_cache_enabled__));
+    json_object_set_new(jn_m, "thread_cache_mem", json_integer(__tcache_blocks__ * block_size));
+#endif
 
     if(display_free_segmented_mem) {
         json_t *jn_free_segmented_mem = json_object();
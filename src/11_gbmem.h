@@ -101,6 +101,14 @@ sys_alloc_funcs fns = {
 
 
 
+/*
+ *  gbmem_startup() flags
+ */
+#define GBMEM_SLAB_MODE     0x0001  /* Round the sizes until 4096 bytes to geometric size classes,
+                                     * carve slabs of each class from the superblocks,
+                                     * stats by class in gbmem_json_info().
+                                     * Needs a min_block of 16 */
+
 /**************************************************************
  *       Prototypes
  **************************************************************/
@@ -110,7 +118,7 @@ PUBLIC int gbmem_startup(
     size_t superblock,                  /* super-block size */
     size_t max_system_memory,           /* maximum core memory */
     sys_alloc_funcs_t *sys_alloc_funcs,   /* system memory functions */
-    int flags
+    int flags                           /* GBMEM_SLAB_MODE */
 );
 PUBLIC int gbmem_startup_system(
     size_t max_block,                       /* largest memory block */
@@ -133,6 +141,18 @@ PUBLIC char * gbmem_strndup(const char *str, size_t n);
 
 PUBLIC size_t gbmem_get_maximum_block(void);
 
+/*
+ *  Thread caches: each thread keeps lists of free small blocks
+ *  in front of the global pool, to alloc/free without the global mutex.
+ *  The blocks are moved in batches from/to the pool,
+ *  and returned to the pool on thread exit, when disabled,
+ *  or when the pool has no free block before aborting.
+ *  Enabled by default (with gcc/clang), disabled while trace of alloc/free is enabled.
+ */
+PUBLIC void gbmem_enable_thread_cache(BOOL enable);
+PUBLIC void gbmem_flush_thread_cache(void); // Return the blocks of the current thread to the pool
+PUBLIC uint32_t gbmem_generation(void);     // Changed in each gbmem_shutdown(), to discard outside caches
+
 
 /*
  *    Statistics
@@ -152,6 +172,15 @@ PUBLIC void gbmem_trace_alloc_free(
     BOOL enable,
     uint32_t *memory_check_list
 );
+
+/*
+ *  Sampling allocation profiler: one of each sample_rate allocations saves his call stack
+ *  (libunwind, or only the caller if NOT_INCLUDE_LIBUNWIND) and the live bytes by call site.
+ *  The top sites are shown in gbmem_json_info(). Use sample_rate 0 to disable.
+ */
+PUBLIC int gbmem_enable_alloc_profiler(uint32_t sample_rate);
+PUBLIC int gbmem_dump_alloc_profile(const char *path); // pprof legacy heap format
+
 PUBLIC void gbmem_log_info(BOOL final);    // log_info of memory stats
 PUBLIC void *gbmem_json_info(BOOL display_free_segmented_mem);        // return an json object with memory stats
 
@@ -5,6 +5,7 @@
  *          All Rights Reserved.
  ***********************************************************************/
 #include <string.h>
+#include <pthread.h>
 #include "14_kw.h"
 
 /****************************************************************
@@ -12,6 +13,9 @@
  ****************************************************************/
 #define MAX_SERIALIZED_FIELDS 20
 
+#define RE_CACHE_SIZE       8       // regex of not compiled filters, by thread
+#define RE_CACHE_PATTERN    256
+
 
 /****************************************************************
  *         Structures
@@ -25,14 +29,88 @@ typedef struct serialize_fields_s {
     decref_fn_t decref_fn;
 } serialize_fields_t;
 
+/*
+ *  Compiled filter
+ */
+typedef enum {
+    KW_OP_EQUAL = 0,
+    KW_OP_NOT_EQUAL,
+    KW_OP_LOWER,
+    KW_OP_HIGHER,
+    KW_OP_IN,
+    KW_OP_RE,
+    KW_OP_PREFIX,
+} kw_op_t;
+
+typedef enum {
+    KW_FILTER_TRUE = 0,
+    KW_FILTER_FALSE,
+    KW_FILTER_AND,          // short-circuit on the first not matched
+    KW_FILTER_OR,           // short-circuit on the first matched
+    KW_FILTER_COND,
+} kw_filter_type_t;
+
+typedef struct kw_filter_node_s {
+    kw_filter_type_t type;
+
+    /*
+     *  AND/OR
+     */
+    struct kw_filter_node_s **childs;
+    size_t n_childs;
+
+    /*
+     *  COND
+     */
+    kw_op_t op;
+    char *path;             // full key, used when the path is not found
+    kw_path_t kwp;
+    json_t *jn_value;       // constant, owned
+    const char *str_value;  // typed constant
+    size_t str_len;
+    json_int_t int_value;
+    BOOL is_str;
+    BOOL is_int;
+    BOOL regex_compiled;
+    regex_t regex;
+} kw_filter_node_t;
+
+/*
+ *  Regular expressions of the not compiled filters (kw_match_simple())
+ */
+typedef struct {
+    BOOL compiled;
+    char pattern[RE_CACHE_PATTERN];
+    regex_t regex;
+} re_cache_t;
+
 
 /****************************************************************
  *         Data
  ****************************************************************/
 PRIVATE char delimiter[2] = {'`',0};
+
+/*
+ *  Filter operators, suffix of the filter path: "path`__lower__"
+ */
+PRIVATE const char *kw_op_names[] = {
+    "__equal__",
+    "__not_equal__",
+    "__lower__",
+    "__higher__",
+    "__in__",
+    "__re__",
+    "__prefix__",
+    0
+};
 PRIVATE int max_slot = 0;
 PRIVATE serialize_fields_t serialize_fields[MAX_SERIALIZED_FIELDS+1];
 
+PRIVATE pthread_key_t re_cache_key;
+PRIVATE pthread_once_t re_cache_key_once = PTHREAD_ONCE_INIT;
+PRIVATE __thread re_cache_t re_cache[RE_CACHE_SIZE];    /* by thread: regexec is not shared */
+PRIVATE __thread int re_cache_next = 0;
+
 
 /****************************************************************
  *         Prototypes
@@ -45,6 +123,8 @@ PRIVATE int _walk_object(
 );
 PRIVATE json_t *_kw_search_dict(json_t *kw, const char *path, kw_flag_t flag);
 PRIVATE json_t *_kw_find_path(json_t *kw, const char *path, BOOL verbose);
+PRIVATE serialize_fields_t * get_serialize_field(const char *binary_field_name);
+PRIVATE void free_filter_node(kw_filter_node_t *node);
 
 
 /***************************************************************************
@@ -201,6 +281,191 @@ PUBLIC json_t *kw_deserialize(
     return kw;
 }
 
+/***************************************************************************
+ *  Dump a key as json string
+ ***************************************************************************/
+PRIVATE int dump_json_key(
+    const char *key,
+    json_dump_callback_t dump_callback,
+    void *data
+)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *p = key;
+    const char *start = key;
+
+    if(dump_callback("\"", 1, data)<0) {
+        return -1;
+    }
+    while(*p) {
+        unsigned char c = (unsigned char)*p;
+        if(c == '"' || c == '\\' || c < 0x20) {
+            if(p > start) {
+                if(dump_callback(start, (size_t)(p - start), data)<0) {
+                    return -1;
+                }
+            }
+            char esc[6] = {'\\', (char)c, 0, 0, 0, 0};
+            size_t esc_len = 2;
+            switch(c) {
+                case '"':
+                case '\\':
+                    break;
+                case '\n': esc[1] = 'n'; break;
+                case '\r': esc[1] = 'r'; break;
+                case '\t': esc[1] = 't'; break;
+                case '\b': esc[1] = 'b'; break;
+                case '\f': esc[1] = 'f'; break;
+                default:
+                    esc[1] = 'u';
+                    esc[2] = '0';
+                    esc[3] = '0';
+                    esc[4] = hex[c >> 4];
+                    esc[5] = hex[c & 0x0F];
+                    esc_len = 6;
+                    break;
+            }
+            if(dump_callback(esc, esc_len, data)<0) {
+                return -1;
+            }
+            start = p + 1;
+        }
+        p++;
+    }
+    if(p > start) {
+        if(dump_callback(start, (size_t)(p - start), data)<0) {
+            return -1;
+        }
+    }
+    if(dump_callback("\":", 2, data)<0) {
+        return -1;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Serialize without copy
+ ***************************************************************************/
+PUBLIC int kw_serialize_dump(
+    json_t *kw,         // owned
+    json_dump_callback_t dump_callback,
+    void *data,
+    size_t flags
+)
+{
+    flags &= ~(size_t)JSON_INDENT(31); // Compact output, the dict is dumped here
+    flags |= JSON_ENCODE_ANY;
+
+    if(!json_is_object(kw)) {
+        int ret = json_dump_callback(kw, dump_callback, data, flags);
+        KW_DECREF(kw);
+        return ret;
+    }
+
+    int ret = 0;
+    BOOL first = TRUE;
+
+    ret += dump_callback("{", 1, data);
+
+    const char *key; json_t *jn_value;
+    json_object_foreach(kw, key, jn_value) {
+        if(ret < 0) {
+            break;
+        }
+        json_t *jn_serialized = 0;
+        serialize_fields_t *pf = max_slot? get_serialize_field(key) : 0;
+        if(pf) {
+            /*
+             *  Binary field, serialize it inline
+             */
+            if(!pf->serialize_fn) {
+                continue;
+            }
+            void *binary = (void *)(size_t)json_integer_value(jn_value);
+            jn_serialized = pf->serialize_fn(binary);
+            if(!jn_serialized) {
+                log_error(LOG_OPT_TRACE_STACK,
+                    "gobj",         "%s", __FILE__,
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+                    "msg",          "%s", "serialize_fn() FAILED",
+                    "key",          "%s", pf->binary_field_name,
+                    NULL
+                );
+                continue;
+            }
+            key = pf->serialized_field_name;
+            jn_value = jn_serialized;
+
+        } else if(max_slot) {
+            /*
+             *  The serialized field of a present binary field is overwritten
+             */
+            serialize_fields_t *pf_ = serialize_fields;
+            while(pf_->binary_field_name) {
+                if(strcmp(pf_->serialized_field_name, key)==0 &&
+                        json_object_get(kw, pf_->binary_field_name)) {
+                    break;
+                }
+                pf_++;
+            }
+            if(pf_->binary_field_name) {
+                continue;
+            }
+        }
+
+        if(!first) {
+            ret += dump_callback(",", 1, data);
+        }
+        first = FALSE;
+        ret += dump_json_key(key, dump_callback, data);
+        ret += json_dump_callback(jn_value, dump_callback, data, flags);
+        JSON_DECREF(jn_serialized);
+    }
+
+    ret += dump_callback("}", 1, data);
+
+    KW_DECREF(kw);
+    return ret<0? -1:0;
+}
+
+/***************************************************************************
+ *  Deserialize without copy
+ ***************************************************************************/
+PUBLIC json_t *kw_deserialize_load(
+    json_load_callback_t load_callback,
+    void *data,
+    size_t flags,
+    json_error_t *error
+)
+{
+    json_t *kw = json_load_callback(load_callback, data, flags, error);
+    if(!json_is_object(kw)) {
+        return kw;
+    }
+
+    /*
+     *  The loaded kw is ours, deserialize in place
+     */
+    serialize_fields_t * pf = serialize_fields;
+    while(pf->serialized_field_name) {
+        json_t *jn_serialized = json_object_get(kw, pf->serialized_field_name);
+        if(jn_serialized) {
+            if(pf->deserialize_fn) {
+                void *binary = pf->deserialize_fn(jn_serialized);
+                json_object_set_new(
+                    kw,
+                    pf->binary_field_name,
+                    json_integer((json_int_t)(size_t)binary)
+                );
+            }
+            json_object_del(kw, pf->serialized_field_name);
+        }
+        pf++;
+    }
+    return kw;
+}
+
 /***************************************************************************
  *  Incref json kw and his binary fields
  ***************************************************************************/
@@ -1089,6 +1354,237 @@ PUBLIC json_t *kw_get_dict_value(
     return jn_value;
 }
 
+/***************************************************************************
+ *  Split the path in the buffer, return the number of segments or -1
+ ***************************************************************************/
+PRIVATE int kw_path_split(kw_path_t *kwp, const char *path)
+{
+    if(!path || strlen(path) >= sizeof(kwp->buffer)) {
+        return -1;
+    }
+    snprintf(kwp->buffer, sizeof(kwp->buffer), "%s", path);
+
+    int n = 0;
+    char *key = kwp->buffer;
+    while(key) {
+        if(n >= KW_PATH_MAX_SEGMENTS) {
+            return -1;
+        }
+        kwp->segments[n++] = key;
+        char *p = search_delimiter(key, delimiter[0]);
+        if(p) {
+            *p = 0;
+            p++;
+        }
+        key = p;
+    }
+    return n;
+}
+
+/***************************************************************************
+ *  Split the path in segments, once.
+ ***************************************************************************/
+PUBLIC int kw_path_init(
+    kw_path_t *kwp,
+    const char *path    // not owned, must be alive while kwp is used
+)
+{
+    kwp->path = path;
+    kwp->n_segments = kw_path_split(kwp, path);
+    return (kwp->n_segments < 0)? -1 : 0;
+}
+
+/***************************************************************************
+ *  Compile a static kw_path_t, in the first use or before.
+ *  Only one thread compiles it, the others use the path meanwhile,
+ *  the segments are published after being written.
+ ***************************************************************************/
+PUBLIC int kw_path_compile(kw_path_t *kwp)
+{
+#if defined(__GNUC__)
+    int n = __atomic_load_n(&kwp->n_segments, __ATOMIC_ACQUIRE);
+    if(n != 0) {
+        return n;
+    }
+    int expected = 0;
+    if(!__atomic_compare_exchange_n(
+            &kwp->n_segments, &expected, -1, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return expected; // compiled or compiling by other thread
+    }
+    n = kw_path_split(kwp, kwp->path);
+    __atomic_store_n(&kwp->n_segments, n, __ATOMIC_RELEASE);
+    return n;
+#else
+    if(kwp->n_segments == 0) {
+        kwp->n_segments = kw_path_split(kwp, kwp->path);
+    }
+    return kwp->n_segments;
+#endif
+}
+
+/***************************************************************************
+ *  Return the json's value find by pre-parsed path
+ *  Walk over dicts and lists
+ ***************************************************************************/
+PUBLIC json_t *kw_path_find(json_t *kw, kw_path_t *kwp)
+{
+    int n_segments = kw_path_compile(kwp);
+    if(n_segments < 0) {
+        if(!kwp->path) {
+            return 0;
+        }
+        return _kw_find_path(kw, kwp->path, FALSE);
+    }
+
+    json_t *jn_value = kw;
+    for(int i=0; i<n_segments && jn_value; i++) {
+        if(json_is_object(jn_value)) {
+            jn_value = json_object_get(jn_value, kwp->segments[i]);
+        } else if(json_is_array(jn_value)) {
+            jn_value = json_array_get(jn_value, atoi(kwp->segments[i]));
+        } else {
+            return 0;
+        }
+    }
+    return jn_value;
+}
+
+/***************************************************************************
+ *  Get an dict value from an json object searched by pre-parsed path
+ ***************************************************************************/
+PUBLIC json_t *kwp_get_dict(
+    json_t *kw,
+    kw_path_t *kwp,
+    json_t *default_value,  // owned
+    kw_flag_t flag)
+{
+    json_t *jn_dict = kw_path_find(kw, kwp);
+    if(json_is_object(jn_dict) && !(flag & KW_EXTRACT)) {
+        JSON_DECREF(default_value);
+        return jn_dict;
+    }
+    if(!jn_dict && !(flag & (KW_CREATE|KW_REQUIRED))) {
+        return default_value;
+    }
+    return kw_get_dict(kw, kwp->path, default_value, flag);
+}
+
+/***************************************************************************
+ *  Get an list value from an json object searched by pre-parsed path
+ ***************************************************************************/
+PUBLIC json_t *kwp_get_list(
+    json_t *kw,
+    kw_path_t *kwp,
+    json_t *default_value,  // owned
+    kw_flag_t flag)
+{
+    json_t *jn_list = kw_path_find(kw, kwp);
+    if(json_is_array(jn_list) && !(flag & KW_EXTRACT)) {
+        JSON_DECREF(default_value);
+        return jn_list;
+    }
+    if(!jn_list && !(flag & (KW_CREATE|KW_REQUIRED))) {
+        return default_value;
+    }
+    return kw_get_list(kw, kwp->path, default_value, flag);
+}
+
+/***************************************************************************
+ *  Get an int value from an json object searched by pre-parsed path
+ ***************************************************************************/
+PUBLIC json_int_t kwp_get_int(
+    json_t *kw,
+    kw_path_t *kwp,
+    json_int_t default_value,
+    kw_flag_t flag)
+{
+    json_t *jn_int = kw_path_find(kw, kwp);
+    if(json_is_integer(jn_int) && !(flag & KW_EXTRACT)) {
+        return json_integer_value(jn_int);
+    }
+    if(!jn_int && !(flag & (KW_CREATE|KW_REQUIRED))) {
+        return default_value;
+    }
+    return kw_get_int(kw, kwp->path, default_value, flag);
+}
+
+/***************************************************************************
+ *  Get an real value from an json object searched by pre-parsed path
+ ***************************************************************************/
+PUBLIC double kwp_get_real(
+    json_t *kw,
+    kw_path_t *kwp,
+    double default_value,
+    kw_flag_t flag)
+{
+    json_t *jn_real = kw_path_find(kw, kwp);
+    if(json_is_real(jn_real) && !(flag & KW_EXTRACT)) {
+        return json_real_value(jn_real);
+    }
+    if(!jn_real && !(flag & (KW_CREATE|KW_REQUIRED))) {
+        return default_value;
+    }
+    return kw_get_real(kw, kwp->path, default_value, flag);
+}
+
+/***************************************************************************
+ *  Get a bool value from an json object searched by pre-parsed path
+ ***************************************************************************/
+PUBLIC BOOL kwp_get_bool(
+    json_t *kw,
+    kw_path_t *kwp,
+    BOOL default_value,
+    kw_flag_t flag)
+{
+    json_t *jn_bool = kw_path_find(kw, kwp);
+    if(json_is_boolean(jn_bool) && !(flag & KW_EXTRACT)) {
+        return json_is_true(jn_bool)?1:0;
+    }
+    if(!jn_bool && !(flag & (KW_CREATE|KW_REQUIRED))) {
+        return default_value;
+    }
+    return kw_get_bool(kw, kwp->path, default_value, flag);
+}
+
+/***************************************************************************
+ *  Get a string value from an json object searched by pre-parsed path
+ ***************************************************************************/
+PUBLIC const char *kwp_get_str(
+    json_t *kw,
+    kw_path_t *kwp,
+    const char *default_value,
+    kw_flag_t flag)
+{
+    json_t *jn_str = kw_path_find(kw, kwp);
+    if(json_is_string(jn_str) && !(flag & KW_EXTRACT)) {
+        return json_string_value(jn_str);
+    }
+    if(!jn_str && !(flag & (KW_CREATE|KW_REQUIRED))) {
+        return default_value;
+    }
+    return kw_get_str(kw, kwp->path, default_value, flag);
+}
+
+/***************************************************************************
+ *  Get any value from an json object searched by pre-parsed path
+ ***************************************************************************/
+PUBLIC json_t *kwp_get_dict_value(
+    json_t *kw,
+    kw_path_t *kwp,
+    json_t *default_value,  // owned
+    kw_flag_t flag)
+{
+    json_t *jn_value = kw_path_find(kw, kwp);
+    if(jn_value && !(flag & KW_EXTRACT)) {
+        JSON_DECREF(default_value);
+        return jn_value;
+    }
+    if(!jn_value && !(flag & (KW_CREATE|KW_REQUIRED))) {
+        return default_value;
+    }
+    return kw_get_dict_value(kw, kwp->path, default_value, flag);
+}
+
 /***************************************************************************
  *  Like json_object_set but with a path.
  ***************************************************************************/
@@ -1791,18 +2287,27 @@ PUBLIC json_t *kw_duplicate(json_t *kw) // not owned
 }
 
 /***************************************************************************
-    HACK Convention: private data begins with "_".
-    This function return a duplicate of kw removing all private data
+ *  Make a copy-on-write duplicate of kw
+ *  Only the first level is copied, the subtrees are shared.
  ***************************************************************************/
-PUBLIC json_t *kw_filter_private(
-    json_t *kw  // owned
-)
+PUBLIC json_t *kw_duplicate_cow(json_t *kw) // not owned
 {
-    json_t *new_kw = 0;
     if(json_is_object(kw)) {
-        new_kw =  _duplicate_object(kw, 0, 1, TRUE);
+        json_t *kw_dup_ = json_copy(kw);
+        if(max_slot) {
+            const char *key; json_t *value;
+            json_object_foreach(kw_dup_, key, value) {
+                if(json_is_integer(value)) {
+                    serialize_fields_t * pf = get_serialize_field(key);
+                    if(pf && pf->incref_fn) {
+                        pf->incref_fn((void *)(size_t)json_integer_value(value));
+                    }
+                }
+            }
+        }
+        return kw_dup_;
     } else if(json_is_array(kw)) {
-        new_kw = _duplicate_array(kw, 0, 1, TRUE);
+        return json_copy(kw);
     } else {
         log_error(LOG_OPT_TRACE_STACK,
             "gobj",         "%s", __FILE__,
@@ -1811,28 +2316,163 @@ PUBLIC json_t *kw_filter_private(
             "msg",          "%s", "json to duplicate must be an object or array",
             NULL
         );
+        return 0;
     }
-    KW_DECREF(kw);
-    return new_kw;
 }
 
 /***************************************************************************
-    HACK Convention: all metadata begins with "__".
-    This function return a duplicate of kw removing all metadata
+ *  Return the subdict `key` of `kw` ready to be modified:
+ *  if it's shared (refcount > 1) then it's replaced by a copy.
  ***************************************************************************/
-PUBLIC json_t *kw_filter_metadata(
-    json_t *kw  // owned
-)
+PRIVATE json_t *_cow_subdict(json_t *kw, const char *key, BOOL create)
 {
-    json_t *new_kw = 0;
-    if(json_is_object(kw)) {
-        new_kw =  _duplicate_object(kw, 0, 2, TRUE);
-    } else if(json_is_array(kw)) {
-        new_kw = _duplicate_array(kw, 0, 2, TRUE);
-    } else {
-        log_error(LOG_OPT_TRACE_STACK,
-            "gobj",         "%s", __FILE__,
-            "function",     "%s", __FUNCTION__,
+    json_t *node_dict = json_object_get(kw, key);
+    if(!node_dict) {
+        if(!create) {
+            return 0;
+        }
+        node_dict = json_object();
+        json_object_set_new(kw, key, node_dict);
+        return node_dict;
+    }
+    if(json_is_object(node_dict) && node_dict->refcount > 1) {
+        node_dict = json_copy(node_dict);
+        json_object_set_new(kw, key, node_dict);
+    }
+    return node_dict;
+}
+
+/***************************************************************************
+ *  Like kw_set_dict_value() but copying the shared subdicts of the path
+ ***************************************************************************/
+PUBLIC int kw_cow_set_dict_value(
+    json_t *kw,
+    const char *path,   // The last word after ` is the key
+    json_t *value) // owned
+{
+    if(!json_is_object(kw)) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "kw MUST BE a json object",
+            "path",         "%s", path,
+            NULL
+        );
+        JSON_DECREF(value);
+        return -1;
+    }
+
+    char *p = search_delimiter(path, delimiter[0]);
+    if(p) {
+        char segment[1024];
+        if(snprintf(segment, sizeof(segment), "%.*s", (int)(size_t)(p-path), path)>=sizeof(segment)) {
+            log_error(LOG_OPT_TRACE_STACK,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+                "msg",          "%s", "buffer too small",
+                "path",         "%s", path,
+                NULL
+            );
+        }
+
+        if(empty_string(segment)) {
+            return kw_cow_set_dict_value(kw, p+1, value);
+        }
+        json_t *node_dict = _cow_subdict(kw, segment, TRUE);
+        return kw_cow_set_dict_value(node_dict, p+1, value);
+    }
+    return kw_set_dict_value(kw, path, value);
+}
+
+/***************************************************************************
+ *  Like kw_delete() but copying the shared subdicts of the path
+ ***************************************************************************/
+PUBLIC int kw_cow_delete(json_t *kw, const char *path)
+{
+    if(!json_is_object(kw)) {
+        // silence
+        return 0;
+    }
+    if(!path) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "path NULL",
+            NULL
+        );
+        return 0;
+    }
+
+    char *p = search_delimiter(path, delimiter[0]);
+    if(!p) {
+        return kw_delete(kw, path);
+    }
+
+    char segment[256];
+    if(snprintf(segment, sizeof(segment), "%.*s", (int)(size_t)(p-path), path)>=sizeof(segment)) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+            "msg",          "%s", "buffer too small",
+            "path",         "%s", path,
+            NULL
+        );
+    }
+
+    if(!json_object_get(kw, segment)) {
+        return kw_delete(kw, path); // path not found, let kw_delete() report it
+    }
+    json_t *deep_dict = _cow_subdict(kw, segment, FALSE);
+    return kw_cow_delete(deep_dict, p+1);
+}
+
+/***************************************************************************
+    HACK Convention: private data begins with "_".
+    This function return a duplicate of kw removing all private data
+ ***************************************************************************/
+PUBLIC json_t *kw_filter_private(
+    json_t *kw  // owned
+)
+{
+    json_t *new_kw = 0;
+    if(json_is_object(kw)) {
+        new_kw =  _duplicate_object(kw, 0, 1, TRUE);
+    } else if(json_is_array(kw)) {
+        new_kw = _duplicate_array(kw, 0, 1, TRUE);
+    } else {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "json to duplicate must be an object or array",
+            NULL
+        );
+    }
+    KW_DECREF(kw);
+    return new_kw;
+}
+
+/***************************************************************************
+    HACK Convention: all metadata begins with "__".
+    This function return a duplicate of kw removing all metadata
+ ***************************************************************************/
+PUBLIC json_t *kw_filter_metadata(
+    json_t *kw  // owned
+)
+{
+    json_t *new_kw = 0;
+    if(json_is_object(kw)) {
+        new_kw =  _duplicate_object(kw, 0, 2, TRUE);
+    } else if(json_is_array(kw)) {
+        new_kw = _duplicate_array(kw, 0, 2, TRUE);
+    } else {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
             "msgset",       "%s", MSGSET_PARAMETER_ERROR,
             "msg",          "%s", "json to duplicate must be an object or array",
             NULL
@@ -2322,6 +2962,135 @@ PUBLIC int cmp_two_simple_json(
     return ret;
 }
 
+/***************************************************************************
+ *  Get the operator of a filter path, "path`__op__", default __equal__
+ *  Return in path_len the length of the path without the operator.
+ ***************************************************************************/
+PRIVATE kw_op_t get_filter_op(const char *filter_path, size_t *path_len)
+{
+    size_t len = strlen(filter_path);
+    *path_len = len;
+
+    if(len < 4 || filter_path[len-1] != '_' || filter_path[len-2] != '_') {
+        return KW_OP_EQUAL;
+    }
+    const char *p = strrchr(filter_path, delimiter[0]);
+    if(!p) {
+        return KW_OP_EQUAL;
+    }
+    for(int i=0; kw_op_names[i]; i++) {
+        if(strcmp(p+1, kw_op_names[i])==0) {
+            *path_len = (size_t)(p - filter_path);
+            return (kw_op_t)i;
+        }
+    }
+    return KW_OP_EQUAL;
+}
+
+/***************************************************************************
+ *  Thread exit: free the compiled regex of the thread
+ ***************************************************************************/
+PRIVATE void re_cache_destructor(void *cache_)
+{
+    re_cache_t *cache = cache_;
+    for(int i=0; i<RE_CACHE_SIZE; i++) {
+        if(cache[i].compiled) {
+            regfree(&cache[i].regex);
+            cache[i].compiled = FALSE;
+        }
+    }
+}
+
+PRIVATE void re_cache_key_create(void)
+{
+    pthread_key_create(&re_cache_key, re_cache_destructor);
+}
+
+/***************************************************************************
+ *  Return the compiled regex of the pattern, compiled once by thread.
+ *  Return 0 if the pattern is too long to be cached or it's a bad regex.
+ ***************************************************************************/
+PRIVATE regex_t *re_cache_get(const char *pattern)
+{
+    if(strlen(pattern) >= RE_CACHE_PATTERN) {
+        return 0;
+    }
+
+    for(int i=0; i<RE_CACHE_SIZE; i++) {
+        if(re_cache[i].compiled && strcmp(re_cache[i].pattern, pattern)==0) {
+            return &re_cache[i].regex;
+        }
+    }
+
+    pthread_once(&re_cache_key_once, re_cache_key_create);
+    pthread_setspecific(re_cache_key, re_cache);
+
+    /*
+     *  Replace the oldest
+     */
+    re_cache_t *entry = &re_cache[re_cache_next];
+    re_cache_next = (re_cache_next + 1) % RE_CACHE_SIZE;
+    if(entry->compiled) {
+        regfree(&entry->regex);
+        entry->compiled = FALSE;
+    }
+    if(regcomp(&entry->regex, pattern, REG_EXTENDED|REG_NOSUB)!=0) {
+        return 0;
+    }
+    snprintf(entry->pattern, sizeof(entry->pattern), "%s", pattern);
+    entry->compiled = TRUE;
+    return &entry->regex;
+}
+
+/***************************************************************************
+ *  Match the record value with the filter value using the operator
+ *  `regex` is only used with KW_OP_RE.
+ ***************************************************************************/
+PRIVATE BOOL match_op(
+    kw_op_t op,
+    json_t *jn_record_value,    // not owned
+    json_t *jn_filter_value,    // not owned
+    regex_t *regex
+)
+{
+    switch(op) {
+        case KW_OP_EQUAL:
+            return cmp_two_simple_json(jn_record_value, jn_filter_value)==0?TRUE:FALSE;
+        case KW_OP_NOT_EQUAL:
+            return cmp_two_simple_json(jn_record_value, jn_filter_value)!=0?TRUE:FALSE;
+        case KW_OP_LOWER:
+            return cmp_two_simple_json(jn_record_value, jn_filter_value)<0?TRUE:FALSE;
+        case KW_OP_HIGHER:
+            return cmp_two_simple_json(jn_record_value, jn_filter_value)>0?TRUE:FALSE;
+        case KW_OP_IN:
+            if(json_is_array(jn_filter_value)) {
+                size_t idx; json_t *jn_value;
+                json_array_foreach(jn_filter_value, idx, jn_value) {
+                    if(cmp_two_simple_json(jn_record_value, jn_value)==0) {
+                        return TRUE;
+                    }
+                }
+                return FALSE;
+            }
+            return cmp_two_simple_json(jn_record_value, jn_filter_value)==0?TRUE:FALSE;
+        case KW_OP_RE:
+            if(!json_is_string(jn_record_value) || !regex) {
+                return FALSE;
+            }
+            return regexec(regex, json_string_value(jn_record_value), 0, 0, 0)==0?TRUE:FALSE;
+        case KW_OP_PREFIX:
+            if(!json_is_string(jn_record_value) || !json_is_string(jn_filter_value)) {
+                return FALSE;
+            }
+            return strncmp(
+                json_string_value(jn_record_value),
+                json_string_value(jn_filter_value),
+                strlen(json_string_value(jn_filter_value))
+            )==0?TRUE:FALSE;
+    }
+    return FALSE;
+}
+
 /***************************************************************************
     Match a json dict with a json filter (only compare str/number)
  ***************************************************************************/
@@ -2364,10 +3133,14 @@ PRIVATE BOOL _kw_match_simple(
         const char *filter_path;
         json_t *jn_filter_value;
         json_object_foreach(jn_filter, filter_path, jn_filter_value) {
+            size_t path_len;
+            kw_op_t op = get_filter_op(filter_path, &path_len);
+
             /*
              *  Variable compleja, recursivo
              */
-            if(json_is_array(jn_filter_value) || json_is_object(jn_filter_value)) {
+            if(op != KW_OP_IN &&
+                    (json_is_array(jn_filter_value) || json_is_object(jn_filter_value))) {
                 JSON_INCREF(jn_filter_value);
                 matched = _kw_match_simple(
                     kw,                 // not owned
@@ -2378,13 +3151,14 @@ PRIVATE BOOL _kw_match_simple(
             }
 
             /*
-             *  Variable sencilla
-             */
-            /*
-             * TODO get the name and op.
+             *  Variable sencilla, get the name without op.
              */
-            const char *path = filter_path; // TODO
-            const char *op = "__equal__";
+            char path_[NAME_MAX];
+            const char *path = filter_path;
+            if(path_len != strlen(filter_path)) {
+                snprintf(path_, sizeof(path_), "%.*s", (int)path_len, filter_path);
+                path = path_;
+            }
 
             /*
              *  Get the record value, firstly by path else by name
@@ -2404,14 +3178,43 @@ PRIVATE BOOL _kw_match_simple(
             /*
              *  Do simple operation
              */
-            if(strcasecmp(op, "__equal__")==0) { // TODO __equal__ by default
-                int cmp = cmp_two_simple_json(jn_record_value, jn_filter_value);
-                if(cmp!=0) {
+            if(op == KW_OP_RE) {
+                /*
+                 *  The regex is compiled once by pattern, not by row.
+                 *  Only patterns too long for the cache are compiled here.
+                 */
+                const char *pattern = json_string_value(jn_filter_value);
+                regex_t regex_;
+                regex_t *regex = pattern?re_cache_get(pattern):0;
+                BOOL local = FALSE;
+                if(!regex && pattern && strlen(pattern) >= RE_CACHE_PATTERN &&
+                        regcomp(&regex_, pattern, REG_EXTENDED|REG_NOSUB)==0) {
+                    regex = &regex_;
+                    local = TRUE;
+                }
+                if(!regex) {
+                    log_error(0,
+                        "gobj",         "%s", __FILE__,
+                        "function",     "%s", __FUNCTION__,
+                        "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                        "msg",          "%s", "Bad regular expression",
+                        "path",         "%s", filter_path,
+                        NULL
+                    );
                     matched = FALSE;
                     break;
                 }
-            } else {
-                // TODO op: __lower__ __higher__ __re__ __equal__
+                BOOL ok = match_op(KW_OP_RE, jn_record_value, jn_filter_value, regex);
+                if(local) {
+                    regfree(&regex_);
+                }
+                if(!ok) {
+                    matched = FALSE;
+                    break;
+                }
+            } else if(!match_op(op, jn_record_value, jn_filter_value, 0)) {
+                matched = FALSE;
+                break;
             }
         }
     }
@@ -2441,6 +3244,329 @@ PUBLIC BOOL kw_match_simple(
     return _kw_match_simple(kw, jn_filter, 0);
 }
 
+/***************************************************************************
+ *  Create a filter node
+ ***************************************************************************/
+PRIVATE kw_filter_node_t *new_filter_node(kw_filter_type_t type)
+{
+    kw_filter_node_t *node = gbmem_malloc(sizeof(kw_filter_node_t));
+    if(!node) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            NULL
+        );
+        return 0;
+    }
+    node->type = type;
+    return node;
+}
+
+/***************************************************************************
+ *  Add a child to a AND/OR node
+ ***************************************************************************/
+PRIVATE int add_filter_child(kw_filter_node_t *node, kw_filter_node_t *child)
+{
+    kw_filter_node_t **childs = gbmem_realloc(
+        node->childs,
+        (node->n_childs + 1) * sizeof(kw_filter_node_t *)
+    );
+    if(!childs) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_realloc() FAILED",
+            NULL
+        );
+        free_filter_node(child);
+        return -1;
+    }
+    node->childs = childs;
+    node->childs[node->n_childs++] = child;
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void free_filter_node(kw_filter_node_t *node)
+{
+    if(!node) {
+        return;
+    }
+    for(size_t i=0; i<node->n_childs; i++) {
+        free_filter_node(node->childs[i]);
+    }
+    GBMEM_FREE(node->childs);
+    GBMEM_FREE(node->path);
+    JSON_DECREF(node->jn_value);
+    if(node->regex_compiled) {
+        regfree(&node->regex);
+    }
+    gbmem_free(node);
+}
+
+/***************************************************************************
+ *  Compile a simple condition: pre-split path and typed constant
+ ***************************************************************************/
+PRIVATE kw_filter_node_t *compile_filter_cond(
+    const char *filter_path,
+    json_t *jn_filter_value // not owned
+)
+{
+    kw_filter_node_t *node = new_filter_node(KW_FILTER_COND);
+    if(!node) {
+        return 0;
+    }
+
+    size_t path_len;
+    node->op = get_filter_op(filter_path, &path_len);
+    node->path = gbmem_strndup(filter_path, path_len);
+    if(!node->path) {
+        // Error already logged
+        free_filter_node(node);
+        return 0;
+    }
+    kw_path_init(&node->kwp, node->path);
+
+    /*
+     *  Typed constant
+     */
+    node->jn_value = json_incref(jn_filter_value);
+    if(json_is_string(jn_filter_value)) {
+        node->is_str = TRUE;
+        node->str_value = json_string_value(jn_filter_value);
+        node->str_len = strlen(node->str_value);
+    } else if(json_is_integer(jn_filter_value)) {
+        node->is_int = TRUE;
+        node->int_value = json_integer_value(jn_filter_value);
+    }
+
+    if(node->op == KW_OP_RE) {
+        if(!node->is_str ||
+                regcomp(&node->regex, node->str_value, REG_EXTENDED|REG_NOSUB)!=0) {
+            log_error(0,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "Bad regular expression",
+                "path",         "%s", filter_path,
+                NULL
+            );
+            free_filter_node(node);
+            return 0;
+        }
+        node->regex_compiled = TRUE;
+    }
+
+    return node;
+}
+
+/***************************************************************************
+ *  Compile a filter, same semantic than _kw_match_simple()
+ ***************************************************************************/
+PRIVATE kw_filter_node_t *compile_filter(
+    json_t *jn_filter // not owned
+)
+{
+    if(json_is_array(jn_filter)) {
+        // Empty array evaluate as false, until a match condition occurs.
+        kw_filter_node_t *node = new_filter_node(KW_FILTER_OR);
+        if(!node) {
+            return 0;
+        }
+        size_t idx;
+        json_t *jn_filter_value;
+        json_array_foreach(jn_filter, idx, jn_filter_value) {
+            kw_filter_node_t *child = compile_filter(jn_filter_value);
+            if(!child || add_filter_child(node, child)<0) {
+                free_filter_node(node);
+                return 0;
+            }
+        }
+        return node;
+
+    } else if(json_is_object(jn_filter)) {
+        if(json_object_size(jn_filter)==0) {
+            // Empty object evaluate as false.
+            return new_filter_node(KW_FILTER_FALSE);
+        }
+        // Not Empty object evaluate as true, until a NOT match condition occurs.
+        kw_filter_node_t *node = new_filter_node(KW_FILTER_AND);
+        if(!node) {
+            return 0;
+        }
+
+        const char *filter_path;
+        json_t *jn_filter_value;
+        json_object_foreach(jn_filter, filter_path, jn_filter_value) {
+            size_t path_len;
+            kw_op_t op = get_filter_op(filter_path, &path_len);
+            kw_filter_node_t *child;
+            if(op != KW_OP_IN &&
+                    (json_is_array(jn_filter_value) || json_is_object(jn_filter_value))) {
+                /*
+                 *  Variable compleja, the rest of keys are ignored
+                 */
+                child = compile_filter(jn_filter_value);
+                if(!child || add_filter_child(node, child)<0) {
+                    free_filter_node(node);
+                    return 0;
+                }
+                break;
+            }
+
+            child = compile_filter_cond(filter_path, jn_filter_value);
+            if(!child || add_filter_child(node, child)<0) {
+                free_filter_node(node);
+                return 0;
+            }
+        }
+        return node;
+    }
+
+    return new_filter_node(KW_FILTER_FALSE);
+}
+
+/***************************************************************************
+ *  Compare the record value with the typed constant
+ ***************************************************************************/
+static inline int cmp_filter_value(kw_filter_node_t *node, json_t *jn_record_value)
+{
+    if(node->is_str && json_is_string(jn_record_value)) {
+        return strcmp(json_string_value(jn_record_value), node->str_value);
+    }
+    if(node->is_int && json_is_integer(jn_record_value)) {
+        json_int_t val1 = json_integer_value(jn_record_value);
+        if(val1 > node->int_value) {
+            return 1;
+        } else if(val1 < node->int_value) {
+            return -1;
+        } else {
+            return 0;
+        }
+    }
+    return cmp_two_simple_json(jn_record_value, node->jn_value);
+}
+
+/***************************************************************************
+ *  Evaluate a compiled condition
+ ***************************************************************************/
+PRIVATE BOOL match_filter_cond(kw_filter_node_t *node, json_t *kw)
+{
+    /*
+     *  Get the record value, firstly by path else by full key
+     */
+    json_t *jn_record_value = kw_path_find(kw, &node->kwp);
+    if(!jn_record_value && node->kwp.n_segments != 1) {
+        jn_record_value = json_object_get(kw, node->path);
+    }
+    if(!jn_record_value) {
+        return FALSE;
+    }
+
+    switch(node->op) {
+        case KW_OP_EQUAL:
+            return cmp_filter_value(node, jn_record_value)==0?TRUE:FALSE;
+        case KW_OP_NOT_EQUAL:
+            return cmp_filter_value(node, jn_record_value)!=0?TRUE:FALSE;
+        case KW_OP_LOWER:
+            return cmp_filter_value(node, jn_record_value)<0?TRUE:FALSE;
+        case KW_OP_HIGHER:
+            return cmp_filter_value(node, jn_record_value)>0?TRUE:FALSE;
+        case KW_OP_PREFIX:
+            if(!node->is_str || !json_is_string(jn_record_value)) {
+                return FALSE;
+            }
+            return strncmp(
+                json_string_value(jn_record_value),
+                node->str_value,
+                node->str_len
+            )==0?TRUE:FALSE;
+        case KW_OP_RE:
+            return match_op(node->op, jn_record_value, node->jn_value, &node->regex);
+        case KW_OP_IN:
+            return match_op(node->op, jn_record_value, node->jn_value, 0);
+    }
+    return FALSE;
+}
+
+/***************************************************************************
+ *  Evaluate a compiled filter
+ ***************************************************************************/
+PRIVATE BOOL match_filter(kw_filter_node_t *node, json_t *kw)
+{
+    switch(node->type) {
+        case KW_FILTER_TRUE:
+            return TRUE;
+        case KW_FILTER_FALSE:
+            return FALSE;
+        case KW_FILTER_AND:
+            for(size_t i=0; i<node->n_childs; i++) {
+                if(!match_filter(node->childs[i], kw)) {
+                    return FALSE;
+                }
+            }
+            return TRUE;
+        case KW_FILTER_OR:
+            for(size_t i=0; i<node->n_childs; i++) {
+                if(match_filter(node->childs[i], kw)) {
+                    return TRUE;
+                }
+            }
+            return FALSE;
+        case KW_FILTER_COND:
+            return match_filter_cond(node, kw);
+    }
+    return FALSE;
+}
+
+/***************************************************************************
+    Compile a json filter to use it many times with kw_filter_match()
+ ***************************************************************************/
+PUBLIC kw_filter kw_filter_compile(
+    json_t *jn_filter   // owned
+)
+{
+    kw_filter_node_t *node;
+    if(!jn_filter) {
+        // Si no hay filtro pasan todos.
+        node = new_filter_node(KW_FILTER_TRUE);
+    } else if(json_is_object(jn_filter) && json_object_size(jn_filter)==0) {
+        // A empty object at first level evaluate as true.
+        node = new_filter_node(KW_FILTER_TRUE);
+    } else {
+        node = compile_filter(jn_filter);
+    }
+    JSON_DECREF(jn_filter);
+    return node;
+}
+
+/***************************************************************************
+    Match a json dict with a compiled filter
+ ***************************************************************************/
+PUBLIC BOOL kw_filter_match(
+    kw_filter filter,
+    json_t *kw          // not owned
+)
+{
+    if(!filter) {
+        return FALSE;
+    }
+    return match_filter(filter, kw);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC void kw_filter_free(kw_filter filter)
+{
+    free_filter_node(filter);
+}
+
 /***************************************************************************
     Being `kw` a row's list or list of dicts [{},...],
     return a new list of **duplicated** kw filtering the rows by `jn_filter` (where),
@@ -2463,15 +3589,30 @@ PUBLIC json_t *kw_select( // WARNING return **duplicated** objects
     json_t *kw_new = json_array();
 
     if(json_is_array(kw)) {
+        kw_filter filter = 0;
+        if(match_fn == kw_match_simple) {
+            /*
+             *  Compile the filter once for all the rows
+             */
+            KW_INCREF(jn_filter);
+            filter = kw_filter_compile(jn_filter);
+        }
         size_t idx;
         json_t *jn_value;
         json_array_foreach(kw, idx, jn_value) {
-            KW_INCREF(jn_filter);
-            if(match_fn(jn_value, jn_filter)) {
+            BOOL matched;
+            if(filter) {
+                matched = kw_filter_match(filter, jn_value);
+            } else {
+                KW_INCREF(jn_filter);
+                matched = match_fn(jn_value, jn_filter);
+            }
+            if(matched) {
                 json_t *jn_row = kw_duplicate_with_only_keys(jn_value, keys);
                 json_array_append_new(kw_new, jn_row);
             }
         }
+        kw_filter_free(filter);
     } else if(json_is_object(kw)) {
         KW_INCREF(jn_filter);
         if(match_fn(kw, jn_filter)) {
@@ -2573,14 +3714,29 @@ PUBLIC json_t *kw_collect( // WARNING be care, you can modify the original recor
     }
     json_t *kw_new = json_array();
     if(json_is_array(kw)) {
+        kw_filter filter = 0;
+        if(match_fn == kw_match_simple) {
+            /*
+             *  Compile the filter once for all the rows
+             */
+            JSON_INCREF(jn_filter);
+            filter = kw_filter_compile(jn_filter);
+        }
         size_t idx;
         json_t *jn_value;
         json_array_foreach(kw, idx, jn_value) {
-            JSON_INCREF(jn_filter);
-            if(match_fn(jn_value, jn_filter)) {
+            BOOL matched;
+            if(filter) {
+                matched = kw_filter_match(filter, jn_value);
+            } else {
+                JSON_INCREF(jn_filter);
+                matched = match_fn(jn_value, jn_filter);
+            }
+            if(matched) {
                 json_array_append(kw_new, jn_value);
             }
         }
+        kw_filter_free(filter);
     } else if(json_is_object(kw)) {
         JSON_INCREF(jn_filter);
         if(match_fn(kw, jn_filter)) {
@@ -3352,13 +4508,8 @@ PUBLIC BOOL kwid_match_id(json_t *ids, const char *id)
         }
         break;
     case JSON_OBJECT:
-        {
-            const char *key; json_t *jn_value;
-            json_object_foreach(ids, key, jn_value) {
-                if(strcmp(id, key)==0)  {
-                    return TRUE;
-                }
-            }
+        if(json_object_get(ids, id)) {
+            return TRUE;
         }
         break;
 
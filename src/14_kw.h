@@ -39,6 +39,21 @@ typedef enum {
     KW_BACKWARD         = 0x0010,   // Search backward in lists or arrays
 } kw_flag_t;
 
+/*
+ *  Pre-parsed path, to use in hot paths with the kwp_get_*() functions.
+ *  Build it as static initializer (compiled in the first use, thread safe):
+ *      PRIVATE kw_path_t kwp_topic_name = KW_PATH_INIT("__md_treedb__`topic_name");
+ *  or in runtime with kw_path_init() (not thread safe, before sharing it).
+ */
+#define KW_PATH_MAX_SEGMENTS    16
+typedef struct {
+    const char *path;       // NOT owned, MUST be alive while the kw_path_t is used
+    int n_segments;         // 0 not compiled, -1 cannot be compiled (use the path)
+    char buffer[256];
+    const char *segments[KW_PATH_MAX_SEGMENTS];
+} kw_path_t;
+#define KW_PATH_INIT(path_) {(path_), 0, {0}, {0}}
+
 typedef void (*incref_fn_t)(void *);
 typedef void (*decref_fn_t)(void *);
 typedef json_t * (*serialize_fn_t)(void *ptr);
@@ -95,6 +110,33 @@ PUBLIC json_t *kw_deserialize(
     json_t *kw // owned
 );
 
+/**rst**
+    Like kw_serialize() but without copy of `kw`:
+    walk the kw once and dump it with `dump_callback`,
+    the binary fields are serialized inline.
+    The output is compact, `flags` are the json_dump_callback() flags.
+    Return -1 if error.
+    See kw2gbuf_serialize().
+**rst**/
+PUBLIC int kw_serialize_dump(
+    json_t *kw,         // owned
+    json_dump_callback_t dump_callback,
+    void *data,
+    size_t flags
+);
+
+/**rst**
+    Like kw_deserialize() but loading the kw with json_load_callback()
+    and deserializing it in place, without copy.
+    See gbuf2kw_deserialize().
+**rst**/
+PUBLIC json_t *kw_deserialize_load(
+    json_load_callback_t load_callback,
+    void *data,
+    size_t flags,
+    json_error_t *error
+);
+
 /**rst**
    This functions does json_incref
    but also it does incref of binary fields like gbuffer.
@@ -230,6 +272,82 @@ PUBLIC json_t *kw_get_dict_value(
     kw_flag_t flag
 );
 
+/**rst**
+   Split the ``path`` in segments, once.
+   Return -1 if the path is too long or has too many segments,
+   in this case the kwp_get_*() functions use the ``path`` as kw_get_*() functions.
+**rst**/
+PUBLIC int kw_path_init(
+    kw_path_t *kwp,
+    const char *path    // NOT owned, MUST be alive while kwp is used
+);
+
+/**rst**
+   Compile a KW_PATH_INIT() path now, instead of in the first use.
+   Thread safe. Return the number of segments, -1 if it cannot be compiled.
+**rst**/
+PUBLIC int kw_path_compile(
+    kw_path_t *kwp
+);
+
+/**rst**
+   Return the json value of the pre-parsed path, or null if not found (silence).
+   Walk over dicts and lists.
+**rst**/
+PUBLIC json_t *kw_path_find( // Return is NOT YOURS
+    json_t *kw,
+    kw_path_t *kwp
+);
+
+/**rst**
+   Like kw_get_*() functions but with a pre-parsed path.
+   The found values of the expected type are returned without more work,
+   the rest of cases (create, required, extract, conversions, errors)
+   are done by the kw_get_*() functions.
+**rst**/
+PUBLIC json_t *kwp_get_dict(
+    json_t *kw,
+    kw_path_t *kwp,
+    json_t *default_value,  // owned
+    kw_flag_t flag
+);
+PUBLIC json_t *kwp_get_list(
+    json_t *kw,
+    kw_path_t *kwp,
+    json_t *default_value,  // owned
+    kw_flag_t flag
+);
+PUBLIC json_int_t kwp_get_int(
+    json_t *kw,
+    kw_path_t *kwp,
+    json_int_t default_value,
+    kw_flag_t flag
+);
+PUBLIC double kwp_get_real(
+    json_t *kw,
+    kw_path_t *kwp,
+    double default_value,
+    kw_flag_t flag
+);
+PUBLIC BOOL kwp_get_bool(
+    json_t *kw,
+    kw_path_t *kwp,
+    BOOL default_value,
+    kw_flag_t flag
+);
+PUBLIC const char *kwp_get_str(
+    json_t *kw,
+    kw_path_t *kwp,
+    const char *default_value,
+    kw_flag_t flag
+);
+PUBLIC json_t *kwp_get_dict_value(
+    json_t *kw,
+    kw_path_t *kwp,
+    json_t *default_value,  // owned
+    kw_flag_t flag
+);
+
 /**rst**
    Like json_object_set but with a path.
 **rst**/
@@ -380,6 +498,27 @@ PUBLIC json_t *kw_duplicate(
     json_t *kw  // NOT owned
 );
 
+/**rst**
+   Make a copy-on-write duplicate of kw.
+   Only the first level is copied, the subtrees are shared by reference (incref),
+   and the binary fields of the first level are incref.
+   Modify the duplicate ONLY with kw_cow_set_dict_value() and kw_cow_delete(),
+   they copy the shared subtrees (refcount > 1) of the modified path before touch them.
+   WARNING with the kw_set_dict_value()/kw_delete() you will modify the original kw.
+**rst**/
+PUBLIC json_t *kw_duplicate_cow(
+    json_t *kw  // NOT owned
+);
+PUBLIC int kw_cow_set_dict_value(
+    json_t *kw,
+    const char *path,   // The last word after ` is the key
+    json_t *value       // owned
+);
+PUBLIC int kw_cow_delete(
+    json_t *kw,
+    const char *path
+);
+
 /**rst**
     HACK Convention: private data begins with "_".
     This function return a duplicate of kw removing all private data
@@ -510,11 +649,46 @@ PUBLIC int cmp_two_simple_json(
 /**rst**
     Match a json dict with a json filter
     Only compare str/int/real/bool items
+    See kw_filter_compile() for the operators.
+    The __re__ regex are compiled once by pattern (cache by thread),
+    to match many rows with the same filter use kw_filter_compile().
 **rst**/
 PUBLIC BOOL kw_match_simple(
     json_t *kw,         // NOT owned
     json_t *jn_filter   // owned
 );
+
+/**rst**
+    Compiled filter: the json filter is converted to a program
+    (pre-split paths, typed constants, short-circuit and/or)
+    to evaluate many rows without walk the filter json again.
+
+    Same semantic than kw_match_simple():
+        - list is OR, dict is AND.
+        - the key of a dict is the path of the record value,
+          optionally ended with an operator: "path`__op__".
+          Operators:
+            __equal__       (default)
+            __not_equal__
+            __lower__
+            __higher__
+            __in__          filter value is a list of values
+            __re__          POSIX extended regular expression
+            __prefix__
+        - a record without the path does not match.
+
+    Return 0 if error (bad regular expression), the filter must be free with kw_filter_free().
+**rst**/
+typedef void *kw_filter;
+PUBLIC kw_filter kw_filter_compile(
+    json_t *jn_filter   // owned
+);
+PUBLIC BOOL kw_filter_match(
+    kw_filter filter,
+    json_t *kw          // NOT owned
+);
+PUBLIC void kw_filter_free(kw_filter filter);
+
 typedef BOOL (*kw_match_fn)(
     json_t *kw,         // NOT owned
     json_t *jn_filter   // owned
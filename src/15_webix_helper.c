@@ -24,6 +24,120 @@
  *              Data
  ***************************************************************/
 
+/***************************************************************************
+ *  Return a new webix record of the node, without the childs (hook level).
+ *  Use it to feed a webix tree incrementally (see treedb_walk_node_childs()).
+ ***************************************************************************/
+PUBLIC json_t *webix_new_tree_record( // Return MUST be decref
+    json_t *node,  // NOT owned
+    json_t *filter,  // NOT owned (fields of tree'records to include, and possible field rename)
+    const char *options // "permissive" "verbose"
+)
+{
+    BOOL verbose = (options && strstr(options, "verbose"))?TRUE:FALSE;
+
+    json_t *new_record = json_object();
+
+    json_object_set(
+        new_record,
+        "id",
+        json_object_get(node, "id")
+    );
+
+    BOOL permissive_added = FALSE;
+
+    if(json_is_object(filter)) {
+        const char *field_name; json_t *f_v;
+        json_object_foreach(filter, field_name, f_v) {
+            const char *new_field_name = json_string_value(f_v);
+            json_t *field_value = json_object_get(node, field_name);
+            if(!field_value) {
+                if(verbose) {
+                    log_error(0,
+                        "gobj",         "%s", __FILE__,
+                        "function",     "%s", __FUNCTION__,
+                        "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                        "msg",          "%s", "filter_name not found in node",
+                        "field_name",   "%s", field_name,
+                        NULL
+                    );
+                }
+                continue;
+            }
+            if(json_typeof(field_value)==JSON_OBJECT ||
+                    json_typeof(field_value)==JSON_ARRAY) {
+                json_t *only_id_record = kwid_get_id_records(field_value);
+                json_object_set_new(
+                    new_record,
+                    !empty_string(new_field_name)?new_field_name:field_name,
+                    only_id_record
+                );
+            } else {
+                json_object_set(
+                    new_record,
+                    !empty_string(new_field_name)?new_field_name:field_name,
+                    field_value
+                );
+            }
+        }
+    } else if(json_is_array(filter)) {
+        int idx; json_t *f_v;
+        json_array_foreach(filter, idx, f_v) {
+            const char *field_name = json_string_value(f_v);
+            json_t *field_value = json_object_get(node, field_name);
+            if(!field_value) {
+                if(verbose) {
+                    log_error(0,
+                        "gobj",         "%s", __FILE__,
+                        "function",     "%s", __FUNCTION__,
+                        "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                        "msg",          "%s", "filter_name not found in node",
+                        "field_name",   "%s", field_name,
+                        NULL
+                    );
+                }
+                continue;
+            }
+            if(json_typeof(field_value)==JSON_OBJECT ||
+                    json_typeof(field_value)==JSON_ARRAY) {
+                json_t *only_id_record = kwid_get_id_records(field_value);
+                json_object_set_new(
+                    new_record,
+                    field_name,
+                    only_id_record
+                );
+            } else {
+                json_object_set(
+                    new_record,
+                    field_name,
+                    field_value
+                );
+            }
+        }
+    } else if(!filter) {
+        json_object_update_missing(new_record, node);
+        permissive_added = TRUE;
+    } else {
+        if(options && strstr(options, "verbose")) {
+            log_error(LOG_OPT_TRACE_STACK,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "bad filter",
+                NULL
+            );
+        }
+    }
+
+    if(options && strstr(options, "permissive")) {
+        if(!permissive_added) {
+            json_object_update_missing(new_record, node);
+        }
+    }
+
+    return new_record;
+}
+
 /***************************************************************************
 
  ***************************************************************************/
@@ -36,8 +150,6 @@ PRIVATE int _new_list_tree(
     const char *options // "permissive" "verbose"
 )
 {
-    BOOL verbose = (options && strstr(options, "verbose"))?TRUE:FALSE;
-
     int ret = 0;
 
     switch(json_typeof(node)) {
@@ -61,106 +173,9 @@ PRIVATE int _new_list_tree(
                 break;
             }
 
-            json_t *new_record = json_object();
+            json_t *new_record = webix_new_tree_record(node, filter, options);
             json_array_append_new(list, new_record);
 
-            json_object_set(
-                new_record,
-                "id",
-                json_object_get(node, "id")
-            );
-
-            BOOL permissive_added = FALSE;
-
-            if(json_is_object(filter)) {
-                const char *field_name; json_t *f_v;
-                json_object_foreach(filter, field_name, f_v) {
-                    const char *new_field_name = json_string_value(f_v);
-                    json_t *field_value = json_object_get(node, field_name);
-                    if(!field_value) {
-                        if(verbose) {
-                            log_error(0,
-                                "gobj",         "%s", __FILE__,
-                                "function",     "%s", __FUNCTION__,
-                                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                                "msg",          "%s", "filter_name not found in node",
-                                "field_name",   "%s", field_name,
-                                NULL
-                            );
-                        }
-                        continue;
-                    }
-                    if(json_typeof(field_value)==JSON_OBJECT ||
-                            json_typeof(field_value)==JSON_ARRAY) {
-                        json_t *only_id_record = kwid_get_id_records(field_value);
-                        json_object_set_new(
-                            new_record,
-                            !empty_string(new_field_name)?new_field_name:field_name,
-                            only_id_record
-                        );
-                    } else {
-                        json_object_set(
-                            new_record,
-                            !empty_string(new_field_name)?new_field_name:field_name,
-                            field_value
-                        );
-                    }
-                }
-            } else if(json_is_array(filter)) {
-                int idx; json_t *f_v;
-                json_array_foreach(filter, idx, f_v) {
-                    const char *field_name = json_string_value(f_v);
-                    json_t *field_value = json_object_get(node, field_name);
-                    if(!field_value) {
-                        if(verbose) {
-                            log_error(0,
-                                "gobj",         "%s", __FILE__,
-                                "function",     "%s", __FUNCTION__,
-                                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                                "msg",          "%s", "filter_name not found in node",
-                                "field_name",   "%s", field_name,
-                                NULL
-                            );
-                        }
-                        continue;
-                    }
-                    if(json_typeof(field_value)==JSON_OBJECT ||
-                            json_typeof(field_value)==JSON_ARRAY) {
-                        json_t *only_id_record = kwid_get_id_records(field_value);
-                        json_object_set_new(
-                            new_record,
-                            field_name,
-                            only_id_record
-                        );
-                    } else {
-                        json_object_set(
-                            new_record,
-                            field_name,
-                            field_value
-                        );
-                    }
-                }
-            } else if(!filter) {
-                json_object_update_missing(new_record, node);
-                permissive_added = TRUE;
-            } else {
-                if(options && strstr(options, "verbose")) {
-                    log_error(LOG_OPT_TRACE_STACK,
-                        "gobj",         "%s", __FILE__,
-                        "function",     "%s", __FUNCTION__,
-                        "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                        "msg",          "%s", "bad filter",
-                        NULL
-                    );
-                }
-            }
-
-            if(options && strstr(options, "permissive")) {
-                if(!permissive_added) {
-                    json_object_update_missing(new_record, node);
-                }
-            }
-
             /*
              *  Next hook level
              */
@@ -34,6 +34,16 @@ PUBLIC json_t *webix_new_list_tree(
     const char *options // "permissive" "verbose"
 );
 
+/**rst**
+    Return a new webix record of the node, without the childs (hook level).
+    Use it to feed a webix tree incrementally, see treedb_walk_node_childs().
+**rst**/
+PUBLIC json_t *webix_new_tree_record( // Return MUST be decref
+    json_t *node,  // NOT owned
+    json_t *filter,  // NOT owned (fields of tree'records to include, and possible field rename)
+    const char *options // "permissive" "verbose"
+);
+
 #ifdef __cplusplus
 }
 #endif
@@ -15,26 +15,96 @@
     #include <io.h>
 #else
     #include <unistd.h>
+    #include <limits.h>
+    #include <sys/mman.h>
+    #define GBUF_MMAP 1
 #endif
 
 #include "20_gbuffer.h"
 
+/*
+ *  Pool of gbuffers with per-thread free lists
+ */
+#if defined(__GNUC__) && !defined(WIN32)
+    #define GBUF_POOL 1
+    #include <pthread.h>
+#endif
+
 /****************************************************************
  *         Constants
  ****************************************************************/
+#define GBUF_POOL_CLASSES       9   /* capacities 256, 512, ... 64K */
+#define GBUF_POOL_MIN_SHIFT     8
 
 /****************************************************************
  *         Structures
  ****************************************************************/
+/*
+ *  Segment of a segmented gbuffer
+ */
+typedef struct {
+    DL_ITEM_FIELDS
+    GBUFFER *chunk;     // chunk of data, own or shared by reference
+    size_t start;       // offset of segment data in chunk
+    size_t len;         // bytes of segment
+} gbuf_seg_t;
+
+#define SEG_DATA(seg) ((seg)->chunk->data + (seg)->start)
+
+#ifdef GBUF_POOL
+/*
+ *  Free gbuffers of a thread, linked by __next__
+ */
+typedef struct {
+    uint32_t generation;    // gbmem generation of the gbuffers
+    BOOL registered;        // thread exit destructor registered
+    GBUFFER *list[GBUF_POOL_CLASSES];
+    size_t count[GBUF_POOL_CLASSES];
+} gbuf_pool_t;
+#endif
 
 /****************************************************************
  *         Data
  ****************************************************************/
 PRIVATE BOOL __trace_create_delete__ = 0;
 
+PRIVATE size_t __gbuf_pool_high_water__ = 0;   /* the pool is opt-in */
+
+#ifdef GBUF_MMAP
+PRIVATE BOOL __spill_mmap__ = TRUE;
+PRIVATE char __spill_dir__[PATH_MAX] = {0};
+PRIVATE size_t __max_total_spill__ = 0;
+PRIVATE volatile size_t __total_spill__ = 0;   /* atomic */
+#endif
+#ifdef GBUF_POOL
+PRIVATE __thread gbuf_pool_t gbuf_pool;
+PRIVATE pthread_key_t gbuf_pool_key;
+PRIVATE pthread_once_t gbuf_pool_key_once = PTHREAD_ONCE_INIT;
+
+/* stats, atomic */
+PRIVATE volatile uint64_t __gbuf_pool_gets__ = 0;
+PRIVATE volatile uint64_t __gbuf_pool_hits__ = 0;
+PRIVATE volatile uint64_t __gbuf_pool_puts__ = 0;
+PRIVATE volatile uint64_t __gbuf_pool_drops__ = 0;
+PRIVATE volatile size_t __gbuf_pool_size__ = 0;
+#endif
+
 /****************************************************************
  *         Prototypes
  ****************************************************************/
+PRIVATE gbuf_seg_t *_seg_rd(GBUFFER *gbuf);
+PRIVATE void _seg_rd_advance(GBUFFER *gbuf, size_t len);
+PRIVATE size_t _seg_append(GBUFFER *gbuf, const char *bf, size_t len);
+PRIVATE gbuf_seg_t *_seg_wr(GBUFFER *gbuf, size_t need);
+PRIVATE void _seg_free(void *seg_);
+PRIVATE GBUFFER *_gbuf_pool_get(size_t data_size);
+PRIVATE BOOL _gbuf_pool_put(GBUFFER *gbuf);
+PRIVATE size_t _gbuf_pool_capacity(size_t data_size);
+#ifdef GBUF_MMAP
+PRIVATE BOOL _gbuf_mmap_spill(GBUFFER *gbuf, size_t more);
+PRIVATE BOOL _gbuf_mmap_grow(GBUFFER *gbuf, size_t more);
+PRIVATE void _gbuf_mmap_free(GBUFFER *gbuf);
+#endif
 
 /***************************************************************************
  *  Crea un gbuf de tamaño de datos 'data_size'
@@ -48,27 +118,116 @@ PUBLIC GBUFFER * gbuf_create(
 {
     GBUFFER *gbuf;
 
+    /*---------------------------------*
+     *   Recycle a gbuffer
+     *---------------------------------*/
+    gbuf = _gbuf_pool_get(data_size);
+
     /*---------------------------------*
      *   Alloc memory
      *---------------------------------*/
-    gbuf = gbmem_malloc(sizeof(struct _GBUFFER));
     if(!gbuf) {
+        gbuf = gbmem_malloc(sizeof(struct _GBUFFER));
+        if(!gbuf) {
+            log_error(LOG_OPT_TRACE_STACK,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "process",      "%s", get_process_name(),
+                "hostname",     "%s", get_host_name(),
+                "pid",          "%d", get_pid(),
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "bmem_malloc() return NULL",
+                "sizeof",       "%d", sizeof(struct _GBUFFER),
+                NULL
+            );
+            return (GBUFFER *)0;
+        }
+
+        /*
+         *  With pool the capacity is rounded to his class, to be recycled
+         */
+        size_t data_capacity = _gbuf_pool_capacity(data_size);
+        gbuf->data = gbmem_malloc(data_capacity+1);
+        if(!gbuf->data) {
+            log_error(LOG_OPT_TRACE_STACK,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "process",      "%s", get_process_name(),
+                "hostname",     "%s", get_host_name(),
+                "pid",          "%d", get_pid(),
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "bmem_malloc() return NULL",
+                "data_size",    "%d", data_size,
+                NULL
+            );
+            gbmem_free(gbuf);
+            return (GBUFFER *)0;
+        }
+        gbuf->data_capacity = data_capacity;
+    }
+
+    /*---------------------------------*
+     *   Inicializa atributos
+     *---------------------------------*/
+    gbuf->data_size = data_size;
+    gbuf->max_memory_size = max_memory_size;
+    gbuf->max_disk_size = max_disk_size;
+    gbuf->encoding = encoding;
+
+    gbuf->tail = 0;
+    gbuf->curp = 0;
+    gbuf->refcount = 1;
+
+    /*----------------------------*
+     *   Retorna pointer a gbuf
+     *----------------------------*/
+    if(__trace_create_delete__) {
+        log_debug(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_CREATION_DELETION_GBUFFERS,
+            "msg",          "%s", "Creating gbuffer",
+            "pointer",      "%p", gbuf,
+            "data_size",    "%d", data_size,
+            NULL);
+    }
+
+    return gbuf;
+}
+
+/***************************************************************************
+ *  Create a segmented gbuf, a chain of chunks of 'chunk_size'
+ *  Retorna NULL if error
+ ***************************************************************************/
+PUBLIC GBUFFER * gbuf_create_segmented(
+    size_t chunk_size,
+    size_t max_memory_size,
+    gbuf_encoding encoding)
+{
+    GBUFFER *gbuf;
+
+    if(chunk_size == 0) {
         log_error(LOG_OPT_TRACE_STACK,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
             "process",      "%s", get_process_name(),
             "hostname",     "%s", get_host_name(),
             "pid",          "%d", get_pid(),
-            "msgset",       "%s", MSGSET_MEMORY_ERROR,
-            "msg",          "%s", "bmem_malloc() return NULL",
-            "sizeof",       "%d", sizeof(struct _GBUFFER),
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "chunk_size is ZERO",
             NULL
         );
         return (GBUFFER *)0;
     }
 
-    gbuf->data = gbmem_malloc(data_size+1);
-    if(!gbuf->data) {
+    /*---------------------------------*
+     *   Alloc memory
+     *---------------------------------*/
+    gbuf = gbmem_malloc(sizeof(struct _GBUFFER));
+    if(!gbuf) {
         log_error(LOG_OPT_TRACE_STACK,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -77,28 +236,27 @@ PUBLIC GBUFFER * gbuf_create(
             "pid",          "%d", get_pid(),
             "msgset",       "%s", MSGSET_MEMORY_ERROR,
             "msg",          "%s", "bmem_malloc() return NULL",
-            "data_size",    "%d", data_size,
+            "sizeof",       "%d", sizeof(struct _GBUFFER),
             NULL
         );
-        gbmem_free(gbuf);
         return (GBUFFER *)0;
     }
 
     /*---------------------------------*
      *   Inicializa atributos
      *---------------------------------*/
-    gbuf->data_size = data_size;
+    dl_init(&gbuf->dl_gbuffers);
+    gbuf->segmented = TRUE;
+    gbuf->chunk_size = chunk_size;
+    gbuf->data_size = chunk_size;
     gbuf->max_memory_size = max_memory_size;
-    gbuf->max_disk_size = max_disk_size;
+    gbuf->max_disk_size = 0;
     gbuf->encoding = encoding;
 
     gbuf->tail = 0;
     gbuf->curp = 0;
     gbuf->refcount = 1;
 
-    /*----------------------------*
-     *   Retorna pointer a gbuf
-     *----------------------------*/
     if(__trace_create_delete__) {
         log_debug(0,
             "gobj",         "%s", __FILE__,
@@ -107,9 +265,9 @@ PUBLIC GBUFFER * gbuf_create(
             "hostname",     "%s", get_host_name(),
             "pid",          "%d", get_pid(),
             "msgset",       "%s", MSGSET_CREATION_DELETION_GBUFFERS,
-            "msg",          "%s", "Creating gbuffer",
+            "msg",          "%s", "Creating segmented gbuffer",
             "pointer",      "%p", gbuf,
-            "data_size",    "%d", data_size,
+            "chunk_size",   "%d", (int)chunk_size,
             NULL);
     }
 
@@ -183,6 +341,13 @@ PRIVATE BOOL _gbuf_realloc(GBUFFER *gbuf, size_t need_size)
     }
 
     more = gbuf->data_size + MAX(gbuf->data_size, need_size);
+
+#ifdef GBUF_MMAP
+    if(gbuf->mmap_mode) {
+        return _gbuf_mmap_grow(gbuf, more);
+    }
+#endif
+
     if(more > gbuf->max_memory_size) {
         if(gbuf->max_disk_size < gbuf->max_memory_size || more > gbuf->max_disk_size) {
             /*
@@ -203,6 +368,16 @@ PRIVATE BOOL _gbuf_realloc(GBUFFER *gbuf, size_t need_size)
             );
             return FALSE;
         }
+
+#ifdef GBUF_MMAP
+        /*
+         *  Spill to mmap'ed file, keeping the pointer access
+         */
+        if(__spill_mmap__ && _gbuf_mmap_spill(gbuf, more)) {
+            return TRUE;
+        }
+#endif
+
         /*
          *  Create temporary file.
          */
@@ -290,6 +465,7 @@ PRIVATE BOOL _gbuf_realloc(GBUFFER *gbuf, size_t need_size)
     }
     gbuf->data = new_buf;
     gbuf->data_size = more;
+    gbuf->data_capacity = more;
     if(__trace_create_delete__) {
         log_debug(0,
             "gobj",         "%s", __FILE__,
@@ -307,6 +483,289 @@ PRIVATE BOOL _gbuf_realloc(GBUFFER *gbuf, size_t need_size)
     return TRUE;
 }
 
+#ifdef GBUF_MMAP
+/***************************************************************************
+ *  Size of map for a data size, with the final null, rounded to pages
+ *  but not beyond max_disk_size.
+ ***************************************************************************/
+PRIVATE size_t _gbuf_mmap_size(GBUFFER *gbuf, size_t data_size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t map_size = ((data_size + 1) + page - 1) / page * page;
+    if(map_size > gbuf->max_disk_size + 1) {
+        map_size = gbuf->max_disk_size + 1;
+    }
+    return map_size;
+}
+
+/***************************************************************************
+ *  Open the spill file: a unlinked file in spill dir or a memfd
+ ***************************************************************************/
+PRIVATE int _gbuf_spill_fd(void)
+{
+    int fd = -1;
+    if(!*__spill_dir__) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+        fd = memfd_create("gbuffer", MFD_CLOEXEC);
+        if(fd >= 0) {
+            return fd;
+        }
+#endif
+    }
+
+    char path[PATH_MAX];
+    int len = snprintf(path, sizeof(path), "%s/gbuffer-XXXXXX", *__spill_dir__? __spill_dir__ : "/tmp");
+    if(len < 0 || len >= (int)sizeof(path)) {
+        // mkstemp() needs the XXXXXX template complete
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = mkstemp(path);
+    if(fd >= 0) {
+        unlink(path);
+    }
+    return fd;
+}
+
+/***************************************************************************
+ *  Move the data to a mmap'ed file with space for 'more' bytes
+ ***************************************************************************/
+PRIVATE BOOL _gbuf_mmap_spill(GBUFFER *gbuf, size_t more)
+{
+    size_t map_size = _gbuf_mmap_size(gbuf, more);
+
+    if(__max_total_spill__ && __total_spill__ + map_size > __max_total_spill__) {
+        log_error(0,
+            "gobj",             "%s", __FILE__,
+            "function",         "%s", __FUNCTION__,
+            "process",          "%s", get_process_name(),
+            "hostname",         "%s", get_host_name(),
+            "pid",              "%d", get_pid(),
+            "msgset",           "%s", MSGSET_INTERNAL_ERROR,
+            "msg",              "%s", "MAXIMUM TOTAL SPILL REACHED",
+            "total_spill",      "%ld", (long)__total_spill__,
+            "max_total_spill",  "%ld", (long)__max_total_spill__,
+            NULL
+        );
+        return FALSE;
+    }
+
+    int fd = _gbuf_spill_fd();
+    if(fd < 0) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "Cannot create spill file",
+            "spill_dir",    "%s", __spill_dir__,
+            "errno",        "%d", errno,
+            "strerror",     "%s", strerror(errno),
+            NULL
+        );
+        return FALSE;
+    }
+    if(ftruncate(fd, map_size) < 0) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "ftruncate() FAILED",
+            "size",         "%ld", (long)map_size,
+            "errno",        "%d", errno,
+            "strerror",     "%s", strerror(errno),
+            NULL
+        );
+        close(fd);
+        return FALSE;
+    }
+    char *map = mmap(0, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "mmap() FAILED",
+            "size",         "%ld", (long)map_size,
+            "errno",        "%d", errno,
+            "strerror",     "%s", strerror(errno),
+            NULL
+        );
+        close(fd);
+        return FALSE;
+    }
+
+    memcpy(map, gbuf->data, gbuf->tail + 1);
+    gbmem_free(gbuf->data);
+    gbuf->data = map;
+    gbuf->data_size = map_size - 1;
+    gbuf->data_capacity = gbuf->data_size;
+    gbuf->mmap_mode = TRUE;
+    gbuf->mmap_fd = fd;
+    __sync_add_and_fetch(&__total_spill__, map_size);
+
+    if(__trace_create_delete__) {
+        log_debug(0,
+            "gobj",             "%s", __FILE__,
+            "function",         "%s", __FUNCTION__,
+            "process",          "%s", get_process_name(),
+            "hostname",         "%s", get_host_name(),
+            "pid",              "%d", get_pid(),
+            "msgset",           "%s", MSGSET_CREATION_DELETION_GBUFFERS,
+            "msg",              "%s", "Reallocationg gbuffer to MMAP",
+            "pointer",          "%p", gbuf,
+            "more",             "%ld", more,
+            "max_disk_size",    "%ld", gbuf->max_disk_size,
+            "max_memory_size",  "%ld", gbuf->max_memory_size,
+            NULL
+        );
+    }
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Grow the mmap'ed file, till max_disk_size
+ ***************************************************************************/
+PRIVATE BOOL _gbuf_mmap_grow(GBUFFER *gbuf, size_t more)
+{
+    if(more > gbuf->max_disk_size) {
+        more = gbuf->max_disk_size;
+    }
+    size_t old_size = gbuf->data_size + 1;
+    size_t map_size = _gbuf_mmap_size(gbuf, more);
+    if(map_size <= old_size) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",             "%s", __FILE__,
+            "function",         "%s", __FUNCTION__,
+            "process",          "%s", get_process_name(),
+            "hostname",         "%s", get_host_name(),
+            "pid",              "%d", get_pid(),
+            "msgset",           "%s", MSGSET_INTERNAL_ERROR,
+            "msg",              "%s", "MAXIMUM SPACE REACHED",
+            "more",             "%ld", more,
+            "max_disk_size",    "%ld", gbuf->max_disk_size,
+            NULL
+        );
+        return FALSE;
+    }
+    if(__max_total_spill__ && __total_spill__ + map_size - old_size > __max_total_spill__) {
+        log_error(0,
+            "gobj",             "%s", __FILE__,
+            "function",         "%s", __FUNCTION__,
+            "process",          "%s", get_process_name(),
+            "hostname",         "%s", get_host_name(),
+            "pid",              "%d", get_pid(),
+            "msgset",           "%s", MSGSET_INTERNAL_ERROR,
+            "msg",              "%s", "MAXIMUM TOTAL SPILL REACHED",
+            "total_spill",      "%ld", (long)__total_spill__,
+            "max_total_spill",  "%ld", (long)__max_total_spill__,
+            NULL
+        );
+        return FALSE;
+    }
+
+    if(ftruncate(gbuf->mmap_fd, map_size) < 0) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "ftruncate() FAILED",
+            "size",         "%ld", (long)map_size,
+            "errno",        "%d", errno,
+            "strerror",     "%s", strerror(errno),
+            NULL
+        );
+        return FALSE;
+    }
+#ifdef __linux__
+    char *map = mremap(gbuf->data, old_size, map_size, MREMAP_MAYMOVE);
+#else
+    char *map = mmap(0, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, gbuf->mmap_fd, 0);
+#endif
+    if(map == MAP_FAILED) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "mremap() FAILED",
+            "size",         "%ld", (long)map_size,
+            "errno",        "%d", errno,
+            "strerror",     "%s", strerror(errno),
+            NULL
+        );
+        return FALSE;
+    }
+#ifndef __linux__
+    munmap(gbuf->data, old_size);
+#endif
+    gbuf->data = map;
+    gbuf->data_size = map_size - 1;
+    gbuf->data_capacity = gbuf->data_size;
+    __sync_add_and_fetch(&__total_spill__, map_size - old_size);
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Unmap and close the spill file
+ ***************************************************************************/
+PRIVATE void _gbuf_mmap_free(GBUFFER *gbuf)
+{
+    size_t map_size = gbuf->data_size + 1;
+    munmap(gbuf->data, map_size);
+    close(gbuf->mmap_fd);
+    __sync_sub_and_fetch(&__total_spill__, map_size);
+    gbuf->data = 0;
+    gbuf->mmap_fd = -1;
+    gbuf->mmap_mode = FALSE;
+}
+#endif
+
+/***************************************************************************
+ *  Configure the spill of gbuffers greater than max_memory_size
+ ***************************************************************************/
+PUBLIC int gbuf_set_spill(
+    BOOL use_mmap,
+    const char *spill_dir,
+    size_t max_total_spill)
+{
+#ifdef GBUF_MMAP
+    if(spill_dir && strlen(spill_dir) + sizeof("/gbuffer-XXXXXX") > sizeof(__spill_dir__)) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "spill_dir too long",
+            "spill_dir",    "%s", spill_dir,
+            NULL
+        );
+        return -1;
+    }
+    __spill_mmap__ = use_mmap?TRUE:FALSE;
+    snprintf(__spill_dir__, sizeof(__spill_dir__), "%s", spill_dir?spill_dir:"");
+    __max_total_spill__ = max_total_spill;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 /***************************************************************************
  *    Elimina paquete
  ***************************************************************************/
@@ -344,112 +803,726 @@ PUBLIC void gbuf_remove(GBUFFER *gbuf)
         gbmem_free((char *)gbuf->label);
         gbuf->label = 0;
     }
-    if(gbuf->data) {
-        gbmem_free(gbuf->data);
-        gbuf->data = 0;
+    if(gbuf->segmented) {
+        dl_flush(&gbuf->dl_gbuffers, _seg_free);
+    }
+    if(gbuf->line) {
+        gbmem_free(gbuf->line);
+        gbuf->line = 0;
     }
     if(gbuf->tmpfile) {
         fclose(gbuf->tmpfile);
         gbuf->tmpfile = 0;
     }
+#ifdef GBUF_MMAP
+    if(gbuf->mmap_mode) {
+        _gbuf_mmap_free(gbuf);
+    }
+#endif
+
+    /*-----------------------*
+     *  Recycle
+     *-----------------------*/
+    if(_gbuf_pool_put(gbuf)) {
+        return;
+    }
+
+    if(gbuf->data) {
+        gbmem_free(gbuf->data);
+        gbuf->data = 0;
+    }
+    gbmem_free(gbuf);
+}
+
+#ifdef GBUF_POOL
+/***************************************************************************
+ *  Capacity class of a data size, -1 if greater than the biggest class.
+ *  With round_up FALSE only a data size equal to a class size has class.
+ ***************************************************************************/
+PRIVATE int _gbuf_pool_class(size_t data_size, BOOL round_up)
+{
+    for(int i=0; i<GBUF_POOL_CLASSES; i++) {
+        size_t class_size = (size_t)1 << (GBUF_POOL_MIN_SHIFT + i);
+        if(round_up) {
+            if(data_size <= class_size) {
+                return i;
+            }
+        } else {
+            if(data_size == class_size) {
+                return i;
+            }
+            if(data_size < class_size) {
+                return -1;
+            }
+        }
+    }
+    return -1;
+}
+
+/***************************************************************************
+ *  Free the gbuffers of a thread pool
+ ***************************************************************************/
+PRIVATE void _gbuf_pool_flush(gbuf_pool_t *pool)
+{
+    BOOL valid = (pool->generation == gbmem_generation())?TRUE:FALSE;
+    for(int i=0; i<GBUF_POOL_CLASSES; i++) {
+        GBUFFER *gbuf = pool->list[i];
+        while(gbuf) {
+            GBUFFER *next = (GBUFFER *)gbuf->__next__;
+            if(valid) {
+                // else the memory is gone with a gbmem shutdown
+                gbmem_free(gbuf->data);
+                gbmem_free(gbuf);
+            }
+            gbuf = next;
+        }
+        __sync_sub_and_fetch(&__gbuf_pool_size__, pool->count[i]);
+        pool->list[i] = 0;
+        pool->count[i] = 0;
+    }
+}
+
+/***************************************************************************
+ *  Thread exit: free the recycled gbuffers
+ ***************************************************************************/
+PRIVATE void _gbuf_pool_destructor(void *pool)
+{
+    _gbuf_pool_flush(pool);
+}
+
+PRIVATE void _gbuf_pool_key_create(void)
+{
+    pthread_key_create(&gbuf_pool_key, _gbuf_pool_destructor);
+}
+
+/***************************************************************************
+ *  Return the pool of current thread
+ ***************************************************************************/
+PRIVATE gbuf_pool_t *_gbuf_pool(void)
+{
+    gbuf_pool_t *pool = &gbuf_pool;
+    if(pool->generation != gbmem_generation()) {
+        /*
+         *  New thread or new gbmem startup, the old gbuffers are not valid
+         */
+        _gbuf_pool_flush(pool);
+        pool->generation = gbmem_generation();
+    }
+    if(!pool->registered) {
+        pthread_once(&gbuf_pool_key_once, _gbuf_pool_key_create);
+        pthread_setspecific(gbuf_pool_key, pool);
+        pool->registered = TRUE;
+    }
+    return pool;
+}
+#endif
+
+/***************************************************************************
+ *  Get a recycled gbuffer with capacity for data_size.
+ *  The gbuffer is clean as new, with data and data_capacity set.
+ ***************************************************************************/
+PRIVATE GBUFFER *_gbuf_pool_get(size_t data_size)
+{
+#ifdef GBUF_POOL
+    if(!__gbuf_pool_high_water__) {
+        return 0;
+    }
+    int cls = _gbuf_pool_class(data_size, TRUE);
+    if(cls < 0) {
+        return 0;
+    }
+    __sync_add_and_fetch(&__gbuf_pool_gets__, 1);
+
+    gbuf_pool_t *pool = _gbuf_pool();
+    GBUFFER *gbuf = pool->list[cls];
+    if(!gbuf) {
+        return 0;
+    }
+    pool->list[cls] = (GBUFFER *)gbuf->__next__;
+    pool->count[cls]--;
+    gbuf->__next__ = 0;
+    __sync_sub_and_fetch(&__gbuf_pool_size__, 1);
+    __sync_add_and_fetch(&__gbuf_pool_hits__, 1);
+    return gbuf;
+#else
+    return 0;
+#endif
+}
+
+/***************************************************************************
+ *  Return the capacity to allocate for data_size
+ ***************************************************************************/
+PRIVATE size_t _gbuf_pool_capacity(size_t data_size)
+{
+#ifdef GBUF_POOL
+    if(__gbuf_pool_high_water__) {
+        int cls = _gbuf_pool_class(data_size, TRUE);
+        if(cls >= 0) {
+            return (size_t)1 << (GBUF_POOL_MIN_SHIFT + cls);
+        }
+    }
+#endif
+    return data_size;
+}
+
+/***************************************************************************
+ *  Put a released gbuffer in the pool, reset as new.
+ *  Return FALSE if it's not recycled.
+ ***************************************************************************/
+PRIVATE BOOL _gbuf_pool_put(GBUFFER *gbuf)
+{
+#ifdef GBUF_POOL
+    if(!__gbuf_pool_high_water__ || !gbuf->data || gbuf->file_mode || gbuf->segmented) {
+        return FALSE;
+    }
+    int cls = _gbuf_pool_class(gbuf->data_capacity, FALSE);
+    if(cls < 0) {
+        return FALSE;
+    }
+    gbuf_pool_t *pool = _gbuf_pool();
+    if(pool->count[cls] >= __gbuf_pool_high_water__) {
+        __sync_add_and_fetch(&__gbuf_pool_drops__, 1);
+        return FALSE;
+    }
+
+    /*
+     *  Reset: data zeroed as new allocated memory, only the written bytes
+     */
+    char *data = gbuf->data;
+    size_t data_capacity = gbuf->data_capacity;
+    size_t written = MAX(gbuf->tail, gbuf->tail_high);
+    memset(data, 0, MIN(written, data_capacity) + 1);
+    memset(gbuf, 0, sizeof(struct _GBUFFER));
+    gbuf->data = data;
+    gbuf->data_capacity = data_capacity;
+
+    gbuf->__next__ = (struct dl_item_s *)pool->list[cls];
+    pool->list[cls] = gbuf;
+    pool->count[cls]++;
+    __sync_add_and_fetch(&__gbuf_pool_size__, 1);
+    __sync_add_and_fetch(&__gbuf_pool_puts__, 1);
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+/***************************************************************************
+ *  Set the maximum of free gbuffers by class and thread, 0 disables the pool
+ ***************************************************************************/
+PUBLIC void gbuf_pool_set_high_water(size_t high_water)
+{
+    __gbuf_pool_high_water__ = high_water;
+    if(!high_water) {
+        gbuf_pool_flush();
+    }
+}
+
+/***************************************************************************
+ *  Free the recycled gbuffers of current thread
+ ***************************************************************************/
+PUBLIC void gbuf_pool_flush(void)
+{
+#ifdef GBUF_POOL
+    _gbuf_pool_flush(&gbuf_pool);
+#endif
+}
+
+/***************************************************************************
+ *  Return the stats of the pool of gbuffers
+ ***************************************************************************/
+PUBLIC json_t *gbuf_pool_stats(void)
+{
+#ifdef GBUF_POOL
+    json_int_t gets = (json_int_t)__gbuf_pool_gets__;
+    json_int_t hits = (json_int_t)__gbuf_pool_hits__;
+    return json_pack("{s:b, s:I, s:I, s:I, s:I, s:I, s:I, s:I}",
+        "enabled", __gbuf_pool_high_water__?1:0,
+        "high_water", (json_int_t)__gbuf_pool_high_water__,
+        "gets", gets,
+        "hits", hits,
+        "hit_rate", gets? hits*100/gets : (json_int_t)0,    // %
+        "puts", (json_int_t)__gbuf_pool_puts__,
+        "drops", (json_int_t)__gbuf_pool_drops__,
+        "free_gbuffers", (json_int_t)__gbuf_pool_size__
+    );
+#else
+    return json_pack("{s:b}", "enabled", 0);
+#endif
+}
+
+/***************************************************************************
+ *    Incr ref
+ ***************************************************************************/
+PUBLIC void gbuf_incref(GBUFFER *gbuf)
+{
+    if(!gbuf || gbuf->refcount <= 0) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "BAD gbuf_incref()",
+            NULL
+        );
+        return;
+    }
+    ++(gbuf->refcount);
+}
+
+/***************************************************************************
+ *    Decr ref
+ ***************************************************************************/
+PUBLIC void gbuf_decref(GBUFFER *gbuf)
+{
+    if(!gbuf || gbuf->refcount <= 0) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "BAD gbuf_decref()",
+            NULL
+        );
+        return;
+    }
+    --(gbuf->refcount);
+    if(gbuf->refcount == 0)
+        gbuf_remove(gbuf);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC void gbuf_set_on_destroy_gbuf(
+    GBUFFER *gbuf,
+    int (*on_destroy_gbuf)(void *param1, void *param2, void *param3, void *param4),
+    void *param1,
+    void *param2,
+    void *param3,
+    void *param4
+)
+{
+    gbuf->on_destroy_gbuf = on_destroy_gbuf;
+    gbuf->param1 = param1;
+    gbuf->param2 = param2;
+    gbuf->param3 = param3;
+    gbuf->param4 = param4;
+}
+
+/***************************************************************************
+ *    Devuelve puntero a la actual posicion de salida de datos
+ ***************************************************************************/
+PUBLIC void * gbuf_cur_rd_pointer(GBUFFER *gbuf)
+{
+    char *p;
+
+    if(!gbuf) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "gbuf is NULL",
+            NULL
+        );
+        return 0;
+    }
+    if(gbuf->segmented) {
+        gbuf_seg_t *seg = _seg_rd(gbuf);
+        return seg? SEG_DATA(seg) + gbuf->rd_seg_offset : 0;
+    }
+    p = gbuf->data;
+    p += gbuf->curp;
+    return p;
+}
+
+/***************************************************************************
+ *    Devuelve puntero a la actual posicion de entrada de datos
+ ***************************************************************************/
+PRIVATE inline void * _gbuf_cur_wr_pointer(GBUFFER *gbuf)
+{
+    return gbuf->data + gbuf->tail;
+}
+
+/***************************************************************************
+ *  Return the line buffer with space for 'size' bytes and final null,
+ *  the current content is kept.
+ ***************************************************************************/
+PRIVATE char *_gbuf_line_buffer(GBUFFER *gbuf, size_t size)
+{
+    if(gbuf->line_size < size + 1) {
+        char *line = gbmem_realloc(gbuf->line, size + 1);
+        if(!line) {
+            log_error(LOG_OPT_TRACE_STACK,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "process",      "%s", get_process_name(),
+                "hostname",     "%s", get_host_name(),
+                "pid",          "%d", get_pid(),
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "gbmem_realloc() return NULL",
+                "size",         "%d", (int)size,
+                NULL
+            );
+            return 0;
+        }
+        gbuf->line = line;
+        gbuf->line_size = size + 1;
+    }
+    return gbuf->line;
+}
+
+
+
+
+                /***************************
+                 *      Segments
+                 ***************************/
+
+
+
+
+/***************************************************************************
+ *  Free a segment, used by dl_flush()
+ ***************************************************************************/
+PRIVATE void _seg_free(void *seg_)
+{
+    gbuf_seg_t *seg = seg_;
+    gbuf_decref(seg->chunk);
+    gbmem_free(seg);
+}
+
+/***************************************************************************
+ *  Add a segment at the end of chain.
+ *  chunk is owned (decref'ed if error)
+ ***************************************************************************/
+PRIVATE gbuf_seg_t *_seg_add(GBUFFER *gbuf, GBUFFER *chunk, size_t start, size_t len)
+{
+    gbuf_seg_t *seg = gbmem_malloc(sizeof(gbuf_seg_t));
+    if(!seg) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() return NULL",
+            "sizeof",       "%d", sizeof(gbuf_seg_t),
+            NULL
+        );
+        gbuf_decref(chunk);
+        return 0;
+    }
+    seg->chunk = chunk;
+    seg->start = start;
+    seg->len = len;
+    dl_add(&gbuf->dl_gbuffers, seg);
+    return seg;
+}
+
+/***************************************************************************
+ *  Return the segment where to write at least 'need' bytes.
+ *  The last segment is used if his chunk is not shared and it's in his tail,
+ *  else a new chunk is added.
+ ***************************************************************************/
+PRIVATE gbuf_seg_t *_seg_wr(GBUFFER *gbuf, size_t need)
+{
+    gbuf_seg_t *seg = dl_last(&gbuf->dl_gbuffers);
+    if(seg &&
+            seg->chunk->refcount == 1 &&
+            !seg->chunk->file_mode &&
+            seg->start + seg->len == seg->chunk->tail &&
+            gbuf_freebytes(seg->chunk) >= need) {
+        return seg;
+    }
+
+    size_t size = MAX(gbuf->chunk_size, need);
+    GBUFFER *chunk = gbuf_create(size, size, 0, gbuf->encoding);
+    if(!chunk) {
+        return 0;
+    }
+    return _seg_add(gbuf, chunk, 0, 0);
+}
+
+/***************************************************************************
+ *  Free space of a segmented gbuf
+ ***************************************************************************/
+PRIVATE size_t _seg_freebytes(GBUFFER *gbuf)
+{
+    if(gbuf->tail >= gbuf->max_memory_size) {
+        return 0;
+    }
+    return gbuf->max_memory_size - gbuf->tail;
+}
+
+/***************************************************************************
+ *  Return the current read segment, skipping the consumed segments
+ ***************************************************************************/
+PRIVATE gbuf_seg_t *_seg_rd(GBUFFER *gbuf)
+{
+    gbuf_seg_t *seg = gbuf->rd_seg;
+    if(!seg) {
+        seg = dl_first(&gbuf->dl_gbuffers);
+        gbuf->rd_seg = seg;
+        gbuf->rd_seg_offset = 0;
+    }
+    while(seg && gbuf->rd_seg_offset >= seg->len) {
+        gbuf_seg_t *next = dl_next(seg);
+        if(!next) {
+            break;
+        }
+        seg = next;
+        gbuf->rd_seg = seg;
+        gbuf->rd_seg_offset = 0;
+    }
+    return seg;
+}
+
+/***************************************************************************
+ *  Pop 'len' bytes
+ ***************************************************************************/
+PRIVATE void _seg_rd_advance(GBUFFER *gbuf, size_t len)
+{
+    while(len > 0) {
+        gbuf_seg_t *seg = _seg_rd(gbuf);
+        if(!seg) {
+            break;
+        }
+        size_t n = MIN(len, seg->len - gbuf->rd_seg_offset);
+        if(n == 0) {
+            break;
+        }
+        gbuf->rd_seg_offset += n;
+        gbuf->curp += n;
+        len -= n;
+    }
+}
+
+/***************************************************************************
+ *  Copy 'len' bytes crossing chunks, and pop them
+ ***************************************************************************/
+PRIVATE size_t _seg_read(GBUFFER *gbuf, char *bf, size_t len)
+{
+    size_t readed = 0;
+    while(readed < len) {
+        gbuf_seg_t *seg = _seg_rd(gbuf);
+        if(!seg) {
+            break;
+        }
+        size_t n = MIN(len - readed, seg->len - gbuf->rd_seg_offset);
+        if(n == 0) {
+            break;
+        }
+        memcpy(bf + readed, SEG_DATA(seg) + gbuf->rd_seg_offset, n);
+        gbuf->rd_seg_offset += n;
+        gbuf->curp += n;
+        readed += n;
+    }
+    return readed;
+}
+
+/***************************************************************************
+ *  Return a not segmented gbuf with the data to read, without pop them.
+ *  A not segmented gbuf is returned incref'ed.
+ ***************************************************************************/
+PRIVATE GBUFFER *_gbuf_flat(GBUFFER *gbuf) // Return MUST be decref
+{
+    if(!gbuf->segmented) {
+        gbuf_incref(gbuf);
+        return gbuf;
+    }
+    size_t len = gbuf_leftbytes(gbuf);
+    GBUFFER *flat = gbuf_create(MAX(len, 1), MAX(len, 1), 0, gbuf->encoding);
+    if(!flat) {
+        // Error already logged
+        return 0;
+    }
 
-    gbmem_free(gbuf);
+    void *rd_seg = gbuf->rd_seg;
+    size_t rd_seg_offset = gbuf->rd_seg_offset;
+    size_t curp = gbuf->curp;
+    flat->tail = _seg_read(gbuf, flat->data, len);
+    flat->data[flat->tail] = 0;
+    gbuf->rd_seg = rd_seg;
+    gbuf->rd_seg_offset = rd_seg_offset;
+    gbuf->curp = curp;
+
+    return flat;
 }
 
 /***************************************************************************
- *    Incr ref
+ *  The chunk of segment is shared: copy his data to a own chunk
  ***************************************************************************/
-PUBLIC void gbuf_incref(GBUFFER *gbuf)
+PRIVATE int _seg_unshare(GBUFFER *gbuf, gbuf_seg_t *seg)
 {
-    if(!gbuf || gbuf->refcount <= 0) {
-        log_error(LOG_OPT_TRACE_STACK,
-            "gobj",         "%s", __FILE__,
-            "function",     "%s", __FUNCTION__,
-            "process",      "%s", get_process_name(),
-            "hostname",     "%s", get_host_name(),
-            "pid",          "%d", get_pid(),
-            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-            "msg",          "%s", "BAD gbuf_incref()",
-            NULL
-        );
-        return;
+    GBUFFER *chunk = gbuf_create(MAX(seg->len, 1), MAX(seg->len, 1), 0, gbuf->encoding);
+    if(!chunk) {
+        // Error already logged
+        return -1;
     }
-    ++(gbuf->refcount);
+    gbuf_append(chunk, SEG_DATA(seg), seg->len);
+    gbuf_decref(seg->chunk);
+    seg->chunk = chunk;
+    seg->start = 0;
+    return 0;
 }
 
 /***************************************************************************
- *    Decr ref
+ *  Append data to the own chunks, adding new chunks when needed
  ***************************************************************************/
-PUBLIC void gbuf_decref(GBUFFER *gbuf)
+PRIVATE size_t _seg_append(GBUFFER *gbuf, const char *bf, size_t len)
 {
-    if(!gbuf || gbuf->refcount <= 0) {
+    size_t written = 0;
+
+    if(len > _seg_freebytes(gbuf)) {
         log_error(LOG_OPT_TRACE_STACK,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
             "process",      "%s", get_process_name(),
             "hostname",     "%s", get_host_name(),
             "pid",          "%d", get_pid(),
-            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-            "msg",          "%s", "BAD gbuf_decref()",
+            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+            "msg",          "%s", "NOT ENOUGH SPACE, append only 'free' bytes",
+            "free",         "%d", (int)_seg_freebytes(gbuf),
+            "needed",       "%d", (int)len,
             NULL
         );
-        return;
+        len = _seg_freebytes(gbuf);
     }
-    --(gbuf->refcount);
-    if(gbuf->refcount == 0)
-        gbuf_remove(gbuf);
-}
 
-/***************************************************************************
- *
- ***************************************************************************/
-PUBLIC void gbuf_set_on_destroy_gbuf(
-    GBUFFER *gbuf,
-    int (*on_destroy_gbuf)(void *param1, void *param2, void *param3, void *param4),
-    void *param1,
-    void *param2,
-    void *param3,
-    void *param4
-)
-{
-    gbuf->on_destroy_gbuf = on_destroy_gbuf;
-    gbuf->param1 = param1;
-    gbuf->param2 = param2;
-    gbuf->param3 = param3;
-    gbuf->param4 = param4;
+    while(written < len) {
+        gbuf_seg_t *seg = _seg_wr(gbuf, 1);
+        if(!seg) {
+            break;
+        }
+        size_t n = MIN(len - written, gbuf_freebytes(seg->chunk));
+        gbuf_append(seg->chunk, (void *)(bf + written), n);
+        seg->len += n;
+        gbuf->tail += n;
+        written += n;
+    }
+    return written;
 }
 
 /***************************************************************************
- *    Devuelve puntero a la actual posicion de salida de datos
+ *  Link the readable data of src to the chain of dst, and pop it from src.
  ***************************************************************************/
-PUBLIC void * gbuf_cur_rd_pointer(GBUFFER *gbuf)
+PRIVATE int _seg_append_gbuf(GBUFFER *dst, GBUFFER *src)
 {
-    char *p;
-
-    if(!gbuf) {
+    size_t ln = gbuf_leftbytes(src);
+    if(ln == 0) {
+        return 0;
+    }
+    if(ln > _seg_freebytes(dst)) {
         log_error(LOG_OPT_TRACE_STACK,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
             "process",      "%s", get_process_name(),
             "hostname",     "%s", get_host_name(),
             "pid",          "%d", get_pid(),
-            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-            "msg",          "%s", "gbuf is NULL",
+            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+            "msg",          "%s", "NOT ENOUGH SPACE",
+            "free",         "%d", (int)_seg_freebytes(dst),
+            "needed",       "%d", (int)ln,
             NULL
         );
+        return -1;
+    }
+
+    if(!src->segmented) {
+        if(ln < dst->chunk_size) {
+            /*
+             *  Small data, copy it
+             */
+            if(_seg_append(dst, gbuf_cur_rd_pointer(src), ln) != ln) {
+                return -1;
+            }
+        } else {
+            gbuf_incref(src);
+            if(!_seg_add(dst, src, src->curp, ln)) {
+                return -1;
+            }
+            dst->tail += ln;
+        }
+        src->curp += ln;
         return 0;
     }
-    p = gbuf->data;
-    p += gbuf->curp;
-    return p;
+
+    while(gbuf_leftbytes(src) > 0) {
+        gbuf_seg_t *seg = _seg_rd(src);
+        size_t n = seg? seg->len - src->rd_seg_offset : 0;
+        if(n == 0) {
+            break;
+        }
+        gbuf_incref(seg->chunk);
+        if(!_seg_add(dst, seg->chunk, seg->start + src->rd_seg_offset, n)) {
+            return -1;
+        }
+        dst->tail += n;
+        _seg_rd_advance(src, n);
+    }
+    return 0;
 }
 
 /***************************************************************************
- *    Devuelve puntero a la actual posicion de entrada de datos
+ *  Match pattern at offset of segment, crossing chunks
  ***************************************************************************/
-PRIVATE inline void * _gbuf_cur_wr_pointer(GBUFFER *gbuf)
+PRIVATE BOOL _seg_match(gbuf_seg_t *seg, size_t offset, const char *pattern, size_t len)
 {
-    return gbuf->data + gbuf->tail;
+    while(len > 0 && seg) {
+        size_t n = MIN(len, seg->len - offset);
+        if(memcmp(SEG_DATA(seg) + offset, pattern, n)!=0) {
+            return FALSE;
+        }
+        pattern += n;
+        len -= n;
+        seg = dl_next(seg);
+        offset = 0;
+    }
+    return len == 0;
+}
+
+/***************************************************************************
+ *  Find pattern in a segmented gbuf, put read pointer in found pattern
+ ***************************************************************************/
+PRIVATE void *_seg_find(GBUFFER *gbuf, const char *pattern, size_t pattern_len)
+{
+    if(pattern_len == 0 || gbuf_leftbytes(gbuf) < pattern_len) {
+        return 0;
+    }
+
+    gbuf_seg_t *seg = _seg_rd(gbuf);
+    size_t offset = gbuf->rd_seg_offset;
+    size_t base = gbuf->curp - offset;  // position of segment start
+    while(seg) {
+        char *data = SEG_DATA(seg);
+        while(offset < seg->len) {
+            char *p = memchr(data + offset, pattern[0], seg->len - offset);
+            if(!p) {
+                break;
+            }
+            offset = p - data;
+            if(_seg_match(seg, offset, pattern, pattern_len)) {
+                gbuf->rd_seg = seg;
+                gbuf->rd_seg_offset = offset;
+                gbuf->curp = base + offset;
+                return p;
+            }
+            offset++;
+        }
+        base += seg->len;
+        seg = dl_next(seg);
+        offset = 0;
+    }
+    return 0;
 }
 
 
@@ -469,6 +1542,11 @@ PUBLIC void gbuf_reset_rd(GBUFFER *gbuf)
 {
     gbuf->curp = 0;
 
+    if(gbuf->segmented) {
+        gbuf->rd_seg = 0;
+        gbuf->rd_seg_offset = 0;
+    }
+
     if(gbuf->file_mode) {
         gbuf->writting = TRUE; // to force reading
         _set_writting(gbuf, FALSE);
@@ -480,6 +1558,27 @@ PUBLIC void gbuf_reset_rd(GBUFFER *gbuf)
  ***************************************************************************/
 PUBLIC int gbuf_set_rd_offset(GBUFFER *gbuf, size_t position)
 {
+    if(gbuf->segmented) {
+        if(position > gbuf->tail) {
+            log_error(LOG_OPT_TRACE_STACK,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "process",      "%s", get_process_name(),
+                "hostname",     "%s", get_host_name(),
+                "pid",          "%d", get_pid(),
+                "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+                "msg",          "%s", "len GREATER than tail",
+                "len",          "%d", position,
+                "tail",         "%d", gbuf->tail,
+                NULL
+            );
+            return -1;
+        }
+        gbuf_reset_rd(gbuf);
+        _seg_rd_advance(gbuf, position);
+        return 0;
+    }
+
     if(position >= gbuf->data_size) {
         log_error(LOG_OPT_TRACE_STACK,
             "gobj",         "%s", __FILE__,
@@ -519,6 +1618,24 @@ PUBLIC int gbuf_set_rd_offset(GBUFFER *gbuf, size_t position)
  ***************************************************************************/
 PUBLIC int gbuf_ungetc(GBUFFER* gbuf, char c)
 {
+    if(gbuf->segmented) {
+        gbuf_seg_t *seg = gbuf->rd_seg;
+        if(seg && gbuf->rd_seg_offset > 0) { // only inside of current chunk
+            char *p = SEG_DATA(seg) + gbuf->rd_seg_offset - 1;
+            if(*p != c && seg->chunk->refcount > 1) {
+                // Don't write in the data of other gbuffers
+                if(_seg_unshare(gbuf, seg)<0) {
+                    return -1;
+                }
+                p = SEG_DATA(seg) + gbuf->rd_seg_offset - 1;
+            }
+            gbuf->rd_seg_offset--;
+            gbuf->curp--;
+            *p = c;
+        }
+        return 0;
+    }
+
     if(gbuf->curp > 0) {
         gbuf->curp--;
 
@@ -574,6 +1691,32 @@ PUBLIC void * gbuf_get(GBUFFER *gbuf, size_t len)
         return 0;
     }
 
+    /*--------------------------*
+     *  Using chain of chunks
+     *--------------------------*/
+    if(gbuf->segmented) {
+        if(len > gbuf_leftbytes(gbuf)) {
+            return 0;
+        }
+        gbuf_seg_t *seg = _seg_rd(gbuf);
+        if(seg && len <= seg->len - gbuf->rd_seg_offset) {
+            char *p = SEG_DATA(seg) + gbuf->rd_seg_offset;
+            gbuf->rd_seg_offset += len;
+            gbuf->curp += len;
+            return p;
+        }
+        /*
+         *  Crossing chunks, copy to line buffer
+         */
+        char *bf = _gbuf_line_buffer(gbuf, len);
+        if(!bf) {
+            return 0;
+        }
+        _seg_read(gbuf, bf, len);
+        bf[len] = 0;
+        return bf;
+    }
+
     /*--------------------------*
      *  Using data in memory
      *--------------------------*/
@@ -647,42 +1790,100 @@ PUBLIC char gbuf_getchar(GBUFFER *gbuf)
 PUBLIC size_t gbuf_chunk(GBUFFER *gbuf)
 {
     int ln = gbuf_leftbytes(gbuf);
+
+    if(gbuf->segmented) {
+        /*
+         *  Contiguous data of current chunk
+         */
+        gbuf_seg_t *seg = _seg_rd(gbuf);
+        if(!seg) {
+            return 0;
+        }
+        return MIN(seg->len - gbuf->rd_seg_offset, ln);
+    }
+
     int chunk_size = MIN(gbuf->data_size, ln);
 
     return chunk_size;
 }
 
-
 /***************************************************************************
- *
+ *  Pop 'len' bytes without get them. Return bytes popped.
  ***************************************************************************/
-void *
-memmem(const void *l, size_t l_len, const void *s, size_t s_len)
+PUBLIC size_t gbuf_consume(GBUFFER *gbuf, size_t len)
 {
-    register char *cur, *last;
-    const char *cl = (const char *)l;
-    const char *cs = (const char *)s;
-
-    /* we need something to compare */
-    if (l_len == 0 || s_len == 0)
-        return NULL;
+    size_t ln = gbuf_leftbytes(gbuf);
+    if(len > ln) {
+        len = ln;
+    }
 
-    /* "s" must be smaller or equal to "l" */
-    if (l_len < s_len)
-        return NULL;
+    if(gbuf->segmented) {
+        _seg_rd_advance(gbuf, len);
+    } else if(gbuf->file_mode) {
+        _set_writting(gbuf, FALSE);
+        gbuf->curp += len;
+        fseeko64(gbuf->tmpfile, gbuf->curp, SEEK_SET);
+    } else {
+        gbuf->curp += len;
+    }
+    return len;
+}
 
-    /* special case where s_len == 1 */
-    if (s_len == 1)
-        return memchr(l, (int)*cs, l_len);
+#ifndef WIN32
+/***************************************************************************
+ *  Fill iov with the readable data, without pop it.
+ *  Return the number of iovec filled, -1 if error.
+ ***************************************************************************/
+PUBLIC int gbuf_iovec(GBUFFER *gbuf, struct iovec *iov, int max_iov)
+{
+    if(gbuf->file_mode) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+            "msg",          "%s", "iovec in file mode NOT IMPLEMENTED",
+            NULL
+        );
+        return -1;
+    }
 
-    /* the last position where its possible to find "s" in "l" */
-    last = (char *)cl + l_len - s_len;
+    if(!gbuf->segmented) {
+        size_t ln = gbuf_leftbytes(gbuf);
+        if(ln == 0 || max_iov < 1) {
+            return 0;
+        }
+        iov[0].iov_base = gbuf->data + gbuf->curp;
+        iov[0].iov_len = ln;
+        return 1;
+    }
+
+    int n = 0;
+    gbuf_seg_t *seg = _seg_rd(gbuf);
+    size_t offset = gbuf->rd_seg_offset;
+    while(seg && n < max_iov) {
+        if(seg->len > offset) {
+            iov[n].iov_base = SEG_DATA(seg) + offset;
+            iov[n].iov_len = seg->len - offset;
+            n++;
+        }
+        seg = dl_next(seg);
+        offset = 0;
+    }
+    return n;
+}
+#endif
 
-    for (cur = (char *)cl; cur <= last; cur++)
-        if (cur[0] == cs[0] && memcmp(cur, cs, s_len) == 0)
-            return cur;
 
-    return NULL;
+/***************************************************************************
+ *
+ ***************************************************************************/
+void *
+memmem(const void *l, size_t l_len, const void *s, size_t s_len)
+{
+    return mem_search(l, l_len, s, s_len);
 }
 
 /***************************************************************************
@@ -690,43 +1891,26 @@ memmem(const void *l, size_t l_len, const void *s, size_t s_len)
  ***************************************************************************/
 PUBLIC void *gbuf_find(GBUFFER *gbuf, const char *pattern, int patter_len)
 {
-    /*-------------------------------------------------------------*
+    /*--------------------------*
+     *  Using chain of chunks
+     *--------------------------*/
+    if(gbuf->segmented) {
+        return _seg_find(gbuf, pattern, patter_len);
+    }
+
+    /*--------------------------*
      *  Using data in memory
-     *  Copied from FreeBSD memmem.c
-     *  Copyright (c) 2005 Pascal Gloor <pascal.gloor@spale.com>
-     *-------------------------------------------------------------*/
+     *--------------------------*/
     if(!gbuf->file_mode) {
-        /*
-         * Find the first occurrence of the byte string cs in byte string cl.
-         */
-        register char *cur, *last;
-        const char *p = (char *)gbuf->data + gbuf->curp;
-
         size_t resto = gbuf_leftbytes(gbuf);
-
-        /* we need something to compare */
-        if (resto == 0 || patter_len == 0)
+        if(resto == 0 || patter_len <= 0) {
             return NULL;
-
-        /* "s" must be smaller or equal to "l" */
-        if (resto < patter_len)
-            return NULL;
-
-        /* special case where len == 1 */
-        if (patter_len == 1)
-            return memchr(p, (int)*pattern, resto);
-
-        /* the last position where its possible to find "s" in "l" */
-        last = (char *)p + resto - patter_len;
-
-        for (cur = (char *)p; cur <= last; cur++) {
-            if (cur[0] == pattern[0] && memcmp(cur, pattern, patter_len) == 0) {
-                gbuf->curp = cur - gbuf->data;
-                return cur;
-            }
         }
-
-        return 0;
+        char *cur = mem_search(gbuf->data + gbuf->curp, resto, pattern, patter_len);
+        if(cur) {
+            gbuf->curp = cur - gbuf->data;
+        }
+        return cur;
     }
 
     /*--------------------------*
@@ -751,20 +1935,82 @@ PUBLIC void *gbuf_find(GBUFFER *gbuf, const char *pattern, int patter_len)
  ***************************************************************************/
 PUBLIC char *gbuf_getline(GBUFFER *gbuf, char separator)
 {
-    if(gbuf_leftbytes(gbuf)<=0) {
+    size_t ln = gbuf_leftbytes(gbuf);
+    if(ln<=0) {
         // No more chars
         return (char *)0;
     }
-    char *begin = gbuf_cur_rd_pointer(gbuf); // TODO WARNING with chunks this will failed!
-    register char *p;
-    while((p=gbuf_get(gbuf,1))) {
-        if(*p == separator) {
+
+    /*--------------------------*
+     *  Using data in memory
+     *--------------------------*/
+    if(!gbuf->file_mode && !gbuf->segmented) {
+        char *begin = gbuf->data + gbuf->curp;
+        char *p = memchr(begin, separator, ln);
+        if(p) {
             *p = 0;
-            return begin;
+            gbuf->curp += (p - begin) + 1;
+        } else {
+            gbuf->curp += ln; // data has final null
+        }
+        return begin;
+    }
+
+    /*----------------------------------------------------*
+     *  Using chunks or file: the line can cross chunks,
+     *  it's copied to the line buffer.
+     *----------------------------------------------------*/
+    size_t line_len = 0;
+    while(gbuf_leftbytes(gbuf) > 0) {
+        char *bf;
+        size_t n;
+        BOOL found = FALSE;
+
+        if(gbuf->segmented) {
+            gbuf_seg_t *seg = _seg_rd(gbuf);
+            bf = SEG_DATA(seg) + gbuf->rd_seg_offset;
+            n = seg->len - gbuf->rd_seg_offset;
+            char *p = memchr(bf, separator, n);
+            if(p) {
+                n = p - bf;
+                found = TRUE;
+                if(line_len == 0 && seg->chunk->refcount == 1) {
+                    // Line inside of a own chunk
+                    *p = 0;
+                    _seg_rd_advance(gbuf, n + 1);
+                    return bf;
+                }
+            }
+            if(!_gbuf_line_buffer(gbuf, line_len + n)) {
+                return (char *)0;
+            }
+            memcpy(gbuf->line + line_len, bf, n);
+            _seg_rd_advance(gbuf, found? n+1 : n);
+        } else {
+            bf = gbuf_get(gbuf, 1);
+            if(!bf) {
+                break;
+            }
+            if(*bf == separator) {
+                break;
+            }
+            n = 1;
+            if(!_gbuf_line_buffer(gbuf, line_len + n)) {
+                return (char *)0;
+            }
+            gbuf->line[line_len] = *bf;
+        }
+        line_len += n;
+        if(found) {
+            break;
         }
     }
 
-    return begin;
+    if(!_gbuf_line_buffer(gbuf, line_len)) {
+        return (char *)0;
+    }
+    gbuf->line[line_len] = 0;
+    return gbuf->line;
 }
 
 
@@ -781,6 +2027,10 @@ PUBLIC char *gbuf_getline(GBUFFER *gbuf, char separator)
  ***************************************************************************/
 PUBLIC void *gbuf_cur_wr_pointer(GBUFFER *gbuf)
 {
+    if(gbuf->segmented) {
+        gbuf_seg_t *seg = _seg_wr(gbuf, 1);
+        return seg? gbuf_cur_wr_pointer(seg->chunk) : 0;
+    }
     return gbuf->data + gbuf->tail;
 }
 
@@ -789,9 +2039,19 @@ PUBLIC void *gbuf_cur_wr_pointer(GBUFFER *gbuf)
  ***************************************************************************/
 PUBLIC void gbuf_reset_wr(GBUFFER *gbuf)
 {
+    if(gbuf->tail > gbuf->tail_high) {
+        gbuf->tail_high = gbuf->tail;
+    }
     gbuf->tail = 0;
     gbuf->curp = 0;
 
+    if(gbuf->segmented) {
+        dl_flush(&gbuf->dl_gbuffers, _seg_free);
+        gbuf->rd_seg = 0;
+        gbuf->rd_seg_offset = 0;
+        return;
+    }
+
     /*
      *  Put final null
      */
@@ -831,6 +2091,35 @@ PUBLIC void gbuf_reset_wr(GBUFFER *gbuf)
  ***************************************************************************/
 PUBLIC int gbuf_set_wr(GBUFFER *gbuf, size_t offset)
 {
+    if(gbuf->segmented) {
+        /*
+         *  Only inside of the last own chunk
+         */
+        gbuf_seg_t *seg = dl_last(&gbuf->dl_gbuffers);
+        size_t seg_base = seg? gbuf->tail - seg->len : 0;
+        if(!seg || seg->chunk->refcount > 1 ||
+                offset < seg_base ||
+                seg->start + (offset - seg_base) > seg->chunk->data_size) {
+            log_error(LOG_OPT_TRACE_STACK,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "process",      "%s", get_process_name(),
+                "hostname",     "%s", get_host_name(),
+                "pid",          "%d", get_pid(),
+                "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+                "msg",          "%s", "offset OUT of last chunk",
+                "offset",       "%d", offset,
+                "tail",         "%d", gbuf->tail,
+                NULL
+            );
+            return -1;
+        }
+        seg->len = offset - seg_base;
+        gbuf_set_wr(seg->chunk, seg->start + seg->len);
+        gbuf->tail = offset;
+        return 0;
+    }
+
     if(offset > gbuf->data_size) { // WARNING collateral damage? (original>=), version 3.4.3
         log_error(LOG_OPT_TRACE_STACK,
             "gobj",         "%s", __FILE__,
@@ -846,6 +2135,9 @@ PUBLIC int gbuf_set_wr(GBUFFER *gbuf, size_t offset)
         );
         return -1;
     }
+    if(gbuf->tail > gbuf->tail_high) {
+        gbuf->tail_high = gbuf->tail;
+    }
     gbuf->tail = offset;
 
     /*
@@ -892,6 +2184,14 @@ PUBLIC size_t gbuf_append(GBUFFER *gbuf, void *bf, size_t len)
         );
         return 0;
     }
+
+    /*--------------------------*
+     *  Using chain of chunks
+     *--------------------------*/
+    if(gbuf->segmented) {
+        return _seg_append(gbuf, bf, len);
+    }
+
     if(gbuf_freebytes(gbuf) < len) {
         _gbuf_realloc(gbuf, len);
     }
@@ -972,8 +2272,16 @@ PUBLIC size_t gbuf_append_char(GBUFFER *gbuf, char c)
 PUBLIC int gbuf_append_gbuf(GBUFFER *dst, GBUFFER *src)
 {
     register char *p;
+
+    if(dst->segmented && !src->file_mode) {
+        /*
+         *  Link the chunks, without copy
+         */
+        return _seg_append_gbuf(dst, src);
+    }
+
     int ln = gbuf_leftbytes(src);
-    int chunk_size = MIN(src->data_size, ln);
+    int chunk_size = gbuf_chunk(src);
 
     while(ln>0) {
         p = gbuf_get(src, chunk_size);
@@ -1004,7 +2312,7 @@ PUBLIC int gbuf_append_gbuf(GBUFFER *dst, GBUFFER *src)
             return -1;
         }
         ln = gbuf_leftbytes(src);
-        chunk_size = MIN(src->data_size, ln);
+        chunk_size = gbuf_chunk(src);
     }
     return 0;
 }
@@ -1038,6 +2346,43 @@ PUBLIC int gbuf_vprintf(GBUFFER *gbuf, const char *format, va_list ap)
 
     va_list aq;
 
+    /*--------------------------*
+     *  Using chain of chunks
+     *--------------------------*/
+    if(gbuf->segmented) {
+        va_copy(aq, ap);
+        written = vsnprintf(0, 0, format, aq);
+        va_end(aq);
+        if(written <= 0) {
+            return 0;
+        }
+        if(written > _seg_freebytes(gbuf)) {
+            log_error(LOG_OPT_TRACE_STACK,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "process",      "%s", get_process_name(),
+                "hostname",     "%s", get_host_name(),
+                "pid",          "%d", get_pid(),
+                "msgset",       "%s", MSGSET_INTERNAL_ERROR,
+                "msg",          "%s", "NOT ENOUGH SPACE",
+                "free",         "%d", (int)_seg_freebytes(gbuf),
+                "needed",       "%d", written,
+                NULL
+            );
+            return 0;
+        }
+        gbuf_seg_t *seg = _seg_wr(gbuf, written);
+        if(!seg) {
+            return 0;
+        }
+        va_copy(aq, ap);
+        written = gbuf_vprintf(seg->chunk, format, aq);
+        va_end(aq);
+        seg->len += written;
+        gbuf->tail += written;
+        return written;
+    }
+
     /*--------------------------*
      *  Using data in memory
      *--------------------------*/
@@ -1165,6 +2510,11 @@ PUBLIC void *gbuf_head_pointer(GBUFFER *gbuf)
         );
         return 0;
     }
+    if(gbuf->segmented) {
+        // Only the first chunk is contiguous
+        gbuf_seg_t *seg = dl_first(&gbuf->dl_gbuffers);
+        return seg? SEG_DATA(seg) : 0;
+    }
     p = gbuf->data;
     return p;
 }
@@ -1225,6 +2575,19 @@ PUBLIC size_t gbuf_totalbytes(GBUFFER *gbuf)
  ***************************************************************************/
 PUBLIC size_t gbuf_freebytes(GBUFFER *gbuf)
 {
+    /*------------------------------------------------*
+     *  Using chain of chunks: contiguous free space
+     *  in the chunk of gbuf_cur_wr_pointer()
+     *------------------------------------------------*/
+    if(gbuf->segmented) {
+        size_t freebytes = _seg_freebytes(gbuf);
+        if(!freebytes) {
+            return 0;
+        }
+        gbuf_seg_t *seg = _seg_wr(gbuf, 1);
+        return seg? MIN(freebytes, gbuf_freebytes(seg->chunk)) : 0;
+    }
+
     /*--------------------------*
      *  Using data in memory
      *--------------------------*/
@@ -1574,7 +2937,6 @@ PRIVATE size_t on_load_callback(void *buffer, size_t buflen, void *data)
     GBUFFER *gbuf = data;
 
     // TODO falta que elimine los comentarios como json_config()
-    // pero gbuf_getline() no funciona si hay chunks
     size_t chunk = gbuf_chunk(gbuf);
     if(!chunk)
         return 0;
@@ -1665,6 +3027,71 @@ PUBLIC GBUFFER *json2gbuf(
     return gbuf;
 }
 
+/***************************************************************************
+ *  Serialize kw into gbuf, without copy of kw
+ ***************************************************************************/
+PUBLIC GBUFFER *kw2gbuf_serialize(
+    GBUFFER *gbuf,
+    json_t *kw, // owned
+    size_t flags)
+{
+    if(!gbuf) {
+        gbuf = gbuf_create(32*1024, gbmem_get_maximum_block(), 0, codec_utf_8);
+        if(!gbuf) {
+            log_error(LOG_OPT_TRACE_STACK,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "gbuf_create() FAILED",
+                NULL
+            );
+            KW_DECREF(kw);
+            return 0;
+        }
+    }
+    kw_serialize_dump(kw, dump2gbuf, gbuf, flags);
+    return gbuf;
+}
+
+/***************************************************************************
+ *  Deserialize kw from gbuf, without copy of kw
+ ***************************************************************************/
+PUBLIC json_t *gbuf2kw_deserialize(
+    GBUFFER *gbuf,  // WARNING gbuf own and data consumed
+    int verbose     // 1 log, 2 log+dump
+)
+{
+    size_t flags = JSON_DECODE_ANY|JSON_ALLOW_NUL;
+    json_error_t jn_error;
+    json_t *kw = kw_deserialize_load(on_load_callback, gbuf, flags, &jn_error);
+
+    if(!kw) {
+        if(verbose) {
+            log_error(LOG_OPT_TRACE_STACK,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "process",      "%s", get_process_name(),
+                "hostname",     "%s", get_host_name(),
+                "pid",          "%d", get_pid(),
+                "msgset",       "%s", MSGSET_JSON_ERROR,
+                "msg",          "%s", "kw_deserialize_load() FAILED",
+                "error",        "%s", jn_error.text,
+                NULL
+            );
+            if(verbose > 1) {
+                gbuf_reset_rd(gbuf);
+                log_debug_gbuf(
+                    0,
+                    gbuf,
+                    "Bad json format"
+                );
+            }
+        }
+    }
+    gbuf_decref(gbuf);
+    return kw;
+}
+
 /*****************************************************************
  *      Log hexa dump gbuffer
  *  WARNING only print a chunk size of data.
@@ -1706,6 +3133,10 @@ PUBLIC void log_debug_full_gbuf(
 
     int len = gbuf_totalbytes(gbuf);
     char *bf = gbuf_head_pointer(gbuf);
+    if(gbuf->segmented) {
+        gbuf_seg_t *seg = dl_first(&gbuf->dl_gbuffers);
+        len = seg? seg->len : 0; // Only the first chunk is contiguous
+    }
 
     va_list ap;
     va_start(ap, fmt);
@@ -1813,9 +3244,15 @@ PUBLIC GBUFFER *gbuf_encodebase64( // return new gbuffer
     GBUFFER *gbuf_input  // decref
 )
 {
-    char *src = gbuf_cur_rd_pointer(gbuf_input);
-    size_t len = gbuf_leftbytes(gbuf_input);
+    GBUFFER *gbuf_flat = _gbuf_flat(gbuf_input); // segmented: the data crosses chunks
+    if(!gbuf_flat) {
+        gbuf_decref(gbuf_input);
+        return 0;
+    }
+    char *src = gbuf_cur_rd_pointer(gbuf_flat);
+    size_t len = gbuf_leftbytes(gbuf_flat);
     GBUFFER *gbuf_output = gbuf_string2base64(src, len);
+    gbuf_decref(gbuf_flat);
     gbuf_decref(gbuf_input);
     return gbuf_output;
 }
@@ -1879,8 +3316,14 @@ PUBLIC GBUFFER *gbuf_decodebase64(
     GBUFFER *gbuf_input  // decref
 )
 {
-    char *base64 = gbuf_cur_rd_pointer(gbuf_input);
+    GBUFFER *gbuf_flat = _gbuf_flat(gbuf_input); // segmented: the data crosses chunks
+    if(!gbuf_flat) {
+        gbuf_decref(gbuf_input);
+        return 0;
+    }
+    char *base64 = gbuf_cur_rd_pointer(gbuf_flat);
     GBUFFER *gbuf_output = gbuf_decodebase64string(base64);
+    gbuf_decref(gbuf_flat);
     gbuf_decref(gbuf_input);
     return gbuf_output;
 }
@@ -1892,6 +3335,13 @@ PUBLIC GBUFFER *gbuf_utf8_to_unicode( // return new gbuffer
     GBUFFER *gbuf_input  // decref
 )
 {
+    GBUFFER *gbuf_flat = _gbuf_flat(gbuf_input); // segmented: the data crosses chunks
+    gbuf_decref(gbuf_input);
+    if(!gbuf_flat) {
+        return 0;
+    }
+    gbuf_input = gbuf_flat;
+
     char *utf8 = gbuf_cur_rd_pointer(gbuf_input);
 
     size_t output_len = (strlen(utf8) + 1) * sizeof(wchar_t);
@@ -1961,89 +3411,140 @@ PUBLIC GBUFFER *gbuf_utf8_to_unicode( // return new gbuffer
 }
 
 /***************************************************************************
- *
+ *  Find the begin of a json value: '{', or '[' too if not dicts_only
  ***************************************************************************/
-PUBLIC int stream_json_filename_parser(
-    const char *path,
-    json_stream_callback_t json_stream_callback,
-    void *user_data,
-    int verbose     // 1 log, 2 log+dump
-)
+PRIVATE const char *json_stream_find_begin(const char *p, const char *end, BOOL dicts_only)
 {
-    FILE *file = fopen(path, "r");
-    if(!file) {
-        if(verbose) {
-            log_error(0,
-                "gobj",         "%s", __FILE__,
-                "function",     "%s", __FUNCTION__,
-                "process",      "%s", get_process_name(),
-                "hostname",     "%s", get_host_name(),
-                "pid",          "%d", get_pid(),
-                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
-                "msg",          "%s", "Cannot open file",
-                "path",         "%s", path,
-                NULL
-            );
+    if(dicts_only) {
+        return memchr(p, '{', end - p);
+    }
+    for(; p < end; p++) {
+        if(*p == '{' || *p == '[') {
+            return p;
         }
-        return -1;
     }
-    /*
-     *  Load commands
-     */
-    #define WAIT_BEGIN_DICT 0
-    #define WAIT_END_DICT   1
-    int c;
-    int st = WAIT_BEGIN_DICT;
-    int brace_indent = 0;
-    GBUFFER *gbuf = gbuf_create(16*1024, gbmem_get_maximum_block(), 0, 0);
-    while((c=fgetc(file))!=EOF) {
-        switch(st) {
-        case WAIT_BEGIN_DICT:
-            if(c != '{') {
-                continue;
-            }
-            gbuf_clear(gbuf);
-            gbuf_append(gbuf, &c, 1);
-            brace_indent = 1;
-            st = WAIT_END_DICT;
-            break;
-        case WAIT_END_DICT:
-            if(c == '{') {
-                brace_indent++;
-            } else if(c == '}') {
-                brace_indent--;
+    return 0;
+}
+
+/***************************************************************************
+ *  Scan a json value, aware of strings (braces inside strings don't count).
+ *  Return the pointer after the end of value, or NULL if it needs more data,
+ *  the state is kept in sc to continue.
+ ***************************************************************************/
+typedef struct {
+    int depth;
+    BOOL in_string;
+    BOOL escape;
+} json_scan_t;
+
+PRIVATE const char *json_stream_scan(json_scan_t *sc, const char *p, const char *end)
+{
+    for(; p < end; p++) {
+        char c = *p;
+        if(sc->in_string) {
+            if(sc->escape) {
+                sc->escape = FALSE;
+            } else if(c == '\\') {
+                sc->escape = TRUE;
+            } else if(c == '"') {
+                sc->in_string = FALSE;
             }
-            gbuf_append(gbuf, &c, 1);
-            if(brace_indent == 0) {
-                gbuf_incref(gbuf);
-                json_t *jn_dict = gbuf2json(gbuf, verbose);
-                gbuf_clear(gbuf);
-                if(jn_dict) {
-                    json_stream_callback(user_data, jn_dict);
+            continue;
+        }
+        switch(c) {
+            case '"':
+                sc->in_string = TRUE;
+                break;
+            case '{':
+            case '[':
+                sc->depth++;
+                break;
+            case '}':
+            case ']':
+                sc->depth--;
+                if(sc->depth <= 0) {
+                    return p + 1;
                 }
-                st = WAIT_BEGIN_DICT;
-            }
-            break;
+                break;
         }
     }
-    fclose(file);
-    gbuf_decref(gbuf);
-
     return 0;
 }
 
 /***************************************************************************
- *
+ *  Decode a json value in place, without copy
  ***************************************************************************/
-PUBLIC int stream_json_filename_parser2(
+PRIVATE json_t *json_stream_decode(const char *bf, size_t len, int verbose)
+{
+    size_t flags = JSON_DECODE_ANY|JSON_ALLOW_NUL;
+    json_error_t jn_error;
+    json_t *jn = json_loadb(bf, len, flags, &jn_error);
+    if(!jn && verbose) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_JSON_ERROR,
+            "msg",          "%s", "json_loadb() FAILED",
+            "error",        "%s", jn_error.text,
+            NULL
+        );
+        if(verbose > 1) {
+            log_debug_dump(0, bf, len, "Bad json format");
+        }
+    }
+    return jn;
+}
+
+/***************************************************************************
+ *  Parse the json values of a buffer, calling the callback with each one.
+ *  Return the bytes consumed, the rest is the begin of an incomplete value.
+ ***************************************************************************/
+PRIVATE size_t json_stream_buffer_parser(
+    const char *bf,
+    size_t len,
+    BOOL dicts_only,
+    json_stream_callback_t json_stream_callback,
+    void *user_data,
+    int verbose
+)
+{
+    const char *p = bf;
+    const char *end = bf + len;
+    while(p < end) {
+        const char *begin = json_stream_find_begin(p, end, dicts_only);
+        if(!begin) {
+            return len;
+        }
+        json_scan_t sc = {0};
+        const char *value_end = json_stream_scan(&sc, begin, end);
+        if(!value_end) {
+            return begin - bf;
+        }
+        json_t *jn_value = json_stream_decode(begin, value_end - begin, verbose);
+        if(jn_value) {
+            json_stream_callback(user_data, jn_value);
+        }
+        p = value_end;
+    }
+    return len;
+}
+
+/***************************************************************************
+ *  Parse a file of json values: mmap'ed or reading by blocks.
+ ***************************************************************************/
+PRIVATE int json_stream_path_parser(
     const char *path,
+    BOOL dicts_only,
     json_stream_callback_t json_stream_callback,
     void *user_data,
-    int verbose     // 1 log, 2 log+dump
+    int verbose
 )
 {
-    FILE *file = fopen(path, "r");
-    if(!file) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
         if(verbose) {
             log_error(0,
                 "gobj",         "%s", __FILE__,
@@ -2059,105 +3560,203 @@ PUBLIC int stream_json_filename_parser2(
         }
         return -1;
     }
+
+#ifdef GBUF_MMAP
     /*
-     *  Load commands
+     *  Regular file: mmap it, the values are decoded in place.
      */
-    #define WAIT_BEGIN_DICT 0
-    #define WAIT_END_DICT   1
-    int c;
-    int begin_separator;
-    int end_separator;
-    int st = WAIT_BEGIN_DICT;
-    int brace_indent = 0;
-    GBUFFER *gbuf = gbuf_create(16*1024, gbmem_get_maximum_block(), 0, 0);
-    while((c=fgetc(file))!=EOF) {
-        switch(st) {
-        case WAIT_BEGIN_DICT:
-            if(!(c == '{' || c == '[')) {
-                continue;
-            }
-            if(c == '{') {
-                begin_separator = '{';
-                end_separator = '}';
-            } else {
-                begin_separator = '[';
-                end_separator = ']';
-            }
-            gbuf_clear(gbuf);
-            gbuf_append(gbuf, &c, 1);
-            brace_indent = 1;
-            st = WAIT_END_DICT;
-            break;
-        case WAIT_END_DICT:
-            if(c == begin_separator) {
-                brace_indent++;
-            } else if(c == end_separator) {
-                brace_indent--;
-            }
-            gbuf_append(gbuf, &c, 1);
-            if(brace_indent == 0) {
-                gbuf_incref(gbuf);
-                json_t *jn_dict = gbuf2json(gbuf, verbose);
-                gbuf_clear(gbuf);
-                if(jn_dict) {
-                    json_stream_callback(user_data, jn_dict);
-                }
-                st = WAIT_BEGIN_DICT;
+    struct stat st;
+    if(fstat(fd, &st)==0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            json_stream_buffer_parser(
+                map, st.st_size, dicts_only, json_stream_callback, user_data, verbose
+            );
+            munmap(map, st.st_size);
+            close(fd);
+            return 0;
+        }
+    }
+#endif
+
+    /*
+     *  Read by blocks, keeping the incomplete value for the next block
+     */
+    size_t size = 64*1024;
+    size_t used = 0;
+    char *bf = gbmem_malloc(size);
+    if(!bf) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "process",      "%s", get_process_name(),
+            "hostname",     "%s", get_host_name(),
+            "pid",          "%d", get_pid(),
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() return NULL",
+            "size",         "%ld", (long)size,
+            NULL
+        );
+        close(fd);
+        return -1;
+    }
+    while(1) {
+        if(used == size) {
+            size_t more = size * 2;
+            char *new_bf = (more <= gbmem_get_maximum_block())? gbmem_realloc(bf, more) : 0;
+            if(!new_bf) {
+                log_error(LOG_OPT_TRACE_STACK,
+                    "gobj",         "%s", __FILE__,
+                    "function",     "%s", __FUNCTION__,
+                    "process",      "%s", get_process_name(),
+                    "hostname",     "%s", get_host_name(),
+                    "pid",          "%d", get_pid(),
+                    "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                    "msg",          "%s", "json value TOO BIG",
+                    "path",         "%s", path,
+                    "size",         "%ld", (long)size,
+                    NULL
+                );
+                break;
             }
+            bf = new_bf;
+            size = more;
+        }
+        int readed = read(fd, bf + used, size - used);
+        if(readed <= 0) {
             break;
         }
+        used += readed;
+        size_t consumed = json_stream_buffer_parser(
+            bf, used, dicts_only, json_stream_callback, user_data, verbose
+        );
+        if(consumed > 0) {
+            memmove(bf, bf + consumed, used - consumed);
+            used -= consumed;
+        }
     }
-    fclose(file);
-    gbuf_decref(gbuf);
+    gbmem_free(bf);
+    close(fd);
 
     return 0;
 }
 
 /***************************************************************************
- *
+ *  Parse a file of json dicts
+ ***************************************************************************/
+PUBLIC int stream_json_filename_parser(
+    const char *path,
+    json_stream_callback_t json_stream_callback,
+    void *user_data,
+    int verbose     // 1 log, 2 log+dump
+)
+{
+    return json_stream_path_parser(path, TRUE, json_stream_callback, user_data, verbose);
+}
+
+/***************************************************************************
+ *  Parse a file of json dicts and lists
+ ***************************************************************************/
+PUBLIC int stream_json_filename_parser2(
+    const char *path,
+    json_stream_callback_t json_stream_callback,
+    void *user_data,
+    int verbose     // 1 log, 2 log+dump
+)
+{
+    return json_stream_path_parser(path, FALSE, json_stream_callback, user_data, verbose);
+}
+
+/***************************************************************************
+ *  Read a json dict from file.
+ *  Seekable files are read by blocks, and the file position is left
+ *  after the dict found; else read by chars.
  ***************************************************************************/
 PUBLIC json_t *stream_json_file_parser(
     FILE *file,     // Read until EOF of a new json dict.
     int verbose     // 1 log, 2 log+dump
 )
 {
+    GBUFFER *gbuf = gbuf_create(4*1024, gbmem_get_maximum_block(), 0, 0);
+    if(!gbuf) {
+        return 0;
+    }
+
+    off_t pos = ftello(file);
+    if(pos >= 0) {
+        /*
+         *  Seekable: read blocks
+         */
+        char block[4*1024];
+        size_t scanned = 0;     // bytes scanned from pos
+        json_scan_t sc = {0};
+        BOOL in_value = FALSE;
+        size_t readed;
+        while((readed = fread(block, 1, sizeof(block), file)) > 0) {
+            const char *p = block;
+            const char *end = block + readed;
+            while(p < end) {
+                if(!in_value) {
+                    const char *b = json_stream_find_begin(p, end, TRUE);
+                    if(!b) {
+                        scanned += end - p;
+                        break;
+                    }
+                    scanned += b - p;
+                    p = b;
+                    memset(&sc, 0, sizeof(sc));
+                    gbuf_clear(gbuf);
+                    in_value = TRUE;
+                }
+                const char *value_end = json_stream_scan(&sc, p, end);
+                const char *stop = value_end? value_end : end;
+                gbuf_append(gbuf, (void *)p, stop - p);
+                scanned += stop - p;
+                p = stop;
+                if(value_end) {
+                    in_value = FALSE;
+                    json_t *jn_dict = json_stream_decode(
+                        gbuf_cur_rd_pointer(gbuf), gbuf_leftbytes(gbuf), verbose
+                    );
+                    if(jn_dict) {
+                        fseeko(file, pos + scanned, SEEK_SET);
+                        gbuf_decref(gbuf);
+                        return jn_dict;
+                    }
+                }
+            }
+        }
+        gbuf_decref(gbuf);
+        return 0;
+    }
+
     /*
-     *  Load commands
+     *  Not seekable: read chars
      */
-    #define WAIT_BEGIN_DICT 0
-    #define WAIT_END_DICT   1
     int c;
-    int st = WAIT_BEGIN_DICT;
-    int brace_indent = 0;
-    GBUFFER *gbuf = gbuf_create(4*1024, gbmem_get_maximum_block(), 0, 0);
+    json_scan_t sc = {0};
+    BOOL in_value = FALSE;
     while((c=fgetc(file))!=EOF) {
-        switch(st) {
-        case WAIT_BEGIN_DICT:
-            if(c != '{') {
+        char ch = (char)c;
+        if(!in_value) {
+            if(ch != '{') {
                 continue;
             }
+            memset(&sc, 0, sizeof(sc));
             gbuf_clear(gbuf);
-            gbuf_append(gbuf, &c, 1);
-            brace_indent = 1;
-            st = WAIT_END_DICT;
-            break;
-        case WAIT_END_DICT:
-            if(c == '{') {
-                brace_indent++;
-            } else if(c == '}') {
-                brace_indent--;
-            }
-            gbuf_append(gbuf, &c, 1);
-            if(brace_indent == 0) {
-                gbuf_incref(gbuf);
-                json_t *jn_dict = gbuf2json(gbuf, verbose);
-                if(jn_dict) {
-                    gbuf_decref(gbuf);
-                    return jn_dict;
-                }
-                st = WAIT_BEGIN_DICT;
+            in_value = TRUE;
+        }
+        gbuf_append(gbuf, &ch, 1);
+        if(json_stream_scan(&sc, &ch, &ch + 1)) {
+            in_value = FALSE;
+            json_t *jn_dict = json_stream_decode(
+                gbuf_cur_rd_pointer(gbuf), gbuf_leftbytes(gbuf), verbose
+            );
+            if(jn_dict) {
+                gbuf_decref(gbuf);
+                return jn_dict;
             }
-            break;
         }
     }
     gbuf_decref(gbuf);
@@ -9,6 +9,9 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <jansson.h>
+#ifndef WIN32
+    #include <sys/uio.h>
+#endif
 
 /*
  *  Dependencies
@@ -80,6 +83,7 @@ typedef struct _GBUFFER {
     int32_t mark;               /* like user_data */
 
     size_t data_size;           /* nº bytes allocated for data */
+    size_t data_capacity;       /* nº bytes really allocated, greater than data_size if recycled */
     size_t max_memory_size;     /* maximum size in memory */
     size_t max_disk_size;       /* maximum size in disk */
     gbuf_encoding encoding;
@@ -90,6 +94,7 @@ typedef struct _GBUFFER {
      */
     size_t tail;    /* write pointer */
     size_t curp;    /* read pointer */
+    size_t tail_high;   /* highest tail before a reset, written bytes to clean if recycled */
 
     /*
      *  Data dinamycally allocated
@@ -98,11 +103,27 @@ typedef struct _GBUFFER {
     char *data;
 
     /*
-     *  TODO optimize
-     *  Instead of creating new gbuffers to insert data in head,
-     *  use a linked list of gbuffers.
+     *  Segmented mode (gbuf_create_segmented()): there is no data buffer,
+     *  the data is a chain of chunks (gbuffers) in dl_gbuffers.
+     *  The chunks of other gbuffers are linked by reference, not copied.
      */
     dl_list_t dl_gbuffers;
+    char segmented;         // True when using chain of chunks
+    size_t chunk_size;      // size of own chunks
+    void *rd_seg;           // current read segment
+    size_t rd_seg_offset;   // read offset in the current read segment
+
+    /*
+     *  Buffer for lines and for data crossing chunks (gbuf_getline(), gbuf_get()).
+     */
+    char *line;
+    size_t line_size;
+
+    /*
+     *  Spilled to a mmap'ed file: data points to the map, pointer access as in memory.
+     */
+    char mmap_mode;     // True when data is mmap'ed
+    int mmap_fd;
 
     /*
      *  Using file
@@ -131,6 +152,22 @@ PUBLIC GBUFFER * gbuf_create(
     size_t max_disk_size,
     gbuf_encoding encoding
 );
+
+/*
+ *  Segmented gbuffer: a chain of chunks of chunk_size bytes, growing without realloc/copy.
+ *  gbuf_append_gbuf() to a segmented gbuffer links the data of source by reference
+ *  (small data from a not segmented source is copied): don't rewrite the source
+ *  (gbuf_reset_wr(), gbuf_set_wr()) while the destination is alive.
+ *  Functions needing contiguous data (gbuf_head_pointer(), gbuf_cur_rd_pointer())
+ *  only see the current chunk: don't read gbuf_leftbytes() from that pointer,
+ *  use gbuf_chunk()/gbuf_get() loops or gbuf_iovec().
+ *  gbuf_encodebase64(), gbuf_decodebase64() and gbuf_utf8_to_unicode() copy the chunks.
+ */
+PUBLIC GBUFFER * gbuf_create_segmented(
+    size_t chunk_size,
+    size_t max_memory_size,
+    gbuf_encoding encoding
+);
 PUBLIC void gbuf_remove(GBUFFER *gbuf); /* do not call gbuf_remove(), call gbuf_decref() */
 PUBLIC void gbuf_incref(GBUFFER *gbuf);
 PUBLIC void gbuf_decref(GBUFFER *gbuf);
@@ -166,9 +203,17 @@ PUBLIC size_t gbuf_get_rd_offset(GBUFFER* gbuf);
 PUBLIC void *gbuf_get(GBUFFER *gbuf, size_t len);
 PUBLIC char gbuf_getchar(GBUFFER *gbuf);   /* pop one bytes */
 PUBLIC size_t gbuf_chunk(GBUFFER *gbuf);   /* return the chunk of data available */
+PUBLIC size_t gbuf_consume(GBUFFER *gbuf, size_t len); /* pop 'len' bytes without get them, return bytes popped */
+#ifndef WIN32
+/*
+ *  Fill iov with the readable data (without pop it), for writev()/sendmsg().
+ *  Return the number of iovec filled, -1 if error (file mode). Pop the data sent with gbuf_consume().
+ */
+PUBLIC int gbuf_iovec(GBUFFER *gbuf, struct iovec *iov, int max_iov);
+#endif
 
 PUBLIC void *gbuf_find(GBUFFER *gbuf, const char *pattern, int patter_len); // put read pointer in found pattern
-PUBLIC char *gbuf_getline(GBUFFER *gbuf, char separator);
+PUBLIC char *gbuf_getline(GBUFFER *gbuf, char separator); // lines crossing chunks are copied to an internal buffer
 
 /*
  *  WRITTING
@@ -197,6 +242,33 @@ PUBLIC size_t gbuf_freebytes(GBUFFER *gbuf);   /* free space */
 
 PUBLIC int gbuf_trace_create_delete(BOOL enable);
 
+/*
+ *  Spill of gbuffers greater than max_memory_size (till max_disk_size).
+ *  By default the data is moved to a mmap'ed file (memfd, or a unlinked file in spill_dir)
+ *  keeping the pointer access of memory; if mmap is disabled or fails a tmpfile() is used
+ *  (file mode, read/write by chunks).
+ *  spill_dir: directory of spill files, NULL to use memfd (or /tmp).
+ *  max_total_spill: maximum bytes spilled by all gbuffers, 0 is unlimited.
+ *  Return -1 if spill_dir is too long for the spill file names.
+ */
+PUBLIC int gbuf_set_spill(
+    BOOL use_mmap,
+    const char *spill_dir,
+    size_t max_total_spill
+);
+
+/*
+ *  Pool of gbuffers: gbuf_create() recycles the gbuffers released by gbuf_decref(),
+ *  with per-thread free lists by capacity class (256 bytes to 64K).
+ *  Disabled by default. When enabled the capacity of gbuf_create() up to 64K
+ *  is rounded up to his class (a power of 2).
+ *  The gbuffers in file mode, segmented or reallocated to other capacity are not recycled.
+ *  high_water is the maximum free gbuffers by class and thread, 0 disables the pool.
+ */
+PUBLIC void gbuf_pool_set_high_water(size_t high_water);
+PUBLIC void gbuf_pool_flush(void);  // Free the recycled gbuffers of current thread
+PUBLIC json_t *gbuf_pool_stats(void);
+
 PUBLIC int gbuf_setlabel(GBUFFER *gbuf, const char *label);
 PUBLIC int gbuf_setnlabel(GBUFFER *gbuf, const char *label, size_t len);
 PUBLIC const char *gbuf_getlabel(GBUFFER *gbuf);
@@ -231,6 +303,20 @@ PUBLIC GBUFFER *json2gbuf(
     size_t flags
 );
 
+/*
+ *  Serialize kw directly to gbuf, without duplicate it (see kw_serialize_dump())
+ *  and deserialize it directly from gbuf (see kw_deserialize_load()).
+ */
+PUBLIC GBUFFER *kw2gbuf_serialize(
+    GBUFFER *gbuf,  // if null a new gbuf is created
+    json_t *kw,     // owned
+    size_t flags
+);
+PUBLIC json_t *gbuf2kw_deserialize(
+    GBUFFER *gbuf,  // WARNING gbuf own and data consumed
+    int verbose     // 1 log, 2 log+dump
+);
+
 PUBLIC void log_debug_gbuf(
     log_opt_t opt,
     GBUFFER *gbuf,
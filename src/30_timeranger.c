@@ -113,6 +113,18 @@ PRIVATE int new_record_md_to_file(
 /***************************************************************
  *              Data
  ***************************************************************/
+/*
+ *  Pre-parsed paths of tranger_append_record()
+ */
+PRIVATE kw_path_t kwp_master = KW_PATH_INIT("master");
+PRIVATE kw_path_t kwp_system_flag = KW_PATH_INIT("system_flag");
+PRIVATE kw_path_t kwp_last_rowid = KW_PATH_INIT("__last_rowid__");
+PRIVATE kw_path_t kwp_tkey = KW_PATH_INIT("tkey");
+PRIVATE kw_path_t kwp_pkey = KW_PATH_INIT("pkey");
+PRIVATE kw_path_t kwp_lists = KW_PATH_INIT("lists");
+PRIVATE kw_path_t kwp_match_cond = KW_PATH_INIT("match_cond");
+PRIVATE kw_path_t kwp_load_record_callback = KW_PATH_INIT("load_record_callback");
+PRIVATE kw_path_t kwp_data = KW_PATH_INIT("data");
 
 /***************************************************************************
  *
@@ -178,6 +190,16 @@ PUBLIC json_t *tranger_startup(
     json_object_update_existing(tranger, jn_tranger);
     JSON_DECREF(jn_tranger);
 
+    kw_path_compile(&kwp_master);
+    kw_path_compile(&kwp_system_flag);
+    kw_path_compile(&kwp_last_rowid);
+    kw_path_compile(&kwp_tkey);
+    kw_path_compile(&kwp_pkey);
+    kw_path_compile(&kwp_lists);
+    kw_path_compile(&kwp_match_cond);
+    kw_path_compile(&kwp_load_record_callback);
+    kw_path_compile(&kwp_data);
+
     char path[PATH_MAX];
     const char *path_ = kw_get_str(tranger, "path", "", 0);
     build_path2(path, sizeof(path), path_, ""); // I want modify path
@@ -1957,7 +1979,7 @@ PUBLIC int tranger_append_record(
         return -1;
     }
 
-    BOOL master = kw_get_bool(tranger, "master", 0, KW_REQUIRED);
+    BOOL master = kwp_get_bool(tranger, &kwp_master, 0, KW_REQUIRED);
     if(!master) {
         log_error(LOG_OPT_TRACE_STACK,
             "gobj",         "%s", __FILE__,
@@ -1990,7 +2012,7 @@ PUBLIC int tranger_append_record(
     /*--------------------------------------------*
      *  If time not specified, use the now time
      *--------------------------------------------*/
-    uint32_t __system_flag__ = kw_get_int(topic, "system_flag", 0, KW_REQUIRED);
+    uint32_t __system_flag__ = kwp_get_int(topic, &kwp_system_flag, 0, KW_REQUIRED);
     if(!__t__) {
         if(__system_flag__ & (sf_t_ms)) {
             __t__ = time_in_miliseconds();
@@ -2002,7 +2024,7 @@ PUBLIC int tranger_append_record(
     /*--------------------------------------------*
      *  Get last_rowid
      *--------------------------------------------*/
-    json_int_t __last_rowid__ = kw_get_int(topic, "__last_rowid__", 0, KW_REQUIRED);
+    json_int_t __last_rowid__ = kwp_get_int(topic, &kwp_last_rowid, 0, KW_REQUIRED);
 
     /*--------------------------------------------*
      *  Recover file corresponds to __t__
@@ -2044,7 +2066,7 @@ PUBLIC int tranger_append_record(
     /*--------------------------------------------*
      *  Get and save the t-key if exists
      *--------------------------------------------*/
-    const char *tkey = kw_get_str(topic, "tkey", "", KW_REQUIRED);
+    const char *tkey = kwp_get_str(topic, &kwp_tkey, "", KW_REQUIRED);
     if(!empty_string(tkey)) {
         json_t *jn_tval = kw_get_dict_value(jn_record, tkey, 0, 0);
         if(!jn_tval) {
@@ -2068,7 +2090,7 @@ PUBLIC int tranger_append_record(
     /*--------------------------------------------*
      *  Get and save the primary-key if exists
      *--------------------------------------------*/
-    const char *pkey = kw_get_str(topic, "pkey", "", KW_REQUIRED);
+    const char *pkey = kwp_get_str(topic, &kwp_pkey, "", KW_REQUIRED);
     system_flag_t system_flag_key_type = md_record->__system_flag__ & KEY_TYPE_MASK;
 
     switch(system_flag_key_type) {
@@ -2234,21 +2256,21 @@ PUBLIC int tranger_append_record(
     /*--------------------------------------------*
      *  Call callbacks
      *--------------------------------------------*/
-    json_t *lists = kw_get_list(topic, "lists", 0, KW_REQUIRED);
+    json_t *lists = kwp_get_list(topic, &kwp_lists, 0, KW_REQUIRED);
     int idx;
     json_t *list;
     json_array_foreach(lists, idx, list) {
         if(tranger_match_record(
                 tranger,
                 topic,
-                kw_get_dict(list, "match_cond", 0, 0),
+                kwp_get_dict(list, &kwp_match_cond, 0, 0),
                 md_record,
                 0
             )) {
             tranger_load_record_callback_t load_record_callback =
-                (tranger_load_record_callback_t)(size_t)kw_get_int(
+                (tranger_load_record_callback_t)(size_t)kwp_get_int(
                 list,
-                "load_record_callback",
+                &kwp_load_record_callback,
                 0,
                 0
             );
@@ -2268,14 +2290,14 @@ PUBLIC int tranger_append_record(
                 } else if(ret>0) {
                     json_object_set_new(jn_record, "__md_tranger__", tranger_md2json(md_record));
                     json_array_append(
-                        kw_get_list(list, "data", 0, KW_REQUIRED),
+                        kwp_get_list(list, &kwp_data, 0, KW_REQUIRED),
                         jn_record
                     );
                 }
             } else {
                 json_object_set_new(jn_record, "__md_tranger__", tranger_md2json(md_record));
                 json_array_append(
-                    kw_get_list(list, "data", 0, KW_REQUIRED),
+                    kwp_get_list(list, &kwp_data, 0, KW_REQUIRED),
                     jn_record
                 );
             }
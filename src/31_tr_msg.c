@@ -12,9 +12,14 @@
     else:
         the active message is the **last** key instance with tag equal to topic tag.
 
+    With max_key_instances the topic is loaded backward (from the last record),
+    only the kept instances are read, and the load ends when all the keys
+    of the "key" filter have their instances or when max_load_time is reached.
+
 ***********************************************************************/
 #include <string.h>
 #include <stdio.h>
+#include "02_time_helper.h"
 #include "31_tr_msg.h"
 
 /***************************************************************
@@ -112,9 +117,6 @@ PRIVATE int load_record_callback(
     json_t *jn_record // must be owned, can be null if sf_loading_from_disk
 )
 {
-    if(!jn_record) {
-        jn_record = tranger_read_record_content(tranger, topic, md_record);
-    }
     json_t *jn_messages = kw_get_dict(list, "messages", 0, KW_REQUIRED);
     json_t *jn_filter2 = kw_get_dict(list, "match_cond", 0, KW_REQUIRED);
 
@@ -125,6 +127,51 @@ PRIVATE int load_record_callback(
         key = key_;
     }
 
+    unsigned max_key_instances = kw_get_int(
+        jn_filter2,
+        "max_key_instances",
+        0,
+        KW_WILD_NUMBER
+    );
+
+    /*
+     *  Loading backward from disk: the first loaded instance is the active,
+     *  and the older are loaded only until the key has max_key_instances.
+     */
+    BOOL backward_load = (md_record->__system_flag__ & sf_loading_from_disk) &&
+        kw_get_bool(jn_filter2, "backward", 0, 0);
+
+    if(backward_load) {
+        uint64_t load_timer = (uint64_t)kw_get_int(list, "__load_timer__", 0, 0);
+        if(load_timer && test_msectimer(load_timer)) {
+            log_warning(0,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_INFO,
+                "msg",          "%s", "trmsg load stopped by max_load_time",
+                "topic_name",   "%s", kw_get_str(list, "topic_name", "", 0),
+                "rowid",        "%lu", (unsigned long)md_record->__rowid__,
+                NULL
+            );
+            JSON_DECREF(jn_record);
+            return -1;  // break the load
+        }
+        if(max_key_instances > 0) {
+            json_t *instances = kw_get_list(
+                json_object_get(jn_messages, key), "instances", 0, 0
+            );
+            if(json_array_size(instances) >= max_key_instances) {
+                // This key is complete, don't read the content
+                JSON_DECREF(jn_record);
+                return 0;  // Timeranger does not load the record, it's me.
+            }
+        }
+    }
+
+    if(!jn_record) {
+        jn_record = tranger_read_record_content(tranger, topic, md_record);
+    }
+
     /*
      *  Search the message for this key
      */
@@ -146,8 +193,11 @@ PRIVATE int load_record_callback(
             0
         );
         if(match_fields) {
-            JSON_INCREF(match_fields);
-            if(!kw_match_simple(jn_record, match_fields)) {
+            // Compiled in trmsg_open_list(), 0 if it has a bad regex: nothing matches
+            kw_filter filter = (kw_filter)(size_t)kw_get_int(
+                list, "__match_fields_filter__", 0, 0
+            );
+            if(!kw_filter_match(filter, jn_record)) {
                 JSON_DECREF(jn_record);
                 return 0;  // Timeranger does not load the record, it's me.
             }
@@ -178,8 +228,9 @@ PRIVATE int load_record_callback(
     /*
      *  Check active
      *  The last loaded msg will be the active msg
+     *  (the first loaded msg if loading backward)
      */
-    BOOL is_active = TRUE;
+    BOOL is_active = backward_load?(json_array_size(instances)==0):TRUE;
 
     /*
      *  Filter by callback
@@ -213,13 +264,7 @@ PRIVATE int load_record_callback(
     /*
      *  max_key_instances
      */
-    unsigned max_key_instances = kw_get_int(
-        jn_filter2,
-        "max_key_instances",
-        0,
-        KW_WILD_NUMBER
-    );
-    if(max_key_instances > 0) {
+    if(max_key_instances > 0 && !backward_load) {
         if(json_array_size(instances) >= max_key_instances) {
             json_t *instance2remove = json_array_get(instances, 0);
             if(instance2remove != instance) {
@@ -254,6 +299,12 @@ PRIVATE int load_record_callback(
         }
         json_array_insert_new(instances, idx, instance);
 
+    } else if(backward_load) {
+        /*
+         *  Order by rowid, the older go to the head
+         */
+        json_array_insert_new(instances, 0, instance);
+
     } else {
         /*
          *  Order by rowid
@@ -268,29 +319,89 @@ PRIVATE int load_record_callback(
         json_object_set(message, "active", instance);
     }
 
+    /*
+     *  Loading backward: end when all the expected keys are complete
+     */
+    if(backward_load && max_key_instances > 0 &&
+            json_array_size(instances) == max_key_instances) {
+        json_int_t expected_keys = kw_get_int(list, "__expected_keys__", 0, 0);
+        json_int_t completed_keys = kw_get_int(list, "__completed_keys__", 0, 0) + 1;
+        json_object_set_new(list, "__completed_keys__", json_integer(completed_keys));
+        if(expected_keys > 0 && completed_keys >= expected_keys) {
+            return -1;  // break the load, all keys are complete
+        }
+    }
+
     return 0;  // Timeranger does not load the record, it's me.
 }
 
 /***************************************************************************
  *
  ***************************************************************************/
-PUBLIC json_t *trmsg_open_list( // TODO esta fn provoca el retardo en arrancar de las aplicaciones
+PUBLIC json_t *trmsg_open_list(
     json_t *tranger,
     const char *topic_name,
     json_t *jn_filter  // owned
 )
 {
-    json_t *jn_list = json_pack("{s:s, s:o, s:I, s:o}",
+    json_t *match_cond = jn_filter?jn_filter:json_object();
+    json_int_t expected_keys = 0;
+    json_int_t load_timer = 0;
+
+    /*
+     *  With max_key_instances load backward: only the kept instances are read.
+     *  Not with order_by_tm or trmsg_instance_callback, they need all the instances.
+     */
+    if(kw_get_int(match_cond, "max_key_instances", 0, KW_WILD_NUMBER) > 0 &&
+        !kw_has_key(match_cond, "backward") &&
+        !kw_get_bool(match_cond, "order_by_tm", 0, 0) &&
+        !kw_get_int(match_cond, "trmsg_instance_callback", 0, 0)
+    ) {
+        json_object_set_new(match_cond, "backward", json_true());
+        json_object_set_new(match_cond, "only_md", json_true());
+    }
+
+    if(kw_get_bool(match_cond, "backward", 0, 0)) {
+        json_t *jn_key = json_object_get(match_cond, "key");
+        if(json_is_array(jn_key)) {
+            expected_keys = json_array_size(jn_key);
+        } else if(json_is_object(jn_key)) {
+            expected_keys = json_object_size(jn_key);
+        } else if(jn_key) {
+            expected_keys = 1;
+        }
+        json_int_t max_load_time = kw_get_int(match_cond, "max_load_time", 0, KW_WILD_NUMBER);
+        if(max_load_time > 0) {
+            load_timer = (json_int_t)start_msectimer(max_load_time);
+        }
+    }
+
+    /*
+     *  The match_fields filter is evaluated by every loaded record, compile it once
+     */
+    kw_filter match_fields_filter = 0;
+    json_t *match_fields = kw_get_dict_value(match_cond, "match_fields", 0, 0);
+    if(match_fields) {
+        match_fields_filter = kw_filter_compile(json_incref(match_fields));
+    }
+
+    json_t *jn_list = json_pack("{s:s, s:o, s:I, s:o, s:I, s:I, s:I}",
         "topic_name", topic_name,
-        "match_cond", jn_filter?jn_filter:json_object(),
+        "match_cond", match_cond,
         "load_record_callback", (json_int_t)(size_t)load_record_callback,
-        "messages", json_object()
+        "messages", json_object(),
+        "__expected_keys__", expected_keys,
+        "__load_timer__", load_timer,
+        "__match_fields_filter__", (json_int_t)(size_t)match_fields_filter
     );
 
     json_t *list = tranger_open_list(
         tranger,
         jn_list // owned
     );
+    if(!list) {
+        kw_filter_free(match_fields_filter);
+    }
     return list;
 }
 
@@ -302,6 +413,10 @@ PUBLIC int trmsg_close_list(
     json_t *tr_list
 )
 {
+    kw_filter match_fields_filter = (kw_filter)(size_t)kw_get_int(
+        tr_list, "__match_fields_filter__", 0, 0
+    );
+    kw_filter_free(match_fields_filter);
     return tranger_close_list(tranger, tr_list);
 }
 
@@ -393,13 +508,13 @@ PUBLIC json_t *trmsg_data_tree(
 {
     json_t *jn_records = json_array();
     json_t *messages = trmsg_get_messages(list);
+    kw_filter filter = kw_filter_compile(jn_filter); // compiled once for all the records
 
     const char *key;
     json_t *message;
     json_object_foreach(messages, key, message) {
         json_t *active = kw_get_dict_value(message, "active", 0, KW_REQUIRED);
-        JSON_INCREF(jn_filter);
-        if(kw_match_simple(active, jn_filter)) {
+        if(kw_filter_match(filter, active)) {
             json_t *jn_active = json_incref(active);
             json_array_append_new(jn_records, jn_active);
             json_t *jn_data = kw_get_list(jn_active, "data", json_array(), KW_CREATE);
@@ -421,8 +536,7 @@ PUBLIC json_t *trmsg_data_tree(
                     }
                 }
 
-                JSON_INCREF(jn_filter);
-                if(kw_match_simple(instance, jn_filter)) {
+                if(kw_filter_match(filter, instance)) {
                     json_t *jn_instance = json_incref(instance);
                     json_array_append_new(jn_data, jn_instance);
                 }
@@ -430,7 +544,7 @@ PUBLIC json_t *trmsg_data_tree(
         }
     }
 
-    JSON_DECREF(jn_filter);
+    kw_filter_free(filter);
     return jn_records;
 }
 
@@ -445,20 +559,20 @@ PUBLIC json_t *trmsg_active_records(
 {
     json_t *jn_records = json_array();
     json_t *messages = trmsg_get_messages(list);
+    kw_filter filter = kw_filter_compile(jn_filter); // compiled once for all the records
 
     const char *key;
     json_t *message;
     void *n;
     json_object_foreach_safe(messages, n, key, message) {
         json_t *active = json_object_get(message, "active");
-        JSON_INCREF(jn_filter);
-        if(kw_match_simple(active, jn_filter)) {
+        if(kw_filter_match(filter, active)) {
             json_t *jn_active = json_incref(active);
             json_array_append_new(jn_records, jn_active);
         }
     }
 
-    JSON_DECREF(jn_filter);
+    kw_filter_free(filter);
     return jn_records;
 }
 
@@ -475,18 +589,18 @@ PUBLIC json_t *trmsg_record_instances(
     json_t *jn_records = json_array();
 
     json_t *instances = trmsg_get_instances(list, key);
+    kw_filter filter = kw_filter_compile(jn_filter); // compiled once for all the records
 
     int idx;
     json_t *jn_value;
     json_array_foreach(instances, idx, jn_value) {
-        JSON_INCREF(jn_filter);
-        if(kw_match_simple(jn_value, jn_filter)) {
+        if(kw_filter_match(filter, jn_value)) {
             json_t *jn_record = json_incref(jn_value); // Your copy
             json_array_append_new(jn_records, jn_record);
         }
     }
 
-    JSON_DECREF(jn_filter);
+    kw_filter_free(filter);
     return jn_records;
 }
 
@@ -508,24 +622,24 @@ PUBLIC int trmsg_foreach_active_messages(
 )
 {
     json_t *messages = trmsg_get_messages(list);
+    kw_filter filter = kw_filter_compile(jn_filter); // compiled once for all the records
 
     const char *key;
     json_t *message;
     void *n;
     json_object_foreach_safe(messages, n, key, message) {
         json_t *active = json_object_get(message, "active");
-        JSON_INCREF(jn_filter);
-        if(kw_match_simple(active, jn_filter)) {
+        if(kw_filter_match(filter, active)) {
             json_t *jn_active = json_incref(active); // Your copy
 
             if(callback(list, key, jn_active, user_data1, user_data2)<0) {
-                JSON_DECREF(jn_filter);
+                kw_filter_free(filter);
                 return -1;
             }
         }
     }
 
-    JSON_DECREF(jn_filter);
+    kw_filter_free(filter);
     return 0;
 }
 
@@ -547,6 +661,7 @@ PUBLIC int trmsg_foreach_instances_messages(
 )
 {
     json_t *messages = trmsg_get_messages(list);
+    kw_filter filter = kw_filter_compile(jn_filter); // compiled once for all the records
 
     const char *key;
     json_t *message;
@@ -557,19 +672,18 @@ PUBLIC int trmsg_foreach_instances_messages(
 
         int idx; json_t *instance;
         json_array_foreach(instances, idx, instance) {
-            JSON_INCREF(jn_filter);
-            if(kw_match_simple(instance, jn_filter)) {
+            if(kw_filter_match(filter, instance)) {
                 json_t *jn_instance = json_incref(instance);
                 json_array_append_new(jn_instances, jn_instance);
             }
         }
         if(callback(list, key, jn_instances, user_data1, user_data2)<0) {
-            JSON_DECREF(jn_filter);
+            kw_filter_free(filter);
             return -1;
         }
     }
 
-    JSON_DECREF(jn_filter);
+    kw_filter_free(filter);
     return 0;
 }
 
@@ -594,14 +708,14 @@ PUBLIC int trmsg_foreach_messages(
 )
 {
     json_t *messages = trmsg_get_messages(list);
+    kw_filter filter = kw_filter_compile(jn_filter); // compiled once for all the records
 
     const char *key;
     json_t *message;
     void *n;
     json_object_foreach_safe(messages, n, key, message) {
         json_t *jn_message;
-        JSON_INCREF(jn_filter);
-        if(kw_match_simple(message, jn_filter)) {
+        if(kw_filter_match(filter, message)) {
             if(duplicated) {
                 jn_message = json_deep_copy(message);
             } else {
@@ -609,12 +723,12 @@ PUBLIC int trmsg_foreach_messages(
             }
 
             if(callback(list, key, jn_message, user_data1, user_data2)<0) {
-                JSON_DECREF(jn_filter);
+                kw_filter_free(filter);
                 return -1;
             }
         }
     }
 
-    JSON_DECREF(jn_filter);
+    kw_filter_free(filter);
     return 0;
 }
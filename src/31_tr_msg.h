@@ -163,6 +163,11 @@ PUBLIC int trmsg_add_instance(
     jn_filter (match_cond) of second level:
 
         max_key_instances   (int) Maximum number of instances per key.
+                            The topic is loaded backward, reading only the kept instances,
+                            and the load ends when the keys of "key" have their instances.
+                            (Not with order_by_tm or trmsg_instance_callback)
+
+        max_load_time       (int) Loading backward, maximum time (miliseconds) of the load.
 
         order_by_tm         (bool) Not use with max_key_instances=1
 
@@ -187,7 +192,7 @@ typedef int (*trmsg_instance_callback_t)(
     json_t *instance    // not yours
 );
 
-PUBLIC json_t *trmsg_open_list( // TODO esta fn provoca el retardo en arrancar de las aplicaciones
+PUBLIC json_t *trmsg_open_list( // WARNING use max_key_instances, loading all the instances delays the startup
     json_t *tranger,
     const char *topic_name,
     json_t *jn_filter  // owned
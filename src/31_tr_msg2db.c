@@ -12,6 +12,8 @@
 ***********************************************************************/
 #include <string.h>
 #include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
 #include "31_tr_msg2db.h"
 
 /***************************************************************
@@ -21,6 +23,42 @@
 /***************************************************************
  *              Structures
  ***************************************************************/
+/*
+ *  Cache of records, used when the msg2db has a memory budget (max_cached_records).
+ *  The indexes keep only the __rowid__ of the records,
+ *  the records are paged in from TimeRanger and kept in a LRU list.
+ */
+typedef struct {
+    DL_ITEM_FIELDS
+
+    json_t *record;
+    char key[NAME_MAX];     // "topic_name^rowid"
+} cache_item_t;
+
+typedef struct {
+    size_t max_cached_records;
+    dl_list_t dl_lru;       // head: least recently used
+    json_t *jn_items;       // {"topic_name^rowid": (cache_item_t *)}
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t page_in_usec;
+    uint64_t page_in_max_usec;
+} msg2db_cache_t;
+
+/*
+ *  Topic handle: direct access to the indexes of a msg2db topic
+ */
+typedef struct {
+    json_t *tranger;
+    json_t *topic;          // tranger topic
+    json_t *indexx;         // {id: {pkey2: record (or __rowid__ with memory budget)}}
+    msg2db_cache_t *cache;  // not null with memory budget
+    json_t *last_message;   // result of the last msg2db_get_message() with memory budget
+    char msg2db_name[NAME_MAX];
+    char topic_name[NAME_MAX];
+} msg2db_topic_t;
 
 
 /***************************************************************
@@ -44,6 +82,12 @@ PRIVATE int load_record_callback(
     md_record_t *md_record,
     json_t *jn_record // must be owned, can be null if sf_loading_from_disk
 );
+PRIVATE int _set_volatil_values(
+    json_t *tranger,
+    const char *topic_name,
+    json_t *record,  // not owned
+    json_t *kw // not owned
+);
 
 /***************************************************************
  *              Data
@@ -65,6 +109,325 @@ PUBLIC char *build_msg2db_index_path(
     return bf;
 }
 
+
+
+
+                    /*------------------------------------*
+                     *      Cache of records
+                     *------------------------------------*/
+
+
+
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE uint64_t monotonic_usec(void)
+{
+    struct timespec spec;
+
+#ifdef WIN32
+    timespec_get(&spec, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+#endif
+    return ((uint64_t)spec.tv_sec) * 1000000 + spec.tv_nsec / 1000;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE msg2db_cache_t *cache_create(size_t max_cached_records)
+{
+    msg2db_cache_t *cache = gbmem_malloc(sizeof(msg2db_cache_t));
+    if(!cache) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "Cannot create msg2db cache. gbmem_malloc() FAILED",
+            NULL
+        );
+        return 0;
+    }
+    cache->max_cached_records = max_cached_records;
+    dl_init(&cache->dl_lru);
+    cache->jn_items = json_object();
+    return cache;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void free_cache_item(void *item_)
+{
+    cache_item_t *item = item_;
+    JSON_DECREF(item->record);
+    gbmem_free(item);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void cache_destroy(msg2db_cache_t *cache)
+{
+    if(!cache) {
+        return;
+    }
+    dl_flush(&cache->dl_lru, free_cache_item);
+    JSON_DECREF(cache->jn_items);
+    gbmem_free(cache);
+}
+
+/***************************************************************************
+ *  Return the cache of msg2db, null if the msg2db has no memory budget
+ ***************************************************************************/
+PRIVATE msg2db_cache_t *get_cache(json_t *msg2db)
+{
+    return (msg2db_cache_t *)(size_t)kw_get_int(msg2db, "__cache__", 0, 0);
+}
+
+/***************************************************************************
+ *  Keys of the msg2db dict that are not topics
+ ***************************************************************************/
+PRIVATE BOOL is_internal_key(const char *key)
+{
+    return (strcmp(key, "__schema_version__")==0 ||
+        strcmp(key, "__cache__")==0 ||
+        strcmp(key, "__handles__")==0)? TRUE:FALSE;
+}
+
+/***************************************************************************
+ *  Return the cached record (NOT YOURS) or null
+ ***************************************************************************/
+PRIVATE json_t *cache_get(
+    msg2db_cache_t *cache,
+    const char *topic_name,
+    uint64_t rowid,
+    BOOL scan   // don't change the order of use
+)
+{
+    char key[NAME_MAX];
+    snprintf(key, sizeof(key), "%s^%"PRIu64, topic_name, rowid);
+    cache_item_t *item = (cache_item_t *)(size_t)json_integer_value(
+        json_object_get(cache->jn_items, key)
+    );
+    if(!item) {
+        cache->misses++;
+        return 0;
+    }
+    cache->hits++;
+
+    /*
+     *  Most recently used to the tail
+     */
+    if(!scan && dl_last(&cache->dl_lru) != item) {
+        dl_delete(&cache->dl_lru, item, 0);
+        dl_add(&cache->dl_lru, item);
+    }
+    return item->record;
+}
+
+/***************************************************************************
+ *  Add the record to the cache, evicting the least recently used records
+ ***************************************************************************/
+PRIVATE int cache_add(
+    msg2db_cache_t *cache,
+    const char *topic_name,
+    uint64_t rowid,
+    json_t *record // incref
+)
+{
+    cache_item_t *item = gbmem_malloc(sizeof(cache_item_t));
+    if(!item) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "Cannot create cache item. gbmem_malloc() FAILED",
+            NULL
+        );
+        return -1;
+    }
+    snprintf(item->key, sizeof(item->key), "%s^%"PRIu64, topic_name, rowid);
+    item->record = json_incref(record);
+
+    cache_item_t *prev = (cache_item_t *)(size_t)json_integer_value(
+        json_object_get(cache->jn_items, item->key)
+    );
+    if(prev) {
+        dl_delete(&cache->dl_lru, prev, free_cache_item);
+    }
+    json_object_set_new(cache->jn_items, item->key, json_integer((json_int_t)(size_t)item));
+    dl_add(&cache->dl_lru, item);
+
+    while(dl_size(&cache->dl_lru) > cache->max_cached_records) {
+        cache_item_t *lru = dl_first(&cache->dl_lru);
+        json_object_del(cache->jn_items, lru->key);
+        dl_delete(&cache->dl_lru, lru, free_cache_item);
+        cache->evictions++;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Return the record, reading it from TimeRanger if it's not cached.
+ *  In scans (full lists) the records read are not cached,
+ *  they would evict the most used records.
+ ***************************************************************************/
+PRIVATE json_t *page_in_record( // Return MUST be decref
+    json_t *tranger,
+    msg2db_cache_t *cache,
+    const char *msg2db_name,
+    const char *topic_name,
+    uint64_t rowid,
+    BOOL scan
+)
+{
+    json_t *record = cache_get(cache, topic_name, rowid, scan);
+    if(record) {
+        return json_incref(record);
+    }
+
+    uint64_t t0 = monotonic_usec();
+
+    json_t *topic = tranger_topic(tranger, topic_name);
+    md_record_t md_record;
+    if(tranger_get_record(tranger, topic, rowid, &md_record, TRUE)<0) {
+        // Error already logged
+        return 0;
+    }
+    record = tranger_read_record_content(tranger, topic, &md_record);
+    if(!record) {
+        // Error already logged
+        return 0;
+    }
+
+    json_t *jn_record_md = _md2json(
+        msg2db_name,
+        topic_name,
+        &md_record
+    );
+    json_object_set_new(jn_record_md, "pkey2", json_string(kw_get_str(topic, "pkey2", 0, 0)));
+    json_object_set_new(record, "__md_msg2db__", jn_record_md);
+    _set_volatil_values(
+        tranger,
+        topic_name,
+        record,  // not owned
+        record // not owned
+    );
+
+    if(!scan) {
+        cache_add(cache, topic_name, rowid, record);
+    }
+
+    uint64_t t = monotonic_usec() - t0;
+    cache->page_in_usec += t;
+    if(t > cache->page_in_max_usec) {
+        cache->page_in_max_usec = t;
+    }
+
+    return record;
+}
+
+/***************************************************************************
+ *  Create the handle of a topic
+ ***************************************************************************/
+PRIVATE msg2db_topic_t *topic_handle_create(
+    json_t *tranger,
+    const char *msg2db_name,
+    const char *topic_name,
+    json_t *indexx,
+    msg2db_cache_t *cache
+)
+{
+    msg2db_topic_t *h = gbmem_malloc(sizeof(msg2db_topic_t));
+    if(!h) {
+        log_error(LOG_OPT_TRACE_STACK,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "Cannot create msg2db topic. gbmem_malloc() FAILED",
+            NULL
+        );
+        return 0;
+    }
+    h->tranger = tranger;
+    h->topic = tranger_topic(tranger, topic_name);
+    h->indexx = indexx;
+    h->cache = cache;
+    h->last_message = 0;
+    snprintf(h->msg2db_name, sizeof(h->msg2db_name), "%s", msg2db_name);
+    snprintf(h->topic_name, sizeof(h->topic_name), "%s", topic_name);
+    return h;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void topic_handle_destroy(msg2db_topic_t *h)
+{
+    JSON_DECREF(h->last_message);
+    gbmem_free(h);
+}
+
+/***************************************************************************
+ *  Set a node in the index, without paths
+ ***************************************************************************/
+PRIVATE void index_set_node(
+    json_t *indexx,
+    const char *id,
+    const char *pkey2_value,
+    json_t *node // owned
+)
+{
+    json_t *pkey2_dict = json_object_get(indexx, id);
+    if(!pkey2_dict) {
+        pkey2_dict = json_object();
+        json_object_set_new(indexx, id, pkey2_dict);
+    }
+    json_object_set_new(pkey2_dict, pkey2_value, node);
+}
+
+/***************************************************************************
+ *  Return the handle of a msg2db topic, null if not found (silence)
+ ***************************************************************************/
+PRIVATE msg2db_topic_t *get_topic_handle(
+    json_t *tranger,
+    const char *msg2db_name,
+    const char *topic_name
+)
+{
+    json_t *msg2db = json_object_get(json_object_get(tranger, "msg2dbs"), msg2db_name);
+    json_t *handles = json_object_get(msg2db, "__handles__");
+    return (msg2db_topic_t *)(size_t)json_integer_value(json_object_get(handles, topic_name));
+}
+
+/***************************************************************************
+ *  Return the handle of a msg2db topic
+ ***************************************************************************/
+PUBLIC msg2db_topic msg2db_get_topic(
+    json_t *tranger,
+    const char *msg2db_name,
+    const char *topic_name
+)
+{
+    msg2db_topic_t *h = get_topic_handle(tranger, msg2db_name, topic_name);
+    if(!h) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MSG2DB_ERROR,
+            "msg",          "%s", "Msg2Db Topic NOT FOUND",
+            "msg2db_name",  "%s", msg2db_name,
+            "topic_name",   "%s", topic_name,
+            NULL
+        );
+        return 0;
+    }
+    return h;
+}
+
 /***************************************************************************
     Open a message2 db (Remember previously open tranger_startup())
 
@@ -128,6 +491,11 @@ PUBLIC json_t *msg2db_open_db(
     json_int_t schema_new_version = kw_get_int(jn_schema, "schema_version", 0, KW_WILD_NUMBER);
     int schema_version = schema_new_version;
 
+    /*
+     *  Memory budget, it's not a persistent attribute of the schema
+     */
+    json_int_t max_cached_records = kw_get_int(jn_schema, "max_cached_records", 0, KW_WILD_NUMBER);
+
     if(options && strstr(options,"persistent")) {
         do {
             BOOL recreating = FALSE;
@@ -321,6 +689,12 @@ PUBLIC json_t *msg2db_open_db(
     json_t *msg2dbs = kw_get_dict(tranger, "msg2dbs", json_object(), KW_CREATE);
     msg2db = kw_get_dict(msg2dbs, msg2db_name, json_object(), KW_CREATE);
     kw_get_int(msg2db, "__schema_version__", schema_version, KW_CREATE|KW_WILD_NUMBER);
+    if(max_cached_records > 0) {
+        msg2db_cache_t *cache = cache_create(max_cached_records);
+        if(cache) {
+            json_object_set_new(msg2db, "__cache__", json_integer((json_int_t)(size_t)cache));
+        }
+    }
 
     /*------------------------------*
      *  Open "system" lists
@@ -337,16 +711,34 @@ PUBLIC json_t *msg2db_open_db(
         }
         build_msg2db_index_path(path, sizeof(path), msg2db_name, topic_name, "id");
 
-        kw_get_subdict_value(msg2db, topic_name, "id", json_object(), KW_CREATE);
+        json_t *indexx = kw_get_subdict_value(msg2db, topic_name, "id", json_object(), KW_CREATE);
+
+        msg2db_topic_t *h = topic_handle_create(
+            tranger,
+            msg2db_name,
+            topic_name,
+            indexx,
+            get_cache(msg2db)
+        );
+        if(!h) {
+            // Error already logged
+            continue;
+        }
+        json_object_set_new(
+            kw_get_dict(msg2db, "__handles__", json_object(), KW_CREATE),
+            topic_name,
+            json_integer((json_int_t)(size_t)h)
+        );
 
         json_t *jn_filter = json_object();
 
-        json_t *jn_list = json_pack("{s:s, s:s, s:o, s:I, s:s}",
+        json_t *jn_list = json_pack("{s:s, s:s, s:o, s:I, s:s, s:I}",
             "id", path,
             "topic_name", topic_name,
             "match_cond", jn_filter,
             "load_record_callback", (json_int_t)(size_t)load_record_callback,
-            "msg2db_name", msg2db_name
+            "msg2db_name", msg2db_name,
+            "msg2db_topic", (json_int_t)(size_t)h
         );
         tranger_open_list(
             tranger,
@@ -386,7 +778,7 @@ PUBLIC int msg2db_close_db(
     char list_id[NAME_MAX];
     const char *topic_name; json_t *topic_records;
     json_object_foreach(msg2db, topic_name, topic_records) {
-        if(strcmp(topic_name, "__schema_version__")==0) {
+        if(is_internal_key(topic_name)) {
             continue;
         }
         build_msg2db_index_path(list_id, sizeof(list_id), msg2db_name, topic_name, "id");
@@ -406,6 +798,11 @@ PUBLIC int msg2db_close_db(
         tranger_close_list(tranger, list);
     }
 
+    json_t *jn_handle;
+    json_object_foreach(kw_get_dict(msg2db, "__handles__", 0, 0), topic_name, jn_handle) {
+        topic_handle_destroy((msg2db_topic_t *)(size_t)json_integer_value(jn_handle));
+    }
+    cache_destroy(get_cache(msg2db));
     JSON_DECREF(msg2db);
     JSON_DECREF(topic_cols_desc);
     return 0;
@@ -870,21 +1267,14 @@ PRIVATE int load_record_callback(
         const char *msg2db_name = kw_get_str(list, "msg2db_name", 0, KW_REQUIRED);
         const char *topic_name = kw_get_str(list, "topic_name", 0, KW_REQUIRED);
 
-        char path[NAME_MAX];
-        build_msg2db_index_path(path, sizeof(path), msg2db_name, topic_name, "id");
-        json_t *indexx = kw_get_dict(
-            tranger,
-            path,
-            0,
-            KW_REQUIRED
-        );
-        if(!indexx) {
+        msg2db_topic_t *h = (msg2db_topic_t *)(size_t)kw_get_int(list, "msg2db_topic", 0, KW_REQUIRED);
+        if(!h) {
             log_error(0,
                 "gobj",         "%s", __FILE__,
                 "function",     "%s", __FUNCTION__,
                 "msgset",       "%s", MSGSET_MSG2DB_ERROR,
                 "msg",          "%s", "Msg2Db Topic indexx NOT FOUND",
-                "path",         "%s", path,
+                "msg2db_name",  "%s", msg2db_name,
                 "topic_name",   "%s", topic_name,
                 NULL
             );
@@ -914,7 +1304,7 @@ PRIVATE int load_record_callback(
                 "function",     "%s", __FUNCTION__,
                 "msgset",       "%s", MSGSET_MSG2DB_ERROR,
                 "msg",          "%s", "Field 'pkey2' required",
-                "path",         "%s", path,
+                "msg2db_name",  "%s", msg2db_name,
                 "topic_name",   "%s", topic_name,
                 "pkey2",        "%s", pkey2_col,
                 "jn_record",    "%j", jn_record,
@@ -937,13 +1327,25 @@ PRIVATE int load_record_callback(
         /*-------------------------------*
          *  Write node
          *-------------------------------*/
-        JSON_INCREF(jn_record);
-        kw_set_subdict_value(
-            indexx,
-            md_record->key.s,
-            pkey2_value,
-            jn_record
-        );
+        if(h->cache) {
+            /*
+             *  With memory budget the index keeps only the rowid
+             */
+            index_set_node(
+                h->indexx,
+                md_record->key.s,
+                pkey2_value,
+                json_integer(md_record->__rowid__)
+            );
+        } else {
+            JSON_INCREF(jn_record);
+            index_set_node(
+                h->indexx,
+                md_record->key.s,
+                pkey2_value,
+                jn_record
+            );
+        }
     } else {
         /*---------------------------------*
          *      Working in memory
@@ -964,28 +1366,32 @@ PUBLIC json_t *msg2db_append_message( // Return is NOT YOURS
     json_t *kw,    // owned
     const char *options // "permissive"
 )
+{
+    json_t *record = msg2db_append_message_ref(tranger, msg2db_name, topic_name, kw, options);
+    if(record) {
+        // Kept by the index, or by the cache with memory budget
+        json_decref(record);
+    }
+    return record;
+}
+
+/***************************************************************************
+ *  Like msg2db_append_message() but returning a new reference
+ ***************************************************************************/
+PUBLIC json_t *msg2db_append_message_ref( // Return MUST be decref
+    json_t *tranger,
+    const char *msg2db_name,
+    const char *topic_name,
+    json_t *kw,    // owned
+    const char *options // "permissive"
+)
 {
     /*-------------------------------*
      *      Get indexx
      *-------------------------------*/
-    char path[NAME_MAX];
-    build_msg2db_index_path(path, sizeof(path), msg2db_name, topic_name, "id");
-    json_t *indexx = kw_get_dict(
-        tranger,
-        path,
-        0,
-        KW_REQUIRED
-    );
-    if(!indexx) {
-        log_error(0,
-            "gobj",         "%s", __FILE__,
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MSG2DB_ERROR,
-            "msg",          "%s", "Msg2Db Topic indexx NOT FOUND",
-            "path",         "%s", path,
-            "topic_name",   "%s", topic_name,
-            NULL
-        );
+    msg2db_topic_t *h = msg2db_get_topic(tranger, msg2db_name, topic_name);
+    if(!h) {
+        // Error already logged
         JSON_DECREF(kw);
         return 0;
     }
@@ -1011,7 +1417,7 @@ PUBLIC json_t *msg2db_append_message( // Return is NOT YOURS
                 "function",     "%s", __FUNCTION__,
                 "msgset",       "%s", MSGSET_MSG2DB_ERROR,
                 "msg",          "%s", "Field 'id' required",
-                "path",         "%s", path,
+                "msg2db_name",  "%s", msg2db_name,
                 "topic_name",   "%s", topic_name,
                 "kw",           "%j", kw,
                 NULL
@@ -1024,15 +1430,14 @@ PUBLIC json_t *msg2db_append_message( // Return is NOT YOURS
     /*-----------------------------------*
      *  Get the pkey2, it's mandatory
      *-----------------------------------*/
-    json_t *topic = tranger_topic(tranger, topic_name);
-    const char *pkey2_col = kw_get_str(topic, "pkey2", 0, 0);
+    const char *pkey2_col = kw_get_str(h->topic, "pkey2", 0, 0);
     if(!kw_has_key(kw, pkey2_col)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
             "msgset",       "%s", MSGSET_MSG2DB_ERROR,
             "msg",          "%s", "Field 'pkey2' required",
-            "path",         "%s", path,
+            "msg2db_name",  "%s", msg2db_name,
             "topic_name",   "%s", topic_name,
             "pkey2",        "%s", pkey2_col,
             "kw",           "%j", kw,
@@ -1097,12 +1502,26 @@ PUBLIC json_t *msg2db_append_message( // Return is NOT YOURS
     /*-------------------------------*
      *  Write node
      *-------------------------------*/
-    kw_set_subdict_value(
-        indexx,
-        id,
-        pkey2_value,
-        record
-    );
+    if(h->cache) {
+        /*
+         *  With memory budget the index keeps only the rowid,
+         *  the new record goes to the cache.
+         */
+        index_set_node(
+            h->indexx,
+            id,
+            pkey2_value,
+            json_integer(md_record.__rowid__)
+        );
+        cache_add(h->cache, topic_name, md_record.__rowid__, record);
+    } else {
+        index_set_node(
+            h->indexx,
+            id,
+            pkey2_value,
+            json_incref(record)
+        );
+    }
 
     JSON_DECREF(kw);
     return record;
@@ -1123,32 +1542,68 @@ PUBLIC json_t *msg2db_list_messages( // Return MUST be decref
     )
 )
 {
-    /*-------------------------------*
-     *      Get indexx
-     *-------------------------------*/
-    char path[NAME_MAX];
-    build_msg2db_index_path(path, sizeof(path), msg2db_name, topic_name, "id");
-    json_t *indexx = kw_get_dict(
-        tranger,
-        path,
-        0,
-        0
-    );
-
-    if(!indexx) {
-        log_error(0,
-            "gobj",         "%s", __FILE__,
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_MSG2DB_ERROR,
-            "msg",          "%s", "Msg2Db Topic indexx NOT FOUND",
-            "path",         "%s", path,
-            "topic_name",   "%s", topic_name,
-            NULL
-        );
+    msg2db_topic_t *h = msg2db_get_topic(tranger, msg2db_name, topic_name);
+    if(!h) {
+        // Error already logged
         JSON_DECREF(jn_ids);
         JSON_DECREF(jn_filter);
         return 0;
     }
+    return msg2db_topic_list_messages(h, jn_ids, jn_filter, match_fn);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC json_t *msg2db_get_message( // Return is NOT YOURS
+    json_t *tranger,
+    const char *msg2db_name,
+    const char *topic_name,
+    const char *id,
+    const char *id2
+)
+{
+    msg2db_topic_t *h = msg2db_get_topic(tranger, msg2db_name, topic_name);
+    if(!h) {
+        // Error already logged
+        return 0;
+    }
+    return msg2db_topic_get_message(h, id, id2);
+}
+
+/***************************************************************************
+ *  Like msg2db_get_message() but returning a new reference
+ ***************************************************************************/
+PUBLIC json_t *msg2db_get_message_ref( // Return MUST be decref
+    json_t *tranger,
+    const char *msg2db_name,
+    const char *topic_name,
+    const char *id,
+    const char *id2
+)
+{
+    msg2db_topic_t *h = msg2db_get_topic(tranger, msg2db_name, topic_name);
+    if(!h) {
+        // Error already logged
+        return 0;
+    }
+    return msg2db_topic_get_message_ref(h, id, id2);
+}
+
+/***************************************************************************
+ *  Like msg2db_list_messages() but with the topic handle
+ ***************************************************************************/
+PUBLIC json_t *msg2db_topic_list_messages( // Return MUST be decref
+    msg2db_topic msg2db_topic_,
+    json_t *jn_ids,     // owned
+    json_t *jn_filter,  // owned
+    BOOL (*match_fn) (
+        json_t *kw,         // not owned
+        json_t *jn_filter   // owned
+    )
+)
+{
+    msg2db_topic_t *h = msg2db_topic_;
 
     /*-------------------------------*
      *      Read
@@ -1156,33 +1611,49 @@ PUBLIC json_t *msg2db_list_messages( // Return MUST be decref
     if(!match_fn) {
         match_fn = kw_match_simple;
     }
+    kw_filter filter = 0;
+    if(match_fn == kw_match_simple) {
+        /*
+         *  Compile the filter once for all the records
+         */
+        JSON_INCREF(jn_filter);
+        filter = kw_filter_compile(jn_filter);
+    }
 
     json_t *list = json_array();
 
-    if(json_is_object(indexx)) {
-        const char *id; json_t *pkey2_dict;
-        json_object_foreach(indexx, id, pkey2_dict) {
-            if(!kwid_match_id(jn_ids, id)) {
-                continue;
+    const char *id; json_t *pkey2_dict;
+    json_object_foreach(h->indexx, id, pkey2_dict) {
+        if(!kwid_match_id(jn_ids, id)) {
+            continue;
+        }
+        const char *pkey2; json_t *node;
+        json_object_foreach(pkey2_dict, pkey2, node) {
+            if(h->cache) {
+                node = page_in_record(
+                    h->tranger, h->cache, h->msg2db_name, h->topic_name, json_integer_value(node),
+                    TRUE
+                );
+                if(!node) {
+                    continue;
+                }
+            } else {
+                json_incref(node);
             }
-            const char *pkey2; json_t *node;
-            json_object_foreach(pkey2_dict, pkey2, node) {
+            BOOL matched;
+            if(filter) {
+                matched = kw_filter_match(filter, node);
+            } else {
                 JSON_INCREF(jn_filter);
-                if(match_fn(node, jn_filter)) {
-                    json_array_append(list, node);
-                }
+                matched = match_fn(node, jn_filter);
+            }
+            if(matched) {
+                json_array_append(list, node);
             }
+            json_decref(node);
         }
-    } else  {
-        log_error(0,
-            "gobj",         "%s", __FILE__,
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-            "msg",          "%s", "kw MUST BE a json object",
-            NULL
-        );
-        JSON_DECREF(list);
     }
+    kw_filter_free(filter);
 
     JSON_DECREF(jn_ids);
     JSON_DECREF(jn_filter);
@@ -1191,61 +1662,149 @@ PUBLIC json_t *msg2db_list_messages( // Return MUST be decref
 }
 
 /***************************************************************************
- *
+ *  Like msg2db_get_message() but with the topic handle
  ***************************************************************************/
-PUBLIC json_t *msg2db_get_message( // Return is NOT YOURS
-    json_t *tranger,
-    const char *msg2db_name,
-    const char *topic_name,
+PUBLIC json_t *msg2db_topic_get_message( // Return is NOT YOURS
+    msg2db_topic msg2db_topic_,
     const char *id,
     const char *id2
 )
 {
-    /*-------------------------------*
-     *      Get indexx
-     *-------------------------------*/
-    char path[NAME_MAX];
-    build_msg2db_index_path(path, sizeof(path), msg2db_name, topic_name, "id");
-    json_t *indexx = kw_get_dict(
-        tranger,
-        path,
-        0,
-        0
-    );
+    msg2db_topic_t *h = msg2db_topic_;
+
+    json_t *message = msg2db_topic_get_message_ref(h, id, id2);
+    if(!message) {
+        return 0;
+    }
+    if(!h->cache) {
+        // Kept by the index
+        json_decref(message);
+        return message;
+    }
+
+    /*
+     *  Memory budget: valid until the next get of the topic
+     */
+    JSON_DECREF(h->last_message);
+    h->last_message = message;
+    return message;
+}
+
+/***************************************************************************
+ *  Like msg2db_topic_get_message() but returning a new reference
+ ***************************************************************************/
+PUBLIC json_t *msg2db_topic_get_message_ref( // Return MUST be decref
+    msg2db_topic msg2db_topic_,
+    const char *id,
+    const char *id2
+)
+{
+    msg2db_topic_t *h = msg2db_topic_;
+
+    json_t *pkey2_dict = json_object_get(h->indexx, id);
+    if(!pkey2_dict) {
+        return 0;
+    }
+    if(!h->cache) {
+        if(!empty_string(id2)) {
+            return json_incref(json_object_get(pkey2_dict, id2));
+        }
+        return json_incref(pkey2_dict);
+    }
 
-    if(!indexx) {
+    /*
+     *  Memory budget: page in the records
+     */
+    if(!empty_string(id2)) {
+        json_t *jn_rowid = json_object_get(pkey2_dict, id2);
+        if(!jn_rowid) {
+            return 0;
+        }
+        return page_in_record(
+            h->tranger, h->cache, h->msg2db_name, h->topic_name, json_integer_value(jn_rowid),
+            FALSE
+        );
+    }
+
+    /*
+     *  The dict of pkey2 records
+     */
+    json_t *message = json_object();
+    const char *pkey2; json_t *jn_rowid;
+    json_object_foreach(pkey2_dict, pkey2, jn_rowid) {
+        json_t *node = page_in_record(
+            h->tranger, h->cache, h->msg2db_name, h->topic_name, json_integer_value(jn_rowid),
+            FALSE
+        );
+        if(node) {
+            json_object_set_new(message, pkey2, node);
+        }
+    }
+    return message;
+}
+
+/***************************************************************************
+ *  Return stats of memory and page in latency
+ ***************************************************************************/
+PUBLIC json_t *msg2db_stats( // Return MUST be decref
+    json_t *tranger,
+    const char *msg2db_name
+)
+{
+    json_t *msg2db = kw_get_subdict_value(tranger, "msg2dbs", msg2db_name, 0, 0);
+    if(!msg2db) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
             "msgset",       "%s", MSGSET_MSG2DB_ERROR,
-            "msg",          "%s", "Msg2Db Topic indexx NOT FOUND",
-            "path",         "%s", path,
-            "topic_name",   "%s", topic_name,
+            "msg",          "%s", "Msg2db not found",
+            "msg2db_name",  "%s", msg2db_name,
             NULL
         );
         return 0;
     }
 
-    /*-------------------------------*
-     *      Read
-     *-------------------------------*/
-    if(json_is_object(indexx)) {
-        json_t *record;
-        if(!empty_string(id2)) {
-            record = kw_get_subdict_value(indexx, id, id2, 0, 0);
-        } else {
-            record = kw_get_dict_value(indexx, id, 0, 0);
+    json_t *jn_stats = json_object();
+
+    /*
+     *  Records in indexes
+     */
+    json_t *jn_topics = json_object();
+    json_int_t total_records = 0;
+    const char *topic_name; json_t *topic_records;
+    json_object_foreach(msg2db, topic_name, topic_records) {
+        if(is_internal_key(topic_name)) {
+            continue;
         }
-        return record;
-    } else  {
-        log_error(0,
-            "gobj",         "%s", __FILE__,
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_INTERNAL_ERROR,
-            "msg",          "%s", "kw MUST BE a json object",
-            NULL
+        json_int_t records = 0;
+        const char *id; json_t *pkey2_dict;
+        json_object_foreach(kw_get_dict(topic_records, "id", 0, 0), id, pkey2_dict) {
+            records += json_object_size(pkey2_dict);
+        }
+        json_object_set_new(jn_topics, topic_name, json_integer(records));
+        total_records += records;
+    }
+    json_object_set_new(jn_stats, "topics", jn_topics);
+    json_object_set_new(jn_stats, "records", json_integer(total_records));
+
+    /*
+     *  Cache
+     */
+    msg2db_cache_t *cache = get_cache(msg2db);
+    if(cache) {
+        json_object_set_new(jn_stats, "max_cached_records", json_integer(cache->max_cached_records));
+        json_object_set_new(jn_stats, "cached_records", json_integer(dl_size(&cache->dl_lru)));
+        json_object_set_new(jn_stats, "hits", json_integer(cache->hits));
+        json_object_set_new(jn_stats, "misses", json_integer(cache->misses));
+        json_object_set_new(jn_stats, "evictions", json_integer(cache->evictions));
+        json_object_set_new(jn_stats, "page_in_max_usec", json_integer(cache->page_in_max_usec));
+        json_object_set_new(jn_stats, "page_in_avg_usec",
+            json_integer(cache->misses?cache->page_in_usec/cache->misses:0)
         );
+    } else {
+        json_object_set_new(jn_stats, "max_cached_records", json_integer(0));
+        json_object_set_new(jn_stats, "cached_records", json_integer(total_records));
     }
 
-    return 0;
+    return jn_stats;
 }
@@ -27,6 +27,7 @@ extern "C"{
 /***************************************************************
  *              Structures
  ***************************************************************/
+typedef void *msg2db_topic;    // Handle of a msg2db topic, valid until msg2db_close_db()
 
 /***************************************************************
  *              Desc
@@ -61,6 +62,18 @@ extern "C"{
         Once saved,
             if you want to change the schema
             then you must change the schema version and topic_version
+
+    Memory budget: "max_cached_records" in jn_schema (0 or missing: all records in memory)
+        The budget is a number of records, not of bytes.
+        The indexes keep only the __rowid__ of the records,
+        and the records are paged in from TimeRanger to a LRU cache of max_cached_records.
+        The lists (msg2db_list_messages()) don't cache the records read,
+        a full scan doesn't evict the most used records.
+        WARNING then the records returned by msg2db_append_message() are valid
+        until they are evicted, and the ones of msg2db_get_message()
+        until the next msg2db_get_message() of the topic.
+        Use the *_ref() functions to get new references (MUST be decref),
+        an evicted record stays valid while the caller keeps it.
 **rst**/
 
 PUBLIC json_t *msg2db_open_db(
@@ -82,6 +95,13 @@ PUBLIC json_t *msg2db_append_message( // Return is NOT YOURS
     json_t *kw,    // owned
     const char *options // "permissive"
 );
+PUBLIC json_t *msg2db_append_message_ref( // Return MUST be decref
+    json_t *tranger,
+    const char *msg2db_name,
+    const char *topic_name,
+    json_t *kw,    // owned
+    const char *options // "permissive"
+);
 
 PUBLIC json_t *msg2db_list_messages( // Return MUST be decref
     json_t *tranger,
@@ -102,6 +122,50 @@ PUBLIC json_t *msg2db_get_message( // Return is NOT YOURS
     const char *id,
     const char *id2
 );
+PUBLIC json_t *msg2db_get_message_ref( // Return MUST be decref
+    json_t *tranger,
+    const char *msg2db_name,
+    const char *topic_name,
+    const char *id,
+    const char *id2
+);
+
+/*
+ *  Topic handle: direct access to the indexes of the topic, without building paths.
+ *  Get it once, and use it in the lookups.
+ */
+PUBLIC msg2db_topic msg2db_get_topic(
+    json_t *tranger,
+    const char *msg2db_name,
+    const char *topic_name
+);
+PUBLIC json_t *msg2db_topic_list_messages( // Return MUST be decref
+    msg2db_topic msg2db_topic,
+    json_t *jn_ids,     // owned
+    json_t *jn_filter,  // owned
+    BOOL (*match_fn) (
+        json_t *kw,         // not owned
+        json_t *jn_filter   // owned
+    )
+);
+PUBLIC json_t *msg2db_topic_get_message( // Return is NOT YOURS
+    msg2db_topic msg2db_topic,
+    const char *id,
+    const char *id2
+);
+PUBLIC json_t *msg2db_topic_get_message_ref( // Return MUST be decref
+    msg2db_topic msg2db_topic,
+    const char *id,
+    const char *id2
+);
+
+/*
+ *  Return stats: records by topic, cache (memory budget) and page in latency
+ */
+PUBLIC json_t *msg2db_stats( // Return MUST be decref
+    json_t *tranger,
+    const char *msg2db_name
+);
 
 /*
  *  Utilities
@@ -19,6 +19,15 @@
 /***************************************************************
  *              Structures
  ***************************************************************/
+/*
+ *  Collapsed view modes of hook and fkey fields, see "fkey options", "hook options"
+ */
+typedef enum {
+    VIEW_LIST_DICT = 0, // default
+    VIEW_ONLY_ID,
+    VIEW_REFS,
+    VIEW_SIZE,          // only hooks
+} view_mode_t;
 
 /***************************************************************
  *              Prototypes
@@ -95,6 +104,25 @@ PRIVATE json_t * treedb_get_activated_snap_tag(
     const char *treedb_name,
     uint32_t *user_flag
 );
+PRIVATE int snap_checkpoints_write(
+    json_t *tranger,
+    const char *treedb_name,
+    const char *topic_name,
+    const char *id,
+    json_t *record,
+    uint32_t tag,
+    uint64_t old_rowid,
+    uint64_t new_rowid
+);
+PRIVATE int snap_checkpoints_delete(
+    json_t *tranger,
+    const char *treedb_name,
+    const char *topic_name,
+    const char *id,
+    uint32_t tag,
+    uint64_t rowid,
+    const char *pkey2_name
+);
 
 PRIVATE json_int_t json_size(json_t *value);
 
@@ -106,6 +134,8 @@ PRIVATE json_t *apply_child_list_options(
     json_t *child_list,  // NOT owned
     json_t *jn_options // NOT owned
 );
+PRIVATE view_mode_t parent_ref_view_mode(json_t *jn_options);
+PRIVATE view_mode_t child_list_view_mode(json_t *jn_options);
 PRIVATE json_t *_list_childs(
     json_t *tranger,
     const char *hook,
@@ -118,6 +148,15 @@ PRIVATE json_t *_list_childs(
 PRIVATE json_t *topic_cols_desc = 0;
 PRIVATE BOOL treedb_trace = 0;
 
+/*
+ *  Pre-parsed paths of the node metadata
+ */
+PRIVATE kw_path_t kwp_md_treedb_name = KW_PATH_INIT("__md_treedb__`treedb_name");
+PRIVATE kw_path_t kwp_md_topic_name = KW_PATH_INIT("__md_treedb__`topic_name");
+PRIVATE kw_path_t kwp_md_pure_node = KW_PATH_INIT("__md_treedb__`__pure_node__");
+PRIVATE kw_path_t kwp_md_rowid = KW_PATH_INIT("__md_treedb__`__rowid__");
+PRIVATE kw_path_t kwp_md_tag = KW_PATH_INIT("__md_treedb__`__tag__");
+
 /***************************************************************************
  *
  ***************************************************************************/
@@ -736,6 +775,16 @@ PUBLIC json_t *treedb_open_db( // WARNING Return IS NOT YOURS!
         return 0;
     }
 
+    /*--------------------------------*
+     *  Compile the metadata paths,
+     *  before using treedb from other threads
+     *--------------------------------*/
+    kw_path_compile(&kwp_md_treedb_name);
+    kw_path_compile(&kwp_md_topic_name);
+    kw_path_compile(&kwp_md_pure_node);
+    kw_path_compile(&kwp_md_rowid);
+    kw_path_compile(&kwp_md_tag);
+
     /*--------------------------------*
      *      Create desc of cols
      *--------------------------------*/
@@ -3424,6 +3473,214 @@ PRIVATE BOOL is_fkey_registered(
     return FALSE;
 }
 
+/***************************************************************************
+ *  Hook index: hashed set of the childs linked in a parent's hook.
+
+        "treedbs`{treedb_name}`{parent_topic_name}`__hook_index__":
+        {
+            "$parent_id": {
+                "$hook_name": {
+                    "child_topic_name^child_id": position in the list hook (-1 in dict hooks),
+                    ...
+                }
+            }
+        }
+
+        "treedbs`{treedb_name}`{parent_topic_name}`__hook_refs__":
+        {
+            "$parent_id": {
+                "$hook_name": ["child_topic_name^child_id", ...] (only list hooks)
+            }
+        }
+
+    The hook field of the node remains the json view (list or dict) for the api,
+    the index gives O(1) membership and the position of the child in the list hook,
+    the refs list gives the child of a position.
+    A child is unlinked of a list hook by swap-remove:
+    the last child takes its position, the order of the list is not kept.
+ ***************************************************************************/
+PRIVATE json_t *_get_hook_index( // Return is NOT YOURS
+    json_t *tranger,
+    const char *treedb_name,
+    const char *parent_topic_name,
+    const char *index_name,
+    const char *parent_id,
+    const char *hook_name,
+    BOOL create
+)
+{
+    json_t *treedb = kw_get_subdict_value(tranger, "treedbs", treedb_name, 0, 0);
+    json_t *topic = json_object_get(treedb, parent_topic_name);
+    if(!json_is_object(topic)) {
+        return 0;
+    }
+
+    json_t *hook_index = json_object_get(topic, index_name);
+    if(!hook_index) {
+        if(!create) {
+            return 0;
+        }
+        hook_index = json_object();
+        json_object_set_new(topic, index_name, hook_index);
+    }
+
+    json_t *parent_index = json_object_get(hook_index, parent_id);
+    if(!parent_index) {
+        if(!create) {
+            return 0;
+        }
+        parent_index = json_object();
+        json_object_set_new(hook_index, parent_id, parent_index);
+    }
+
+    json_t *childs = json_object_get(parent_index, hook_name);
+    if(!childs) {
+        if(!create) {
+            return 0;
+        }
+        childs = strcmp(index_name, "__hook_refs__")==0? json_array():json_object();
+        json_object_set_new(parent_index, hook_name, childs);
+    }
+    return childs;
+}
+
+/***************************************************************************
+ *  Return the dict of the childs linked in a parent's hook
+ ***************************************************************************/
+PRIVATE json_t *get_hook_index( // Return is NOT YOURS
+    json_t *tranger,
+    const char *treedb_name,
+    const char *parent_topic_name,
+    const char *parent_id,
+    const char *hook_name,
+    BOOL create
+)
+{
+    return _get_hook_index(
+        tranger, treedb_name, parent_topic_name, "__hook_index__", parent_id, hook_name, create
+    );
+}
+
+/***************************************************************************
+ *  Return TRUE if the child was not in the index (it has been added)
+ *  The caller appends the child to the list hook after this call.
+ ***************************************************************************/
+PRIVATE BOOL hook_index_add(
+    json_t *tranger,
+    const char *treedb_name,
+    const char *parent_topic_name,
+    const char *parent_id,
+    const char *hook_name,
+    const char *child_topic_name,
+    const char *child_id,
+    json_t *parent_hook_data // NOT owned
+)
+{
+    json_t *childs = get_hook_index(
+        tranger, treedb_name, parent_topic_name, parent_id, hook_name, TRUE
+    );
+    if(!childs) {
+        // Not a treedb topic, nothing to index
+        return TRUE;
+    }
+
+    char ref[NAME_MAX];
+    snprintf(ref, sizeof(ref), "%s^%s", child_topic_name, child_id);
+    if(json_object_get(childs, ref)) {
+        return FALSE;
+    }
+
+    json_int_t position = -1;
+    if(json_is_array(parent_hook_data)) {
+        json_t *refs = _get_hook_index(
+            tranger, treedb_name, parent_topic_name, "__hook_refs__", parent_id, hook_name, TRUE
+        );
+        position = (json_int_t)json_array_size(parent_hook_data);
+        json_array_append_new(refs, json_string(ref));
+    }
+    json_object_set_new(childs, ref, json_integer(position));
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Return TRUE if the child was in the index (it has been removed)
+ *  In list hooks the child is removed too, with swap-remove, O(1).
+ ***************************************************************************/
+PRIVATE BOOL hook_index_delete(
+    json_t *tranger,
+    const char *treedb_name,
+    const char *parent_topic_name,
+    const char *parent_id,
+    const char *hook_name,
+    const char *child_topic_name,
+    const char *child_id,
+    json_t *parent_hook_data // NOT owned
+)
+{
+    json_t *childs = get_hook_index(
+        tranger, treedb_name, parent_topic_name, parent_id, hook_name, FALSE
+    );
+
+    char ref[NAME_MAX];
+    snprintf(ref, sizeof(ref), "%s^%s", child_topic_name, child_id);
+    json_t *jn_position = json_object_get(childs, ref);
+    if(!jn_position) {
+        return FALSE;
+    }
+
+    if(json_is_array(parent_hook_data)) {
+        json_t *refs = _get_hook_index(
+            tranger, treedb_name, parent_topic_name, "__hook_refs__", parent_id, hook_name, FALSE
+        );
+        size_t size = json_array_size(parent_hook_data);
+        size_t position = (size_t)json_integer_value(jn_position);
+        if(size == 0 || json_array_size(refs) != size || position >= size ||
+                strcmp(json_string_value(json_array_get(refs, position)), ref)!=0) {
+            // Index out of sync with the list hook
+            return FALSE;
+        }
+
+        /*
+         *  The last child takes the position of the removed child
+         */
+        size_t last = size - 1;
+        if(position != last) {
+            json_t *last_ref = json_array_get(refs, last);
+            json_array_set(parent_hook_data, position, json_array_get(parent_hook_data, last));
+            json_array_set(refs, position, last_ref);
+            json_object_set_new(childs, json_string_value(last_ref), json_integer(position));
+        }
+        json_array_remove(parent_hook_data, last);
+        json_array_remove(refs, last);
+    }
+
+    json_object_del(childs, ref);
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Remove all hook indexes of a parent node (used when the node is deleted)
+ ***************************************************************************/
+PRIVATE int hook_index_delete_parent(
+    json_t *tranger,
+    const char *treedb_name,
+    const char *parent_topic_name,
+    const char *parent_id
+)
+{
+    json_t *treedb = kw_get_subdict_value(tranger, "treedbs", treedb_name, 0, 0);
+    json_t *topic = json_object_get(treedb, parent_topic_name);
+    json_t *hook_index = json_object_get(topic, "__hook_index__");
+    if(hook_index) {
+        json_object_del(hook_index, parent_id);
+    }
+    json_t *hook_refs = json_object_get(topic, "__hook_refs__");
+    if(hook_refs) {
+        json_object_del(hook_refs, parent_id);
+    }
+    return 0;
+}
+
 /***************************************************************************
  *  Loading hook links
  ***************************************************************************/
@@ -3530,6 +3787,22 @@ PRIVATE int link_child_to_parent(
         return -1;
     }
 
+    /*
+     *  Check the hook index, a repeated fkey ref must not duplicate the child
+     */
+    if(!hook_index_add(
+        tranger,
+        treedb_name,
+        parent_topic_name,
+        parent_id,
+        hook_name,
+        child_topic_name,
+        child_id,
+        parent_hook_data
+    )) {
+        return 0;
+    }
+
     switch(json_typeof(parent_hook_data)) { // json_typeof PROTECTED
     case JSON_ARRAY:
         {
@@ -3550,7 +3823,7 @@ PRIVATE int link_child_to_parent(
                     child_id,
                     fkey_col_name
                 );
-                json_object_set(parent_hook_data, pref, child_data);
+                json_object_set(parent_hook_data, pref_, child_data);
             } else {
                 json_object_set(parent_hook_data, child_id, child_node);
             }
@@ -3567,6 +3840,16 @@ PRIVATE int link_child_to_parent(
                 "link",                 "%s", hook_name,
                 NULL
             );
+            hook_index_delete(
+                tranger,
+                treedb_name,
+                parent_topic_name,
+                parent_id,
+                hook_name,
+                child_topic_name,
+                child_id,
+                parent_hook_data
+            );
         }
         return -1;
     }
@@ -3585,8 +3868,8 @@ PRIVATE int load_links(
 {
     int ret = 0;
 
-    const char *treedb_name = kw_get_str(child_node, "__md_treedb__`treedb_name", 0, KW_REQUIRED);
-    const char *topic_name = kw_get_str(child_node, "__md_treedb__`topic_name", 0, KW_REQUIRED);
+    const char *treedb_name = kwp_get_str(child_node, &kwp_md_treedb_name, 0, KW_REQUIRED);
+    const char *topic_name = kwp_get_str(child_node, &kwp_md_topic_name, 0, KW_REQUIRED);
 
     json_t *cols = tranger_dict_topic_desc(
         tranger,
@@ -3744,6 +4027,126 @@ PRIVATE int load_all_links(
     return ret;
 }
 
+/***************************************************************************
+ *  Unload a link (child's fkey to parent's hook), only in memory.
+ *  Inverse of link_child_to_parent(), used when the node is replaced
+ *  by the node of another snap.
+ ***************************************************************************/
+PRIVATE int unlink_child_from_parent(
+    json_t *tranger,
+    const char *treedb_name,
+    const char *pref,
+    json_t *child_node,
+    const char *fkey_col_name,
+    BOOL is_child_hook
+)
+{
+    char parent_topic_name[NAME_MAX];
+    char parent_id[NAME_MAX];
+    char hook_name[NAME_MAX];
+    if(!decode_parent_ref(
+        pref,
+        parent_topic_name, sizeof(parent_topic_name),
+        parent_id, sizeof(parent_id),
+        hook_name, sizeof(hook_name)
+    )) {
+        return 0;
+    }
+
+    const char *child_topic_name = kwp_get_str(child_node, &kwp_md_topic_name, "", 0);
+    const char *child_id = kw_get_str(child_node, "id", "", KW_REQUIRED);
+
+    json_t *parent_node = exist_primary_node(
+        treedb_get_id_index(tranger, treedb_name, parent_topic_name),
+        parent_id
+    );
+    json_t *parent_hook_data = kw_get_dict_value(parent_node, hook_name, 0, 0);
+
+    /*
+     *  The index removes the child of a list hook
+     */
+    if(!hook_index_delete(
+        tranger,
+        treedb_name,
+        parent_topic_name,
+        parent_id,
+        hook_name,
+        child_topic_name,
+        child_id,
+        parent_hook_data
+    )) {
+        // Not linked (or the parent has been already unloaded)
+        return 0;
+    }
+
+    switch(json_typeof(parent_hook_data)) { // json_typeof PROTECTED
+    case JSON_OBJECT:
+        {
+            if(is_child_hook) {
+                char pref_[NAME_MAX];
+                snprintf(pref_, sizeof(pref_), "%s~%s~%s",
+                    child_topic_name,
+                    child_id,
+                    fkey_col_name
+                );
+                json_object_del(parent_hook_data, pref_);
+            } else {
+                json_object_del(parent_hook_data, child_id);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/***************************************************************************
+ *  Unload links (child's fkeys to parent's hooks)
+ *  Inverse of load_links(), only in memory
+ ***************************************************************************/
+PRIVATE int unload_links(
+    json_t *tranger,
+    json_t *child_node
+)
+{
+    const char *treedb_name = kwp_get_str(child_node, &kwp_md_treedb_name, 0, KW_REQUIRED);
+    const char *topic_name = kwp_get_str(child_node, &kwp_md_topic_name, 0, KW_REQUIRED);
+
+    json_t *cols = tranger_dict_topic_desc(
+        tranger,
+        topic_name
+    );
+
+    const char *col_name; json_t *col;
+    json_object_foreach(cols, col_name, col) {
+        json_t *desc_flag = kw_get_dict_value(col, "flag", 0, 0);
+        BOOL is_child_hook = kw_has_word(desc_flag, "hook", "")?TRUE:FALSE;
+        BOOL is_fkey = kw_has_word(desc_flag, "fkey", 0)?TRUE:FALSE;
+        if(!is_fkey) {
+            continue;
+        }
+
+        json_t *refs = get_fkey_refs(kw_get_dict_value(child_node, col_name, 0, 0));
+        int idx; json_t *jn_ref;
+        json_array_foreach(refs, idx, jn_ref) {
+            unlink_child_from_parent(
+                tranger,
+                treedb_name,
+                json_string_value(jn_ref),
+                child_node,
+                col_name,
+                is_child_hook
+            );
+        }
+        json_decref(refs);
+    }
+
+    json_decref(cols);
+    return 0;
+}
+
 /***************************************************************************
     Being `ids` a:
 
@@ -3980,8 +4383,8 @@ PRIVATE json_t *get_node_down_refs(  // Return MUST be decref
 {
     json_t *refs = json_array();
 
-    const char *treedb_name = kw_get_str(node, "__md_treedb__`treedb_name", 0, KW_REQUIRED);
-    const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, KW_REQUIRED);
+    const char *treedb_name = kwp_get_str(node, &kwp_md_treedb_name, 0, KW_REQUIRED);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, KW_REQUIRED);
     json_t *cols = tranger_dict_topic_desc(tranger, topic_name);
 
     const char *col_name; json_t *col;
@@ -4029,8 +4432,8 @@ PRIVATE json_t *get_node_up_refs(  // Return MUST be decref
 {
     json_t *refs = json_array();
 
-    const char *treedb_name = kw_get_str(node, "__md_treedb__`treedb_name", 0, KW_REQUIRED);
-    const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, KW_REQUIRED);
+    const char *treedb_name = kwp_get_str(node, &kwp_md_treedb_name, 0, KW_REQUIRED);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, KW_REQUIRED);
     json_t *cols = tranger_dict_topic_desc(tranger, topic_name);
 
     const char *col_name; json_t *col;
@@ -4416,6 +4819,16 @@ PUBLIC json_t *treedb_create_node( // WARNING Return is NOT YOURS, pure node
         JSON_DECREF(record);
         return 0;
     }
+    snap_checkpoints_write(
+        tranger,
+        treedb_name,
+        topic_name,
+        id,
+        record,
+        0,
+        0,
+        md_record.__rowid__
+    );
 
     /*--------------------------------------------------*
      *  Set volatil data
@@ -4591,7 +5004,7 @@ PUBLIC int treedb_save_node(
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -4606,8 +5019,8 @@ PUBLIC int treedb_save_node(
     /*-------------------------------*
      *      Get node info
      *-------------------------------*/
-    const char *treedb_name = kw_get_str(node, "__md_treedb__`treedb_name", 0, 0);
-    const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, 0);
+    const char *treedb_name = kwp_get_str(node, &kwp_md_treedb_name, 0, 0);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
 
     /*---------------------------------------*
      *  Create the tranger record to update
@@ -4621,7 +5034,7 @@ PUBLIC int treedb_save_node(
     /*-------------------------------------*
      *  Write to tranger (save, updating)
      *-------------------------------------*/
-    uint32_t tag = kw_get_int(node, "__md_treedb__`__tag__", 0, KW_REQUIRED);
+    uint32_t tag = kwp_get_int(node, &kwp_md_tag, 0, KW_REQUIRED);
 
     JSON_INCREF(record);
     md_record_t md_record;
@@ -4637,6 +5050,16 @@ PUBLIC int treedb_save_node(
         // Error already logged
         return -1;
     }
+    snap_checkpoints_write(
+        tranger,
+        treedb_name,
+        topic_name,
+        kw_get_str(node, "id", "", 0),
+        node,
+        tag,
+        kwp_get_int(node, &kwp_md_rowid, 0, KW_REQUIRED),
+        md_record.__rowid__
+    );
 
     /*--------------------------------------------*
      *  Build metadata, update node in memory
@@ -4720,7 +5143,7 @@ PUBLIC json_t *treedb_update_node( // WARNING Return is NOT YOURS, pure node
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -4736,7 +5159,7 @@ PUBLIC json_t *treedb_update_node( // WARNING Return is NOT YOURS, pure node
     /*-------------------------------*
      *      Get node info
      *-------------------------------*/
-    const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, 0);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
 
     /*-------------------------------*
      *  Update fields
@@ -4799,7 +5222,7 @@ PUBLIC int treedb_delete_node(
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -4816,16 +5239,16 @@ PUBLIC int treedb_delete_node(
     /*-------------------------------*
      *      Get node info
      *-------------------------------*/
-    const char *treedb_name = kw_get_str(node, "__md_treedb__`treedb_name", 0, 0);
-    const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, 0);
+    const char *treedb_name = kwp_get_str(node, &kwp_md_treedb_name, 0, 0);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
     const char *id = kw_get_str(node, "id", "", 0);
     BOOL force = kw_get_bool(jn_options, "force", 0, KW_WILD_NUMBER);
 
     /*-------------------------------*
      *      Get record info
      *-------------------------------*/
-    json_int_t __rowid__ = kw_get_int(node, "__md_treedb__`__rowid__", 0, KW_REQUIRED);
-    json_int_t __tag__ = kw_get_int(node, "__md_treedb__`__tag__", 0, KW_REQUIRED);
+    json_int_t __rowid__ = kwp_get_int(node, &kwp_md_rowid, 0, KW_REQUIRED);
+    json_int_t __tag__ = kwp_get_int(node, &kwp_md_tag, 0, KW_REQUIRED);
     if(__tag__ && !force) {
         // añade opción de borrar un snap que desmarque los nodos?
         log_error(0,
@@ -4867,7 +5290,7 @@ PUBLIC int treedb_delete_node(
                     node
                 );
                 int idx; json_t *child;
-                json_array_foreach(childs, idx, child) {
+                json_array_backward(childs, idx, child) { // childs can be the hook list itself
                     _unlink_nodes(tranger, hook, node, child);
                 }
                 JSON_DECREF(childs);
@@ -4944,6 +5367,16 @@ PUBLIC int treedb_delete_node(
      *  (borrar un id record en tranger, y el resto?)
      *-------------------------------------------------*/
     if(tranger_write_mark1(tranger, topic_name, __rowid__, TRUE)==0) {
+        snap_checkpoints_delete(
+            tranger,
+            treedb_name,
+            topic_name,
+            id,
+            kwp_get_int(node, &kwp_md_tag, 0, KW_REQUIRED),
+            __rowid__,
+            0
+        );
+
         /*-------------------------------*
          *  Trace
          *-------------------------------*/
@@ -4971,6 +5404,7 @@ PUBLIC int treedb_delete_node(
                 NULL
             );
         }
+        hook_index_delete_parent(tranger, treedb_name, topic_name, id);
 
         /*-------------------------------*
          *      Borra indexy data
@@ -5107,7 +5541,7 @@ PUBLIC int treedb_delete_instance(
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -5124,16 +5558,16 @@ PUBLIC int treedb_delete_instance(
     /*-------------------------------*
      *      Get node info
      *-------------------------------*/
-    const char *treedb_name = kw_get_str(node, "__md_treedb__`treedb_name", 0, 0);
-    const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, 0);
+    const char *treedb_name = kwp_get_str(node, &kwp_md_treedb_name, 0, 0);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
     const char *id = kw_get_str(node, "id", "", 0);
     BOOL force = kw_get_bool(jn_options, "force", 0, KW_WILD_NUMBER);
 
     /*-------------------------------*
      *      Get record info
      *-------------------------------*/
-    json_int_t __rowid__ = kw_get_int(node, "__md_treedb__`__rowid__", 0, KW_REQUIRED);
-    json_int_t __tag__ = kw_get_int(node, "__md_treedb__`__tag__", 0, KW_REQUIRED);
+    json_int_t __rowid__ = kwp_get_int(node, &kwp_md_rowid, 0, KW_REQUIRED);
+    json_int_t __tag__ = kwp_get_int(node, &kwp_md_tag, 0, KW_REQUIRED);
     if(__tag__ && !force) {
         // añade opción de borrar un snap que desmarque los nodos?
         log_error(0,
@@ -5176,7 +5610,7 @@ PUBLIC int treedb_delete_instance(
                     node
                 );
                 int idx; json_t *child;
-                json_array_foreach(childs, idx, child) {
+                json_array_backward(childs, idx, child) { // childs can be the hook list itself
                     _unlink_nodes(tranger, hook, node, child);
                 }
                 JSON_DECREF(childs);
@@ -5254,6 +5688,16 @@ PUBLIC int treedb_delete_instance(
      *  (borrar un id record en tranger, y el resto?)
      *-------------------------------------------------*/
     if(tranger_write_mark1(tranger, topic_name, __rowid__, TRUE)==0) {
+        snap_checkpoints_delete(
+            tranger,
+            treedb_name,
+            topic_name,
+            id,
+            kwp_get_int(node, &kwp_md_tag, 0, KW_REQUIRED),
+            __rowid__,
+            pkey2_name
+        );
+
         /*-------------------------------*
          *  Trace
          *-------------------------------*/
@@ -5500,7 +5944,7 @@ PRIVATE int _link_nodes(
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(parent_node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(parent_node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -5515,7 +5959,7 @@ PRIVATE int _link_nodes(
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(child_node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(child_node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -5545,8 +5989,8 @@ PRIVATE int _link_nodes(
     /*--------------------------------------------------*
      *  Check treedb_name's
      *--------------------------------------------------*/
-    const char *parent_node_treedb_name = kw_get_str(parent_node, "__md_treedb__`treedb_name", 0, 0);
-    const char *treedb_name = kw_get_str(child_node, "__md_treedb__`treedb_name", 0, 0);
+    const char *parent_node_treedb_name = kwp_get_str(parent_node, &kwp_md_treedb_name, 0, 0);
+    const char *treedb_name = kwp_get_str(child_node, &kwp_md_treedb_name, 0, 0);
     if(strcmp(parent_node_treedb_name, treedb_name)!=0) {
         log_error(0,
             "gobj",         "%s", __FILE__,
@@ -5746,14 +6190,42 @@ PRIVATE int _link_nodes(
     }
 
     /*--------------------------------------------------*
-     *  In parent hook data: save child content
-     *  WARNING repeated in
-     *      _link_nodes() and link_child_to_parent()
+     *  Check the hook index: already linked?
      *--------------------------------------------------*/
-    switch(json_typeof(parent_hook_data)) { // json_typeof PROTECTED
-    case JSON_ARRAY:
-        {
-            if(is_child_hook) {
+    if(!hook_index_add(
+        tranger,
+        treedb_name,
+        parent_topic_name,
+        parent_id,
+        hook_name,
+        child_topic_name,
+        child_id,
+        parent_hook_data
+    )) {
+        log_error(0,
+            "gobj",                 "%s", __FILE__,
+            "function",             "%s", __FUNCTION__,
+            "msgset",               "%s", MSGSET_TREEDB_ERROR,
+            "msg",                  "%s", "Child already linked in parent hook",
+            "parent_topic_name",    "%s", parent_topic_name,
+            "hook_name",            "%s", hook_name,
+            "parent_id",            "%s", parent_id,
+            "child_topic_name",     "%s", child_topic_name,
+            "child_id",             "%s", child_id,
+            NULL
+        );
+        return -1;
+    }
+
+    /*--------------------------------------------------*
+     *  In parent hook data: save child content
+     *  WARNING repeated in
+     *      _link_nodes() and link_child_to_parent()
+     *--------------------------------------------------*/
+    switch(json_typeof(parent_hook_data)) { // json_typeof PROTECTED
+    case JSON_ARRAY:
+        {
+            if(is_child_hook) {
                 json_array_append(parent_hook_data, child_data);
 
             } else {
@@ -5894,7 +6366,7 @@ PRIVATE int _unlink_nodes(
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(parent_node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(parent_node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -5909,7 +6381,7 @@ PRIVATE int _unlink_nodes(
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(child_node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(child_node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -5939,8 +6411,8 @@ PRIVATE int _unlink_nodes(
     /*--------------------------------------------------*
      *  Check treedb_name's
      *--------------------------------------------------*/
-    const char *parent_node_treedb_name = kw_get_str(parent_node, "__md_treedb__`treedb_name", 0, 0);
-    const char *treedb_name = kw_get_str(child_node, "__md_treedb__`treedb_name", 0, 0);
+    const char *parent_node_treedb_name = kwp_get_str(parent_node, &kwp_md_treedb_name, 0, 0);
+    const char *treedb_name = kwp_get_str(child_node, &kwp_md_treedb_name, 0, 0);
     if(strcmp(parent_node_treedb_name, treedb_name)!=0) {
         log_error(0,
             "gobj",         "%s", __FILE__,
@@ -6142,63 +6614,38 @@ PRIVATE int _unlink_nodes(
     }
 
     /*--------------------------------------------------*
-     *  In parent hook data: save child content
+     *  In parent hook data: remove child content
+     *  The hook index says if the child is linked,
+     *  and removes it from a list hook (swap-remove).
      *--------------------------------------------------*/
+    BOOL linked = hook_index_delete(
+        tranger,
+        treedb_name,
+        parent_topic_name,
+        parent_id,
+        hook_name,
+        child_topic_name,
+        child_id,
+        parent_hook_data
+    );
+
     switch(json_typeof(parent_hook_data)) { // json_typeof PROTECTED
     case JSON_ARRAY:
         {
-            if(is_child_hook) {
-                // link: json_array_append(parent_hook_data, child_data);
-                BOOL found = FALSE;
-                int idx; json_t *data;
-                json_array_foreach(parent_hook_data, idx, data) {
-                    if(child_data == data) {
-                        json_array_remove(parent_hook_data, idx);
-                        found = TRUE;
-                        break;
-                    }
-                }
-                if(!found) {
-                    log_error(0,
-                        "gobj",                 "%s", __FILE__,
-                        "function",             "%s", __FUNCTION__,
-                        "msgset",               "%s", MSGSET_TREEDB_ERROR,
-                        "msg",                  "%s", "Child data not found in list parent hook",
-                        "parent_topic_name",    "%s", parent_topic_name,
-                        "hook_name",            "%s", hook_name,
-                        "parent_id",            "%s", parent_id,
-                        "child_topic_name",     "%s", child_topic_name,
-                        "child_id",             "%s", child_id,
-                        "child_field",          "%s", child_field,
-                        NULL
-                    );
-                }
-            } else {
-                // link: json_array_append(parent_hook_data, child_node);
-                BOOL found = FALSE;
-                int idx; json_t *data;
-                json_array_foreach(parent_hook_data, idx, data) {
-                    if(child_node == data) {
-                        json_array_remove(parent_hook_data, idx);
-                        found = TRUE;
-                        break;
-                    }
-                }
-                if(!found) {
-                    log_error(0,
-                        "gobj",                 "%s", __FILE__,
-                        "function",             "%s", __FUNCTION__,
-                        "msgset",               "%s", MSGSET_TREEDB_ERROR,
-                        "msg",                  "%s", "Child data not found in dict parent hook",
-                        "parent_topic_name",    "%s", parent_topic_name,
-                        "hook_name",            "%s", hook_name,
-                        "parent_id",            "%s", parent_id,
-                        "child_topic_name",     "%s", child_topic_name,
-                        "child_id",             "%s", child_id,
-                        "child_field",          "%s", child_field,
-                        NULL
-                    );
-                }
+            if(!linked) {
+                log_error(0,
+                    "gobj",                 "%s", __FILE__,
+                    "function",             "%s", __FUNCTION__,
+                    "msgset",               "%s", MSGSET_TREEDB_ERROR,
+                    "msg",                  "%s", "Child data not found in list parent hook",
+                    "parent_topic_name",    "%s", parent_topic_name,
+                    "hook_name",            "%s", hook_name,
+                    "parent_id",            "%s", parent_id,
+                    "child_topic_name",     "%s", child_topic_name,
+                    "child_id",             "%s", child_id,
+                    "child_field",          "%s", child_field,
+                    NULL
+                );
             }
         }
         break;
@@ -6357,7 +6804,7 @@ PUBLIC int treedb_clean_node(
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -6372,8 +6819,8 @@ PUBLIC int treedb_clean_node(
     /*-------------------------------*
      *      Get node info
      *-------------------------------*/
-    const char *treedb_name = kw_get_str(node, "__md_treedb__`treedb_name", 0, 0);
-    const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, 0);
+    const char *treedb_name = kwp_get_str(node, &kwp_md_treedb_name, 0, 0);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
 
     int ret = 0;
     BOOL to_save = FALSE;
@@ -6476,7 +6923,7 @@ PUBLIC int treedb_autolink( // use fkeys fields of kw to auto-link
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -6492,8 +6939,8 @@ PUBLIC int treedb_autolink( // use fkeys fields of kw to auto-link
     /*-------------------------------*
      *      Get node info
      *-------------------------------*/
-    const char *treedb_name = kw_get_str(node, "__md_treedb__`treedb_name", 0, 0);
-    const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, 0);
+    const char *treedb_name = kwp_get_str(node, &kwp_md_treedb_name, 0, 0);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
 
     json_t *cols = tranger_dict_topic_desc(tranger, topic_name);
     if(!cols) {
@@ -6695,6 +7142,42 @@ PUBLIC int treedb_unlink_nodes(
     return treedb_save_node(tranger, child_node);
 }
 
+/***************************************************************************
+ *  Return TRUE if child_node is linked to the hook of parent_node.
+ *  Use the hook index, O(1).
+ ***************************************************************************/
+PUBLIC BOOL treedb_is_child_linked(
+    json_t *tranger,
+    const char *hook_name,
+    json_t *parent_node,    // NOT owned, pure node
+    json_t *child_node      // NOT owned, pure node
+)
+{
+    const char *treedb_name = kwp_get_str(parent_node, &kwp_md_treedb_name, 0, 0);
+    const char *parent_topic_name = kwp_get_str(parent_node, &kwp_md_topic_name, 0, 0);
+    const char *parent_id = kw_get_str(parent_node, "id", 0, 0);
+    const char *child_topic_name = kwp_get_str(child_node, &kwp_md_topic_name, 0, 0);
+    const char *child_id = kw_get_str(child_node, "id", 0, 0);
+    if(!treedb_name || !parent_topic_name || !parent_id || !child_topic_name || !child_id) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_TREEDB_ERROR,
+            "msg",          "%s", "Not a treedb node",
+            NULL
+        );
+        return FALSE;
+    }
+
+    json_t *childs = get_hook_index(
+        tranger, treedb_name, parent_topic_name, parent_id, hook_name, FALSE
+    );
+
+    char ref[NAME_MAX];
+    snprintf(ref, sizeof(ref), "%s^%s", child_topic_name, child_id);
+    return json_object_get(childs, ref)?TRUE:FALSE;
+}
+
 /***************************************************************************
  *
  ***************************************************************************/
@@ -6902,7 +7385,7 @@ PRIVATE BOOL match_node_simple(
     json_object_foreach(jn_filter, col_name, jn_filter_value) {
         json_t *col = kw_get_dict(cols, col_name, 0, KW_REQUIRED);
         if(!col) {
-            const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, 0);
+            const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
             log_error(0,
                 "gobj",         "%s", __FILE__,
                 "function",     "%s", __FUNCTION__,
@@ -6916,7 +7399,7 @@ PRIVATE BOOL match_node_simple(
         }
         json_t *jn_record_value = kw_get_dict_value(node, col_name, 0, KW_REQUIRED);
         if(!jn_record_value) {
-            const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, 0);
+            const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
             log_error(0,
                 "gobj",         "%s", __FILE__,
                 "function",     "%s", __FUNCTION__,
@@ -7064,6 +7547,8 @@ PUBLIC json_t *treedb_get_instance( // WARNING Return is NOT YOURS, pure node
 /***************************************************************************
     Return a view of node with hook fields being collapsed
     WARNING extra fields are ignored, only topic desc fields are used
+    WARNING the values of not hook/fkey fields are shared (incref) with the node,
+        they are not copied: don't modify them.
 
     See 31_tr_treedb for options
  ***************************************************************************/
@@ -7076,7 +7561,7 @@ PUBLIC json_t *node_collapsed_view( // Return MUST be decref
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -7092,7 +7577,7 @@ PUBLIC json_t *node_collapsed_view( // Return MUST be decref
     /*-------------------------------*
      *      Get node info
      *-------------------------------*/
-    const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, 0);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
 
     json_t *topic_desc = tranger_dict_topic_desc(tranger, topic_name);
 
@@ -7166,7 +7651,7 @@ PUBLIC json_t *node_collapsed_view( // Return MUST be decref
         json_object_set_new(
             node_view,
             "__md_treedb__",
-            json_deep_copy(json_object_get(node, "__md_treedb__"))
+            json_copy(json_object_get(node, "__md_treedb__")) // metadata are simple values
         );
         json_object_set_new(
             json_object_get(node_view, "__md_treedb__"),
@@ -7180,6 +7665,268 @@ PUBLIC json_t *node_collapsed_view( // Return MUST be decref
     return node_view;
 }
 
+/***************************************************************************
+ *  Write a json string to gbuf
+ ***************************************************************************/
+PRIVATE void gbuf_append_json_str(GBUFFER *gbuf, const char *str)
+{
+    const char *hex = "0123456789abcdef";
+    const char *p = str?str:"";
+    const char *pos = p;
+
+    gbuf_append_char(gbuf, '"');
+    for(; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if(c == '"' || c == '\\' || c < 0x20) {
+            if(p > pos) {
+                gbuf_append(gbuf, (void *)pos, p - pos);
+            }
+            switch(c) {
+            case '"':  gbuf_append(gbuf, "\\\"", 2); break;
+            case '\\': gbuf_append(gbuf, "\\\\", 2); break;
+            case '\n': gbuf_append(gbuf, "\\n", 2); break;
+            case '\r': gbuf_append(gbuf, "\\r", 2); break;
+            case '\t': gbuf_append(gbuf, "\\t", 2); break;
+            case '\b': gbuf_append(gbuf, "\\b", 2); break;
+            case '\f': gbuf_append(gbuf, "\\f", 2); break;
+            default:
+                {
+                    char u[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0x0F]};
+                    gbuf_append(gbuf, u, sizeof(u));
+                }
+                break;
+            }
+            pos = p + 1;
+        }
+    }
+    if(p > pos) {
+        gbuf_append(gbuf, (void *)pos, p - pos);
+    }
+    gbuf_append_char(gbuf, '"');
+}
+
+/***************************************************************************
+ *  Write "key": to gbuf
+ ***************************************************************************/
+PRIVATE void gbuf_append_json_key(GBUFFER *gbuf, const char *key, BOOL *first)
+{
+    if(!*first) {
+        gbuf_append_char(gbuf, ',');
+    }
+    *first = FALSE;
+    gbuf_append_json_str(gbuf, key);
+    gbuf_append_char(gbuf, ':');
+}
+
+/***************************************************************************
+ *  Dump a json value to gbuf
+ ***************************************************************************/
+PRIVATE int dump_view2gbuf(const char *buffer, size_t size, void *data)
+{
+    GBUFFER *gbuf = data;
+    if(size > 0) {
+        gbuf_append(gbuf, (void *)buffer, size);
+    }
+    return 0;
+}
+
+/***************************************************************************
+    Write the collapsed view of the node to gbuf, in compact json,
+    without building the view. Same output as node_collapsed_view().
+
+    See 31_tr_treedb for options
+ ***************************************************************************/
+PUBLIC int node_collapsed_view2gbuf(
+    json_t *tranger, // NOT owned
+    json_t *node, // NOT owned
+    json_t *jn_options, // owned fkey,hook options
+    GBUFFER *gbuf // NOT owned
+)
+{
+    /*------------------------------*
+     *      Check original node
+     *------------------------------*/
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_TREEDB_ERROR,
+            "msg",          "%s", "Not a pure node",
+            NULL
+        );
+        log_debug_json(0, node, "Not a pure node");
+        JSON_DECREF(jn_options);
+        return -1;
+    }
+
+    /*-------------------------------*
+     *      Get node info
+     *-------------------------------*/
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
+
+    json_t *topic_desc = tranger_dict_topic_desc(tranger, topic_name);
+
+    BOOL with_metadata = kw_get_bool(jn_options, "with_metadata", 0, KW_WILD_NUMBER);
+    BOOL without_rowid =  kw_get_bool(jn_options, "without_rowid", 0, KW_WILD_NUMBER);
+    view_mode_t child_mode = child_list_view_mode(jn_options);
+    view_mode_t parent_mode = parent_ref_view_mode(jn_options);
+
+    BOOL first = TRUE;
+    gbuf_append_char(gbuf, '{');
+
+    const char *col_name; json_t *col;
+    json_object_foreach(topic_desc, col_name, col) {
+        json_t *desc_flag = kw_get_dict_value(col, "flag", 0, 0);
+        BOOL is_hook = kw_has_word(desc_flag, "hook", 0)?TRUE:FALSE;
+        BOOL is_fkey = kw_has_word(desc_flag, "fkey", 0)?TRUE:FALSE;
+        BOOL is_rowid = kw_has_word(desc_flag, "rowid", 0)?TRUE:FALSE;
+        BOOL is_required = kw_has_word(desc_flag, "required", 0)?TRUE:FALSE;
+        json_t *field_data = kw_get_dict_value(node, col_name, 0, is_required?KW_REQUIRED:0);
+        if(!field_data) {
+            // Something wrong?
+            continue;
+        }
+        if(strncmp(col_name, "__", 2)==0) {
+            if(!with_metadata) {
+                // Ignore metadata
+                continue;
+            }
+        }
+        if(is_rowid) {
+            if(without_rowid) {
+                // Ignore rowid
+                continue;
+            }
+        }
+
+        gbuf_append_json_key(gbuf, col_name, &first);
+
+        if(is_hook) {
+            json_t *child_list = get_hook_list(field_data);
+            gbuf_append_char(gbuf, '[');
+            if(child_mode == VIEW_SIZE) {
+                gbuf_printf(gbuf, "{\"size\":%"JSON_INTEGER_FORMAT"}", json_size(child_list));
+            } else {
+                int idx; json_t *child;
+                json_array_foreach(child_list, idx, child) {
+                    const char *id = kw_get_str(child, "id", 0, KW_REQUIRED);
+                    const char *child_topic_name = kwp_get_str(child, &kwp_md_topic_name, 0, 0);
+                    if(idx > 0) {
+                        gbuf_append_char(gbuf, ',');
+                    }
+                    switch(child_mode) {
+                    case VIEW_ONLY_ID:
+                        gbuf_append_json_str(gbuf, id);
+                        break;
+                    case VIEW_REFS:
+                        {
+                            char ref[NAME_MAX];
+                            snprintf(ref, sizeof(ref), "%s^%s", child_topic_name, id);
+                            gbuf_append_json_str(gbuf, ref);
+                        }
+                        break;
+                    default:
+                        gbuf_append(gbuf, "{\"id\":", 6);
+                        gbuf_append_json_str(gbuf, id);
+                        gbuf_append(gbuf, ",\"topic_name\":", 14);
+                        if(child_topic_name) {
+                            gbuf_append_json_str(gbuf, child_topic_name);
+                        } else {
+                            gbuf_append(gbuf, "null", 4);
+                        }
+                        gbuf_append_char(gbuf, '}');
+                        break;
+                    }
+                }
+            }
+            gbuf_append_char(gbuf, ']');
+            json_decref(child_list);
+
+        } else if(is_fkey) {
+            char parent_topic_name[NAME_MAX];
+            char parent_id[NAME_MAX];
+            char hook_name[NAME_MAX];
+            BOOL first_ref = TRUE;
+
+            json_t *refs = get_fkey_refs(field_data);
+            gbuf_append_char(gbuf, '[');
+            int idx; json_t *jn_fkey;
+            json_array_foreach(refs, idx, jn_fkey) {
+                const char *ref = json_string_value(jn_fkey);
+                if(!decode_parent_ref(
+                    ref,
+                    parent_topic_name, sizeof(parent_topic_name),
+                    parent_id, sizeof(parent_id),
+                    hook_name, sizeof(hook_name)
+                )) {
+                    // It's not a fkey, error logged in apply_parent_ref_options()
+                    continue;
+                }
+                if(!first_ref) {
+                    gbuf_append_char(gbuf, ',');
+                }
+                first_ref = FALSE;
+                switch(parent_mode) {
+                case VIEW_ONLY_ID:
+                    gbuf_append_json_str(gbuf, parent_id);
+                    break;
+                case VIEW_REFS:
+                    gbuf_append_json_str(gbuf, ref);
+                    break;
+                default:
+                    gbuf_append(gbuf, "{\"id\":", 6);
+                    gbuf_append_json_str(gbuf, parent_id);
+                    gbuf_append(gbuf, ",\"topic_name\":", 14);
+                    gbuf_append_json_str(gbuf, parent_topic_name);
+                    gbuf_append(gbuf, ",\"hook_name\":", 13);
+                    gbuf_append_json_str(gbuf, hook_name);
+                    gbuf_append_char(gbuf, '}');
+                    break;
+                }
+            }
+            gbuf_append_char(gbuf, ']');
+            json_decref(refs);
+
+        } else {
+            json_dump_callback(
+                field_data,
+                dump_view2gbuf,
+                gbuf,
+                JSON_COMPACT|JSON_ENCODE_ANY
+            );
+        }
+    }
+
+    if(with_metadata) {
+        gbuf_append_json_key(gbuf, "__md_treedb__", &first);
+        gbuf_append_char(gbuf, '{');
+        BOOL first_md = TRUE;
+        BOOL pure_node = FALSE;
+        const char *key; json_t *value;
+        json_object_foreach(json_object_get(node, "__md_treedb__"), key, value) {
+            gbuf_append_json_key(gbuf, key, &first_md);
+            if(strcmp(key, "__pure_node__")==0) {
+                // Same position of the key in node_collapsed_view()
+                gbuf_append(gbuf, "false", 5);
+                pure_node = TRUE;
+                continue;
+            }
+            json_dump_callback(value, dump_view2gbuf, gbuf, JSON_COMPACT|JSON_ENCODE_ANY);
+        }
+        if(!pure_node) {
+            gbuf_append_json_key(gbuf, "__pure_node__", &first_md);
+            gbuf_append(gbuf, "false", 5);
+        }
+        gbuf_append_char(gbuf, '}');
+    }
+
+    gbuf_append_char(gbuf, '}');
+
+    JSON_DECREF(topic_desc);
+    JSON_DECREF(jn_options);
+    return 0;
+}
+
 /***************************************************************************
  *
  ***************************************************************************/
@@ -7212,10 +7959,10 @@ PUBLIC json_t *treedb_list_nodes( // Return MUST be decref
         return 0;
     }
 
-    /*-----------------------------------*
-     *  Use duplicate, will be modified
-     *-----------------------------------*/
-    json_t *jn_filter = jn_filter_?json_deep_copy(jn_filter_):0;
+    /*-----------------------------------------------------*
+     *  Use duplicate, will be modified (only first level)
+     *-----------------------------------------------------*/
+    json_t *jn_filter = jn_filter_?json_copy(jn_filter_):0;
     JSON_DECREF(jn_filter_);
 
     /*-------------------------------*
@@ -7352,10 +8099,10 @@ PUBLIC json_t *treedb_list_instances( // Return MUST be decref
         return 0;
     }
 
-    /*-----------------------------------*
-     *  Use duplicate, will be modified
-     *-----------------------------------*/
-    json_t *jn_filter = jn_filter_?json_deep_copy(jn_filter_):0;
+    /*-----------------------------------------------------*
+     *  Use duplicate, will be modified (only first level)
+     *-----------------------------------------------------*/
+    json_t *jn_filter = jn_filter_?json_copy(jn_filter_):0;
     JSON_DECREF(jn_filter_);
 
     /*--------------------------------------------*
@@ -7516,12 +8263,31 @@ PRIVATE json_int_t json_size(json_t *value)
             [{"id": "$id", "topic_name":"$topic_name", "hook_name":"$hook_name"}, ...]
 
  ***************************************************************************/
+PRIVATE view_mode_t parent_ref_view_mode(json_t *jn_options)
+{
+    if(kw_get_bool(jn_options, "only_id", 0, KW_WILD_NUMBER) ||
+        kw_get_bool(jn_options, "fkey_only_id", 0, KW_WILD_NUMBER)
+    ) {
+        return VIEW_ONLY_ID;
+    } else if(kw_get_bool(jn_options, "list_dict", 0, KW_WILD_NUMBER) ||
+        kw_get_bool(jn_options, "fkey_list_dict", 0, KW_WILD_NUMBER)
+    ) {
+        return VIEW_LIST_DICT;
+    } else if(kw_get_bool(jn_options, "refs", 0, KW_WILD_NUMBER) ||
+        kw_get_bool(jn_options, "fkey_refs", 0, KW_WILD_NUMBER)
+    ) {
+        return VIEW_REFS;
+    }
+    return VIEW_LIST_DICT;
+}
+
 PRIVATE json_t *apply_parent_ref_options(
     json_t *refs,  // NOT owned
     json_t *jn_options // NOT owned
 )
 {
     json_t *parents = json_array();
+    view_mode_t view_mode = parent_ref_view_mode(jn_options);
     char parent_topic_name[NAME_MAX];
     char parent_id[NAME_MAX];
     char hook_name[NAME_MAX];
@@ -7550,18 +8316,14 @@ PRIVATE json_t *apply_parent_ref_options(
             continue;
         }
 
-        if(kw_get_bool(jn_options, "only_id", 0, KW_WILD_NUMBER) ||
-            kw_get_bool(jn_options, "fkey_only_id", 0, KW_WILD_NUMBER)
-        ) {
+        if(view_mode == VIEW_ONLY_ID) {
             /*
                 Return the 'fkey ref' with only the 'id' field
                     ["$id",...]
              */
             json_array_append_new(parents, json_string(parent_id));
 
-        } else if(kw_get_bool(jn_options, "list_dict", 0, KW_WILD_NUMBER) ||
-            kw_get_bool(jn_options, "fkey_list_dict", 0, KW_WILD_NUMBER)
-        ) {
+        } else if(view_mode == VIEW_LIST_DICT) {
             /*
                 Return the kwid style:
                     [{"id": "$id", "topic_name":"$topic_name", "hook_name":"$hook_name"}, ...]
@@ -7575,9 +8337,7 @@ PRIVATE json_t *apply_parent_ref_options(
                 )
             );
 
-        } else if(kw_get_bool(jn_options, "refs", 0, KW_WILD_NUMBER) ||
-            kw_get_bool(jn_options, "fkey_refs", 0, KW_WILD_NUMBER)
-        ) {
+        } else if(view_mode == VIEW_REFS) {
             /*
                 Return 'fkey ref'
                     ["topic_name^id^hook_name", ...]
@@ -7631,16 +8391,37 @@ PRIVATE json_t *apply_parent_ref_options(
             [{"size": size}]
 
  ***************************************************************************/
+PRIVATE view_mode_t child_list_view_mode(json_t *jn_options)
+{
+    if(kw_get_bool(jn_options, "size", 0, KW_WILD_NUMBER) ||
+        kw_get_bool(jn_options, "hook_size", 0, KW_WILD_NUMBER)
+    ) {
+        return VIEW_SIZE;
+    } else if(kw_get_bool(jn_options, "only_id", 0, KW_WILD_NUMBER) ||
+        kw_get_bool(jn_options, "hook_only_id", 0, KW_WILD_NUMBER)
+    ) {
+        return VIEW_ONLY_ID;
+    } else if(kw_get_bool(jn_options, "list_dict", 0, KW_WILD_NUMBER) ||
+        kw_get_bool(jn_options, "hook_list_dict", 0, KW_WILD_NUMBER)
+    ) {
+        return VIEW_LIST_DICT;
+    } else if(kw_get_bool(jn_options, "refs", 0, KW_WILD_NUMBER) ||
+        kw_get_bool(jn_options, "hook_refs", 0, KW_WILD_NUMBER)
+    ) {
+        return VIEW_REFS;
+    }
+    return VIEW_LIST_DICT;
+}
+
 PRIVATE json_t *apply_child_list_options(
     json_t *child_list,  // NOT owned
     json_t *jn_options // NOT owned
 )
 {
     json_t *childs = json_array();
+    view_mode_t view_mode = child_list_view_mode(jn_options);
 
-    if(kw_get_bool(jn_options, "size", 0, KW_WILD_NUMBER) ||
-        kw_get_bool(jn_options, "hook_size", 0, KW_WILD_NUMBER)
-    ) {
+    if(view_mode == VIEW_SIZE) {
         /*
             Return:
                 [{"size": size}]
@@ -7656,9 +8437,7 @@ PRIVATE json_t *apply_child_list_options(
 
     int idx; json_t *child;
     json_array_foreach(child_list, idx, child) {
-        if(kw_get_bool(jn_options, "only_id", 0, KW_WILD_NUMBER) ||
-            kw_get_bool(jn_options, "hook_only_id", 0, KW_WILD_NUMBER)
-        ) {
+        if(view_mode == VIEW_ONLY_ID) {
             /*
                 Return the 'hook ref' with only the 'id' field
                     ["$id",...]
@@ -7666,15 +8445,13 @@ PRIVATE json_t *apply_child_list_options(
             const char *id = kw_get_str(child, "id", 0, KW_REQUIRED);
             json_array_append_new(childs, json_string(id));
 
-        } else if(kw_get_bool(jn_options, "list_dict", 0, KW_WILD_NUMBER) ||
-            kw_get_bool(jn_options, "hook_list_dict", 0, KW_WILD_NUMBER)
-        ) {
+        } else if(view_mode == VIEW_LIST_DICT) {
             /*
                 Return the kwid style:
                     [{"id": "$id", "topic_name":"$topic_name"}, ...]
              */
             const char *id = kw_get_str(child, "id", 0, KW_REQUIRED);
-            const char *topic_name = kw_get_str(child, "__md_treedb__`topic_name", 0, 0);
+            const char *topic_name = kwp_get_str(child, &kwp_md_topic_name, 0, 0);
 
             json_array_append_new(
                 childs,
@@ -7684,16 +8461,14 @@ PRIVATE json_t *apply_child_list_options(
                 )
             );
 
-        } else if(kw_get_bool(jn_options, "refs", 0, KW_WILD_NUMBER) ||
-            kw_get_bool(jn_options, "hook_refs", 0, KW_WILD_NUMBER)
-        ) {
+        } else if(view_mode == VIEW_REFS) {
             /*
                     Return 'hook ref'
                         ["topic_name^id", ...]
 
             */
             const char *id = kw_get_str(child, "id", 0, KW_REQUIRED);
-            const char *topic_name = kw_get_str(child, "__md_treedb__`topic_name", 0, 0);
+            const char *topic_name = kwp_get_str(child, &kwp_md_topic_name, 0, 0);
             char ref[NAME_MAX];
             snprintf(ref, sizeof(ref), "%s^%s", topic_name, id);
             json_array_append_new(childs, json_string(ref));
@@ -7706,7 +8481,7 @@ PRIVATE json_t *apply_child_list_options(
                     [{"id": "$id", "topic_name":"$topic_name"}, ...]
              */
             const char *id = kw_get_str(child, "id", 0, KW_REQUIRED);
-            const char *topic_name = kw_get_str(child, "__md_treedb__`topic_name", 0, 0);
+            const char *topic_name = kwp_get_str(child, &kwp_md_topic_name, 0, 0);
 
             json_array_append_new(
                 childs,
@@ -7735,7 +8510,7 @@ PUBLIC json_t *treedb_parent_refs( // Return MUST be decref
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -7751,7 +8526,7 @@ PUBLIC json_t *treedb_parent_refs( // Return MUST be decref
     /*-------------------------------*
      *      Get node info
      *-------------------------------*/
-    const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, 0);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
 
     json_t *cols = tranger_dict_topic_desc(tranger, topic_name);
     json_t *col = kw_get_dict_value(cols, fkey, 0, 0);
@@ -7823,8 +8598,8 @@ PUBLIC json_t *treedb_list_parents( // Return MUST be decref
     BOOL collapsed_view, // TRUE return collapsed views
     json_t *jn_options // owned, fkey,hook options when collapsed_view is true
 ) {
-    const char *treedb_name = kw_get_str(node, "__md_treedb__`treedb_name", 0, KW_REQUIRED);
-    const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, 0);
+    const char *treedb_name = kwp_get_str(node, &kwp_md_treedb_name, 0, KW_REQUIRED);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
 
     json_t *refs = treedb_parent_refs( // Return MUST be decref
         tranger,
@@ -7893,9 +8668,9 @@ PUBLIC json_t *treedb_list_parents( // Return MUST be decref
 }
 
 /***************************************************************************
- *  Return a list of childs of the hook
+ *  Return the data of the hook (list or dict of childs), checking the hook
  ***************************************************************************/
-PRIVATE json_t *_list_childs(
+PRIVATE json_t *_hook_data( // Return is NOT YOURS
     json_t *tranger,
     const char *hook,
     json_t *node       // NOT owned, pure node
@@ -7904,7 +8679,7 @@ PRIVATE json_t *_list_childs(
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -7919,7 +8694,7 @@ PRIVATE json_t *_list_childs(
     /*-------------------------------*
      *      Get node info
      *-------------------------------*/
-    const char *topic_name = kw_get_str(node, "__md_treedb__`topic_name", 0, 0);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
 
     json_t *cols = tranger_dict_topic_desc(tranger, topic_name);
     json_t *col = kw_get_dict_value(cols, hook, 0, 0);
@@ -7970,10 +8745,26 @@ PRIVATE json_t *_list_childs(
         return 0;
     }
 
-    json_t *child_list = get_hook_list(field_data);
-
     json_decref(cols);
-    return child_list;
+    return field_data;
+}
+
+/***************************************************************************
+ *  Return a list of childs of the hook
+ ***************************************************************************/
+PRIVATE json_t *_list_childs(
+    json_t *tranger,
+    const char *hook,
+    json_t *node       // NOT owned, pure node
+)
+{
+    json_t *field_data = _hook_data(tranger, hook, node);
+    if(!field_data) {
+        // Error already logged
+        return 0;
+    }
+
+    return get_hook_list(field_data);
 }
 
 /***************************************************************************
@@ -7985,7 +8776,7 @@ PRIVATE json_t *add_tree_childs(
     const char *hook,
     json_t *node,       // not owned
     BOOL recursive,
-    json_t *jn_filter   // not owned
+    kw_filter filter    // not owned
 )
 {
     json_t *child_list = _list_childs(tranger, hook, node);
@@ -7996,13 +8787,10 @@ PRIVATE json_t *add_tree_childs(
 
     int idx; json_t *child;
     json_array_foreach(child_list, idx, child) {
-        if(kw_match_simple(
-            child, // NOT owned
-            json_incref(jn_filter) // owned
-        )){
+        if(kw_filter_match(filter, child)) {
             json_array_append(list, child);
             if(recursive) {
-                add_tree_childs(tranger, list, hook, child, recursive, jn_filter);
+                add_tree_childs(tranger, list, hook, child, recursive, filter);
             }
         }
     }
@@ -8025,7 +8813,7 @@ PUBLIC json_t *treedb_node_childs(
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -8045,7 +8833,7 @@ PUBLIC json_t *treedb_node_childs(
             "function",     "%s", __FUNCTION__,
             "msgset",       "%s", MSGSET_TREEDB_ERROR,
             "msg",          "%s", "hook not found",
-            "topic_name",   "%s", kw_get_str(node, "__md_treedb__`treedb_name", 0, 0),
+            "topic_name",   "%s", kwp_get_str(node, &kwp_md_treedb_name, 0, 0),
             "hook",         "%s", hook,
             NULL
         );
@@ -8056,9 +8844,10 @@ PUBLIC json_t *treedb_node_childs(
 
     BOOL recursive = kw_get_bool(jn_options, "recursive", 0, KW_WILD_NUMBER);
     json_t *list = json_array();
-    add_tree_childs(tranger, list, hook, node, recursive, jn_filter);
+    kw_filter filter = kw_filter_compile(jn_filter); // compiled once for all the childs
+    add_tree_childs(tranger, list, hook, node, recursive, filter);
 
-    JSON_DECREF(jn_filter);
+    kw_filter_free(filter);
     JSON_DECREF(jn_options);
     return list;
 }
@@ -8095,16 +8884,20 @@ PRIVATE json_t *create_jchild(
     const char *hook,   // hook to build the hierarchical tree
     const char *rename_hook, // change the hook name in the tree response
     json_t *node,       // NOT owned, pure node
-    json_t *jn_options  // fkey,hook options
+    json_t *jn_options, // fkey,hook options
+    BOOL shared         // TRUE: the values are shared with the node, read-only
 )
 {
-    json_t *jchild_ = node_collapsed_view(
+    json_t *jchild = node_collapsed_view(
         tranger,
         node,
         json_incref(jn_options)
     );
-    json_t *jchild = json_deep_copy(jchild_);
-    json_decref(jchild_);
+    if(!shared) {
+        json_t *jchild_ = jchild;
+        jchild = json_deep_copy(jchild_);
+        json_decref(jchild_);
+    }
 
     if(!empty_string(rename_hook)) {
         json_t *jn_hook = kw_get_dict_value(jchild, hook, 0, KW_REQUIRED|KW_EXTRACT);
@@ -8124,8 +8917,9 @@ PRIVATE json_t *add_jtree_childs(
     const char *rename_hook, // change the hook name in the tree response
     json_t *node,     // not owned
     json_t *parent,     // not owned
-    json_t *jn_filter,  // not owned
-    json_t *jn_options  // not owned
+    kw_filter filter,   // not owned
+    json_t *jn_options, // not owned
+    BOOL shared
 )
 {
     json_t *child_list = _list_childs(tranger, hook, node);
@@ -8136,14 +8930,11 @@ PRIVATE json_t *add_jtree_childs(
 
     int idx; json_t *child;
     json_array_foreach(child_list, idx, child) {
-        if(!kw_match_simple(
-            child, // NOT owned
-            json_incref(jn_filter) // owned
-        )){
+        if(!kw_filter_match(filter, child)) {
             continue;
         }
 
-        json_t *_child = create_jchild(tranger, hook, rename_hook, child, jn_options);
+        json_t *_child = create_jchild(tranger, hook, rename_hook, child, jn_options, shared);
         add_jtree_path(parent, _child);
 
         json_t *list = kw_get_list(parent, rename_hook?rename_hook:hook, 0, KW_REQUIRED);
@@ -8157,8 +8948,9 @@ PRIVATE json_t *add_jtree_childs(
             rename_hook,
             child,
             _child,
-            jn_filter,
-            jn_options
+            filter,
+            jn_options,
+            shared
         );
     }
     json_decref(child_list);
@@ -8169,19 +8961,20 @@ PRIVATE json_t *add_jtree_childs(
 /***************************************************************************
  *  Return a list of childs of the hook
  ***************************************************************************/
-PUBLIC json_t *treedb_node_jtree(
+PRIVATE json_t *node_jtree(
     json_t *tranger,
     const char *hook,   // hook to build the hierarchical tree
     const char *rename_hook, // change the hook name in the tree response
     json_t *node,       // NOT owned, pure node
     json_t *jn_filter,  // filter to childs tree
-    json_t *jn_options  // fkey,hook options
+    json_t *jn_options, // fkey,hook options
+    BOOL shared
 )
 {
     /*------------------------------*
      *      Check original node
      *------------------------------*/
-    if(!kw_get_bool(node, "__md_treedb__`__pure_node__", 0, 0)) {
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
         log_error(0,
             "gobj",         "%s", __FILE__,
             "function",     "%s", __FUNCTION__,
@@ -8201,7 +8994,7 @@ PUBLIC json_t *treedb_node_jtree(
             "function",     "%s", __FUNCTION__,
             "msgset",       "%s", MSGSET_TREEDB_ERROR,
             "msg",          "%s", "hook not found",
-            "topic_name",   "%s", kw_get_str(node, "__md_treedb__`treedb_name", 0, 0),
+            "topic_name",   "%s", kwp_get_str(node, &kwp_md_treedb_name, 0, 0),
             "hook",         "%s", hook,
             NULL
         );
@@ -8214,19 +9007,368 @@ PUBLIC json_t *treedb_node_jtree(
         rename_hook = 0;
     }
 
-    json_t *root = create_jchild(tranger, hook, rename_hook, node, jn_options);
+    json_t *root = create_jchild(tranger, hook, rename_hook, node, jn_options, shared);
     add_jtree_path(0, root);
 
     json_t *tree = root;
 
     // recursive
-    add_jtree_childs(tranger, tree, hook, rename_hook, node, root, jn_filter, jn_options);
+    kw_filter filter = kw_filter_compile(jn_filter); // compiled once for all the childs
+    add_jtree_childs(tranger, tree, hook, rename_hook, node, root, filter, jn_options, shared);
 
-    JSON_DECREF(jn_filter);
+    kw_filter_free(filter);
     JSON_DECREF(jn_options);
     return tree;
 }
 
+/***************************************************************************
+ *  Return a tree of childs of the hook, a copy
+ ***************************************************************************/
+PUBLIC json_t *treedb_node_jtree(
+    json_t *tranger,
+    const char *hook,   // hook to build the hierarchical tree
+    const char *rename_hook, // change the hook name in the tree response
+    json_t *node,       // NOT owned, pure node
+    json_t *jn_filter,  // filter to childs tree
+    json_t *jn_options  // fkey,hook options
+)
+{
+    return node_jtree(tranger, hook, rename_hook, node, jn_filter, jn_options, FALSE);
+}
+
+/***************************************************************************
+ *  Return a tree of childs of the hook, sharing the values of the nodes
+ ***************************************************************************/
+PUBLIC json_t *treedb_node_jtree_view(
+    json_t *tranger,
+    const char *hook,   // hook to build the hierarchical tree
+    const char *rename_hook, // change the hook name in the tree response
+    json_t *node,       // NOT owned, pure node
+    json_t *jn_filter,  // filter to childs tree
+    json_t *jn_options  // fkey,hook options
+)
+{
+    return node_jtree(tranger, hook, rename_hook, node, jn_filter, jn_options, TRUE);
+}
+
+
+/***************************************************************************
+ *  Walk state of treedb_walk_node_childs()
+ ***************************************************************************/
+typedef struct {
+    json_t *tranger;
+    const char *hook;
+    kw_filter filter;       // compiled jn_filter
+    json_t *fields;         // not owned
+    int max_depth;
+    int limit;
+    int count;
+    BOOL full;              // page full, looking for a next child
+    const char **resume_ids;
+    int resume_size;
+    treedb_walk_callback_t walk_callback;
+    void *user_data;
+    char path[PATH_MAX];
+    char resume[PATH_MAX];
+} treedb_walk_t;
+
+/***************************************************************************
+ *  Return the child to give to the walk callback
+ ***************************************************************************/
+PRIVATE json_t *walk_child_view( // Return MUST be decref
+    json_t *child,  // not owned
+    json_t *fields  // not owned
+)
+{
+    if(json_array_size(fields)==0) {
+        return json_incref(child);
+    }
+
+    json_t *view = json_object();
+    json_object_set(view, "id", json_object_get(child, "id"));
+
+    int idx; json_t *jn_field;
+    json_array_foreach(fields, idx, jn_field) {
+        const char *field = json_string_value(jn_field);
+        json_t *value = field?json_object_get(child, field):0;
+        if(value) {
+            json_object_set(view, field, value);
+        }
+    }
+    return view;
+}
+
+/***************************************************************************
+ *  Return the position of the child in the list hook of node, -1 if not linked.
+ *  Use the hook index, O(1).
+ ***************************************************************************/
+PRIVATE json_int_t hook_child_position(
+    json_t *tranger,
+    const char *hook,
+    json_t *node,       // not owned, pure node
+    const char *child_id
+)
+{
+    const char *treedb_name = kwp_get_str(node, &kwp_md_treedb_name, 0, 0);
+    const char *topic_name = kwp_get_str(node, &kwp_md_topic_name, 0, 0);
+    const char *id = kw_get_str(node, "id", 0, 0);
+    if(!treedb_name || !topic_name || !id) {
+        return -1;
+    }
+
+    json_t *childs = get_hook_index(tranger, treedb_name, topic_name, id, hook, FALSE);
+    json_t *hook_desc = kwid_get("", tranger, "topics`%s`cols`%s`hook", topic_name, hook);
+
+    /*
+     *  The child can be of any of the child topics of the hook
+     */
+    const char *child_topic_name; json_t *jn_field;
+    json_object_foreach(hook_desc, child_topic_name, jn_field) {
+        char ref[NAME_MAX];
+        snprintf(ref, sizeof(ref), "%s^%s", child_topic_name, child_id);
+        json_t *jn_position = json_object_get(childs, ref);
+        if(jn_position) {
+            return json_integer_value(jn_position);
+        }
+    }
+    return -1;
+}
+
+/***************************************************************************
+ *  Depth-first walk, the childs are given in the same order of treedb_node_jtree()
+ *  Return -1 if the walk must stop (page full or stopped by the callback)
+ ***************************************************************************/
+PRIVATE int walk_childs(
+    treedb_walk_t *walk,
+    json_t *node,       // not owned
+    int depth,          // depth of node
+    BOOL resuming
+)
+{
+    if(walk->max_depth > 0 && depth >= walk->max_depth) {
+        return 0;
+    }
+
+    /*
+     *  Walk the hook data itself, no list of childs is built
+     */
+    json_t *hook_data = _hook_data(walk->tranger, walk->hook, node);
+    if(!json_is_array(hook_data) && !json_is_object(hook_data)) {
+        // Error already logged, skip this level
+        return 0;
+    }
+    json_incref(hook_data);
+
+    /*
+     *  When resuming, continue from the child in the resume token,
+     *  located with the hook index (list hooks) or the key (dict hooks)
+     */
+    size_t start = 0;
+    void *iter = json_object_iter(hook_data);
+    const char *resume_id = 0;
+    if(resuming && depth + 1 < walk->resume_size) {
+        resume_id = walk->resume_ids[depth + 1];
+        if(json_is_array(hook_data)) {
+            json_int_t position = hook_child_position(
+                walk->tranger, walk->hook, node, resume_id
+            );
+            json_t *child = position >= 0? json_array_get(hook_data, (size_t)position):0;
+            if(child && strcmp(kw_get_str(child, "id", "", 0), resume_id)==0) {
+                start = (size_t)position;
+            } else {
+                resume_id = 0;
+            }
+        } else {
+            void *resume_iter = json_object_iter_at(hook_data, resume_id);
+            if(resume_iter) {
+                iter = resume_iter;
+            } else {
+                resume_id = 0;
+            }
+        }
+        // If the child of the token is gone, all the childs of this level are walked
+    }
+
+    int ret = 0;
+    size_t path_len = strlen(walk->path);
+
+    for(size_t idx = start; ; idx++) {
+        json_t *child;
+        if(json_is_array(hook_data)) {
+            child = json_array_get(hook_data, idx);
+        } else {
+            child = json_object_iter_value(iter);
+            iter = json_object_iter_next(hook_data, iter);
+        }
+        if(!child) {
+            break;
+        }
+
+        if(!kw_filter_match(walk->filter, child)) {
+            continue;
+        }
+
+        const char *child_id = kw_get_str(child, "id", "", 0);
+        snprintf(walk->path + path_len, sizeof(walk->path) - path_len, "`%s", child_id);
+
+        BOOL resume_child = (resume_id && idx == start)?TRUE:FALSE;
+        if(!resume_child) {
+            /*
+             *  Not walked in the previous page
+             */
+            if(walk->full) {
+                // There are more childs, the resume token is the last walked child
+                ret = -1;
+                break;
+            }
+            int cb_ret = walk->walk_callback(
+                walk->user_data,
+                walk->tranger,
+                node,
+                walk_child_view(child, walk->fields),
+                depth + 1,
+                walk->path
+            );
+            walk->count++;
+            if(cb_ret < 0) {
+                snprintf(walk->resume, sizeof(walk->resume), "%s", walk->path);
+                ret = -1;
+                break;
+            }
+            if(walk->limit > 0 && walk->count >= walk->limit) {
+                /*
+                 *  Continue until the next child, no resume token if there is none
+                 */
+                snprintf(walk->resume, sizeof(walk->resume), "%s", walk->path);
+                walk->full = TRUE;
+            }
+        }
+
+        if(walk_childs(walk, child, depth + 1, resume_child) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    walk->path[path_len] = 0;
+    json_decref(hook_data);
+    return ret;
+}
+
+/***************************************************************************
+ *  Walk the childs of the hook, without building the tree
+ ***************************************************************************/
+PUBLIC json_t *treedb_walk_node_childs( // Return MUST be decref
+    json_t *tranger,
+    const char *hook,
+    json_t *node,       // NOT owned, pure node
+    json_t *jn_filter,  // owned, filter to childs tree
+    json_t *jn_options, // owned, "max_depth", "limit", "resume", "fields"
+    treedb_walk_callback_t walk_callback,
+    void *user_data
+)
+{
+    /*------------------------------*
+     *      Check original node
+     *------------------------------*/
+    if(!kwp_get_bool(node, &kwp_md_pure_node, 0, 0)) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_TREEDB_ERROR,
+            "msg",          "%s", "Not a pure node",
+            NULL
+        );
+        log_debug_json(0, node, "Not a pure node");
+        JSON_DECREF(jn_filter);
+        JSON_DECREF(jn_options);
+        return 0;
+    }
+
+    if(!kw_get_dict_value(node, hook, 0, 0)) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_TREEDB_ERROR,
+            "msg",          "%s", "hook not found",
+            "topic_name",   "%s", kwp_get_str(node, &kwp_md_treedb_name, 0, 0),
+            "hook",         "%s", hook,
+            NULL
+        );
+        JSON_DECREF(jn_filter);
+        JSON_DECREF(jn_options);
+        return 0;
+    }
+
+    if(!walk_callback) {
+        log_error(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "walk_callback NULL",
+            NULL
+        );
+        JSON_DECREF(jn_filter);
+        JSON_DECREF(jn_options);
+        return 0;
+    }
+
+    treedb_walk_t walk_;
+    treedb_walk_t *walk = &walk_;
+    memset(walk, 0, sizeof(treedb_walk_t));
+    walk->tranger = tranger;
+    walk->hook = hook;
+    walk->filter = kw_filter_compile(jn_filter); // compiled once for all the childs
+    walk->fields = kw_get_list(jn_options, "fields", 0, 0);
+    walk->max_depth = (int)kw_get_int(jn_options, "max_depth", 0, KW_WILD_NUMBER);
+    walk->limit = (int)kw_get_int(jn_options, "limit", 0, KW_WILD_NUMBER);
+    walk->walk_callback = walk_callback;
+    walk->user_data = user_data;
+
+    const char *root_id = kw_get_str(node, "id", "", 0);
+    snprintf(walk->path, sizeof(walk->path), "%s", root_id);
+
+    /*
+     *  The resume token is the path of the last walked child: "root_id`id`...`id"
+     */
+    BOOL resuming = FALSE;
+    const char *resume = kw_get_str(jn_options, "resume", "", 0);
+    if(!empty_string(resume)) {
+        walk->resume_ids = split2(resume, "`", &walk->resume_size);
+        if(walk->resume_size > 1 && strcmp(walk->resume_ids[0], root_id)==0) {
+            resuming = TRUE;
+        } else {
+            log_error(0,
+                "gobj",         "%s", __FILE__,
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "resume token not belongs to this node",
+                "resume",       "%s", resume,
+                "id",           "%s", root_id,
+                NULL
+            );
+        }
+    }
+
+    if(walk_childs(walk, node, 0, resuming) == 0) {
+        // The page ends at the last child
+        walk->resume[0] = 0;
+    }
+
+    json_t *cursor = json_pack("{s:i, s:s}",
+        "count", walk->count,
+        "resume", walk->resume   // empty when the walk is finished
+    );
+
+    if(walk->resume_ids) {
+        split_free2(walk->resume_ids);
+    }
+
+    kw_filter_free(walk->filter);
+    JSON_DECREF(jn_options);
+    return cursor;
+}
+
 
 
 
@@ -8421,47 +9563,788 @@ PRIVATE json_t * treedb_get_activated_snap_tag(
 }
 
 /***************************************************************************
- *
+ *  Snap checkpoints: the live set of each snap, by topic.
+
+        "treedbs_snaps`{treedb_name}`checkpoints":
+        {
+            "$snap_tag": {          // "0" is the current (not tagged) set
+                "$topic_name": {
+                    "ids": {
+                        "$id": __rowid__,
+                        ...
+                    },
+                    "pkey2s": {
+                        "$pkey2_name": {
+                            "$id": {
+                                "$pkey2_value": __rowid__,
+                                ...
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+    The checkpoint of a snap is built from memory when shooting the snap,
+    or loaded once scanning the topic (snap shot by a previous run).
+    The "0" checkpoint is copied from memory when a snap is activated.
+    The writes update the checkpoints of "0" and of the tag of the record,
+    the checkpoints are not dropped and loaded again.
  ***************************************************************************/
-PUBLIC int treedb_shoot_snap( // tag the current tree db
+PRIVATE json_t *get_snap_checkpoints( // Return is NOT YOURS, {topic: checkpoint}
     json_t *tranger,
     const char *treedb_name,
-    const char *snap_name,
-    const char *description
+    uint32_t snap_tag,
+    BOOL create
 )
 {
-    /*-----------------------------------*
-     *  Check if the tag already exists
-     *-----------------------------------*/
-    json_t *jn_tag = json_pack("{s:s}",
-        "name", snap_name
-    );
-    json_t *snaps = treedb_list_nodes( // Return MUST be decref
-        tranger,
-        treedb_name,
-        "__snaps__",
-        jn_tag,  // filter, owned
-        0   // match_fn
-    );
-    if(json_array_size(snaps)>0) {
-        char temp[80];
-        snprintf(temp, sizeof(temp), "Snap already exists: '%s'", snap_name);
-        log_info(0,
-            "gobj",         "%s", __FILE__,
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_TREEDB_ERROR,
-            "msg",          "%s", temp,
-            "snap",         "%s", snap_name,
-            NULL
-        );
-        JSON_DECREF(snaps);
-        return -1;
+    char path[NAME_MAX];
+    snprintf(path, sizeof(path), "treedbs_snaps`%s`checkpoints`%u", treedb_name, snap_tag);
+    if(create) {
+        return kw_get_dict(tranger, path, json_object(), KW_CREATE);
     }
-    JSON_DECREF(snaps);
+    return kw_get_dict(tranger, path, 0, 0);
+}
 
-    /*
-     *  Register the tag
-     */
+/***************************************************************************
+ *  Return an empty checkpoint of the topic
+ ***************************************************************************/
+PRIVATE json_t *new_snap_checkpoint( // Return MUST be decref
+    json_t *tranger,
+    const char *topic_name
+)
+{
+    json_t *checkpoint = json_pack("{s:{}, s:{}}",
+        "ids",
+        "pkey2s"
+    );
+    json_t *pkey2s = kw_get_dict(checkpoint, "pkey2s", 0, KW_REQUIRED);
+
+    json_t *iter_pkey2s = treedb_topic_pkey2s(tranger, topic_name);
+    int idx; json_t *jn_pkey2_name;
+    json_array_foreach(iter_pkey2s, idx, jn_pkey2_name) {
+        const char *pkey2_name = json_string_value(jn_pkey2_name);
+        if(empty_string(pkey2_name)) {
+            continue;
+        }
+        json_object_set_new(pkey2s, pkey2_name, json_object());
+    }
+    JSON_DECREF(iter_pkey2s);
+
+    return checkpoint;
+}
+
+/***************************************************************************
+ *  Return the checkpoint of the nodes in memory
+ ***************************************************************************/
+PRIVATE json_t *memory_snap_checkpoint( // Return MUST be decref
+    json_t *tranger,
+    const char *treedb_name,
+    const char *topic_name
+)
+{
+    json_t *checkpoint = new_snap_checkpoint(tranger, topic_name);
+
+    json_t *ids = kw_get_dict(checkpoint, "ids", 0, KW_REQUIRED);
+    json_t *indexx = treedb_get_id_index(tranger, treedb_name, topic_name);
+    const char *id; json_t *node;
+    json_object_foreach(indexx, id, node) {
+        json_int_t __rowid__ = kwp_get_int(node, &kwp_md_rowid, 0, KW_REQUIRED);
+        json_object_set_new(ids, id, json_integer(__rowid__));
+    }
+
+    json_t *pkey2s = kw_get_dict(checkpoint, "pkey2s", 0, KW_REQUIRED);
+    const char *pkey2_name; json_t *pkey2_checkpoint;
+    json_object_foreach(pkey2s, pkey2_name, pkey2_checkpoint) {
+        json_t *indexy = treedb_get_pkey2_index(
+            tranger,
+            treedb_name,
+            topic_name,
+            pkey2_name
+        );
+        json_t *instances;
+        json_object_foreach(indexy, id, instances) {
+            json_t *jn_instances = json_object();
+            const char *pkey2_value;
+            json_object_foreach(instances, pkey2_value, node) {
+                json_int_t __rowid__ = kwp_get_int(node, &kwp_md_rowid, 0, KW_REQUIRED);
+                json_object_set_new(jn_instances, pkey2_value, json_integer(__rowid__));
+            }
+            json_object_set_new(pkey2_checkpoint, id, jn_instances);
+        }
+    }
+
+    return checkpoint;
+}
+
+/***************************************************************************
+ *  A record has been written: update the checkpoints of "0" and of the tag.
+ *  Same logic than create/save node: the existing keys are kept,
+ *  or replaced if they were the old record.
+ ***************************************************************************/
+PRIVATE int snap_checkpoints_write(
+    json_t *tranger,
+    const char *treedb_name,
+    const char *topic_name,
+    const char *id,
+    json_t *record,         // NOT owned, the written record
+    uint32_t tag,
+    uint64_t old_rowid,     // 0 if it's a new record
+    uint64_t new_rowid
+)
+{
+    uint32_t tags[2] = {0, tag};
+    for(int i=0; i<(tag?2:1); i++) {
+        json_t *checkpoint = json_object_get(
+            get_snap_checkpoints(tranger, treedb_name, tags[i], FALSE),
+            topic_name
+        );
+        if(!checkpoint) {
+            continue;
+        }
+
+        json_t *ids = kw_get_dict(checkpoint, "ids", 0, KW_REQUIRED);
+        json_t *jn_rowid = json_object_get(ids, id);
+        if(!jn_rowid || (old_rowid && json_integer_value(jn_rowid) == (json_int_t)old_rowid)) {
+            json_object_set_new(ids, id, json_integer(new_rowid));
+        }
+
+        json_t *pkey2s = kw_get_dict(checkpoint, "pkey2s", 0, KW_REQUIRED);
+        const char *pkey2_name; json_t *pkey2_checkpoint;
+        json_object_foreach(pkey2s, pkey2_name, pkey2_checkpoint) {
+            json_t *instances = json_object_get(pkey2_checkpoint, id);
+            if(!instances) {
+                instances = json_object();
+                json_object_set_new(pkey2_checkpoint, id, instances);
+            }
+            if(old_rowid) {
+                const char *pkey2_value; json_t *jn_value; void *tmp;
+                json_object_foreach_safe(instances, tmp, pkey2_value, jn_value) {
+                    if(json_integer_value(jn_value) == (json_int_t)old_rowid) {
+                        json_object_del(instances, pkey2_value);
+                    }
+                }
+            }
+            const char *pkey2_value = get_key2_value(
+                tranger,
+                topic_name,
+                pkey2_name,
+                record
+            );
+            if(!json_object_get(instances, pkey2_value)) {
+                json_object_set_new(instances, pkey2_value, json_integer(new_rowid));
+            }
+        }
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  A record has been deleted (mark1): update the checkpoints of "0" and of the tag.
+ *  Same logic than delete node (pkey2_name null) or delete instance.
+ ***************************************************************************/
+PRIVATE int snap_checkpoints_delete(
+    json_t *tranger,
+    const char *treedb_name,
+    const char *topic_name,
+    const char *id,
+    uint32_t tag,
+    uint64_t rowid,
+    const char *pkey2_name  // null: delete the node, else only the instance of pkey2_name
+)
+{
+    uint32_t tags[2] = {0, tag};
+    for(int i=0; i<(tag?2:1); i++) {
+        json_t *checkpoint = json_object_get(
+            get_snap_checkpoints(tranger, treedb_name, tags[i], FALSE),
+            topic_name
+        );
+        if(!checkpoint) {
+            continue;
+        }
+
+        json_t *ids = kw_get_dict(checkpoint, "ids", 0, KW_REQUIRED);
+        json_t *pkey2s = kw_get_dict(checkpoint, "pkey2s", 0, KW_REQUIRED);
+        if(!pkey2_name &&
+                json_integer_value(json_object_get(ids, id)) == (json_int_t)rowid) {
+            json_object_del(ids, id);
+            const char *pkey2_name_; json_t *pkey2_checkpoint;
+            json_object_foreach(pkey2s, pkey2_name_, pkey2_checkpoint) {
+                json_object_del(pkey2_checkpoint, id);
+            }
+            continue;
+        }
+
+        const char *pkey2_name_; json_t *pkey2_checkpoint;
+        json_object_foreach(pkey2s, pkey2_name_, pkey2_checkpoint) {
+            if(pkey2_name && strcmp(pkey2_name, pkey2_name_)!=0) {
+                continue;
+            }
+            json_t *instances = json_object_get(pkey2_checkpoint, id);
+            const char *pkey2_value; json_t *jn_value; void *tmp;
+            json_object_foreach_safe(instances, tmp, pkey2_value, jn_value) {
+                if(json_integer_value(jn_value) == (json_int_t)rowid) {
+                    json_object_del(instances, pkey2_value);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Same logic than load_id_callback() and load_pkey2_callback():
+ *  the first record (backward) of a key or of a key/pkey2_value.
+ ***************************************************************************/
+PRIVATE int load_checkpoint_callback(
+    json_t *tranger,
+    json_t *topic,
+    json_t *list,
+    md_record_t *md_record,
+    json_t *jn_record // must be owned, can be null if sf_loading_from_disk
+)
+{
+    json_t *checkpoint = kw_get_dict(list, "checkpoint", 0, KW_REQUIRED);
+    json_t *deleted_records = kw_get_dict(list, "deleted_records", 0, KW_REQUIRED);
+    const char *topic_name = kw_get_str(list, "topic_name", 0, KW_REQUIRED);
+    json_t *ids = kw_get_dict(checkpoint, "ids", 0, KW_REQUIRED);
+    json_t *pkey2s = kw_get_dict(checkpoint, "pkey2s", 0, KW_REQUIRED);
+
+    const char *key = md_record->key.s;
+    if(json_object_get(deleted_records, key)) {
+        JSON_DECREF(jn_record);
+        return 0;  // Timeranger: does not load the record, it's mine.
+    }
+    if(md_record->__system_flag__ & (sf_mark1)) {
+        json_object_set_new(deleted_records, key, json_true());
+        JSON_DECREF(jn_record);
+        return 0;  // Timeranger: does not load the record, it's mine.
+    }
+
+    if(!json_object_get(ids, key)) {
+        json_object_set_new(ids, key, json_integer(md_record->__rowid__));
+    }
+
+    if(json_object_size(pkey2s) > 0) {
+        if(!jn_record) {
+            jn_record = tranger_read_record_content(tranger, topic, md_record);
+        }
+        const char *pkey2_name; json_t *pkey2_checkpoint;
+        json_object_foreach(pkey2s, pkey2_name, pkey2_checkpoint) {
+            json_t *instances = json_object_get(pkey2_checkpoint, key);
+            if(!instances) {
+                instances = json_object();
+                json_object_set_new(pkey2_checkpoint, key, instances);
+            }
+            const char *pkey2_value = get_key2_value(
+                tranger,
+                topic_name,
+                pkey2_name,
+                jn_record
+            );
+            if(!json_object_get(instances, pkey2_value)) {
+                json_object_set_new(instances, pkey2_value, json_integer(md_record->__rowid__));
+            }
+        }
+    }
+
+    JSON_DECREF(jn_record);
+    return 0;  // Timeranger: does not load the record, it's mine.
+}
+
+/***************************************************************************
+ *  Return the checkpoint of a snap topic
+ ***************************************************************************/
+PRIVATE json_t *get_snap_checkpoint( // Return is NOT YOURS
+    json_t *tranger,
+    const char *treedb_name,
+    const char *topic_name,
+    uint32_t snap_tag
+)
+{
+    json_t *checkpoints = get_snap_checkpoints(tranger, treedb_name, snap_tag, TRUE);
+
+    json_t *checkpoint = json_object_get(checkpoints, topic_name);
+    if(checkpoint) {
+        return checkpoint;
+    }
+
+    /*
+     *  Load the checkpoint, once.
+     *  Only md records, unless the topic has secondary keys.
+     */
+    checkpoint = new_snap_checkpoint(tranger, topic_name);
+    json_object_set_new(checkpoints, topic_name, checkpoint);
+
+    BOOL only_md = json_object_size(kw_get_dict(checkpoint, "pkey2s", 0, KW_REQUIRED))==0;
+    json_t *jn_filter = json_pack("{s:b, s:b}",
+        "backward", 1,
+        "only_md", only_md
+    );
+    if(snap_tag) {
+        json_object_set_new(
+            jn_filter,
+            "user_flag",
+            json_integer(snap_tag)
+        );
+    }
+    json_t *jn_list = json_pack("{s:s, s:o, s:I, s:O, s:{}}",
+        "topic_name", topic_name,
+        "match_cond", jn_filter,
+        "load_record_callback", (json_int_t)(size_t)load_checkpoint_callback,
+        "checkpoint", checkpoint,
+        "deleted_records"
+    );
+    json_t *list = tranger_open_list(
+        tranger,
+        jn_list // owned
+    );
+    tranger_close_list(tranger, list);
+
+    return checkpoint;
+}
+
+/***************************************************************************
+ *  Set the snap tag in the opened lists of the topic
+ ***************************************************************************/
+PRIVATE int set_lists_snap_tag(
+    json_t *tranger,
+    const char *path,
+    uint32_t snap_tag
+)
+{
+    json_t *list = tranger_get_list(tranger, path);
+    if(!list) {
+        return -1;
+    }
+    json_object_set_new(list, "snap_tag", json_integer(snap_tag));
+    json_t *match_cond = kw_get_dict(list, "match_cond", 0, 0);
+    if(snap_tag) {
+        json_object_set_new(match_cond, "user_flag", json_integer(snap_tag));
+    } else {
+        json_object_del(match_cond, "user_flag");
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  TRUE if the instances in memory {pkey2_value: node}
+ *  are the instances of the checkpoint {pkey2_value: rowid}
+ ***************************************************************************/
+PRIVATE BOOL same_snap_instances(json_t *instances, json_t *jn_instances)
+{
+    if(json_object_size(instances) != json_object_size(jn_instances)) {
+        return FALSE;
+    }
+    const char *pkey2_value; json_t *node;
+    json_object_foreach(instances, pkey2_value, node) {
+        json_int_t __rowid__ = kwp_get_int(node, &kwp_md_rowid, 0, KW_REQUIRED);
+        if(json_integer_value(json_object_get(jn_instances, pkey2_value)) != __rowid__) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Read a node from tranger by rowid
+ ***************************************************************************/
+PRIVATE json_t *read_snap_node( // Return MUST be decref
+    json_t *tranger,
+    const char *treedb_name,
+    const char *topic_name,
+    uint64_t __rowid__
+)
+{
+    json_t *topic = tranger_topic(tranger, topic_name);
+
+    md_record_t md_record;
+    if(tranger_get_record(tranger, topic, __rowid__, &md_record, TRUE)<0) {
+        // Error already logged
+        return 0;
+    }
+    json_t *jn_record = tranger_read_record_content(tranger, topic, &md_record);
+    if(!jn_record) {
+        // Error already logged
+        return 0;
+    }
+
+    json_t *jn_record_md = _md2json(
+        treedb_name,
+        topic_name,
+        &md_record
+    );
+    json_object_set_new(jn_record, "__md_treedb__", jn_record_md);
+    set_missing_values( // crea campos vacios
+        tranger,
+        topic_name,
+        jn_record  // NOT owned
+    );
+    return jn_record;
+}
+
+/***************************************************************************
+ *  Change the nodes in memory to the snap_tag set,
+ *  applying only the differences with the current set.
+
+    - the changed nodes (different rowid) and the missing nodes are dropped,
+      unloading their links, and their childs are marked to re-link.
+    - the new nodes are read from tranger by rowid.
+    - the changed instances of the secondary indexes are read by rowid.
+    - the links of the new nodes and of the marked childs are loaded.
+    - the subscribers are informed of the created, updated and deleted nodes.
+
+    Finding the changed keys walks the indexes in memory, without disk reads.
+    Only the changed records are read, no topic is scanned,
+    except to load once the checkpoint of a snap shot by a previous run.
+ ***************************************************************************/
+PRIVATE int apply_snap_checkpoint(
+    json_t *tranger,
+    const char *treedb_name,
+    uint32_t snap_tag
+)
+{
+    char path[NAME_MAX];
+    int changed = 0;
+    uint32_t old_snap_tag = (uint32_t)current_snap_tag(tranger, treedb_name);
+
+    json_t *changes = json_object();        // {topic: {id: new rowid (0 if deleted)}}
+    json_t *pkey2_changes = json_object();  // {topic: {pkey2_name: {id: true}}}
+    json_t *relinks = json_object();        // {"topic^id": true}, nodes to load links
+    json_t *events = json_array();          // [[event, topic, node]], to inform subscribers
+
+    /*----------------------------------------------------*
+     *  Compare the current indexes with the checkpoints
+     *----------------------------------------------------*/
+    json_t *topics = treedb_topics(tranger, treedb_name, 0);
+    int idx; json_t *jn_topic;
+    json_array_foreach(topics, idx, jn_topic) {
+        const char *topic_name = json_string_value(jn_topic);
+        if(strncmp(topic_name, "__", 2)==0) { // Ignore meta-tables
+            continue;
+        }
+        json_t *indexx = treedb_get_id_index(tranger, treedb_name, topic_name);
+        if(!indexx) {
+            // It's not a treedb topic
+            continue;
+        }
+
+        if(old_snap_tag == 0) {
+            /*
+             *  Leaving the current set: the nodes in memory are its checkpoint
+             */
+            json_object_set_new(
+                get_snap_checkpoints(tranger, treedb_name, 0, TRUE),
+                topic_name,
+                memory_snap_checkpoint(tranger, treedb_name, topic_name)
+            );
+        }
+        json_t *checkpoint = get_snap_checkpoint(tranger, treedb_name, topic_name, snap_tag);
+        json_t *ids = kw_get_dict(checkpoint, "ids", 0, KW_REQUIRED);
+
+        json_t *topic_changes = json_object();
+        const char *id; json_t *node;
+        json_object_foreach(indexx, id, node) {
+            json_int_t __rowid__ = kwp_get_int(node, &kwp_md_rowid, 0, KW_REQUIRED);
+            json_t *jn_rowid = json_object_get(ids, id);
+            if(json_integer_value(jn_rowid) != __rowid__) {
+                json_object_set_new(topic_changes, id, json_integer(json_integer_value(jn_rowid)));
+            }
+        }
+        json_t *jn_rowid;
+        json_object_foreach(ids, id, jn_rowid) {
+            if(!exist_primary_node(indexx, id)) {
+                json_object_set(topic_changes, id, jn_rowid);
+            }
+        }
+
+        if(json_object_size(topic_changes) > 0) {
+            changed += (int)json_object_size(topic_changes);
+            json_object_set_new(changes, topic_name, topic_changes);
+        } else {
+            json_decref(topic_changes);
+        }
+
+        char list_id[NAME_MAX];
+        build_id_index_path(list_id, sizeof(list_id), treedb_name, topic_name);
+        set_lists_snap_tag(tranger, list_id, snap_tag);
+
+        /*
+         *  Secondary indexes
+         */
+        json_t *topic_pkey2_changes = json_object();
+        json_t *pkey2s = kw_get_dict(checkpoint, "pkey2s", 0, KW_REQUIRED);
+        const char *pkey2_name; json_t *pkey2_checkpoint;
+        json_object_foreach(pkey2s, pkey2_name, pkey2_checkpoint) {
+            json_t *indexy = treedb_get_pkey2_index(
+                tranger,
+                treedb_name,
+                topic_name,
+                pkey2_name
+            );
+            json_t *pkey2_ids = json_object();
+            json_t *instances;
+            json_object_foreach(indexy, id, instances) {
+                if(!same_snap_instances(instances, json_object_get(pkey2_checkpoint, id))) {
+                    json_object_set_new(pkey2_ids, id, json_true());
+                }
+            }
+            json_object_foreach(pkey2_checkpoint, id, instances) {
+                if(json_object_size(instances) > 0 && !json_object_get(indexy, id)) {
+                    json_object_set_new(pkey2_ids, id, json_true());
+                }
+            }
+            if(json_object_size(pkey2_ids) > 0) {
+                json_object_set_new(topic_pkey2_changes, pkey2_name, pkey2_ids);
+            } else {
+                json_decref(pkey2_ids);
+            }
+
+            build_pkey_index_path(path, sizeof(path), treedb_name, topic_name, pkey2_name);
+            set_lists_snap_tag(tranger, path, snap_tag);
+        }
+        if(json_object_size(topic_pkey2_changes) > 0) {
+            json_object_set_new(pkey2_changes, topic_name, topic_pkey2_changes);
+        } else {
+            json_decref(topic_pkey2_changes);
+        }
+    }
+    JSON_DECREF(topics);
+
+    /*----------------------------------------------------*
+     *  Unload the links of the dropped nodes
+     *----------------------------------------------------*/
+    const char *topic_name; json_t *topic_changes;
+    json_object_foreach(changes, topic_name, topic_changes) {
+        json_t *indexx = treedb_get_id_index(tranger, treedb_name, topic_name);
+        const char *id; json_t *jn_rowid;
+        json_object_foreach(topic_changes, id, jn_rowid) {
+            json_t *node = exist_primary_node(indexx, id);
+            if(!node) {
+                continue;
+            }
+            unload_links(tranger, node);
+
+            /*
+             *  The childs must be linked to the new node
+             */
+            json_t *hook_index = kwid_get("", tranger,
+                "treedbs`%s`%s`__hook_index__`%s", treedb_name, topic_name, id
+            );
+            const char *hook_name; json_t *childs;
+            json_object_foreach(hook_index, hook_name, childs) {
+                const char *child_ref; json_t *child_data;
+                json_object_foreach(childs, child_ref, child_data) {
+                    json_object_set_new(relinks, child_ref, json_true());
+                }
+            }
+            hook_index_delete_parent(tranger, treedb_name, topic_name, id);
+        }
+    }
+
+    /*----------------------------------------------------*
+     *  Replace the nodes
+     *----------------------------------------------------*/
+    json_object_foreach(changes, topic_name, topic_changes) {
+        json_t *indexx = treedb_get_id_index(tranger, treedb_name, topic_name);
+        const char *id; json_t *jn_rowid;
+        json_object_foreach(topic_changes, id, jn_rowid) {
+            json_t *old_node = exist_primary_node(indexx, id);
+            JSON_INCREF(old_node);
+            delete_primary_node(indexx, id);
+
+            json_t *node = 0;
+            uint64_t __rowid__ = (uint64_t)json_integer_value(jn_rowid);
+            if(__rowid__) {
+                node = read_snap_node(tranger, treedb_name, topic_name, __rowid__);
+            }
+            if(node) {
+                add_primary_node(indexx, id, node);
+
+                char ref[NAME_MAX];
+                snprintf(ref, sizeof(ref), "%s^%s", topic_name, id);
+                json_object_set_new(relinks, ref, json_true());
+
+                json_array_append_new(events, json_pack("[s,s,o]",
+                    old_node?"EV_TREEDB_NODE_UPDATED":"EV_TREEDB_NODE_CREATED",
+                    topic_name,
+                    node
+                ));
+            } else if(old_node) {
+                json_array_append_new(events, json_pack("[s,s,O]",
+                    "EV_TREEDB_NODE_DELETED",
+                    topic_name,
+                    old_node
+                ));
+            }
+            JSON_DECREF(old_node);
+        }
+    }
+
+    /*----------------------------------------------------*
+     *  Replace the changed instances of secondary indexes
+     *----------------------------------------------------*/
+    json_t *topic_pkey2_changes;
+    json_object_foreach(pkey2_changes, topic_name, topic_pkey2_changes) {
+        json_t *indexx = treedb_get_id_index(tranger, treedb_name, topic_name);
+        json_t *checkpoint = get_snap_checkpoint(tranger, treedb_name, topic_name, snap_tag);
+        const char *pkey2_name; json_t *pkey2_ids;
+        json_object_foreach(topic_pkey2_changes, pkey2_name, pkey2_ids) {
+            json_t *indexy = treedb_get_pkey2_index(
+                tranger,
+                treedb_name,
+                topic_name,
+                pkey2_name
+            );
+            json_t *pkey2_checkpoint = kwid_get("", checkpoint, "pkey2s`%s", pkey2_name);
+            const char *id; json_t *v;
+            json_object_foreach(pkey2_ids, id, v) {
+                json_object_del(indexy, id);
+                changed++;
+
+                json_t *primary_node = exist_primary_node(indexx, id);
+                json_int_t primary_rowid = kwp_get_int(primary_node, &kwp_md_rowid, 0, 0);
+
+                json_t *jn_instances = json_object_get(pkey2_checkpoint, id);
+                const char *pkey2_value; json_t *jn_rowid;
+                json_object_foreach(jn_instances, pkey2_value, jn_rowid) {
+                    json_int_t __rowid__ = json_integer_value(jn_rowid);
+                    if(primary_node && __rowid__ == primary_rowid) {
+                        add_secondary_node(indexy, id, pkey2_value, primary_node);
+                        continue;
+                    }
+                    json_t *node = read_snap_node(tranger, treedb_name, topic_name, __rowid__);
+                    if(node) {
+                        add_secondary_node(indexy, id, pkey2_value, node);
+                        json_decref(node);
+                    }
+                }
+            }
+        }
+    }
+
+    /*----------------------------------------------------*
+     *  Load the links of new nodes and their childs
+     *----------------------------------------------------*/
+    const char *ref; json_t *v;
+    json_object_foreach(relinks, ref, v) {
+        char child_topic_name[NAME_MAX];
+        char child_id[NAME_MAX];
+        if(!decode_child_ref(
+            ref,
+            child_topic_name, sizeof(child_topic_name),
+            child_id, sizeof(child_id)
+        )) {
+            continue;
+        }
+        json_t *child_node = exist_primary_node(
+            treedb_get_id_index(tranger, treedb_name, child_topic_name),
+            child_id
+        );
+        if(child_node) {
+            load_links(tranger, child_node);
+        }
+    }
+
+    JSON_DECREF(relinks);
+    JSON_DECREF(pkey2_changes);
+    JSON_DECREF(changes);
+
+    /*
+     *  Save current snap tag
+     */
+    snprintf(path, sizeof(path), "treedbs_snaps`%s", treedb_name);
+    json_t *treedb_snap = kw_get_dict(tranger, path, json_object(), KW_CREATE);
+    json_object_set_new(treedb_snap, "activated_snap_tag", json_integer(snap_tag));
+    if(snap_tag == 0) {
+        // The nodes in memory are the current set again
+        json_object_del(kw_get_dict(treedb_snap, "checkpoints", 0, 0), "0");
+    }
+
+    /*----------------------------------------------------*
+     *  Inform the subscribers, with the links loaded
+     *----------------------------------------------------*/
+    json_t *treedb = kwid_get("", tranger, "treedbs`%s", treedb_name);
+    treedb_callback_t treedb_callback =
+        (treedb_callback_t)(size_t)kw_get_int(
+        treedb,
+        "__treedb_callback__",
+        0,
+        0
+    );
+    void *user_data =
+        (void *)(size_t)kw_get_int(
+        treedb,
+        "__treedb_callback_user_data__",
+        0,
+        0
+    );
+    if(treedb_callback) {
+        json_t *event;
+        json_array_foreach(events, idx, event) {
+            json_t *node = json_array_get(event, 2);
+            JSON_INCREF(node);
+            treedb_callback(
+                user_data,
+                tranger,
+                treedb_name,
+                json_string_value(json_array_get(event, 1)),
+                json_string_value(json_array_get(event, 0)),
+                node
+            );
+        }
+    }
+    JSON_DECREF(events);
+
+    if(treedb_trace) {
+        trace_msg("activate snap_tag %u, changed nodes %d", snap_tag, changed);
+    }
+
+    return changed;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC int treedb_shoot_snap( // tag the current tree db
+    json_t *tranger,
+    const char *treedb_name,
+    const char *snap_name,
+    const char *description
+)
+{
+    /*-----------------------------------*
+     *  Check if the tag already exists
+     *-----------------------------------*/
+    json_t *jn_tag = json_pack("{s:s}",
+        "name", snap_name
+    );
+    json_t *snaps = treedb_list_nodes( // Return MUST be decref
+        tranger,
+        treedb_name,
+        "__snaps__",
+        jn_tag,  // filter, owned
+        0   // match_fn
+    );
+    if(json_array_size(snaps)>0) {
+        char temp[80];
+        snprintf(temp, sizeof(temp), "Snap already exists: '%s'", snap_name);
+        log_info(0,
+            "gobj",         "%s", __FILE__,
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_TREEDB_ERROR,
+            "msg",          "%s", temp,
+            "snap",         "%s", snap_name,
+            NULL
+        );
+        JSON_DECREF(snaps);
+        return -1;
+    }
+    JSON_DECREF(snaps);
+
+    /*
+     *  Register the tag
+     */
     time_t t;
     time(&t);
     struct tm tm;
@@ -8535,12 +10418,35 @@ PUBLIC int treedb_shoot_snap( // tag the current tree db
         }
 
         /*
-         *  Firstly create a new node. Last node can already have a snap tag
+         *  Firstly create a new node. Last node can already have a snap tag,
+         *  the new record loses it: the checkpoint of that tag is loaded again.
          */
+        json_t *old_tags = json_object();
+        json_t *checkpoint = new_snap_checkpoint(tranger, topic_name);
+        json_t *ids = kw_get_dict(checkpoint, "ids", 0, KW_REQUIRED);
+        json_t *pkey2s = kw_get_dict(checkpoint, "pkey2s", 0, KW_REQUIRED);
         const char *node_id; json_t *node;
         json_object_foreach(indexx, node_id, node) {
+            uint32_t old_tag = kwp_get_int(node, &kwp_md_tag, 0, KW_REQUIRED);
+            if(old_tag) {
+                char tag[32];
+                snprintf(tag, sizeof(tag), "%u", old_tag);
+                json_object_set_new(old_tags, tag, json_true());
+            }
             treedb_save_node(tranger, node);
-            uint64_t __rowid__ = kw_get_int(node, "__md_treedb__`__rowid__", 0, KW_REQUIRED);
+            uint64_t __rowid__ = kwp_get_int(node, &kwp_md_rowid, 0, KW_REQUIRED);
+            json_object_set_new(ids, node_id, json_integer(__rowid__));
+
+            const char *pkey2_name; json_t *pkey2_checkpoint;
+            json_object_foreach(pkey2s, pkey2_name, pkey2_checkpoint) {
+                json_t *instances = json_object();
+                json_object_set_new(
+                    instances,
+                    get_key2_value(tranger, topic_name, pkey2_name, node),
+                    json_integer(__rowid__)
+                );
+                json_object_set_new(pkey2_checkpoint, node_id, instances);
+            }
 
             ret += tranger_write_user_flag(
                 tranger,
@@ -8561,10 +10467,23 @@ PUBLIC int treedb_shoot_snap( // tag the current tree db
             }
         }
 
+        const char *old_tag; json_t *v;
+        json_object_foreach(old_tags, old_tag, v) {
+            json_object_del(
+                get_snap_checkpoints(tranger, treedb_name, (uint32_t)atol(old_tag), FALSE),
+                topic_name
+            );
+        }
+        JSON_DECREF(old_tags);
+
         /*
-         *  Mark
+         *  Save the checkpoint of the new snap, to activate it without reading the topic
          */
-
+        json_object_set_new(
+            get_snap_checkpoints(tranger, treedb_name, user_flag, TRUE),
+            topic_name,
+            checkpoint
+        );
     }
 
     JSON_DECREF(topics);
@@ -8604,6 +10523,9 @@ PUBLIC int treedb_activate_snap( // Activate tag, return the snap tag
                 );
             }
         }
+        if(current_snap_tag(tranger, treedb_name) != 0) {
+            apply_snap_checkpoint(tranger, treedb_name, 0);
+        }
         return 0;
     }
 
@@ -8683,6 +10605,14 @@ PUBLIC int treedb_activate_snap( // Activate tag, return the snap tag
         return ret;
     }
 
+    /*-------------------------------------*
+     *  Apply the snap to the memory
+     *-------------------------------------*/
+    uint32_t snap_tag = (uint32_t)kw_get_int(snap, "id", 0, KW_REQUIRED|KW_WILD_NUMBER);
+    if(current_snap_tag(tranger, treedb_name) != (int)snap_tag) {
+        apply_snap_checkpoint(tranger, treedb_name, snap_tag);
+    }
+
     return user_flag;
 }
 
@@ -349,6 +349,10 @@ PUBLIC int treedb_autolink( // use fkeys fields of kw to auto-link
     BOOL save
 );
 
+/*
+ *  Link fails if the child is already linked to the hook.
+ *  Unlink of a list hook is O(1): the last child takes the position of the unlinked one.
+ */
 PUBLIC int treedb_link_nodes(
     json_t *tranger,
     const char *hook,
@@ -363,6 +367,16 @@ PUBLIC int treedb_unlink_nodes(
     json_t *child_node      // NOT owned, pure node
 );
 
+/*
+ *  Return TRUE if child_node is linked to the hook of parent_node (O(1), hook index)
+ */
+PUBLIC BOOL treedb_is_child_linked(
+    json_t *tranger,
+    const char *hook,
+    json_t *parent_node,    // NOT owned, pure node
+    json_t *child_node      // NOT owned, pure node
+);
+
 /**rst**
     Meaning of parent and child 'references' (fkeys, hooks)
     -----------------------------------------------------
@@ -449,12 +463,25 @@ PUBLIC json_t *treedb_get_instance( // WARNING Return is NOT YOURS, pure node
     const char *key2    // secondary key
 );
 
+/*
+ *  WARNING the values of not hook/fkey fields are shared (incref) with the node: don't modify them.
+ */
 PUBLIC json_t *node_collapsed_view( // Return MUST be decref
     json_t *tranger, // NOT owned
     json_t *node, // NOT owned
     json_t *jn_options // owned fkey,hook options, see Other options
 );
 
+/*
+ *  Write the collapsed view of the node to gbuf (compact json) without building it.
+ */
+PUBLIC int node_collapsed_view2gbuf(
+    json_t *tranger, // NOT owned
+    json_t *node, // NOT owned
+    json_t *jn_options, // owned fkey,hook options, see Other options
+    GBUFFER *gbuf // NOT owned
+);
+
 PUBLIC json_t *treedb_list_nodes( // Return MUST be decref
     json_t *tranger,
     const char *treedb_name,
@@ -528,6 +555,66 @@ PUBLIC json_t *treedb_node_jtree(
     json_t *jn_options  // fkey,hook options
 );
 
+/*
+ *  Like treedb_node_jtree() but without copying the nodes:
+ *  the nested values of the tree are shared with the nodes of the db.
+ *  WARNING the tree is read-only, modifying it corrupts the db.
+ */
+PUBLIC json_t *treedb_node_jtree_view(
+    json_t *tranger,
+    const char *hook,   // hook to build the hierarchical tree
+    const char *rename_hook, // change the hook name in the tree response
+    json_t *node,       // NOT owned, pure node
+    json_t *jn_filter,  // filter to childs tree
+    json_t *jn_options  // fkey,hook options
+);
+
+/*
+ *  Walk the childs of the hook without building the tree, in bounded memory.
+ *
+ *  The walk is depth-first, in the same order of treedb_node_jtree().
+ *  The callback receives the child (owned) with only the "fields" if they are set,
+ *  and the path "root_id`id`...`id" of the child (like __path__ of the jtree).
+ *  Return of walk_callback < 0 stops the walk.
+ *
+ *  Options:
+ *      "max_depth":    int, 0 no limit, 1 only direct childs.
+ *      "limit":        int, page size, 0 no limit.
+ *      "resume":       string, token returned by the previous page.
+ *      "fields":       list of strings, fields of the child to give to the callback
+ *                      ("id" is always given). Without fields the pure node is given.
+ *
+ *  Return MUST be decref, a cursor:
+ *      {
+ *          "count":    walked childs,
+ *          "resume":   token to continue with the next page, empty if the walk is finished
+ *      }
+ *
+ *  If the child of the resume token is gone, the childs of its level are walked again.
+ *  The resume token is located in O(1) with the hook index, a page costs only its childs.
+ *  Unlinks between pages move childs of list hooks (swap-remove),
+ *  a moved child can be skipped or walked twice.
+ *  The callback must not link or unlink childs of the walked hook.
+ */
+typedef int (*treedb_walk_callback_t)(
+    void *user_data,
+    json_t *tranger,
+    json_t *parent,     // NOT owned, pure node
+    json_t *child,      // owned, pure node or view with "fields"
+    int depth,          // 1 for the direct childs
+    const char *path    // "root_id`id`...`id"
+);
+
+PUBLIC json_t *treedb_walk_node_childs( // Return MUST be decref
+    json_t *tranger,
+    const char *hook,
+    json_t *node,       // NOT owned, pure node
+    json_t *jn_filter,  // owned, filter to childs tree
+    json_t *jn_options, // owned, "max_depth", "limit", "resume", "fields"
+    treedb_walk_callback_t walk_callback,
+    void *user_data
+);
+
 /*----------------------------*
  *          Schema
  *----------------------------*/
@@ -558,6 +645,13 @@ PUBLIC int treedb_shoot_snap( // tag the current tree db
     const char *snap_name,
     const char *description
 );
+/*
+ *  The nodes in memory are changed to the snap set, applying only the differences
+ *  (by rowid) with the current set: there is no need to close and open the treedb.
+ *  Use snap_name "__clear__" to return to the current (not tagged) set.
+ *  The changed nodes are informed to the treedb callback
+ *  (EV_TREEDB_NODE_CREATED, EV_TREEDB_NODE_UPDATED, EV_TREEDB_NODE_DELETED).
+ */
 PUBLIC int treedb_activate_snap( // Activate tag, return the snap tag
     json_t *tranger,
     const char *treedb_name,